@@ -67,6 +67,7 @@ CBaseDrive::CBaseDrive (CMBA &mba, uint8_t nUnit, CDriveType const *pType, CImag
   m_nUnit = nUnit;  m_nSerial = 0;
   m_fOnline = m_fReadOnly = false;
   m_pType = pType;  m_pImage = pImage;
+  m_lCommandLBA = CFlightRecorder::NO_LBA;
 }
 
 
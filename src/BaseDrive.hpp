@@ -32,6 +32,9 @@
 #include <iostream>             // C++ style output for LOGS() ...
 using std::string;              // ...
 using std::ostream;             // ...
+#include "Counter.hpp"          // 64 bit event counter and rate
+#include "Latency.hpp"          // command latency histograms
+#include "FlightRecorder.hpp"   // CFlightRecorder::NO_LBA
 class CDriveType;               // we need forward pointers for this class
 class CImageFile;               //   ... and this one ....
 class CDECUPE;                  //   ... and this ...
@@ -76,6 +79,21 @@ public:
   bool IsDisk() const {return m_pType->IsDisk();}
   bool IsTape() const {return m_pType->IsTape();}
   bool IsNI() const {return false;}
+  //   Return the number of reads and writes (disk sectors or tape records)
+  // actually done by MBS for this drive ...
+  const CCounter &GetReadCounter() const {return m_ctrReads;}
+  const CCounter &GetWriteCounter() const {return m_ctrWrites;}
+  // Update the read and write rates (called by the MASSBUS thread) ...
+  void SampleCounters (double dSeconds)
+    {m_ctrReads.UpdateRate(dSeconds);  m_ctrWrites.UpdateRate(dSeconds);}
+  // Return the command latency statistics for this drive ...
+  CLatency &GetLatency() {return m_Latency;}
+  const CLatency &GetLatency() const {return m_Latency;}
+  //   Get or set the LBA of the command that's executing now, for the flight
+  // recorder.  CMBA sets it to NO_LBA before every command, and disks set it
+  // when they figure out which sector they want ...
+  uint32_t GetCommandLBA() const {return m_lCommandLBA;}
+  void SetCommandLBA (uint32_t lLBA) {m_lCommandLBA = lLBA;}
 
   // Public basic drive methods ...
 public:
@@ -95,6 +113,26 @@ public:
   virtual void SetSerialNumber(uint16_t nSerial);
   // Execute a MASSBUS command
   virtual void DoCommand (uint32_t lCommand);
+  //   Return true if this command might use the MASSBUS data FIFO, in which
+  // case CMBA holds the UPE transfer lock while it executes.  A drive that
+  // takes the lock itself, around just the FIFO part (as CDiskDrive does),
+  // returns false.  When in doubt, the safe answer is true ...
+  virtual bool IsTransfer (uint32_t lCommand) const {return true;}
+  //   Do any periodic housekeeping.  This is called about once a second by
+  // the MASSBUS thread, with the unit locked, whether the bus is busy or not.
+  // It's skipped if the UI has the unit locked at the time, and note that the
+  // unit's worker may be executing a command at the same time!  This must
+  // never block - anything slow (like image file I/O) belongs in
+  // Housekeeping(), and Periodic() returns true to ask for that ...
+  virtual bool Periodic (double dSeconds) {return false;}
+  //   Do the slow housekeeping that Periodic() asked for.  This is called by
+  // the unit's worker between commands, so the UI can't be changing anything
+  // and no command for this unit is executing ...
+  virtual void Housekeeping() {};
+  //   Touch any big buffers the drive uses for transfers, so that they're in
+  // memory once it's locked (see CRealTime).  Buffers on the stack are taken
+  // care of by the thread, so the default is to do nothing ...
+  virtual void Prefault() {};
 
   // Disallow copy and assignment operations with CBaseDrive objects...
 private:
@@ -118,6 +156,10 @@ protected:
   CImageFile       *m_pImage;   // associated disk image file
   // Likewise, m_pType actually points to either a CDiskType or CTapeType object.
   CDriveType const *m_pType;    // drive type data for this unit
+  CCounter    m_ctrReads;       // sectors or records read by this drive
+  CCounter    m_ctrWrites;      //   "     "    "     written  "    "
+  CLatency    m_Latency;        // command latency histograms
+  uint32_t    m_lCommandLBA;    // LBA of the current command (or NO_LBA)
 };
 
 
@@ -0,0 +1,645 @@
+//++
+// ChunkedImage.cpp -> CChunkedImage (compressed disk image container) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CChunkedImage class, including the LZ77
+// compressor and decompressor.  See ChunkedImage.hpp for the file layout.
+// The header, index and footer are all stored in the host byte order, the
+// same as the image data itself.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memcpy(), memset(), etc ...
+#include <stdio.h>              // fopen(), fread(), fwrite(), rename(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#ifdef _WIN32
+#include <windows.h>            // MoveFileEx() ...
+#include <io.h>                 // _commit(), _fileno() ...
+#else
+#include <unistd.h>             // fsync() ...
+#endif
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "SectorKernels.hpp"    // SIMD zero test
+#include "ChunkedImage.hpp"     // declarations for this module
+
+// Header and footer signatures ...
+static const char g_szHeaderMagic[8] = {'M', 'B', 'S', 'C', 'H', 'U', 'N', 'K'};
+static const char g_szFooterMagic[8] = {'M', 'B', 'S', 'I', 'N', 'D', 'E', 'X'};
+
+
+static bool SeekFile (FILE *pFile, uint64_t llOffset)
+{
+  //++
+  // Seek to an absolute 64 bit offset ...
+  //--
+#ifdef _WIN32
+  return _fseeki64(pFile, (__int64) llOffset, SEEK_SET) == 0;
+#else
+  return fseeko(pFile, (off_t) llOffset, SEEK_SET) == 0;
+#endif
+}
+
+
+static uint64_t FileSize (FILE *pFile)
+{
+  //++
+  // Return the size of an open file (and leave it positioned at the end) ...
+  //--
+#ifdef _WIN32
+  if (_fseeki64(pFile, 0, SEEK_END) != 0) return 0;
+  return (uint64_t) _ftelli64(pFile);
+#else
+  if (fseeko(pFile, 0, SEEK_END) != 0) return 0;
+  return (uint64_t) ftello(pFile);
+#endif
+}
+
+
+static bool SyncFile (FILE *pFile)
+{
+  //++
+  //   Write everything in the stdio buffer to the file, and then make sure
+  // it's really on the disk (not just in the OS cache) ...
+  //--
+  if (fflush(pFile) != 0) return false;
+#ifdef _WIN32
+  return _commit(_fileno(pFile)) == 0;
+#else
+  return fsync(fileno(pFile)) == 0;
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////   LZ77 COMPRESSION   /////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+//   The compressed data is a series of sequences, each of which is a token
+// byte, some literal bytes, and a match (a copy of earlier output).  The high
+// nibble of the token is the literal count and the low nibble is the match
+// length minus MIN_MATCH.  A nibble of 15 means more length bytes follow,
+// each added on, until one that isn't 255.  After the literals comes a two
+// byte little endian match offset, and then any extra match length bytes.
+// The last sequence has only literals, and ends the data.
+enum {
+  MIN_MATCH   = 4,              // shortest match worth encoding
+  MAX_OFFSET  = 65535,          // furthest back a match can be
+  HASH_BITS   = 13,             // log2 of the match finder hash table size
+  NO_POSITION = 0xFFFFFFFFUL,   // empty hash table entry
+};
+
+
+static inline uint32_t Load32 (const uint8_t *pb)
+{
+  //++
+  // Load four bytes, unaligned, in any old byte order ...
+  //--
+  uint32_t l;  memcpy(&l, pb, sizeof(l));  return l;
+}
+
+
+static bool PutLength (uint8_t *pbOut, uint32_t &op, uint32_t cbMax, uint32_t nLength)
+{
+  //++
+  // Write the extra length bytes for a length of 15 or more ...
+  //--
+  for (nLength -= 15;  ;  nLength -= 255) {
+    if (op >= cbMax) return false;
+    if (nLength < 255) {pbOut[op++] = (uint8_t) nLength;  return true;}
+    pbOut[op++] = 255;
+  }
+}
+
+
+static bool GetLength (const uint8_t *pbIn, uint32_t &ip, uint32_t cbIn, uint32_t &nLength)
+{
+  //++
+  // And read them back again ...
+  //--
+  uint8_t b;
+  do {
+    if (ip >= cbIn) return false;
+    b = pbIn[ip++];  nLength += b;
+  } while (b == 255);
+  return true;
+}
+
+
+static bool PutSequence (uint8_t *pbOut, uint32_t &op, uint32_t cbMax,
+                         const uint8_t *pbLiterals, uint32_t cbLiterals, uint32_t nOffset, uint32_t nMatch)
+{
+  //++
+  //   Write one sequence.  If nMatch is zero then it's the last sequence,
+  // which has only literals.  Returns false if it won't fit ...
+  //--
+  uint32_t nCode = (nMatch == 0) ? 0 : (nMatch - MIN_MATCH);
+  if (op >= cbMax) return false;
+  pbOut[op++] = (uint8_t) (((cbLiterals < 15) ? cbLiterals : 15) << 4) | ((nCode < 15) ? nCode : 15);
+  if ((cbLiterals >= 15) && !PutLength(pbOut, op, cbMax, cbLiterals)) return false;
+  if ((cbMax - op) < cbLiterals) return false;
+  memcpy(pbOut+op, pbLiterals, cbLiterals);  op += cbLiterals;
+  if (nMatch == 0) return true;
+  if ((cbMax - op) < 2) return false;
+  pbOut[op++] = (uint8_t) (nOffset & 0xFF);  pbOut[op++] = (uint8_t) (nOffset >> 8);
+  return (nCode < 15) || PutLength(pbOut, op, cbMax, nCode);
+}
+
+
+/*static*/ uint32_t CChunkedImage::Compress (const uint8_t *pbIn, uint32_t cbIn, uint8_t *pbOut, uint32_t cbMax)
+{
+  //++
+  //   Compress cbIn bytes and return the compressed size, or zero if it won't
+  // fit in cbMax bytes.  Matches are found with a hash table of the last
+  // position where each four byte string was seen - there's no searching
+  // for the best match, which keeps it quick ...
+  //--
+  std::vector<uint32_t> alHash(1UL << HASH_BITS, (uint32_t) NO_POSITION);
+  uint32_t ip = 0, nAnchor = 0, op = 0;
+  while ((ip + MIN_MATCH) <= cbIn) {
+    uint32_t lValue = Load32(pbIn+ip);
+    uint32_t nHash = ((uint32_t) (lValue * 2654435761UL)) >> (32 - HASH_BITS);
+    uint32_t nRef = alHash[nHash];  alHash[nHash] = ip;
+    if ((nRef == NO_POSITION) || ((ip - nRef) > MAX_OFFSET) || (Load32(pbIn+nRef) != lValue)) {
+      ++ip;  continue;
+    }
+    uint32_t nMatch = MIN_MATCH;
+    while (((ip + nMatch) < cbIn) && (pbIn[nRef+nMatch] == pbIn[ip+nMatch])) ++nMatch;
+    if (!PutSequence(pbOut, op, cbMax, pbIn+nAnchor, ip-nAnchor, ip-nRef, nMatch)) return 0;
+    ip += nMatch;  nAnchor = ip;
+  }
+  if (!PutSequence(pbOut, op, cbMax, pbIn+nAnchor, cbIn-nAnchor, 0, 0)) return 0;
+  return op;
+}
+
+
+/*static*/ bool CChunkedImage::Decompress (const uint8_t *pbIn, uint32_t cbIn, uint8_t *pbOut, uint32_t cbOut)
+{
+  //++
+  //   Decompress exactly cbOut bytes.  Everything is checked, so a damaged
+  // chunk just returns false rather than scribbling on memory ...
+  //--
+  uint32_t ip = 0, op = 0;
+  while (ip < cbIn) {
+    uint8_t bToken = pbIn[ip++];
+    uint32_t cbLiterals = bToken >> 4;
+    if ((cbLiterals == 15) && !GetLength(pbIn, ip, cbIn, cbLiterals)) return false;
+    if (((cbIn - ip) < cbLiterals) || ((cbOut - op) < cbLiterals)) return false;
+    memcpy(pbOut+op, pbIn+ip, cbLiterals);  ip += cbLiterals;  op += cbLiterals;
+    if (ip == cbIn) break;
+    if ((cbIn - ip) < 2) return false;
+    uint32_t nOffset = pbIn[ip] | (pbIn[ip+1] << 8);  ip += 2;
+    uint32_t nMatch = bToken & 15;
+    if ((nMatch == 15) && !GetLength(pbIn, ip, cbIn, nMatch)) return false;
+    nMatch += MIN_MATCH;
+    if ((nOffset == 0) || (nOffset > op) || ((cbOut - op) < nMatch)) return false;
+    // The match may overlap the output, so copy it one byte at a time ...
+    for (uint32_t i = 0;  i < nMatch;  ++i, ++op) pbOut[op] = pbOut[op-nOffset];
+  }
+  return op == cbOut;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////   CONTAINER FILE   //////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+CChunkedImage::CChunkedImage()
+  : m_pFile(NULL), m_fReadOnly(false), m_fIndexDirty(false), m_cbSector(0), m_nSectors(0),
+    m_nStored(0), m_cbLive(0), m_llAppend(0), m_llClock(0), m_cHits(0), m_cMisses(0)
+{
+  //++
+  // The constructor doesn't do anything - call Open() to get started ...
+  //--
+  for (uint32_t i = 0;  i < CACHE_CHUNKS;  ++i) {
+    m_aCache[i].nChunk = NO_CHUNK;  m_aCache[i].fDirty = false;  m_aCache[i].llLastUsed = 0;
+  }
+}
+
+
+/*static*/ uint32_t CChunkedImage::Checksum (const void *pData, size_t cbData)
+{
+  //++
+  // A 32 bit FNV-1a hash, to make sure the index we read is the one we wrote ...
+  //--
+  const uint8_t *pb = (const uint8_t *) pData;  uint32_t lHash = 2166136261UL;
+  for (size_t i = 0;  i < cbData;  ++i) lHash = (lHash ^ pb[i]) * 16777619UL;
+  return lHash;
+}
+
+
+bool CChunkedImage::Open (const string &strFileName, bool fReadOnly, uint32_t cbSector, uint32_t nSectors)
+{
+  //++
+  //   Open a container file.  If the file is empty then it's initialized as
+  // an all zero pack (which takes only a header, an empty index and a footer).
+  // Otherwise the header has to match the sector size and pack size, if we
+  // were given them ...
+  //--
+  assert(!IsOpen());
+  m_strFileName = strFileName;  m_fReadOnly = fReadOnly;  m_fIndexDirty = false;
+  m_cbSector = cbSector;  m_nSectors = nSectors;  m_nStored = 0;  m_cbLive = 0;
+  m_cHits = m_cMisses = 0;
+  m_pFile = fopen(strFileName.c_str(), fReadOnly ? "rb" : "r+b");
+  if (m_pFile == NULL) {
+    LOGS(ERROR, "unable to open " << strFileName);  return false;
+  }
+  uint64_t cbFile = FileSize(m_pFile);
+  if (cbFile == 0) {
+    if (fReadOnly || (cbSector == 0) || (nSectors == 0)) {
+      LOGS(ERROR, strFileName << " is empty");  goto failed;
+    }
+    if (!Create()) goto failed;
+  } else {
+    //  Read and check the header ...
+    uint8_t abHeader[HEADER_SIZE];  uint32_t lVersion, cbFileSector, nChunkSectors, nFileSectors;
+    if (!SeekFile(m_pFile, 0) || (fread(abHeader, 1, HEADER_SIZE, m_pFile) != HEADER_SIZE)
+     || (memcmp(abHeader, g_szHeaderMagic, sizeof(g_szHeaderMagic)) != 0)) {
+      LOGS(ERROR, strFileName << " is not a chunked image");  goto failed;
+    }
+    memcpy(&lVersion,      &abHeader[ 8], sizeof(uint32_t));
+    memcpy(&cbFileSector,  &abHeader[12], sizeof(uint32_t));
+    memcpy(&nChunkSectors, &abHeader[16], sizeof(uint32_t));
+    memcpy(&nFileSectors,  &abHeader[20], sizeof(uint32_t));
+    if ((lVersion != VERSION) || (nChunkSectors != CHUNK_SECTORS)
+     || ((cbFileSector % CSectorKernels::ZERO_GRAIN) != 0) || (cbFileSector == 0)) {
+      LOGS(ERROR, strFileName << " is an unsupported chunked image version");  goto failed;
+    }
+    if (((cbSector != 0) && (cbSector != cbFileSector)) || ((nSectors != 0) && (nSectors != nFileSectors))) {
+      LOGS(ERROR, strFileName << " is for a different pack type or format");  goto failed;
+    }
+    m_cbSector = cbFileSector;  m_nSectors = nFileSectors;
+    if (!ReadIndex(cbFile)) goto failed;
+  }
+
+  // Set up the cache and the compression buffer ...
+  for (uint32_t i = 0;  i < CACHE_CHUNKS;  ++i) {
+    m_aCache[i].nChunk = NO_CHUNK;  m_aCache[i].fDirty = false;
+    m_aCache[i].abData.resize(ChunkBytes());
+  }
+  m_abBuffer.resize(ChunkBytes());
+  LOGS(DEBUG, "chunked image " << strFileName << " opened, " << m_nStored << " of "
+    << GetChunks() << " chunks stored, " << m_cbLive << " bytes");
+  return true;
+
+failed:
+  fclose(m_pFile);  m_pFile = NULL;
+  return false;
+}
+
+
+bool CChunkedImage::Create()
+{
+  //++
+  // Initialize an empty file with a header and an empty index ...
+  //--
+  uint8_t abHeader[HEADER_SIZE];  uint32_t lVersion = VERSION, nChunkSectors = CHUNK_SECTORS;
+  memset(abHeader, 0, sizeof(abHeader));
+  memcpy(abHeader, g_szHeaderMagic, sizeof(g_szHeaderMagic));
+  memcpy(&abHeader[ 8], &lVersion,      sizeof(uint32_t));
+  memcpy(&abHeader[12], &m_cbSector,    sizeof(uint32_t));
+  memcpy(&abHeader[16], &nChunkSectors, sizeof(uint32_t));
+  memcpy(&abHeader[20], &m_nSectors,    sizeof(uint32_t));
+  if (!SeekFile(m_pFile, 0) || (fwrite(abHeader, 1, HEADER_SIZE, m_pFile) != HEADER_SIZE)) {
+    LOGS(ERROR, "error writing " << m_strFileName);  return false;
+  }
+  CHUNK_ENTRY empty = {0, 0, 0};
+  m_aIndex.assign((m_nSectors + CHUNK_SECTORS - 1) / CHUNK_SECTORS, empty);
+  m_llAppend = HEADER_SIZE;
+  m_fIndexDirty = true;
+  return WriteIndex();
+}
+
+
+bool CChunkedImage::LoadIndex (uint64_t llFooter)
+{
+  //++
+  //   Read the footer at llFooter, and then the index that it points to, and
+  // check everything we can.  The index has to end exactly where the footer
+  // starts, the checksum has to match, and every chunk has to be before the
+  // index and no bigger than a chunk.  Returns false (without any message)
+  // if any of that isn't true ...
+  //--
+  uint8_t abFooter[FOOTER_SIZE];  uint64_t llIndex;  uint32_t nChunks, lChecksum;
+  m_nStored = 0;  m_cbLive = 0;
+  if (!SeekFile(m_pFile, llFooter) || (fread(abFooter, 1, FOOTER_SIZE, m_pFile) != FOOTER_SIZE)
+   || (memcmp(abFooter, g_szFooterMagic, sizeof(g_szFooterMagic)) != 0)) return false;
+  memcpy(&llIndex,   &abFooter[ 8], sizeof(uint64_t));
+  memcpy(&nChunks,   &abFooter[16], sizeof(uint32_t));
+  memcpy(&lChecksum, &abFooter[20], sizeof(uint32_t));
+  if (nChunks != (m_nSectors + CHUNK_SECTORS - 1) / CHUNK_SECTORS) return false;
+  if ((llIndex < HEADER_SIZE) || ((llIndex + (uint64_t) nChunks*sizeof(CHUNK_ENTRY)) != llFooter)) return false;
+  m_aIndex.resize(nChunks);
+  if (!SeekFile(m_pFile, llIndex)
+   || (fread(&m_aIndex[0], sizeof(CHUNK_ENTRY), nChunks, m_pFile) != nChunks)
+   || (Checksum(&m_aIndex[0], nChunks*sizeof(CHUNK_ENTRY)) != lChecksum)) return false;
+  for (uint32_t i = 0;  i < nChunks;  ++i) {
+    if (m_aIndex[i].llOffset == 0) continue;
+    if ((m_aIndex[i].llOffset + m_aIndex[i].cbStored) > llIndex) return false;
+    if (m_aIndex[i].cbStored > ChunkBytes()) return false;
+    ++m_nStored;  m_cbLive += m_aIndex[i].cbStored;
+  }
+  return true;
+}
+
+
+bool CChunkedImage::ReadIndex (uint64_t cbFile)
+{
+  //++
+  //   Normally the footer is the very last thing in the file.  But changed
+  // chunks are appended to the file as they fall out of the cache, not just
+  // by Flush(), so if MBS crashed after that and before the next Flush() then
+  // there are chunks after the last footer.  In that case we search backwards
+  // for the most recent footer that's valid, and the file is just as it was
+  // after the last Flush().  The chunks after that become garbage, and new
+  // data is always appended at the very end of the file.  The index is marked
+  // dirty, so the next Flush() puts a good footer back at the end.
+  //
+  //   Footers can be at any byte offset, so the search has to look at every
+  // byte.  That's slow for a big file, but it only happens after a crash and
+  // the index checksum makes sure we don't mistake chunk data for a footer.
+  //--
+  m_llAppend = cbFile;
+  if (cbFile < HEADER_SIZE+FOOTER_SIZE) goto damaged;
+  if (LoadIndex(cbFile-FOOTER_SIZE)) return true;
+  {
+    const uint64_t cbMagic = sizeof(g_szFooterMagic);
+    std::vector<uint8_t> abBlock(SCAN_BLOCK);
+    uint64_t llEnd = cbFile - FOOTER_SIZE;
+    while (llEnd > HEADER_SIZE) {
+      //   Candidate footers start at llStart thru llEnd-1, and we read enough
+      // extra bytes to see the whole signature of the last one ...
+      uint64_t llStart = ((llEnd - HEADER_SIZE) > (SCAN_BLOCK - cbMagic)) ? (llEnd - (SCAN_BLOCK - cbMagic)) : HEADER_SIZE;
+      size_t cbRead = (size_t) (llEnd - llStart + cbMagic);
+      if (!SeekFile(m_pFile, llStart) || (fread(&abBlock[0], 1, cbRead, m_pFile) != cbRead)) goto damaged;
+      for (uint64_t llFooter = llEnd;  llFooter-- > llStart; ) {
+        if (memcmp(&abBlock[(size_t) (llFooter-llStart)], g_szFooterMagic, cbMagic) != 0) continue;
+        if (!LoadIndex(llFooter)) continue;
+        LOGS(WARNING, m_strFileName << " wasn't flushed - " << (cbFile - llFooter - FOOTER_SIZE)
+          << " bytes of changes after the last index were lost");
+        m_fIndexDirty = true;  return true;
+      }
+      llEnd = llStart;
+    }
+  }
+
+damaged:
+  LOGS(ERROR, "the index in " << m_strFileName << " is damaged");
+  return false;
+}
+
+
+bool CChunkedImage::WriteIndex()
+{
+  //++
+  // Append the index and a new footer that points to it ...
+  //--
+  uint8_t abFooter[FOOTER_SIZE];
+  uint64_t llIndex = m_llAppend;  uint32_t nChunks = GetChunks();
+  uint32_t lChecksum = Checksum(&m_aIndex[0], nChunks*sizeof(CHUNK_ENTRY));
+  memset(abFooter, 0, sizeof(abFooter));
+  memcpy(abFooter, g_szFooterMagic, sizeof(g_szFooterMagic));
+  memcpy(&abFooter[ 8], &llIndex,   sizeof(uint64_t));
+  memcpy(&abFooter[16], &nChunks,   sizeof(uint32_t));
+  memcpy(&abFooter[20], &lChecksum, sizeof(uint32_t));
+  if (!SeekFile(m_pFile, llIndex)
+   || (fwrite(&m_aIndex[0], sizeof(CHUNK_ENTRY), nChunks, m_pFile) != nChunks)
+   || (fwrite(abFooter, 1, FOOTER_SIZE, m_pFile) != FOOTER_SIZE)
+   || (fflush(m_pFile) != 0)) {
+    LOGS(ERROR, "error writing the index to " << m_strFileName);  return false;
+  }
+  m_llAppend = llIndex + nChunks*sizeof(CHUNK_ENTRY) + FOOTER_SIZE;
+  m_fIndexDirty = false;
+  return true;
+}
+
+
+bool CChunkedImage::NeedsCompaction() const
+{
+  //++
+  //   Return true if more than a third of the file is garbage - old copies of
+  // chunks and old indices - and there's enough of it to be worth while ...
+  //--
+  if (!IsOpen() || m_fReadOnly) return false;
+  uint64_t cbUsed = HEADER_SIZE + m_cbLive + GetChunks()*sizeof(CHUNK_ENTRY) + FOOTER_SIZE;
+  uint64_t cbGarbage = (m_llAppend > cbUsed) ? (m_llAppend - cbUsed) : 0;
+  return (cbGarbage > COMPACT_SLACK) && (cbGarbage > m_llAppend/3);
+}
+
+
+CChunkedImage::CACHE_SLOT *CChunkedImage::Load (uint32_t nChunk)
+{
+  //++
+  //   Return the cache slot for a chunk, loading it if necessary.  The least
+  // recently used slot is replaced, and written back first if it's dirty.
+  // Returns NULL if anything goes wrong ...
+  //--
+  assert(nChunk < GetChunks());
+  CACHE_SLOT *pVictim = &m_aCache[0];
+  for (uint32_t i = 0;  i < CACHE_CHUNKS;  ++i) {
+    if (m_aCache[i].nChunk == nChunk) {
+      ++m_cHits;  m_aCache[i].llLastUsed = ++m_llClock;  return &m_aCache[i];
+    }
+    if (m_aCache[i].llLastUsed < pVictim->llLastUsed) pVictim = &m_aCache[i];
+  }
+  ++m_cMisses;
+  if (pVictim->fDirty && !Store(*pVictim)) return NULL;
+  pVictim->nChunk = NO_CHUNK;
+
+  // Read and decompress the chunk ...
+  const CHUNK_ENTRY &e = m_aIndex[nChunk];
+  if (e.llOffset == 0) {
+    memset(&pVictim->abData[0], 0, ChunkBytes());
+  } else {
+    uint8_t *pbStored = ((e.lFlags & CHUNK_RAW) != 0) ? &pVictim->abData[0] : &m_abBuffer[0];
+    if (   (e.cbStored > ChunkBytes()) || !SeekFile(m_pFile, e.llOffset)
+        || (fread(pbStored, 1, e.cbStored, m_pFile) != e.cbStored)
+        || (((e.lFlags & CHUNK_RAW) != 0) ? (e.cbStored != ChunkBytes())
+             : !Decompress(pbStored, e.cbStored, &pVictim->abData[0], ChunkBytes()))) {
+      LOGS(ERROR, "error reading chunk " << nChunk << " from " << m_strFileName);
+      return NULL;
+    }
+  }
+  pVictim->nChunk = nChunk;  pVictim->fDirty = false;  pVictim->llLastUsed = ++m_llClock;
+  return pVictim;
+}
+
+
+bool CChunkedImage::Store (CACHE_SLOT &slot)
+{
+  //++
+  //   Compress a changed chunk and append it to the file.  A chunk of all
+  // zeros isn't written at all, and one that doesn't compress is written
+  // as is.  The index is updated, but not written ...
+  //--
+  assert(slot.fDirty && (slot.nChunk != NO_CHUNK) && !m_fReadOnly);
+  CHUNK_ENTRY &e = m_aIndex[slot.nChunk];
+  if (e.llOffset != 0) {--m_nStored;  m_cbLive -= e.cbStored;}
+  e.llOffset = 0;  e.cbStored = 0;  e.lFlags = 0;
+  m_fIndexDirty = true;  slot.fDirty = false;
+  if (CSectorKernels::IsZero(&slot.abData[0], ChunkBytes())) return true;
+
+  const uint8_t *pbData = &m_abBuffer[0];
+  uint32_t cbStored = Compress(&slot.abData[0], ChunkBytes(), &m_abBuffer[0], ChunkBytes());
+  if (cbStored == 0) {
+    pbData = &slot.abData[0];  cbStored = ChunkBytes();  e.lFlags = CHUNK_RAW;
+  }
+  if (!SeekFile(m_pFile, m_llAppend) || (fwrite(pbData, 1, cbStored, m_pFile) != cbStored)) {
+    LOGS(ERROR, "error writing chunk " << slot.nChunk << " to " << m_strFileName);
+    slot.fDirty = true;  return false;
+  }
+  e.llOffset = m_llAppend;  e.cbStored = cbStored;
+  m_llAppend += cbStored;  ++m_nStored;  m_cbLive += cbStored;
+  return true;
+}
+
+
+bool CChunkedImage::Read (uint32_t lLBA, void *pData)
+{
+  //++
+  // Read one sector.  Sectors past the end of the pack are an error ...
+  //--
+  assert(IsOpen());
+  if (lLBA >= m_nSectors) return false;
+  CACHE_SLOT *pSlot = Load(lLBA / CHUNK_SECTORS);
+  if (pSlot == NULL) return false;
+  memcpy(pData, &pSlot->abData[(size_t) (lLBA % CHUNK_SECTORS) * m_cbSector], m_cbSector);
+  return true;
+}
+
+
+bool CChunkedImage::Write (uint32_t lLBA, const void *pData)
+{
+  //++
+  //   Write one sector.  This just changes the cached chunk, and it gets
+  // compressed and written when it falls out of the cache or by Flush() ...
+  //--
+  assert(IsOpen());
+  if (m_fReadOnly || (lLBA >= m_nSectors)) return false;
+  CACHE_SLOT *pSlot = Load(lLBA / CHUNK_SECTORS);
+  if (pSlot == NULL) return false;
+  memcpy(&pSlot->abData[(size_t) (lLBA % CHUNK_SECTORS) * m_cbSector], pData, m_cbSector);
+  pSlot->fDirty = true;
+  return true;
+}
+
+
+bool CChunkedImage::Flush()
+{
+  //++
+  //   Write every changed chunk and then, if anything changed, a new index.
+  // The file is consistent as of the last successful Flush() ...
+  //--
+  if (!IsOpen() || m_fReadOnly) return true;
+  bool fOK = true;
+  for (uint32_t i = 0;  i < CACHE_CHUNKS;  ++i)
+    if (m_aCache[i].fDirty && !Store(m_aCache[i])) fOK = false;
+  if (m_fIndexDirty && !WriteIndex()) fOK = false;
+  return fOK;
+}
+
+
+bool CChunkedImage::Close()
+{
+  //++
+  // Flush everything and close the file ...
+  //--
+  if (!IsOpen()) return true;
+  bool fOK = Flush();
+  fclose(m_pFile);  m_pFile = NULL;
+  for (uint32_t i = 0;  i < CACHE_CHUNKS;  ++i) {
+    m_aCache[i].nChunk = NO_CHUNK;  m_aCache[i].fDirty = false;
+  }
+  return fOK;
+}
+
+
+/*static*/ bool CChunkedImage::IsChunked (const string &strFileName)
+{
+  //++
+  // Return true if this file starts with the chunked image header ...
+  //--
+  char szMagic[sizeof(g_szHeaderMagic)];
+  FILE *pFile = fopen(strFileName.c_str(), "rb");
+  if (pFile == NULL) return false;
+  bool fChunked = (fread(szMagic, 1, sizeof(szMagic), pFile) == sizeof(szMagic))
+               && (memcmp(szMagic, g_szHeaderMagic, sizeof(szMagic)) == 0);
+  fclose(pFile);
+  return fChunked;
+}
+
+
+/*static*/ bool CChunkedImage::Compact (const string &strFileName)
+{
+  //++
+  //   Copy the header, all the live chunks (in chunk order, without
+  // decompressing them), and a new index to a temporary file, and then
+  // replace the original with it.  If anything goes wrong the original is
+  // left alone.  The temporary file is synced before the rename, otherwise
+  // a crash could leave us with a new name for a file that isn't all there.
+  // The file must not be open anywhere else while this runs!
+  //--
+  CChunkedImage src;  string strTemp = strFileName + ".tmp";
+  if (!src.Open(strFileName, true)) return false;
+  uint64_t cbBefore = src.m_llAppend;
+  FILE *pTemp = fopen(strTemp.c_str(), "w+b");
+  if (pTemp == NULL) {
+    LOGS(ERROR, "unable to create " << strTemp);  return false;
+  }
+
+  //   Borrow the source object's index and buffer, and then write the new
+  // file using the source object's own WriteIndex() ...
+  std::vector<uint8_t> abChunk(src.ChunkBytes());
+  uint8_t abHeader[HEADER_SIZE];  uint64_t llAppend = HEADER_SIZE;  bool fOK = false;
+  if (!SeekFile(src.m_pFile, 0) || (fread(abHeader, 1, HEADER_SIZE, src.m_pFile) != HEADER_SIZE)
+   || (fwrite(abHeader, 1, HEADER_SIZE, pTemp) != HEADER_SIZE)) goto done;
+  for (uint32_t i = 0;  i < src.GetChunks();  ++i) {
+    CHUNK_ENTRY &e = src.m_aIndex[i];
+    if (e.llOffset == 0) continue;
+    assert(e.cbStored <= abChunk.size());
+    if (!SeekFile(src.m_pFile, e.llOffset) || (fread(&abChunk[0], 1, e.cbStored, src.m_pFile) != e.cbStored)
+     || (fwrite(&abChunk[0], 1, e.cbStored, pTemp) != e.cbStored)) goto done;
+    e.llOffset = llAppend;  llAppend += e.cbStored;
+  }
+  fclose(src.m_pFile);  src.m_pFile = pTemp;  pTemp = NULL;
+  src.m_llAppend = llAppend;  src.m_strFileName = strTemp;
+  fOK = src.WriteIndex() && SyncFile(src.m_pFile);
+  fclose(src.m_pFile);  src.m_pFile = NULL;
+
+done:
+  if (pTemp != NULL) fclose(pTemp);
+  if (!fOK) {
+    LOGS(ERROR, "unable to compact " << strFileName);
+    remove(strTemp.c_str());  return false;
+  }
+#ifdef _WIN32
+  fOK = MoveFileExA(strTemp.c_str(), strFileName.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  fOK = rename(strTemp.c_str(), strFileName.c_str()) == 0;
+#endif
+  if (!fOK) {
+    LOGS(ERROR, "unable to replace " << strFileName << " with " << strTemp);
+    remove(strTemp.c_str());  return false;
+  }
+  LOGS(DEBUG, strFileName << " compacted from " << cbBefore << " to " << src.m_llAppend << " bytes");
+  return true;
+}
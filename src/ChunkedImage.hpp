@@ -0,0 +1,184 @@
+//++
+// ChunkedImage.hpp -> CChunkedImage (compressed disk image container) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Most of the packs in the museum archive are mostly empty, and the rest
+// compress very well (especially in the simh format, where 28 of every 64
+// bits are zero).  ATTACH /FORMAT=CHUNKED stores the image in a compressed
+// container instead.  The pack is divided into chunks of CHUNK_SECTORS
+// sectors, each compressed separately, so any sector can be found without
+// reading more than one chunk.  The sector data inside the container is in
+// the simh format for 18 bit packs and the usual two bytes per word for 16
+// bit packs.
+//
+//   The file is laid out like this -
+//
+//      header  - HEADER_SIZE bytes, identifies the file and the pack size
+//      chunks  - compressed (or raw, if they don't compress) chunk data
+//      index   - one CHUNK_ENTRY for every chunk on the pack
+//      footer  - FOOTER_SIZE bytes, the location and checksum of the index
+//
+// A chunk that's all zeros isn't stored at all - its index entry is empty.
+// When a chunk changes, the new copy is appended to the end of the file and
+// the old copy is just forgotten.  Flush() writes a new index and footer,
+// again at the end of the file, so the previous index and footer are never
+// overwritten and the file is always consistent as of the last Flush().
+// Chunks that fall out of the cache are appended between flushes too, so
+// after a crash the footer may not be the last thing in the file - Open()
+// searches backwards for the last good one when that happens.
+// The wasted space is recovered by Compact(), which copies just the live
+// chunks to a new file.  CDiskDrive compacts the image when it's detached
+// if more than a third of it is garbage.
+//
+//   The compression is a simple LZ77 byte oriented scheme (it's the LZ4 block
+// format, but written from scratch here so that MBS has no dependencies).
+// It's very fast in both directions, and does well on the long runs of zeros
+// and repeated patterns that disk packs are full of.
+//
+//   Decompressed chunks are kept in a small cache of CACHE_CHUNKS entries,
+// since the host nearly always reads and writes sequentially.  Changed chunks
+// are written back when they fall out of the cache or when Flush() is called.
+// The caller (CDiskDrive) must hold the image lock for every call.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <stdio.h>              // FILE, fopen(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+using std::string;              // ...
+
+
+class CChunkedImage {
+  //++
+  // Chunked, compressed, disk image container ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    HEADER_SIZE   = 64,         // size of the file header, in bytes
+    FOOTER_SIZE   = 32,         // size of the file footer, in bytes
+    VERSION       = 1,          // current container format version
+    CHUNK_SECTORS = 64,         // sectors per chunk
+    CACHE_CHUNKS  = 16,         // decompressed chunks cached
+    COMPACT_SLACK = 1048576,    // never compact less garbage than this
+    SCAN_BLOCK    = 65536,      // buffer size used to search for a footer
+  };
+
+  // Constructor and destructor ...
+public:
+  CChunkedImage();
+  virtual ~CChunkedImage() {Close();}
+private:
+  // Disallow copy and assignment operations with CChunkedImage objects...
+  CChunkedImage(const CChunkedImage &) = delete;
+  CChunkedImage& operator= (const CChunkedImage &) = delete;
+
+  // Public properties ...
+public:
+  bool IsOpen() const {return m_pFile != NULL;}
+  bool IsReadOnly() const {return m_fReadOnly;}
+  // Return the sector size, and the pack size in sectors and chunks ...
+  uint32_t GetSectorSize() const {return m_cbSector;}
+  uint32_t GetSectors() const {return m_nSectors;}
+  uint32_t GetChunks() const {return (uint32_t) m_aIndex.size();}
+  // Return the number of chunks actually stored (i.e. not all zeros) ...
+  uint32_t GetStoredChunks() const {return m_nStored;}
+  // Return the bytes of live chunk data, and the total file size ...
+  uint64_t GetLiveBytes() const {return m_cbLive;}
+  uint64_t GetFileBytes() const {return m_llAppend;}
+  // Return the chunk cache statistics ...
+  uint64_t GetHits() const {return m_cHits;}
+  uint64_t GetMisses() const {return m_cMisses;}
+  // Return true if enough of the file is garbage to make compacting it worth while ...
+  bool NeedsCompaction() const;
+
+  // Public methods ...
+public:
+  //   Open a container file.  An empty file becomes a new, all zero, pack.
+  // If cbSector and nSectors are zero then they come from the header (the
+  // file must already exist in that case) ...
+  bool Open (const string &strFileName, bool fReadOnly, uint32_t cbSector=0, uint32_t nSectors=0);
+  // Write everything back and close the file ...
+  bool Close();
+  // Read or write one sector ...
+  bool Read (uint32_t lLBA, void *pData);
+  bool Write (uint32_t lLBA, const void *pData);
+  // Write all changed chunks, and then a new index ...
+  bool Flush();
+  // Return true if this file is a chunked container ...
+  static bool IsChunked (const string &strFileName);
+  // Copy just the live chunks to a new file, and replace the original ...
+  static bool Compact (const string &strFileName);
+
+  // Private types ...
+private:
+  //   One index entry.  An offset of zero means the chunk is all zeros, and
+  // otherwise the chunk is stored at llOffset, cbStored bytes long ...
+  struct CHUNK_ENTRY {
+    uint64_t  llOffset;         // offset of the chunk data in the file
+    uint32_t  cbStored;         // size of the stored chunk data
+    uint32_t  lFlags;           // CHUNK_RAW if not compressed
+  };
+  enum {CHUNK_RAW = 1};
+  // One decompressed chunk in the cache ...
+  struct CACHE_SLOT {
+    uint32_t  nChunk;           // chunk number (or NO_CHUNK if empty)
+    bool      fDirty;           // changed since it was loaded
+    uint64_t  llLastUsed;       // LRU timestamp
+    std::vector<uint8_t> abData;// the decompressed data
+  };
+  enum {NO_CHUNK = 0xFFFFFFFFUL};
+
+  // Private methods ...
+private:
+  // Return the size of one chunk, decompressed, in bytes ...
+  uint32_t ChunkBytes() const {return m_cbSector * CHUNK_SECTORS;}
+  // Find or load a chunk in the cache and return the slot ...
+  CACHE_SLOT *Load (uint32_t nChunk);
+  // Append one changed chunk to the file and update the index ...
+  bool Store (CACHE_SLOT &slot);
+  // Read, write or create the index and the header ...
+  bool LoadIndex (uint64_t llFooter);
+  bool ReadIndex (uint64_t cbFile);
+  bool WriteIndex();
+  bool Create();
+  // Compress or decompress a chunk ...
+  static uint32_t Compress (const uint8_t *pbIn, uint32_t cbIn, uint8_t *pbOut, uint32_t cbMax);
+  static bool Decompress (const uint8_t *pbIn, uint32_t cbIn, uint8_t *pbOut, uint32_t cbOut);
+  // Checksum the index ...
+  static uint32_t Checksum (const void *pData, size_t cbData);
+
+  // Private member data ...
+private:
+  FILE                 *m_pFile;        // the container file
+  string                m_strFileName;  // and its name, for messages
+  bool                  m_fReadOnly;    // the file is open read only
+  bool                  m_fIndexDirty;  // the index has changed since the last Flush()
+  uint32_t              m_cbSector;     // image sector size, in bytes
+  uint32_t              m_nSectors;     // number of sectors on the pack
+  uint32_t              m_nStored;      // number of chunks stored
+  uint64_t              m_cbLive;       // bytes of live chunk data
+  uint64_t              m_llAppend;     // end of the file
+  uint64_t              m_llClock;      // LRU clock for the cache
+  uint64_t              m_cHits;        // chunk cache hits
+  uint64_t              m_cMisses;      //   ... and misses
+  std::vector<CHUNK_ENTRY> m_aIndex;    // the chunk index
+  CACHE_SLOT            m_aCache[CACHE_CHUNKS]; // decompressed chunk cache
+  std::vector<uint8_t>  m_abBuffer;     // compressed chunk buffer
+};
@@ -0,0 +1,97 @@
+//++
+// Counter.hpp -> CCounter (64 bit event counter and rate) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A CCounter is a 64 bit event total plus the rate, in events per second,
+// measured over the last sample interval.  Counters get their events in one
+// of two ways - software counters are simply incremented by Increment(), and
+// hardware counters are fed the raw value of some FPGA register by
+// Accumulate().  The FPGA counters are only 20 bits wide and wrap around
+// quite happily, so Accumulate() adds the difference between this value and
+// the last one, modulo the counter width.  That works as long as we sample
+// more often than the counter can wrap, which at 20 bits is a LONG time.
+//
+//   The first raw value given to Accumulate() just establishes the baseline,
+// so the total is the number of events since we started watching rather than
+// since the FPGA was last reset.  UpdateRate() should be called at the end of
+// each sample interval to compute the rate.
+//
+//   This class doesn't do any locking - it's expected that one thread does
+// all the counting (a unit's worker thread for software counters, and the
+// MASSBUS channel thread for the hardware ones), and that only the channel
+// thread calls UpdateRate().  Anybody else (i.e. the UI) only reads the
+// results, and a slightly stale value is fine for display.  The total is
+// atomic only so that the channel thread never sees half an update.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <atomic>               // C++ std::atomic template
+
+
+class CCounter {
+  //++
+  // 64 bit event counter with wrap around handling and rate ...
+  //--
+
+  // Constructor ...
+public:
+  CCounter (uint8_t nBits=32)
+    : m_lMask((nBits >= 32) ? 0xFFFFFFFFUL : ((1UL << nBits) - 1)),
+      m_fPrimed(false), m_lLast(0), m_llTotal(0), m_llPrevious(0), m_dRate(0.0) {};
+  virtual ~CCounter() {};
+  // std::atomic can't be copied, so we have to do it ourselves ...
+  CCounter (const CCounter &c)
+    : m_lMask(c.m_lMask), m_fPrimed(c.m_fPrimed), m_lLast(c.m_lLast),
+      m_llTotal(c.m_llTotal.load()), m_llPrevious(c.m_llPrevious), m_dRate(c.m_dRate) {};
+  CCounter& operator= (const CCounter &c) {
+    m_lMask = c.m_lMask;  m_fPrimed = c.m_fPrimed;  m_lLast = c.m_lLast;
+    m_llTotal = c.m_llTotal.load();  m_llPrevious = c.m_llPrevious;  m_dRate = c.m_dRate;
+    return *this;
+  }
+
+  // Public counter methods ...
+public:
+  // Count software events ...
+  void Increment (uint32_t n=1) {m_llTotal += n;}
+  // Add the events counted by a free running hardware counter ...
+  void Accumulate (uint32_t lRaw) {
+    lRaw &= m_lMask;
+    if (m_fPrimed) m_llTotal += (lRaw - m_lLast) & m_lMask;
+    m_lLast = lRaw;  m_fPrimed = true;
+  }
+  // Compute the event rate for the sample interval just ended ...
+  void UpdateRate (double dSeconds) {
+    uint64_t llTotal = m_llTotal;
+    if (dSeconds > 0.0) m_dRate = (llTotal - m_llPrevious) / dSeconds;
+    m_llPrevious = llTotal;
+  }
+  // Zero the total and the rate (but not the hardware baseline!) ...
+  void Reset() {m_llTotal = m_llPrevious = 0;  m_dRate = 0.0;}
+  // Return the total events and the current rate ...
+  uint64_t GetTotal() const {return m_llTotal;}
+  double GetRate() const {return m_dRate;}
+
+  // Private member data ...
+private:
+  uint32_t m_lMask;             // mask for the hardware counter width
+  bool     m_fPrimed;           // true after the first Accumulate()
+  uint32_t m_lLast;             // last raw hardware counter value
+  std::atomic<uint64_t> m_llTotal; // total events counted
+  uint64_t m_llPrevious;        // total at the end of the last interval
+  double   m_dRate;             // events per second in the last interval
+};
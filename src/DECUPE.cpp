@@ -43,13 +43,20 @@
 //234567890123456789012345678901234567890123456789012345678901234567890123456789
 #include <stdlib.h>             // exit(), system(), etc ...
 #include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <stddef.h>             // offsetof() ...
 #include <assert.h>             // assert() (what else??)
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
 #include <PlxApi.h>             // PLX 9054 PCI interface API declarations
 #include "UPELIB.hpp"           // UPE library definitions
 #include "UPE.hpp"              // UPE library FPGA interface methods
 #include "LogFile.hpp"          // UPE library message logging facility
 #include "MBS.hpp"              // global declarations for this project
+#include "MASSBUS.h"            // MASSBUS commands and registers
 #include "DECUPE.hpp"           // and declarations for this module
+#include "TransferEngine.hpp"   // abstract data transfer engine
+#include "PLXDMA.hpp"           // PLX DMA data transfers
+#include "SimUPE.hpp"           // software UPE simulation
+#include "TraceLog.hpp"         // deferred TRACE message logging
 
 
 CUPE *NewDECUPE (const PLX_DEVICE_KEY *pplxKey)
@@ -64,6 +71,170 @@ CUPE *NewDECUPE (const PLX_DEVICE_KEY *pplxKey)
 }
 
 
+CDECUPE::~CDECUPE()
+{
+  //++
+  //   Note that this destructor should explicitly Close() the UPE if it has
+  // been opened.  Why?  It's complicated, but the comments in the CUPE::Close
+  // method will tell you more...  And if this UPE was simulated, then delete
+  // the simulator too.
+  //--
+  m_pTransfer = NULL;
+  if (m_pDMA != NULL) delete m_pDMA;
+  m_pDMA = NULL;
+  if (IsOpen())  Close();
+  if (m_pSimulator != NULL) delete m_pSimulator;
+  m_pSimulator = NULL;
+}
+
+
+bool CDECUPE::Simulate()
+{
+  //++
+  //   This method attaches a software simulation of the UPE FIFOs (see the
+  // CUPESimulator class) to this UPE.  That's only possible for an offline
+  // UPE, since an online one has the real FIFOs and these can't be replaced.
+  // Once a UPE is simulated it stays that way until it's destroyed.
+  //--
+  assert(IsOpen());
+  if (!IsOffline()) return false;
+  if (m_pSimulator == NULL) m_pSimulator = DBGNEW CUPESimulator(*this);
+  return true;
+}
+
+
+bool CDECUPE::SetDMA (bool fEnable)
+{
+  //++
+  //   Enable or disable block transfers for the data FIFO.  For a real UPE
+  // that means the PLX DMA engine, which we open the first time it's needed.
+  // For a simulated UPE the simulator does the block transfers.  It's not
+  // possible for an offline, unsimulated, UPE.  Returns false if block
+  // transfers can't be enabled, in which case we stay with PIO.
+  //--
+  assert(IsOpen());
+  if (!fEnable) {m_pTransfer = NULL;  return true;}
+  if (m_pSimulator != NULL) {m_pTransfer = m_pSimulator;  return true;}
+  if (IsOffline()) return false;
+  if (m_pDMA == NULL) {
+    m_pDMA = DBGNEW CPLXDMA();
+    if (!m_pDMA->Open(&m_plxKey, offsetof(SHARED_MEMORY, lDataFIFO))) {
+      delete m_pDMA;  m_pDMA = NULL;  return false;
+    }
+  }
+  m_pTransfer = m_pDMA;
+  return true;
+}
+
+
+const char *CDECUPE::GetTransferName() const
+{
+  //++
+  // Return the name of the data transfer mode (e.g. "PIO", "DMA") ...
+  //--
+  return (m_pTransfer != NULL) ? m_pTransfer->GetTransferName() : "PIO";
+}
+
+
+uint32_t CDECUPE::ReadFIFOBlock (uint32_t *plData, uint32_t clData)
+{
+  //++
+  //   Read as many as clData valid words from the data FIFO and return the
+  // number actually read.  If we have a transfer engine then it does the work,
+  // and otherwise we read words one at a time until we find the FIFO empty.
+  // If the transfer engine fails, then we give up on it for good and fall
+  // back to PIO.
+  //--
+  if (m_pTransfer != NULL) {
+    uint32_t nRead = m_pTransfer->ReadFIFO(plData, clData);
+    if (nRead != CTransferEngine::FAILED) return nRead;
+    LOGS(WARNING, m_pTransfer->GetTransferName() << " failed on " << *this << " - reverting to PIO");
+    m_pTransfer = NULL;
+  }
+  uint32_t i;
+  for (i = 0;  i < clData;  ++i) {
+    uint32_t data = ReadDataFIFO();
+    if (!IsDataValid(data)) break;
+    plData[i] = MASK18(data);
+  }
+  return i;
+}
+
+
+void CDECUPE::WriteFIFOBlock (const uint32_t *plData, uint32_t clData)
+{
+  //++
+  //   Write clData words to the data FIFO, using the transfer engine if we
+  // have one.  Anything the transfer engine doesn't handle, either because it
+  // failed or because it just couldn't take everything, gets written by PIO.
+  // Note that it's up to the caller to make sure there's room in the FIFO!
+  //--
+  uint32_t nDone = 0;
+  if (m_pTransfer != NULL) {
+    nDone = m_pTransfer->WriteFIFO(plData, clData);
+    if (nDone == CTransferEngine::FAILED) {
+      LOGS(WARNING, m_pTransfer->GetTransferName() << " failed on " << *this << " - reverting to PIO");
+      m_pTransfer = NULL;  nDone = 0;
+    }
+  }
+  for (;  nDone < clData;  ++nDone)  WriteDataFIFO(MASK18(plData[nDone]));
+}
+
+
+uint32_t CDECUPE::ReadCommandFIFO() const
+{
+  //++
+  // Pop the next entry from the command FIFO (real or simulated) ...
+  //--
+  if (m_pSimulator != NULL) return m_pSimulator->ReadCommandFIFO();
+  return GetWindow()->lCommandFIFO;
+}
+
+
+uint32_t CDECUPE::ReadDataFIFO() const
+{
+  //++
+  // Pop the next word from the "to PC" data FIFO ...
+  //--
+  if (m_pSimulator != NULL) return m_pSimulator->ReadDataFIFO();
+  return GetWindow()->lDataFIFO;
+}
+
+
+void CDECUPE::WriteDataFIFO (uint32_t lData)
+{
+  //++
+  // Push one word into the "from PC" data FIFO ...
+  //--
+  if (m_pSimulator != NULL)
+    m_pSimulator->WriteDataFIFO(lData);
+  else
+    GetWindow()->lDataFIFO = lData;
+}
+
+
+uint32_t CDECUPE::ReadFIFOstatus() const
+{
+  //++
+  // Read the FIFO status (full, empty, almost full, etc) bits ...
+  //--
+  if (m_pSimulator != NULL) return m_pSimulator->ReadFIFOstatus();
+  return GetWindow()->lFIFOstatus;
+}
+
+
+void CDECUPE::WriteSendCount (uint32_t lCount)
+{
+  //++
+  // Write the "send word count" register ...
+  //--
+  if (m_pSimulator != NULL)
+    m_pSimulator->WriteSendCount(lCount);
+  else
+    GetWindow()->lSendCount = lCount;
+}
+
+
 bool CDECUPE::Initialize()
 {
   //++
@@ -83,6 +254,7 @@ bool CDECUPE::Initialize()
   if (RegisterInterrupt() != ApiSuccess) return false;
 
   // Initialize the FPGA registers ...
+  FlushShadow();
   GetWindow()->lDrivesAttached = 0;
   if (!IsCableConnected())
     LOGS(WARNING, "MASSBUS cable disconnected on " << *this);
@@ -94,6 +266,36 @@ bool CDECUPE::Initialize()
 }
 
 
+bool CDECUPE::IsShadowed (uint8_t nRegister) const
+{
+  //++
+  //   Return true if the specified MASSBUS register is one that's owned by
+  // MBS and can be shadowed.  These are registers that only we ever write -
+  // neither the FPGA nor the host can change them - and so the copy in our
+  // shadow is always the same as the one in the FPGA.  Everything else (the
+  // status registers, the desired address registers, the tape byte and frame
+  // counts, etc) can change behind our back and must always be read.
+  //
+  //   Note that the register assignments are different for disk and tape,
+  // and we just use the VHDL type to figure out which we've got.
+  //--
+  static const uint32_t DISK_SHADOW = (1UL << RPDT) | (1UL << RPSN);
+  static const uint32_t TAPE_SHADOW = (1UL << TMDT) | (1UL << TMSN);
+  uint32_t lMask = IsDisk() ? DISK_SHADOW : IsTape() ? TAPE_SHADOW : 0;
+  return ISSET(lMask, 1UL << nRegister);
+}
+
+
+void CDECUPE::FlushShadow()
+{
+  //++
+  //   Invalidate all the shadowed registers for all units.  The next read
+  // of any register will come from the FPGA ...
+  //--
+  for (uint8_t i = 0;  i < 8;  ++i)  m_alShadowValid[i] = 0;
+}
+
+
 uint16_t CDECUPE::ReadMBR (uint8_t nUnit, uint8_t nRegister) const
 {
   //++
@@ -101,9 +303,20 @@ uint16_t CDECUPE::ReadMBR (uint8_t nUnit, uint8_t nRegister) const
   // specified MASSBUS register for the specified unit.  Remember that there
   // can be up to 8 devices on the MASSBUS and each one has its own separate
   // and independent register file.  
+  //
+  //   Every FPGA register read is a non-posted PCI read across the PLX bridge
+  // and they're not cheap, so registers that MBS owns are returned from the
+  // shadow copy instead (see IsShadowed()).
   //--
   assert((GetWindow() != NULL) && (nUnit < 8) && (nRegister < 32));
-  return LOWORD(GetWindow()->alRegisters[nUnit][nRegister]);
+  if (ISSET(m_alShadowValid[nUnit], 1UL << nRegister))
+    return m_awShadow[nUnit][nRegister];
+  ++m_cRegisterReads;
+  uint16_t wValue = LOWORD(GetWindow()->alRegisters[nUnit][nRegister]);
+  if (IsShadowed(nRegister)) {
+    m_awShadow[nUnit][nRegister] = wValue;  m_alShadowValid[nUnit] |= 1UL << nRegister;
+  }
+  return wValue;
 }
 
 
@@ -111,12 +324,19 @@ void CDECUPE::WriteMBR (uint8_t nUnit, uint8_t nRegister, uint16_t wValue)
 {
   //++
   //   Write (via the FPGA) the contents of a MASSBUS register ...
-  // This is the logical complement to ReadMBR() ...
+  // This is the logical complement to ReadMBR() ...  Writes always go thru
+  // to the FPGA, but if the register is shadowed then we update the shadow
+  // copy too.
   //--
   assert((GetWindow() != NULL) && (nUnit < 8) && (nRegister < 32));
+  ++m_cRegisterWrites;
   GetWindow()->alRegisters[nUnit][nRegister] = wValue;
+  if (IsShadowed(nRegister)) {
+    m_awShadow[nUnit][nRegister] = wValue;  m_alShadowValid[nUnit] |= 1UL << nRegister;
+  }
 #ifdef _DEBUG
-  uint16_t wNew = ReadMBR(nUnit, nRegister);
+  ++m_cRegisterReads;
+  uint16_t wNew = LOWORD(GetWindow()->alRegisters[nUnit][nRegister]);
   if (wNew != wValue)
     LOGF(WARNING, "WriteMBR() failed - nUnit=%d, nRegister=%d, wValue=%06o, register=%06o", nUnit, nRegister, wValue, wNew);
 #endif
@@ -126,12 +346,19 @@ void CDECUPE::WriteMBR (uint8_t nUnit, uint8_t nRegister, uint16_t wValue)
 uint16_t CDECUPE::ClearBitMBR (uint8_t nUnit, uint8_t nRegister, uint16_t wMask)
 {
   //++
-  // Clear bits (under mask) in the MASSBUS register ...
+  //   Clear bits (under mask) in the MASSBUS register ...  For shadowed
+  // registers we can compute the new value locally; otherwise this is a read-
+  // modify-write of the FPGA register.
   //--
   assert((GetWindow() != NULL) && (nUnit < 8) && (nRegister < 32));
+  if (IsShadowed(nRegister)) {
+    uint16_t wNew = ReadMBR(nUnit, nRegister) & ~wMask;
+    WriteMBR(nUnit, nRegister, wNew);  return wNew;
+  }
 #ifdef _DEBUG
   uint16_t wOld = ReadMBR(nUnit, nRegister);
 #endif
+  m_cRegisterReads += 2;  ++m_cRegisterWrites;
   GetWindow()->alRegisters[nUnit][nRegister] &= MKLONG(0, ~wMask);
 #ifdef _DEBUG
   uint16_t wNew = ReadMBR(nUnit, nRegister);
@@ -149,9 +376,14 @@ uint16_t CDECUPE::SetBitMBR (uint8_t nUnit, uint8_t nRegister, uint16_t wMask)
   // Set bits (under mask) in the MASSBUS register ...
   //--
   assert((GetWindow() != NULL) && (nUnit < 8) && (nRegister < 32));
+  if (IsShadowed(nRegister)) {
+    uint16_t wNew = ReadMBR(nUnit, nRegister) | wMask;
+    WriteMBR(nUnit, nRegister, wNew);  return wNew;
+  }
 #ifdef _DEBUG
   uint16_t wOld = ReadMBR(nUnit, nRegister);
 #endif
+  m_cRegisterReads += 2;  ++m_cRegisterWrites;
   GetWindow()->alRegisters[nUnit][nRegister] |= MKLONG(0, wMask);
 #ifdef _DEBUG
   uint16_t wNew = ReadMBR(nUnit, nRegister);
@@ -169,11 +401,27 @@ uint16_t CDECUPE::ToggleBitMBR (uint8_t nUnit, uint8_t nRegister, uint16_t wMask
   // Toggle bits (under mask) in the MASSBUS register ...
   //--
   assert((GetWindow() != NULL) && (nUnit < 8) && (nRegister < 32));
+  if (IsShadowed(nRegister)) {
+    uint16_t wNew = ReadMBR(nUnit, nRegister) ^ wMask;
+    WriteMBR(nUnit, nRegister, wNew);  return wNew;
+  }
+  m_cRegisterReads += 2;  ++m_cRegisterWrites;
   GetWindow()->alRegisters[nUnit][nRegister] ^= MKLONG(0, wMask);
   return LOWORD(GetWindow()->alRegisters[nUnit][nRegister]);
 }
 
 
+void CDECUPE::CommandDone()
+{
+  //++
+  //   The simulated host model needs to know when a command is really done
+  // (e.g. the image file has been written) before it sets up the next one,
+  // so tell the simulator.  For a real UPE the FPGA doesn't care ...
+  //--
+  if (m_pSimulator != NULL) m_pSimulator->CommandDone();
+}
+
+
 uint32_t CDECUPE::WaitCommand (uint32_t lTimeout)
 {
   //++
@@ -189,17 +437,38 @@ uint32_t CDECUPE::WaitCommand (uint32_t lTimeout)
   // bus transaction that reads the FIFO also clears it, so we only get exactly
   // one chance to read it!  If you read it a second time, you're guaranteed
   // not to get the same result...
+  //
+  //   Interrupts are expensive, though - it takes many microseconds for the
+  // PLX driver to wake us up, and during a multi sector transfer the RH20 is
+  // waiting on us the whole time.  So if the last call found a command (i.e.
+  // the bus is busy) then we first spin polling the FIFO for a short time,
+  // m_lPollTime microseconds, before we give up and wait for an interrupt.
+  // When the bus goes idle we stop polling until the next command arrives.
   //--
   uint32_t cmd, ret;
   assert(IsOpen());
 
   //   If we're offline, then just sleep for the timeout period and then
   // return CMD_TIMEOUT.  That's all we know how to do!
-  if (IsOffline()) {_sleep_ms(lTimeout);  return TIMEOUT;}
+  if (IsOffline() && !IsSimulated()) {_sleep_ms(lTimeout);  return TIMEOUT;}
 
   // If there's a valid command in the queue now, then just return it.
-  cmd = GetWindow()->lCommandFIFO;
-  if (IsCommandValid(cmd)) goto gotcmd;
+  cmd = ReadCommandFIFO();
+  if (IsCommandValid(cmd)) {++m_cCommandsReady;  goto gotcmd;}
+
+  // If we're busy, then spin for a while and see if something shows up ...
+  if (m_fPollNext && (m_lPollTime > 0) && PollCommand(m_lPollTime, cmd)) {
+    ++m_cCommandsPolled;  goto gotcmd;
+  }
+  m_fPollNext = false;
+
+  //   If we're simulated, then let the simulator wait for a command.  It's
+  // the moral equivalent of waiting for the interrupt ...
+  if (m_pSimulator != NULL) {
+    cmd = m_pSimulator->WaitCommand(lTimeout);
+    if (!IsCommandValid(cmd)) return TIMEOUT;
+    ++m_cCommandsInterrupt;  goto gotcmd;
+  }
 
   //   There's no command waiting, so we'll have to block until something
   // shows up.  The order of operations here is tricky - if the FPGA asserts
@@ -215,19 +484,99 @@ uint32_t CDECUPE::WaitCommand (uint32_t lTimeout)
   if (ret != ApiSuccess)  return ERROR;
 
   // And now there should be a command in the queue!
-  cmd = GetWindow()->lCommandFIFO;
+  cmd = ReadCommandFIFO();
   if (!IsCommandValid(cmd)) {
     LOGF(WARNING, "FPGA interrupted but no command found");  return TIMEOUT;
   }
+  ++m_cCommandsInterrupt;
 
   // Here if we have a good command ...
 gotcmd:
-  LOGF(TRACE, "Command 0x%08x (reg=%02o, unit=%d, cmd=%06o) received by %s", 
-    cmd, ExtractRegister(cmd), ExtractUnit(cmd), ExtractCommand(cmd), GetBDF().c_str());
+  m_fPollNext = true;
+  TRACEF("Command 0x%08x (reg=%02o, unit=%d, cmd=%06o) received by UPE %p",
+    cmd, ExtractRegister(cmd), ExtractUnit(cmd), ExtractCommand(cmd), this);
   return cmd;
 }
 
 
+uint32_t CDECUPE::ReadCommand()
+{
+  //++
+  //   Return the next command from the FIFO if there's one waiting right now,
+  // and TIMEOUT if there isn't.  This never waits, never polls and never
+  // enables interrupts - it's used to drain any commands that queued up
+  // while we were busy with the last one.
+  //--
+  assert(IsOpen());
+  if (IsOffline() && !IsSimulated()) return TIMEOUT;
+  uint32_t cmd = ReadCommandFIFO();
+  if (!IsCommandValid(cmd)) return TIMEOUT;
+  ++m_cCommandsReady;
+  return cmd;
+}
+
+
+bool CDECUPE::PollCommand (uint32_t lPollTime, uint32_t &lCommand)
+{
+  //++
+  //   Spin, polling the command FIFO, for up to lPollTime microseconds.  If a
+  // command shows up in that time then return true and the command longword
+  // in lCommand; otherwise return false.  Note that we read the clock only
+  // every few FIFO reads - the FIFO read is a PCI transaction and slow enough
+  // already, but there's no point in making it worse...
+  //--
+  std::chrono::steady_clock::time_point tmEnd
+    = std::chrono::steady_clock::now() + std::chrono::microseconds(lPollTime);
+  for (uint32_t n = 0;  ;  ++n) {
+    lCommand = ReadCommandFIFO();
+    if (IsCommandValid(lCommand)) return true;
+    CPU_PAUSE();
+    if (((n & 7) == 7) && (std::chrono::steady_clock::now() >= tmEnd)) return false;
+  }
+}
+
+
+bool CDECUPE::Spin (SPIN &spin)
+{
+  //++
+  //   Called every time around a loop that's waiting for the data FIFO, this
+  // pauses the CPU for a moment and returns false once the FIFO has been
+  // stalled for DATA_TIMEOUT microseconds.  This used to be a simple count
+  // of times around the loop, but then the real timeout depended on the CPU
+  // and on how long a PCI read takes (and DMA made it a lot longer).  The
+  // clock is only read every few spins, the same as PollCommand() - on any
+  // modern PC it's just the TSC, but there's no point in hammering it.  A
+  // timeout is counted and recorded in the stall histogram here, since the
+  // caller won't be calling EndSpin() after that ...
+  //--
+  if (spin.nSpins++ == 0) spin.tmStart = std::chrono::steady_clock::now();
+  CPU_PAUSE();
+  if ((spin.nSpins & 7) != 0) return true;
+  uint64_t llStall = std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now() - spin.tmStart).count();
+  if (llStall < DATA_TIMEOUT*1000ULL) return true;
+  m_histStalls.Record(llStall);  ++m_cDataTimeouts;  spin.nSpins = 0;
+  return false;
+}
+
+
+void CDECUPE::EndSpin (SPIN &spin)
+{
+  //++
+  //   The FIFO is ready again - if we actually had to wait for it, then record
+  // how long, and count it as a near miss if that was more than NEAR_MISS
+  // percent of the deadline.  The near miss count is the one to watch, since
+  // it shows how close a bus is to dropping a transfer ...
+  //--
+  if (spin.nSpins == 0) return;
+  uint64_t llStall = std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now() - spin.tmStart).count();
+  m_histStalls.Record(llStall);
+  if (llStall >= DATA_TIMEOUT*1000ULL*NEAR_MISS/100) ++m_cNearMisses;
+  spin.nSpins = 0;
+}
+
+
 bool CDECUPE::ReadData (uint32_t *plData, uint32_t clData)
 {
   //++
@@ -243,39 +592,39 @@ bool CDECUPE::ReadData (uint32_t *plData, uint32_t clData)
   // valid word, so any word we read WITHOUT this bit set is invalid. Unlike the
   // command FIFO, however, the data FIFO has no hardware interrupt to let us
   // know when more data is ready - we simply spin here polling the FIFO until
-  // we get what we want.
+  // we get what we want.  If a transfer engine (e.g. DMA) is enabled then we
+  // take as many words as are available in each go, otherwise it's one word
+  // per PCI read.
   //
   //   This is a little hokey, but remember that the real MASSBUS has to
   // transfer data fast enough to keep up with the spinning disk.  That means
   // there's an upper limit on how long it can take to transfer a sector and
   // we're guaranteed that we can't wait forever.  Just in case something goes
-  // wrong, however, we also implement a simple timeout that aborts the read
-  // operation if things drag on too long.
+  // wrong, however, we also abort the read if the FIFO stays empty for more
+  // than DATA_TIMEOUT microseconds (see Spin()).
   //
   //   The only thing that can go wrong here is a timeout reading data, and if
   // that happens then false is returned.
   //--
-  uint32_t i, tmo, data;
-  if (IsOffline()) return false;
+  uint32_t i, nRead;  SPIN spin;
+  if (IsOffline() && !IsSimulated()) return false;
   assert(IsOpen() && (plData != NULL) && (clData > 0));
 
   // For tapes, tell the FPGA how many words to expect ...
   if (IsTape()) {
-    LOGF(TRACE, "  >> reading %d halfwords from FIFO", clData);
-    GetWindow()->lSendCount = clData;
+    TRACEF("  >> reading %d halfwords from FIFO", clData);
+    WriteSendCount(clData);
   }
 
   //   And now read the expected number of words from the FIFO.  Spin wait, in a
   // tight little loop here, if data is not available (but don't wait too long!).
-  for (i = 0;  i < clData;  ++i) {
-    for (tmo = 0;  ;  ++tmo) {
-      data = GetWindow()->lDataFIFO;
-      if (IsDataValid (data)) break;
-      if (tmo >= DATA_TIMEOUT) {
-        LOGS(WARNING, "data FIFO timeout on " << *this);  return false;
-      }
+  for (i = 0;  i < clData;  ) {
+    nRead = ReadFIFOBlock(&plData[i], clData-i);
+    if (nRead > 0) {
+      i += nRead;  EndSpin(spin);
+    } else if (!Spin(spin)) {
+      LOGS(WARNING, "data FIFO timeout on " << *this);  return false;
     }
-    plData[i] = MASK18(data);
   }
 
   // Success!
@@ -298,6 +647,10 @@ bool CDECUPE::WriteData (const uint32_t *plData, uint32_t clData, bool fExceptio
   // faster than the RH20 and that the FIFO could overflow for long records.
   // To avoid data loss, we have to poll the FIFO's status and make sure
   // there's room before we write a word.
+  //
+  //   With a transfer engine (e.g. DMA) we can't check the FIFO status on every
+  // word, so tape records are sent in chunks of TAPE_CHUNK words and we wait
+  // for the FIFO to be almost empty before each chunk.
   //--
   assert(IsOpen()  &&  (plData != NULL)  &&  (clData > 0));
 
@@ -318,26 +671,40 @@ bool CDECUPE::WriteData (const uint32_t *plData, uint32_t clData, bool fExceptio
     // (exception) signal, which tells the RH20 that an error occurred.  This in
     // turn sets the DEE (drive exception error) bit in the RH20 status and
     // aborts any RH20 command list in progress...
-    GetWindow()->lSendCount = clData | (fException ? FORCE_EXCEPTION : 0);
+    WriteSendCount(clData | (fException ? FORCE_EXCEPTION : 0));
+    if (m_pTransfer != NULL) {
+      for (uint32_t i = 0;  i < clData;  i += TAPE_CHUNK) {
+        SPIN spin;
+        while (!ISSET(ReadFIFOstatus(), FROMPC_ALMOST_EMPTY)) {
+          if (!Spin(spin)) {
+            LOGS(WARNING, "data FIFO timeout on " << *this);  return false;
+          }
+        }
+        EndSpin(spin);
+        WriteFIFOBlock(&plData[i], ((clData-i) < TAPE_CHUNK) ? (clData-i) : TAPE_CHUNK);
+      }
+      return true;
+    }
     for (uint32_t i = 0;  i < clData;  ++i) {
       //   If the "from PC" FIFO is almost full, then just spin in a tight loop
       // waiting for some of the data to clear out.  Don't wait forever, though!
-      if (ISSET(GetWindow()->lFIFOstatus, FROMPC_ALMOST_FULL)) {
+      if (ISSET(ReadFIFOstatus(), FROMPC_ALMOST_FULL)) {
         //LOGF(TRACE, "  >> FIFO STATUS 0x%08x .. waiting", GetWindow()->lFIFOstatus);
-        for (uint32_t tmo = 0;  !ISSET(GetWindow()->lFIFOstatus, FROMPC_ALMOST_EMPTY);  ++tmo) {
-          if (tmo >= DATA_TIMEOUT) {
+        SPIN spin;
+        while (!ISSET(ReadFIFOstatus(), FROMPC_ALMOST_EMPTY)) {
+          if (!Spin(spin)) {
             LOGS(WARNING, "data FIFO timeout on " << *this);  return false;
           }
         }
+        EndSpin(spin);
         //LOGF(TRACE, "  >> FIFO STATUS 0x%08x .. ready", GetWindow()->lFIFOstatus);
       }
       // Stuff the next word into the FIFO ...
-      GetWindow()->lDataFIFO = MASK18(plData[i]);
+      WriteDataFIFO(MASK18(plData[i]));
     }
   } else {
     // For the disk case, we can just let 'er rip!
-    for (uint32_t i = 0;  i < clData;  ++i) 
-      GetWindow()->lDataFIFO = MASK18(plData[i]);
+    WriteFIFOBlock(plData, clData);
   }
 
   // Success!
@@ -345,6 +712,76 @@ bool CDECUPE::WriteData (const uint32_t *plData, uint32_t clData, bool fExceptio
 }
 
 
+bool CDECUPE::ReadStream (CFIFOStream &dst, uint32_t clData)
+{
+  //++
+  //   This is the streaming version of ReadData(), for disks only.  Words are
+  // collected from the FIFO and each CHUNK is handed to the stream as soon as
+  // it's complete.  The stream converts it straight into the image file
+  // format.  With PIO we read one chunk at a time, so each chunk is converted
+  // while it's still in the L1 cache.  A transfer engine is asked for all the
+  // words that are left at once, though - each DMA costs the same setup time
+  // no matter how small it is, so one transfer per sector is what we want.
+  // The timeout rules are the same as ReadData().
+  //--
+  uint32_t alBuffer[SECTOR_SIZE], nHave = 0, nDone = 0;  SPIN spin;
+  if (IsOffline() && !IsSimulated()) return false;
+  assert(IsOpen() && !IsTape() && (clData > 0) && (clData <= SECTOR_SIZE));
+  while (nDone < clData) {
+    uint32_t clWant = clData - nHave;
+    if ((m_pTransfer == NULL) && (clWant > (CFIFOStream::CHUNK - (nHave % CFIFOStream::CHUNK))))
+      clWant = CFIFOStream::CHUNK - (nHave % CFIFOStream::CHUNK);
+    uint32_t nRead = ReadFIFOBlock(&alBuffer[nHave], clWant);
+    if (nRead == 0) {
+      if (!Spin(spin)) {
+        LOGS(WARNING, "data FIFO timeout on " << *this);  return false;
+      }
+      continue;
+    }
+    EndSpin(spin);  nHave += nRead;
+    // Pass along every complete chunk, and the last one even if it isn't ...
+    while (((nHave-nDone) >= CFIFOStream::CHUNK) || ((nHave == clData) && (nDone < clData))) {
+      uint32_t cl = ((nHave-nDone) < CFIFOStream::CHUNK) ? (nHave-nDone) : CFIFOStream::CHUNK;
+      dst.Put(nDone, cl, &alBuffer[nDone]);  nDone += cl;
+    }
+  }
+  return true;
+}
+
+
+bool CDECUPE::WriteStream (const CFIFOStream &src, uint32_t clData)
+{
+  //++
+  //   And this is the streaming version of WriteData(), again for disks only.
+  // A transfer engine gets the whole stream at once, and the DMA engine
+  // converts it right into its bounce buffer.  Otherwise (or for whatever
+  // the engine didn't take) the stream converts a CHUNK at a time and the
+  // words go into the FIFO by PIO while they're still in the L1 cache.  The
+  // FIFO starts filling as soon as the first chunk is ready.
+  //--
+  assert(IsOpen() && !IsTape() && (clData > 0));
+  uint32_t alChunk[CFIFOStream::CHUNK], nDone = 0;
+  if (m_pTransfer != NULL) {
+    nDone = m_pTransfer->WriteStream(src, 0, clData);
+    if (nDone == CTransferEngine::FAILED) {
+      LOGS(WARNING, m_pTransfer->GetTransferName() << " failed on " << *this << " - reverting to PIO");
+      m_pTransfer = NULL;  nDone = 0;
+    }
+  }
+
+  //   The transfer engine might have stopped in the middle of a chunk, so
+  // start with the chunk that contains word nDone and skip what's already
+  // been written ...
+  for (uint32_t n = nDone - (nDone % CFIFOStream::CHUNK);  n < clData;  n += CFIFOStream::CHUNK) {
+    uint32_t cl = ((clData-n) < CFIFOStream::CHUNK) ? (clData-n) : CFIFOStream::CHUNK;
+    src.Get(n, cl, alChunk);
+    for (uint32_t i = (nDone > n) ? (nDone-n) : 0;  i < cl;  ++i)
+      WriteDataFIFO(MASK18(alChunk[i]));
+  }
+  return true;
+}
+
+
 void CDECUPE::EmptyTransfer (bool fException)
 {
   //++
@@ -358,11 +795,11 @@ void CDECUPE::EmptyTransfer (bool fException)
   // (exception) signal, which tells the RH20 that an error occurred.  This in
   // turn sets the DEE (drive exception error) bit in the RH20 status and
   // aborts any RH20 command list in progress...
-  GetWindow()->lSendCount = fException ? FORCE_EXCEPTION : 0;
+  WriteSendCount(fException ? FORCE_EXCEPTION : 0);
   //   Even though we are transferring zero words, Bruce's FPGA state machine
   // needs to find something in the data FIFO or else it will hang up.  Bruce
   // swears that this word will be flushed and not actually sent to the host.
-  GetWindow()->lDataFIFO = 0;
+  WriteDataFIFO(0);
 }
 
 
@@ -392,3 +829,26 @@ void CDECUPE::SetDrivesAttached (uint32_t nMap)
   GetWindow()->lDrivesAttached = nMap;
   LOGF(DEBUG, "drive map set to 0x%02X", nMap);
 }
+
+
+void CDECUPE::SampleCounters (double dSeconds)
+{
+  //++
+  //   Read the FPGA parity error and per drive sector counters and add them
+  // to our 64 bit accumulators, then update the rates over the last dSeconds.
+  // The FPGA counters are only 20 bits and wrap around, but CCounter takes
+  // care of that as long as we get here at least once every million or so
+  // events.  This is called every second or so by the MASSBUS channel thread.
+  //--
+  if (!IsOpen()) return;
+  volatile SHARED_MEMORY *pWindow = GetWindow();
+  m_ctrControlErrors.Accumulate(pWindow->lControlErrors);
+  m_ctrDataErrors.Accumulate(pWindow->lDataErrors);
+  m_ctrControlErrors.UpdateRate(dSeconds);  m_ctrDataErrors.UpdateRate(dSeconds);
+  for (uint8_t i = 0;  i < 8;  ++i) {
+    m_actrSectorsRead[i].Accumulate(pWindow->alReadCounters[i]);
+    m_actrSectorsWritten[i].Accumulate(pWindow->alWriteCounters[i]);
+    m_actrSectorsRead[i].UpdateRate(dSeconds);
+    m_actrSectorsWritten[i].UpdateRate(dSeconds);
+  }
+}
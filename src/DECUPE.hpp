@@ -28,8 +28,17 @@
 #pragma once
 #include <string>               // C++ std::string class, et al ...
 #include <iostream>             // C++ style output for LOGS() ...
+#include <atomic>               // C++ std::atomic template
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
 using std::string;              // ...
 using std::ostream;             // ...
+#include "Mutex.hpp"            // UPELIB CMutex critical section lock
+#include "Counter.hpp"          // 64 bit event counter and rate
+#include "Latency.hpp"          // CHistogram for data FIFO stalls
+class CUPESimulator;            // we need forward pointers for this class
+class CTransferEngine;          //   ... and this one ...
+class CPLXDMA;                  //   ... and this one too ...
+class CFIFOStream;              //   ... and this one ...
 
 
 // CDECUPE class definition ...
@@ -42,7 +51,12 @@ class CDECUPE : public CUPE {
   public:
     enum {
       COMMAND_TIMEOUT =  1000UL,  // upeWaitCommand() timeout (in ms)
-      DATA_TIMEOUT    = 77777UL   // data transfer timeout (iterations)
+      DATA_TIMEOUT    = 50000UL,  // data FIFO stall deadline (in us)
+      NEAR_MISS       =    25UL,  // a stall this % of the deadline is close
+      TAPE_CHUNK      =   256UL,  // tape record block transfer size (words)
+      DEFAULT_POLL    =    20UL,  // default command poll window (in us)
+      MAX_POLL        = 10000UL,  // maximum poll window allowed (in us)
+      COUNTER_BITS    =    20UL   // width of the FPGA error and sector counters
     };
 
     // Shared Memory Map
@@ -82,8 +96,10 @@ private:
       uint32_t lwhatever;               //   don't know what Bruce put here!
       uint32_t lVHDL;                   //   VHDL version number
       uint32_t filler_6[251];           //
-      uint32_t filler_7[256];           // 0x1Cxx unused ...
-      uint32_t filler_8[256];           // 0x20xx unused ...
+      uint32_t alReadCounters[8];       // 0x1Cxx per drive sector read counters
+      uint32_t filler_7[248];           //
+      uint32_t alWriteCounters[8];      // 0x20xx per drive sector write counters
+      uint32_t filler_8[248];           //
       uint32_t lSendCount;              // 0x2400 count of words to be sent to the host
       uint32_t lReceiveCount;           // 0x2404 count of words received from the host
       uint32_t filler_9[254];           // ...
@@ -140,6 +156,7 @@ public:
   uint8_t  GetVHDLtype() const {return IsOpen() ? HIWORD(GetWindow()->lVHDL) & 7 : 0;}
   void SetVHDLtype (uint8_t  nType) {
     if (IsOffline()) GetWindow()->lVHDL = MKLONG((nType & 7), LOWORD(GetWindow()->lVHDL));
+    FlushShadow();
   }
   // Get or set the owner PID of this UPE ...
 //virtual PROCESS_ID GetOwner() const  {return IsOpen() ? GetWindow()->lOwner : 0;}
@@ -158,15 +175,65 @@ public:
   bool IsTape() const {return (GetVHDLtype() == TYPE_TAPE);}
   bool IsNI()   const {return (GetVHDLtype() == TYPE_MEIS);}
 
+  //   Get or set the command FIFO poll window, in microseconds.  Zero disables
+  // polling and WaitCommand() will always wait for an interrupt ...
+  uint32_t GetPollTime() const {return m_lPollTime;}
+  void SetPollTime (uint32_t lPollTime) {m_lPollTime = lPollTime;}
+  //   Return the number of commands that were already waiting in the FIFO,
+  // that were found by polling, and that required an interrupt ...
+  uint64_t GetCommandsReady() const {return m_cCommandsReady;}
+  uint64_t GetCommandsPolled() const {return m_cCommandsPolled;}
+  uint64_t GetCommandsInterrupt() const {return m_cCommandsInterrupt;}
+  uint64_t GetCommandCount() const
+    {return m_cCommandsReady + m_cCommandsPolled + m_cCommandsInterrupt;}
+  // Return the number of actual FPGA MASSBUS register reads and writes ...
+  uint64_t GetRegisterReads() const {return m_cRegisterReads;}
+  uint64_t GetRegisterWrites() const {return m_cRegisterWrites;}
+  //   Return the FPGA parity error and per drive sector counters.  These are
+  // only as current as the last call to SampleCounters() ...
+  const CCounter &GetControlErrors() const {return m_ctrControlErrors;}
+  const CCounter &GetDataErrors() const {return m_ctrDataErrors;}
+  const CCounter &GetSectorsRead (uint8_t nUnit) const
+    {assert(nUnit < 8);  return m_actrSectorsRead[nUnit];}
+  const CCounter &GetSectorsWritten (uint8_t nUnit) const
+    {assert(nUnit < 8);  return m_actrSectorsWritten[nUnit];}
+  //   Enable or disable block (e.g. DMA) transfers for the data FIFO, and
+  // return the name of the current transfer mode ...
+  bool SetDMA (bool fEnable);
+  bool IsDMA() const {return m_pTransfer != NULL;}
+  const char *GetTransferName() const;
+  // Return TRUE if this UPE is simulated in software ...
+  bool IsSimulated() const {return m_pSimulator != NULL;}
+  CUPESimulator *GetSimulator() const {return m_pSimulator;}
+  //   Return the data FIFO stall statistics - the number of stalls that took
+  // more than NEAR_MISS percent of the deadline and the number that missed it
+  // entirely, and a copy of the stall time histogram.  The copy is made with
+  // the transfer lock held, so it's consistent ...
+  uint64_t GetNearMisses() const {return m_cNearMisses;}
+  uint64_t GetDataTimeouts() const {return m_cDataTimeouts;}
+  void GetStallHistogram (CHistogram &hist)
+    {LockTransfer();  hist = m_histStalls;  UnlockTransfer();}
+
   // CUPE constructor and destructor ...
 public:
-  CDECUPE (const PLX_DEVICE_KEY *pplxKey) : CUPE(pplxKey) {};
+  CDECUPE (const PLX_DEVICE_KEY *pplxKey)
+    : CUPE(pplxKey), m_plxKey(*pplxKey), m_pSimulator(NULL), m_pTransfer(NULL), m_pDMA(NULL),
+      m_lPollTime(DEFAULT_POLL), m_fPollNext(false),
+      m_cCommandsReady(0), m_cCommandsPolled(0), m_cCommandsInterrupt(0),
+      m_cRegisterReads(0), m_cRegisterWrites(0), m_cNearMisses(0), m_cDataTimeouts(0),
+      m_ctrControlErrors(COUNTER_BITS), m_ctrDataErrors(COUNTER_BITS) {
+    FlushShadow();
+    for (uint8_t i = 0;  i < 8;  ++i)
+      m_actrSectorsRead[i] = m_actrSectorsWritten[i] = CCounter(COUNTER_BITS);
+  };
   //   Note that this destructor should explicitly Close() the UPE if it has
   // been opened.  Why?  It's complicated, but the comments in the CUPE::Close
   // method will tell you more...
-  virtual ~CDECUPE() {if (IsOpen())  Close();};
+  virtual ~CDECUPE();
   // Initialize the DEC specific state ...
   virtual bool Initialize();
+  // Attach a software simulator to an offline UPE ...
+  bool Simulate();
 
   // Disallow copy and assignment operations with CUPE objects...
   //   There's locally allocated data in m_pplxData and m_pUPE, and it's not
@@ -185,21 +252,92 @@ public:
   uint16_t ToggleBitMBR(uint8_t nUnit, uint8_t nregister, uint16_t wMask);
   // Wait for a command in the command FIFO ...
   uint32_t WaitCommand (uint32_t lTimeout=COMMAND_TIMEOUT);
+  // Return the next command only if one is waiting now ...
+  uint32_t ReadCommand();
   // Special values returned by WaitCommand() for timeout and errors.
   enum {TIMEOUT = 0x00000000UL, ERROR = 0x0FFFFFFF};
   // Read and write blocks of data to/from the FIFO ...
   bool ReadData (uint32_t alData[], uint32_t clData);
   bool WriteData (const uint32_t alData[], uint32_t clData, bool fException = false);
   void EmptyTransfer (bool fException = false);
+  // Stream disk sector data to/from the FIFO, converting on the fly ...
+  bool ReadStream (CFIFOStream &dst, uint32_t clData);
+  bool WriteStream (const CFIFOStream &src, uint32_t clData);
   // Tell the FPGA about mapped drives and emulated geometry ...
   void SetDrivesAttached (uint32_t nMap);
   void SetGeometry (uint8_t nUnit, uint16_t nCylinders, uint8_t nHeads, uint8_t nSectors);
+  // Sample the FPGA counters (called periodically by the MASSBUS thread) ...
+  void SampleCounters (double dSeconds);
+  //   Serialize data transfers.  The unit workers execute commands for
+  // different drives at the same time, but there's only one data FIFO (and
+  // only one MASSBUS!) so CMBA holds this lock for any command that uses it.
+  // The MASSBUS registers are separate for each unit and don't need it ...
+  void LockTransfer() {m_TransferLock.Enter();}
+  void UnlockTransfer() {m_TransferLock.Leave();}
+  //   Called by CMBA after a command taken from the command FIFO is completely
+  // finished (or has been thrown away).  Only the simulator cares ...
+  void CommandDone();
 
   // Private methods ...
 private:
+  // Test for shadowed MASSBUS registers and invalidate the shadow ...
+  bool IsShadowed (uint8_t nRegister) const;
+  void FlushShadow();
+  // Read or write a block of data using PIO or the transfer engine ...
+  uint32_t ReadFIFOBlock (uint32_t *plData, uint32_t clData);
+  void WriteFIFOBlock (const uint32_t *plData, uint32_t clData);
+  // Spin polling the command FIFO for a while ...
+  bool PollCommand (uint32_t lPollTime, uint32_t &lCommand);
+  //   Wait for the data FIFO.  Spin() is called every time around a wait loop
+  // and returns false once the deadline has passed; EndSpin() is called when
+  // the FIFO is ready again and records how long we waited ...
+  struct SPIN {
+    std::chrono::steady_clock::time_point tmStart;  // time the stall began
+    uint32_t nSpins;                                // times around the loop
+    SPIN() : nSpins(0) {};
+  };
+  bool Spin (SPIN &spin);
+  void EndSpin (SPIN &spin);
+  //   All access to the UPE FIFOs goes thru these routines, which redirect
+  // to the simulator (if there is one) instead of the real hardware ...
+  uint32_t ReadCommandFIFO() const;
+  uint32_t ReadDataFIFO() const;
+  void WriteDataFIFO (uint32_t lData);
+  uint32_t ReadFIFOstatus() const;
+  void WriteSendCount (uint32_t lCount);
 
   // Private member data ...
 private:
+  PLX_DEVICE_KEY m_plxKey;        // PLX device key (for opening DMA)
+  CUPESimulator *m_pSimulator;    // software UPE simulation (offline only!)
+  CTransferEngine *m_pTransfer;   // block transfer engine (NULL for PIO)
+  CPLXDMA       *m_pDMA;          // PLX DMA engine, if we've opened it
+  uint32_t m_lPollTime;           // command FIFO poll window (microseconds)
+  bool     m_fPollNext;           // true if the last WaitCommand() found one
+  uint64_t m_cCommandsReady;      // commands found on the first FIFO read
+  uint64_t m_cCommandsPolled;     //   "   "    "  by polling the FIFO
+  uint64_t m_cCommandsInterrupt;  //   "   "    "  after an interrupt
+  //   The MASSBUS register shadow holds copies of registers that only MBS
+  // ever writes (see IsShadowed()), and m_alShadowValid is a bitmap, one bit
+  // per register, of the ones in the shadow that are currently valid.  These
+  // are mutable because ReadMBR() is logically const ...
+  mutable uint16_t m_awShadow[8][32];   // shadow copies of MASSBUS registers
+  mutable uint32_t m_alShadowValid[8];  // bitmap of valid shadow registers
+  //   The register counters are updated by every unit worker, so they have
+  // to be atomic ...
+  mutable std::atomic<uint64_t> m_cRegisterReads; // count of FPGA register reads
+  std::atomic<uint64_t> m_cRegisterWrites;        //   "   "   "     "     writes
+  CMutex   m_TransferLock;              // held for every data transfer
+  //   The data FIFO stall statistics are only updated by transfers, which
+  // means with m_TransferLock held ...
+  CHistogram m_histStalls;              // time spent waiting for the FIFO
+  uint64_t m_cNearMisses;               // stalls longer than NEAR_MISS%
+  uint64_t m_cDataTimeouts;             // stalls that missed the deadline
+  // Host side accumulators for the 20 bit FPGA counters ...
+  CCounter m_ctrControlErrors;          // control bus parity errors
+  CCounter m_ctrDataErrors;             // data bus parity errors
+  CCounter m_actrSectorsRead[8];        // sectors read, per drive
+  CCounter m_actrSectorsWritten[8];     // sectors written, per drive
 };
 
 
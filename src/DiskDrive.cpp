@@ -32,6 +32,9 @@
 //--
 #include <stdint.h>	        // uint8_t, uint32_t, etc ...
 #include <assert.h>             // assert() (what else??)
+#include <string.h>             // memset(), etc ...
+#include <stdio.h>              // fopen(), fread(), fwrite(), etc ...
+#include <chrono>               // steady_clock, for timing SetRam() ...
 #include "UPELIB.hpp"           // UPE library definitions
 #include "UPE.hpp"              // UPE library FPGA interface methods
 #include "LogFile.hpp"          // UPE library message logging facility
@@ -41,8 +44,20 @@
 #include "DriveType.hpp"        // internal drive type class
 #include "DECUPE.hpp"           // DEC specific UPE/FPGA class definitions
 #include "BaseDrive.hpp"        // common methods for all MASSBUS drives
+#include "SectorCache.hpp"      // SLRU cache of unpacked sectors
+#include "ReadAhead.hpp"        // sequential read ahead
+#include "MappedImage.hpp"      // memory mapped image files
+#include "WriteBehind.hpp"      // asynchronous write queue
+#include "SectorKernels.hpp"    // SIMD sector pack/unpack kernels
+#include "TransferEngine.hpp"   // CFIFOStream streaming interface
+#include "Overlay.hpp"          // copy on write overlays
+#include "SparseImage.hpp"      // sparse image file I/O
+#include "ChunkedImage.hpp"     // compressed image container
+#include "RamImage.hpp"         // RAM resident images
+#include "ImageSync.hpp"        // image durability and group commit
 #include "DiskDrive.hpp"        // declarations for this module
 #include "MBA.hpp"              // MASSBUS drive collection class
+#include "TraceLog.hpp"         // deferred TRACE message logging
 
 
 
@@ -57,7 +72,11 @@ CDiskDrive::CDiskDrive (CMBA &mba, uint8_t nUnit, uint8_t nIDT)
   //   Initialize any disk specific members...  Note that GetDiskType() has
   // already asserted that nIDT corresponds to a disk type device!!
   //--
-  m_f18Bit = false;  m_nSectorSize = 512;
+  m_f18Bit = false;  m_nSectorSize = 512;  m_pCache = NULL;  m_pReadAhead = NULL;
+  m_pMap = NULL;  m_nFlushInterval = DEFAULT_FLUSH;  m_dSinceFlush = 0;
+  m_nFormat = FORMAT_SIMH;
+  m_pWriteBehind = NULL;  m_pOverlay = NULL;  m_pBaseCache = NULL;  m_pSparse = NULL;
+  m_pChunked = NULL;  m_pRam = NULL;  m_pSync = NULL;
 }
 
 
@@ -68,7 +87,9 @@ CDiskDrive::~CDiskDrive()
   //--
   if (IsOnline()) SpinDown();
   if (IsAttached()) Detach();
-  delete (CDiskImageFile *) m_pImage;
+  delete m_pWriteBehind;  delete m_pReadAhead;  delete m_pCache;  delete m_pMap;
+  delete m_pOverlay;  CBaseCache::Close(m_pBaseCache);  delete m_pSparse;
+  delete m_pChunked;  delete m_pRam;  delete m_pSync;  delete (CDiskImageFile *) m_pImage;
 }
 
 
@@ -78,7 +99,7 @@ bool CDiskDrive::Attach(const string &strFileName, bool fReadOnly, bool f18Bit,
   // The disk specific Attach() method just handles the 18 bit flag ...
   //--
   if (!CBaseDrive::Attach(strFileName, fReadOnly, nShareMode)) return false;
-  Set18Bit(f18Bit);
+  SetFormat(f18Bit, m_nFormat);
   return true;
 }
 
@@ -86,30 +107,531 @@ bool CDiskDrive::Attach(const string &strFileName, bool fReadOnly, bool f18Bit,
 void CDiskDrive::Detach()
 {
   //++
-  // The disk specific detach calls SpinDown() first ...
+  //   The disk specific detach calls SpinDown() first and drops the cache.
+  // The write behind and read ahead threads have to be stopped and the image
+  // has to be unmapped (which flushes it) before the image is closed, and
+  // the RAM image has to be written back and then synced.  And any overlay
+  // goes away with the base image.  A chunked image is closed
+  // too, and then compacted if it needs it once nothing has it open.  The
+  // format goes back to simh (which has the same sector size) so that the
+  // next Attach() doesn't try to open some other file as a container ...
   //--
   SpinDown();
+  SetWriteBehind(false);
+  SetReadAhead(false);
+  SetRam(false);
+  SetSync(CImageSync::SYNC_NONE);
+  SetMap(false);
+  SetOverlay(string());
+  SetSparse(false);
+  bool fCompact = (m_pChunked != NULL) && m_pChunked->NeedsCompaction();
+  SetChunked(false);
+  if (m_nFormat == FORMAT_CHUNKED) m_nFormat = FORMAT_SIMH;
+  string strFileName = GetFileName();
   CBaseDrive::Detach();
+  SetCache(0);
+  if (fCompact && !CChunkedImage::Compact(strFileName))
+    LOGS(WARNING, "unit " << *this << " unable to compact " << strFileName);
 }
 
 
-void CDiskDrive::Set18Bit (bool f18Bit)
+void CDiskDrive::SetCache (uint64_t cbCache)
 {
   //++
-  // Set or clear the 18 bit mode for this drive (disks only!) ...
+  //   Create a new sector cache with the specified memory budget, replacing
+  // any existing cache, or delete the cache if cbCache is zero.  Since the
+  // cache is write through, throwing it away never loses anything.  The cache
+  // is never bigger than the pack, and since Set18Bit() doesn't replace the
+  // cache we allow for whichever format has more sectors ...
   //--
-  if (f18Bit == m_f18Bit) return;
+  delete m_pCache;  m_pCache = NULL;
+  if (cbCache == 0) return;
+  uint8_t nPerTrack = GetType()->GetSectors(false);
+  if (GetType()->GetSectors(true) > nPerTrack) nPerTrack = GetType()->GetSectors(true);
+  uint32_t nSectors = (uint32_t) GetType()->GetCylinders() * GetType()->GetHeads() * nPerTrack;
+  m_pCache = new CSectorCache(cbCache, SECTOR_SIZE, nSectors);
+  LOGS(DEBUG, "unit " << *this << " cache " << m_pCache->GetCapacity() << " sectors");
+}
+
+
+uint64_t CDiskDrive::GetPackSize() const
+{
+  //++
+  //   Return the size of a full pack image, which depends on the drive type
+  // and also the 18 bit flag (both the sectors per track and the bytes per
+  // sector change!) ...
+  //--
+  uint64_t nSectors = (uint64_t) GetType()->GetCylinders()
+                    * GetType()->GetHeads() * GetType()->GetSectors(m_f18Bit);
+  return nSectors * ((CDiskImageFile *) m_pImage)->GetSectorSize();
+}
+
+
+bool CDiskDrive::SetMap (bool fMap)
+{
+  //++
+  //   Map the image file into memory, or unmap it.  If the image is already
+  // mapped then it's unmapped and mapped again, which is how Set18Bit() and
+  // SetReadOnly() pick up a new pack size or protection.  Unmapping flushes
+  // any changes back to the file.  Returns false if the mapping fails, in
+  // which case the drive goes back to using normal file I/O ...
+  //--
+  LockImage();
+  if (!fMap) {
+    delete m_pMap;  m_pMap = NULL;
+    UnlockImage();  return true;
+  }
+  if ((m_pOverlay != NULL) || (m_pSparse != NULL) || (m_nFormat == FORMAT_CHUNKED) || (m_pRam != NULL) || (m_pSync != NULL)) {
+    LOGS(ERROR, "unit " << *this << " overlay, sparse, chunked, RAM and synced images can't be mapped");
+    UnlockImage();  return false;
+  }
+  if (m_pMap == NULL)
+    m_pMap = new CMappedImage();
+  else
+    m_pMap->Unmap();
+  m_dSinceFlush = 0;
+  if (!m_pMap->Map(GetFileName(), IsReadOnly(), GetPackSize())) {
+    delete m_pMap;  m_pMap = NULL;
+    UnlockImage();  return false;
+  }
+  UnlockImage();
+  return true;
+}
+
+
+bool CDiskDrive::Periodic (double dSeconds)
+{
+  //++
+  //   If the image is mapped or chunked, then flush it every m_nFlushInterval
+  // seconds.  That puts an upper limit on how much we could lose in a crash.
+  // For a chunked image, it also writes a new index.  A RAM image has its own
+  // checkpoint thread, which owns the chunked image too.  The flush itself
+  // can take a long time, so all we do here is decide that it's time and the
+  // unit's worker does the rest in Housekeeping() ...
+  //--
+  if (((m_pMap == NULL) && (m_pChunked == NULL)) || (m_pRam != NULL) || (m_nFlushInterval == 0)) return false;
+  m_dSinceFlush += dSeconds;
+  if (m_dSinceFlush < m_nFlushInterval) return false;
+  m_dSinceFlush = 0;
+  return true;
+}
+
+
+void CDiskDrive::Housekeeping()
+{
+  //++
+  //   Flush the mapped or chunked image.  This runs in the unit's worker, so
+  // only this unit's commands wait for it.  The image could have changed
+  // since Periodic() asked for this, so check again ...
+  //--
+  if (m_pRam != NULL) return;
+  LockImage();
+  if (m_pMap != NULL) m_pMap->Sync();
+  if (m_pChunked != NULL) m_pChunked->Flush();
+  UnlockImage();
+}
+
+
+void CDiskDrive::SetWriteBehind (bool fWriteBehind)
+{
+  //++
+  //   Start or stop the write behind queue for this drive.  Deleting the
+  // CWriteBehind object writes everything still in the queue first ...
+  //--
+  if (fWriteBehind == (m_pWriteBehind != NULL)) return;
+  if (!fWriteBehind) {
+    DrainWrites();  delete m_pWriteBehind;  m_pWriteBehind = NULL;  return;
+  }
+  m_pWriteBehind = new CWriteBehind(*this);
+  if (!m_pWriteBehind->Begin()) {
+    LOGS(ERROR, "unit " << *this << " unable to start write behind thread");
+    delete m_pWriteBehind;  m_pWriteBehind = NULL;
+  }
+}
+
+
+bool CDiskDrive::SetOverlay (const string &strOverlay, bool fReadOnly, uint64_t cbCache)
+{
+  //++
+  //   Attach a copy on write delta file to this drive, or remove the current
+  // one if strOverlay is empty.  The drive must already be attached to the
+  // base image (read only) and the format must already be set, since the
+  // delta is tied to the image sector size.  The drive's read only flag comes
+  // from fReadOnly, because it's the delta that gets written, not the base.
+  // Everything that might have been read from the base or the old delta has
+  // to be thrown away ...
+  //--
+  DrainWrites();
+  if (m_pCache != NULL) m_pCache->Flush();
+  if (m_pReadAhead != NULL) m_pReadAhead->Flush();
+  LockImage();
+  delete m_pOverlay;  m_pOverlay = NULL;
+  CBaseCache::Close(m_pBaseCache);  m_pBaseCache = NULL;
+  if (strOverlay.empty()) {
+    UnlockImage();  return true;
+  }
+  assert(IsAttached() && (m_pMap == NULL));
+  uint32_t cbSector = GetImage()->GetSectorSize();
+  m_pOverlay = new COverlayImage();
+  if (!m_pOverlay->Open(strOverlay, GetFileName(), cbSector, (uint32_t) (GetPackSize() / cbSector))) {
+    delete m_pOverlay;  m_pOverlay = NULL;
+    UnlockImage();  return false;
+  }
+  m_pBaseCache = CBaseCache::Open(GetFileName(), cbSector, cbCache, (uint32_t) (GetPackSize() / cbSector));
+  m_fReadOnly = fReadOnly;
+  UnlockImage();
+  LOGS(DEBUG, "unit " << *this << " overlay " << strOverlay << " on " << GetFileName()
+    << (IsReadOnly() ? " read only" : " read/write"));
+  return true;
+}
+
+
+bool CDiskDrive::SetSparse (bool fSparse)
+{
+  //++
+  //   Switch to sparse image file I/O, or back to the regular CDiskImageFile
+  // I/O.  If sparse I/O is already in use then the image is opened again,
+  // which is how SetFormat() gets a new sector size.  Nothing cached needs to
+  // change, since the data is the same either way.  Returns false if the
+  // image can't be opened, in which case the regular I/O is used ...
+  //--
+  LockImage();
+  delete m_pSparse;  m_pSparse = NULL;
+  if (!fSparse) {
+    UnlockImage();  return true;
+  }
+  if ((m_pMap != NULL) || (m_nFormat == FORMAT_CHUNKED)) {
+    LOGS(ERROR, "unit " << *this << " mapped and chunked images can't be sparse");
+    UnlockImage();  return false;
+  }
+  uint32_t cbSector = GetImage()->GetSectorSize();
+  m_pSparse = new CSparseImage();
+  if (!m_pSparse->Open(GetFileName(), GetImage()->IsReadOnly(), cbSector, (uint32_t) (GetPackSize() / cbSector))) {
+    delete m_pSparse;  m_pSparse = NULL;
+    UnlockImage();  return false;
+  }
+  UnlockImage();
+  return true;
+}
+
+
+bool CDiskDrive::CommitOverlay (uint32_t &nSectors)
+{
+  //++
+  //   Copy every sector in the delta back to the base image, and then empty
+  // the delta.  The caller is responsible for making sure that no other unit
+  // is using the same base image!  Nothing cached changes, since this drive
+  // sees the same data either way, but the shared base cache is flushed and
+  // the sparse image (if any) has to find the zero sectors again.  A RAM
+  // image is checkpointed first, so that the delta is up to date, and then
+  // the checkpoint is kept out of the way until the commit is done ...
+  //--
+  assert(m_pOverlay != NULL);
+  DrainWrites();
+  if (m_pRam != NULL) {m_pRam->Checkpoint();  m_pRam->LockBacking();}
+  LockImage();
+  bool fOK = m_pOverlay->Commit(GetFileName(), nSectors);
+  if (m_pBaseCache != NULL) m_pBaseCache->Flush();
+  UnlockImage();
+  if (m_pSparse != NULL) SetSparse(true);
+  if (m_pRam != NULL) m_pRam->UnlockBacking();
+  return fOK;
+}
+
+
+bool CDiskDrive::ReadImage (uint32_t lLBA, void *pData)
+{
+  //++
+  //   Read one raw image sector.  A RAM image has every sector.  With an
+  // overlay, the delta has the sector if it's ever been written and otherwise
+  // it comes from the base, by way of the shared base cache ...
+  //--
+  if (m_pRam != NULL) return m_pRam->Read(lLBA, pData);
+  if (m_pOverlay == NULL) return ReadBase(lLBA, pData);
+  if (m_pOverlay->Contains(lLBA)) return m_pOverlay->Read(lLBA, pData);
+  if ((m_pBaseCache != NULL) && m_pBaseCache->Find(lLBA, pData)) return true;
+  if (!ReadBase(lLBA, pData)) return false;
+  if (m_pBaseCache != NULL) m_pBaseCache->Store(lLBA, pData);
+  return true;
+}
+
+
+bool CDiskDrive::WriteImage (uint32_t lLBA, const void *pData)
+{
+  //++
+  //   Write one raw image sector.  With a RAM image, it gets written to the
+  // file by the next checkpoint ...
+  //--
+  if (m_pRam != NULL) return m_pRam->Write(lLBA, pData);
+  return WriteBacking(lLBA, pData);
+}
+
+
+bool CDiskDrive::WriteBacking (uint32_t lLBA, const void *pData)
+{
+  //++
+  //   Write one raw sector to the image file, or to the delta if there is
+  // one.  With a RAM image, only the checkpoint calls this, and it holds the
+  // backing lock instead of the image lock.  If there's a durability policy
+  // then every write is counted, and a plain image file is written through
+  // the sync object, where the C library can't buffer it ...
+  //--
+  bool fOK;
+  if (m_pOverlay != NULL)
+    fOK = m_pOverlay->Write(lLBA, pData);
+  else if (m_nFormat == FORMAT_CHUNKED)
+    return (m_pChunked != NULL) && m_pChunked->Write(lLBA, pData);
+  else if (m_pSparse != NULL)
+    fOK = m_pSparse->Write(lLBA, pData);
+  else if (m_pSync != NULL)
+    fOK = m_pSync->Write(lLBA, pData);
+  else
+    fOK = GetImage()->WriteSector(lLBA, pData);
+  if (fOK && (m_pSync != NULL)) m_pSync->Written();
+  return fOK;
+}
+
+
+bool CDiskDrive::ReadBase (uint32_t lLBA, void *pData)
+{
+  //++
+  //   Read one raw sector from the image file itself.  If the format is
+  // CHUNKED but the container couldn't be opened, then all I/O fails - the
+  // file is certainly not a raw image.  A plain image with a durability
+  // policy is read through the sync object, since that's where it's written
+  // (with an overlay, the sync object is for the delta, not this file) ...
+  //--
+  if (m_nFormat == FORMAT_CHUNKED) return (m_pChunked != NULL) && m_pChunked->Read(lLBA, pData);
+  if (m_pSparse != NULL) return m_pSparse->Read(lLBA, pData);
+  if ((m_pSync != NULL) && (m_pOverlay == NULL)) return m_pSync->Read(lLBA, pData);
+  return GetImage()->ReadSector(lLBA, pData);
+}
+
+
+bool CDiskDrive::SyncBacking()
+{
+  //++
+  //   Write anything buffered by the image file back to the disk.  Only the
+  // chunked image buffers anything - the others all write through.  With
+  // /SYNC=WRITE, this waits for the writes to be synced, too ...
+  //--
+  if (m_pChunked != NULL) return m_pChunked->Flush();
+  if (m_pSync != NULL) return m_pSync->WaitDurable();
+  return true;
+}
+
+
+bool CDiskDrive::WaitDurable()
+{
+  //++
+  //   Wait for the writes just done to be synced, if the policy says so.  A
+  // write to a RAM image never touches the file, so it doesn't wait - the
+  // checkpoint waits instead.  The image must NOT be locked ...
+  //--
+  if ((m_pSync == NULL) || (m_pRam != NULL)) return true;
+  return m_pSync->WaitDurable();
+}
+
+
+bool CDiskDrive::SetSync (int nPolicy, uint32_t lInterval)
+{
+  //++
+  //   Set the durability policy for the image file, or remove it.  The sync
+  // object is opened on the delta if there's an overlay and on the image
+  // itself otherwise, so this has to be called after SetOverlay().  Like
+  // SetMap(), this must be called with the write behind thread stopped and
+  // the MASSBUS locked out - it isn't something that can change under a
+  // write in progress.  Removing the policy (or changing it) syncs anything
+  // that's still outstanding.  Chunked and mapped images can't be synced, and
+  // a read only image has nothing to sync.  Returns false if the policy can't
+  // be set, in which case there's no policy at all ...
+  //--
+  DrainWrites();
+  if (m_pRam != NULL) m_pRam->LockBacking();
+  LockImage();
+  CImageSync *pOld = m_pSync;  m_pSync = NULL;
+  UnlockImage();
+  delete pOld;
+  bool fOK = true;
+  if ((CImageSync::SYNC_POLICY) nPolicy == CImageSync::SYNC_NONE) goto done;
+  if ((m_nFormat == FORMAT_CHUNKED) || (m_pMap != NULL)) {
+    LOGS(ERROR, "unit " << *this << " chunked and mapped images can't be synced");
+    fOK = false;  goto done;
+  }
+  if (IsReadOnly()) goto done;
+  {
+    string strFileName = (m_pOverlay != NULL) ? m_pOverlay->GetFileName() : GetFileName();
+    CImageSync *pSync = new CImageSync();
+    if (!pSync->Open(strFileName, GetImage()->GetSectorSize(), (CImageSync::SYNC_POLICY) nPolicy, lInterval)) {
+      delete pSync;  fOK = false;  goto done;
+    }
+    LockImage();
+    m_pSync = pSync;
+    UnlockImage();
+  }
+done:
+  if (m_pRam != NULL) m_pRam->UnlockBacking();
+  return fOK;
+}
+
+
+bool CDiskDrive::SetRam (bool fRam, bool fHuge)
+{
+  //++
+  //   Load the whole image into memory, or write it back and free the memory.
+  // The image is loaded through ReadImage(), so it works on top of an overlay,
+  // sparse or chunked image.  A plain image file that's shorter than the pack
+  // (e.g. a brand new scratch pack) just leaves the rest of the memory zero.
+  //
+  //   Going back to the regular I/O stops the checkpoint thread and then writes
+  // the last checkpoint with both the backing lock and the image lock held,
+  // so that nothing can get dirty in between.  Returns false if the memory
+  // can't be allocated or the image can't be read, in which case the drive
+  // goes on using the regular I/O ...
+  //--
+  DrainWrites();
+  if (m_pRam != NULL) {
+    CRamImage *pRam = m_pRam;
+    pRam->End();
+    pRam->LockBacking();  LockImage();
+    if (!pRam->CheckpointLocked())
+      LOGS(ERROR, "unit " << *this << " final checkpoint failed - data may be lost");
+    m_pRam = NULL;
+    UnlockImage();  pRam->UnlockBacking();
+    delete pRam;
+  }
+  if (!fRam) return true;
+  if (m_pMap != NULL) {
+    LOGS(ERROR, "unit " << *this << " mapped images can't be loaded into RAM");
+    return false;
+  }
+
+  // Figure out how much of the image to load ...
+  uint32_t cbSector = GetImage()->GetSectorSize();
+  uint32_t nSectors = (uint32_t) (GetPackSize() / cbSector), nLoad = nSectors;
+  uint64_t cbLogical, cbAllocated;
+  if ((m_pOverlay == NULL) && (m_pSparse == NULL) && (m_nFormat != FORMAT_CHUNKED)
+   && CSparseImage::GetFileSizes(GetFileName(), cbLogical, cbAllocated)) {
+    uint64_t nFile = (cbLogical + cbSector - 1) / cbSector;
+    if (nFile < nLoad) nLoad = (uint32_t) nFile;
+  }
+
+  // Allocate the memory and read the image ...
+  CRamImage *pRam = new CRamImage(*this);
+  if (!pRam->Allocate(cbSector, nSectors, fHuge)) {
+    delete pRam;  return false;
+  }
+  std::chrono::steady_clock::time_point tmStart = std::chrono::steady_clock::now();
+  LockImage();
+  for (uint32_t lLBA = 0;  lLBA < nLoad;  ++lLBA) {
+    if (!ReadImage(lLBA, pRam->GetSector(lLBA))) {
+      LOGS(ERROR, "unit " << *this << " error loading LBA " << lLBA << " into RAM");
+      UnlockImage();  delete pRam;  return false;
+    }
+  }
+  m_pRam = pRam;
+  UnlockImage();
+  double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+  LOGS(DEBUG, "unit " << *this << " loaded " << nLoad << " sectors into RAM in " << dSeconds << " seconds");
+  if (!m_pRam->Begin())
+    LOGS(WARNING, "unit " << *this << " unable to start checkpoint thread - checkpoints only at spin down");
+  return true;
+}
+
+
+bool CDiskDrive::SetChunked (bool fChunked)
+{
+  //++
+  //   Open the compressed container for the CHUNKED format, or close it.  If
+  // it's already open then it's closed (which writes back all the changes)
+  // and opened again, which is how SetFormat() gets a new sector size.  An
+  // empty image file becomes a new, all zero, container.  Returns false if
+  // the container can't be opened ...
+  //--
+  LockImage();
+  if ((m_pChunked != NULL) && !m_pChunked->Close())
+    LOGS(ERROR, "unit " << *this << " error writing " << GetFileName() << " - data may be lost");
+  delete m_pChunked;  m_pChunked = NULL;
+  if (!fChunked) {
+    UnlockImage();  return true;
+  }
+  uint32_t cbSector = GetImage()->GetSectorSize();
+  m_pChunked = new CChunkedImage();  m_dSinceFlush = 0;
+  if (!m_pChunked->Open(GetFileName(), GetImage()->IsReadOnly(), cbSector, (uint32_t) (GetPackSize() / cbSector))) {
+    delete m_pChunked;  m_pChunked = NULL;
+    UnlockImage();  return false;
+  }
+  UnlockImage();
+  return true;
+}
+
+
+void CDiskDrive::DrainWrites()
+{
+  //++
+  //   Wait for any queued writes to finish.  This has to be done before the
+  // drive goes offline or anything else that changes how the image is
+  // written.  There's no one to report an error to by now, so just log it ...
+  //--
+  if ((m_pWriteBehind != NULL) && !m_pWriteBehind->Drain())
+    LOGS(ERROR, "unit " << *this << " write behind errors - data may be lost");
+}
+
+
+void CDiskDrive::SetReadAhead (bool fReadAhead)
+{
+  //++
+  //   Start or stop the read ahead engine for this drive.  Deleting the
+  // CReadAhead object waits for its thread to finish any read in progress ...
+  //--
+  if (fReadAhead == (m_pReadAhead != NULL)) return;
+  if (!fReadAhead) {
+    delete m_pReadAhead;  m_pReadAhead = NULL;  return;
+  }
+  m_pReadAhead = new CReadAhead(*this);
+  if (!m_pReadAhead->Begin()) {
+    LOGS(ERROR, "unit " << *this << " unable to start read ahead thread");
+    delete m_pReadAhead;  m_pReadAhead = NULL;
+  }
+}
+
+
+void CDiskDrive::SetFormat (bool f18Bit, IMAGE_FORMAT nFormat)
+{
+  //++
+  //   Set or clear the 18 bit mode for this drive (disks only!), and set the
+  // image file format.  Note that the packed format makes sense only for 18
+  // bit packs - for 16 bit packs simh and packed are the same, but a chunked
+  // container still works.  If the container can't be opened then GetChunked()
+  // returns NULL and every read and write fails.
+  //--
+  if (!f18Bit && (nFormat == FORMAT_PACKED)) nFormat = FORMAT_SIMH;
+  if ((f18Bit == m_f18Bit) && (nFormat == m_nFormat)) return;
+  assert(m_pOverlay == NULL);
+  //   A RAM image is written back first, and then loaded again in the new
+  // format at the end ...
+  bool fRam = (m_pRam != NULL), fHuge = fRam && m_pRam->IsHuge();
+  if (fRam) SetRam(false);
+  DrainWrites();
+  if (m_pCache != NULL) m_pCache->Flush();
+  if (m_pReadAhead != NULL) m_pReadAhead->Flush();
 
   //   Calculate the correct sector size for this emulated drive. This depends
   // on both the physical disk sector size AND the way the data is stored in
   // the image file.  For VAX and PDP11 systems, this is a no brainer, since
   // 16 bit words are stored exactly in two disk bytes.  For -10 systems it's
-  // a bit trickier - the only file format we currently support, simh, stores
-  // one 36 bit PDP10 word in a 64 bit disk word (it wastes a lot of space!).
-  const uint32_t nSectorSize = f18Bit
-    ? (SECTOR_SIZE/2)*sizeof(uint64_t)  // 128 words * 8 bytes =  1K bytes/sector
-    : (SECTOR_SIZE*2)*sizeof(uint8_t);  // 256 words * 2 bytes = 512 bytes/sector
-  GetImage()->SetSectorSize(nSectorSize);  m_f18Bit = f18Bit;
+  // a bit trickier - the simh format stores one 36 bit PDP10 word in a 64 bit
+  // disk word (it wastes a lot of space!) and the packed format stores two
+  // 36 bit words in nine bytes.
+  const uint32_t nSectorSize = GetImageSectorSize(f18Bit, nFormat);
+  LockImage();
+  GetImage()->SetSectorSize(nSectorSize);  m_f18Bit = f18Bit;  m_nFormat = nFormat;
+  UnlockImage();
+  if ((nFormat == FORMAT_CHUNKED) || (m_pChunked != NULL)) SetChunked(nFormat == FORMAT_CHUNKED);
+  if (m_pMap != NULL) SetMap(true);
+  if (m_pSparse != NULL) SetSparse(true);
+  if (m_pSync != NULL) SetSync(m_pSync->GetPolicy(), m_pSync->GetInterval());
+  if (fRam) SetRam(true, fHuge);
 
   //   Note that changing the 18 bit flag changes the drive's geometry (the
   // number of sectors per track differ) and hence the FPGA needs to be told...
@@ -157,12 +679,15 @@ void CDiskDrive::SetReadOnly (bool fReadOnly)
   //++
   // This disk specific version sets or clears the WLK bit in the RPDS ...
   //--
+  DrainWrites();
   CBaseDrive::SetReadOnly(fReadOnly);
   if (IsReadOnly()) {
     m_UPE.SetBitMBR(m_nUnit, RPDS, RPDS_WLK);  m_fReadOnly = true;
   } else {
     m_UPE.ClearBitMBR(m_nUnit, RPDS, RPDS_WLK);  m_fReadOnly = false;
   }
+  // A mapped image has to be remapped to make it writable ...
+  if ((m_pMap != NULL) && (m_pMap->IsReadOnly() != IsReadOnly())) SetMap(true);
 }
 
 
@@ -203,27 +728,185 @@ void CDiskDrive::SpinDown()
   // nothing happens.
   //--
   assert(IsAttached());
+  DrainWrites();
   if (!IsOnline()) return;
   //Clear();
   m_UPE.ClearBitMBR(m_nUnit, RPDS, RPDS_MOL|RPDS_VV);
+  if (m_pMap != NULL) {LockImage();  m_pMap->Sync();  UnlockImage();}
+  if (m_pRam != NULL)
+    m_pRam->Checkpoint();
+  else if (m_pChunked != NULL)
+    {LockImage();  m_pChunked->Flush();  UnlockImage();}
   LOGS(DEBUG, "unit " << *this << " offline");
   CBaseDrive::GoOffline();
 }
 
 
-uint32_t CDiskDrive::GetDesiredLBA() const
+uint32_t CDiskDrive::GetDesiredLBA (uint16_t &nCylinder, uint8_t &nHead, uint8_t &nSector) const
+{
+  //++
+  //   Return the desired C/H/S address as a LBA ...  Note that RPDC and RPDA
+  // belong to the host and can't be shadowed, so every ReadMBR() here is a
+  // real PCI read.  That's why we read each one just once and return the
+  // C/H/S values to the caller.
+  //--
+  uint16_t rpdc = m_UPE.ReadMBR(m_nUnit, RPDC);
+  uint16_t rpda = m_UPE.ReadMBR(m_nUnit, RPDA);
+  nCylinder = rpdc;  nHead = HIBYTE(rpda);  nSector = LOBYTE(rpda);
+  TRACEF("GetDesiredLBA() RPDC=0%06o, RPDA=0%06o, c/h/s = %d/%d/%d",
+    rpdc, rpda, nCylinder, nHead, nSector);
+  return GetType()->CHStoLBA(nCylinder, nHead, nSector, m_f18Bit);
+}
+
+
+/* static */ void CDiskDrive::Unpack18 (const uint64_t aqData[], uint32_t alData18[], uint32_t clData)
+{
+  //++
+  //   Unpack one sector of 36 bit image file words, right justified in 64 bit
+  // quadwords, into 18 bit halfwords for the FPGA.  The actual work is done
+  // by whichever kernel CSectorKernels selected for this CPU ...
+  //--
+  (*CSectorKernels::GetSelected().pfnUnpack18)(aqData, alData18, clData);
+}
+
+
+/* static */ void CDiskDrive::Pack18 (const uint32_t alData18[], uint64_t aqData[], uint32_t clData)
+{
+  //++
+  // And pack 18 bit halfwords from the FPGA back into 36 bit words ...
+  //--
+  (*CSectorKernels::GetSelected().pfnPack18)(alData18, aqData, clData);
+}
+
+
+/* static */ void CDiskDrive::UnpackPacked18 (const uint8_t abData[], uint32_t alData18[], uint32_t clData)
 {
   //++
-  // Return the desired C/H/S address as a LBA ...
+  //   Unpack one sector in the packed format, where every pair of 36 bit
+  // words is stored as 72 bits in nine bytes, most significant bit first, into
+  // 18 bit halfwords for the FPGA.  Each group of nine bytes gives us four
+  // halfwords - the first eight bytes hold the first 64 bits and the last
+  // byte has the low 8 bits of the fourth halfword ...
   //--
-  //uint32_t rpda = m_UPE.ReadMBR(m_nUnit, RPDA);
-  //uint32_t rpdc = m_UPE.ReadMBR(m_nUnit, RPDC);
-  uint16_t c = GetDesiredCylinder();
-  uint8_t  h = GetDesiredHead();
-  uint8_t  s = GetDesiredSector();
-  LOGF(TRACE, "GetDesiredLBA() RPDC=0%06o, RPDA=0%06o, c/h/s = %d/%d/%d",
-    m_UPE.ReadMBR(m_nUnit, RPDC), m_UPE.ReadMBR(m_nUnit, RPDA), c, h, s);
-  return GetType()->CHStoLBA(c, h, s, m_f18Bit);
+  for (uint32_t i = 0; i < clData/4; ++i) {
+    const uint8_t *pb = &abData[9*i];
+    uint64_t q =   ((uint64_t) pb[0] << 56) | ((uint64_t) pb[1] << 48)
+                 | ((uint64_t) pb[2] << 40) | ((uint64_t) pb[3] << 32)
+                 | ((uint64_t) pb[4] << 24) | ((uint64_t) pb[5] << 16)
+                 | ((uint64_t) pb[6] <<  8) |  (uint64_t) pb[7];
+    alData18[4*i]   = (uint32_t) (q >> 46) & 0777777;
+    alData18[4*i+1] = (uint32_t) (q >> 28) & 0777777;
+    alData18[4*i+2] = (uint32_t) (q >> 10) & 0777777;
+    alData18[4*i+3] = (((uint32_t) q & 01777) << 8) | pb[8];
+  }
+}
+
+
+/* static */ void CDiskDrive::PackPacked18 (const uint32_t alData18[], uint8_t abData[], uint32_t clData)
+{
+  //++
+  // And pack 18 bit halfwords from the FPGA back into nine byte pairs ...
+  //--
+  for (uint32_t i = 0; i < clData/4; ++i) {
+    uint8_t *pb = &abData[9*i];
+    uint64_t q =   ((uint64_t) (alData18[4*i]   & 0777777) << 46)
+                 | ((uint64_t) (alData18[4*i+1] & 0777777) << 28)
+                 | ((uint64_t) (alData18[4*i+2] & 0777777) << 10)
+                 | ((uint64_t) (alData18[4*i+3] & 0777777) >>  8);
+    pb[0] = (uint8_t) (q >> 56);  pb[1] = (uint8_t) (q >> 48);
+    pb[2] = (uint8_t) (q >> 40);  pb[3] = (uint8_t) (q >> 32);
+    pb[4] = (uint8_t) (q >> 24);  pb[5] = (uint8_t) (q >> 16);
+    pb[6] = (uint8_t) (q >>  8);  pb[7] = (uint8_t)  q;
+    pb[8] = (uint8_t) alData18[4*i+3];
+  }
+}
+
+
+/* static */ uint32_t CDiskDrive::GetImageSectorSize (bool f18Bit, IMAGE_FORMAT nFormat)
+{
+  //++
+  // Return the number of bytes per sector in the image file ...
+  //--
+  if (!f18Bit) return (SECTOR_SIZE*2)*sizeof(uint8_t);  // 256 words * 2 bytes = 512 bytes
+  if (nFormat == FORMAT_PACKED) return PACKED_SECTOR;    // 128 words * 4.5 bytes = 576 bytes
+  return (SECTOR_SIZE/2)*sizeof(uint64_t);              // 128 words * 8 bytes = 1K bytes
+}
+
+
+void CDiskDrive::UnpackSector (const void *pData, uint32_t alData[], uint32_t nFirst, uint32_t clData) const
+{
+  //++
+  //   Unpack one sector of image file data, in whatever format this drive is
+  // using, for the FPGA.  pData always points to the start of the sector, and
+  // if nFirst isn't zero then we skip over the image data for the first
+  // nFirst words.  alData[0] gets word nFirst.  A partial sector must start
+  // and end on a KERNEL_GRAIN boundary, which is also a nice even number of
+  // words for the packed format ...
+  //--
+  assert(((nFirst % CSectorKernels::KERNEL_GRAIN) == 0) && ((clData % CSectorKernels::KERNEL_GRAIN) == 0));
+  assert((nFirst+clData) <= SECTOR_SIZE);
+  if (!m_f18Bit)
+    Unpack16((const uint16_t *) pData + nFirst, alData, clData);
+  else if (m_nFormat == FORMAT_PACKED)
+    UnpackPacked18((const uint8_t *) pData + (nFirst/4)*9, alData, clData);
+  else
+    Unpack18((const uint64_t *) pData + nFirst/2, alData, clData);
+}
+
+
+void CDiskDrive::PackSector (const uint32_t alData[], void *pData, uint32_t nFirst, uint32_t clData) const
+{
+  //++
+  // And pack one sector (or part of one) of FPGA data in the image format ...
+  //--
+  assert(((nFirst % CSectorKernels::KERNEL_GRAIN) == 0) && ((clData % CSectorKernels::KERNEL_GRAIN) == 0));
+  assert((nFirst+clData) <= SECTOR_SIZE);
+  if (!m_f18Bit)
+    Pack16(alData, (uint16_t *) pData + nFirst, clData);
+  else if (m_nFormat == FORMAT_PACKED)
+    PackPacked18(alData, (uint8_t *) pData + (nFirst/4)*9, clData);
+  else
+    Pack18(alData, (uint64_t *) pData + nFirst/2, clData);
+}
+
+
+class CDiskDrive::CImageStream : public CFIFOStream {
+  //++
+  //   This little class connects one sector of image file data (either in a
+  // local buffer or in the mapped image) to CDECUPE::ReadStream() and
+  // WriteStream(), so that the data is converted on its way to or from the
+  // FIFO and never exists as a whole sector in the FPGA format ...
+  //--
+public:
+  CImageStream (const CDiskDrive &disk, const void *pData)
+    : m_Disk(disk), m_pData(const_cast<void *>(pData)) {};
+  virtual ~CImageStream() {};
+public:
+  virtual void Get (uint32_t nFirst, uint32_t clData, uint32_t alData[]) const
+    {m_Disk.UnpackSector(m_pData, alData, nFirst, clData);}
+  virtual void Put (uint32_t nFirst, uint32_t clData, const uint32_t alData[])
+    {m_Disk.PackSector(alData, m_pData, nFirst, clData);}
+private:
+  const CDiskDrive &m_Disk;     // the drive (for the image format)
+  void             *m_pData;    // the image data for this sector
+};
+
+
+/* static */ void CDiskDrive::Unpack16 (const uint16_t awData[], uint32_t alData16[], uint32_t clData)
+{
+  //++
+  // Unpack one sector of 16 bit image file words into 32 bit longwords ...
+  //--
+  (*CSectorKernels::GetSelected().pfnUnpack16)(awData, alData16, clData);
+}
+
+
+/* static */ void CDiskDrive::Pack16 (const uint32_t alData16[], uint16_t awData[], uint32_t clData)
+{
+  //++
+  // And pack 32 bit longwords from the FPGA back into 16 bit words ...
+  //--
+  (*CSectorKernels::GetSelected().pfnPack16)(alData16, awData, clData);
 }
 
 
@@ -247,10 +930,7 @@ uint32_t CDiskDrive::GetDesiredLBA() const
   if (!pImage->ReadSector(lLBA, &aqData)) return false;
 
   // Now unpack the 36 bit data into two 18 bit words ...
-  for (uint32_t i = 0; i < SECTOR_SIZE/2; ++i) {
-    alData18[2*i] = LH36(aqData[i]);
-    alData18[2*i+1] = RH36(aqData[i]);
-  }
+  Unpack18(aqData, alData18);
   return true;
 }
 
@@ -274,8 +954,7 @@ uint32_t CDiskDrive::GetDesiredLBA() const
   if (!pImage->ReadSector(lLBA, &awData)) return false;
 
   // And unpack the 16 bit data into 32 bit words ...
-  for (uint32_t i = 0; i < SECTOR_SIZE; ++i)
-    alData16[i] = MKLONG(0, awData[i]);
+  Unpack16(awData, alData16);
   return true;
 }
 
@@ -290,11 +969,7 @@ uint32_t CDiskDrive::GetDesiredLBA() const
   // the whole endian thing, which hasn't been dealt with.
   //--
   uint64_t aqData[SECTOR_SIZE/2];
-  for (uint32_t i = 0; i < SECTOR_SIZE/2; ++i) {
-    uint32_t h = alData18[2*i];
-    uint32_t l = alData18[2*i+1];
-    aqData[i]  = MK36(h, l);
-  }
+  Pack18(alData18, aqData);
   return pImage->WriteSector(lLBA, &aqData);
 }
 
@@ -313,14 +988,255 @@ uint32_t CDiskDrive::GetDesiredLBA() const
   uint16_t awData[SECTOR_SIZE];
 
   // Repack the 32 bit words into 16 bit words ...
-  for (uint32_t i = 0; i < SECTOR_SIZE; ++i)
-    awData[i] = LOWORD(alData16[i]);
+  Pack16(alData16, awData);
 
   // And write the sector ...
   return pImage->WriteSector(lLBA, &awData);
 }
 
 
+bool CDiskDrive::ReadSector18 (uint32_t lLBA, uint32_t alData18[])
+{
+  //++
+  //   Read an 18 bit sector from this drive's image, with the image locked.
+  // If the drive is in 18 bit mode anyway, then ReadSector() does the job
+  // and also handles the write behind queue and the mapped image ...
+  //--
+  if (m_f18Bit) return ReadSector(lLBA, alData18);
+  LockImage();
+  bool fOK = ReadSector18(GetImage(), lLBA, alData18);
+  UnlockImage();
+  return fOK;
+}
+
+
+bool CDiskDrive::ReadSector16 (uint32_t lLBA, uint32_t alData16[])
+{
+  //++
+  // Same as above, but for 16 bit sectors ...
+  //--
+  if (!m_f18Bit) return ReadSector(lLBA, alData16);
+  LockImage();
+  bool fOK = ReadSector16(GetImage(), lLBA, alData16);
+  UnlockImage();
+  return fOK;
+}
+
+
+bool CDiskDrive::ReadSector (uint32_t lLBA, uint32_t alData[])
+{
+  //++
+  //   Read a sector in the drive's current format.  The 18 bit flag is tested
+  // with the image locked, so that Set18Bit() can't change it out from under
+  // the read ahead thread between the test and the read.  If the sector is
+  // waiting in the write behind queue then the queued data is the real data.
+  //--
+  if ((m_pWriteBehind != NULL) && m_pWriteBehind->Find(lLBA, alData)) return true;
+  uint64_t aqData[SECTOR_SIZE/2];
+  LockImage();
+  bool fOK;
+  if (m_pMap != NULL)
+    fOK = ReadMapped(lLBA, alData);
+  else if ((fOK = ReadImage(lLBA, aqData)))
+    UnpackSector(aqData, alData);
+  UnlockImage();
+  return fOK;
+}
+
+
+bool CDiskDrive::WriteSector (uint32_t lLBA, const uint32_t alData[])
+{
+  //++
+  //   Write a sector in the drive's current format, bypassing the write
+  // behind queue (this is how the queue itself gets written).  Any read ahead
+  // copy of the sector is invalidated while the image is still locked, and
+  // then (with /SYNC=WRITE) we wait for the write to be synced ...
+  //--
+  uint64_t aqData[SECTOR_SIZE/2];
+  LockImage();
+  bool fOK;
+  if (m_pMap != NULL) {
+    fOK = WriteMapped(lLBA, alData);
+  } else {
+    PackSector(alData, aqData);  fOK = WriteImage(lLBA, aqData);
+  }
+  if (m_pReadAhead != NULL) m_pReadAhead->Invalidate(lLBA);
+  UnlockImage();
+  return fOK && WaitDurable();
+}
+
+
+bool CDiskDrive::WriteSector18 (uint32_t lLBA, const uint32_t alData18[])
+{
+  //++
+  //   Write an 18 bit sector to this drive's image, with the image locked.
+  // Like ReadSector18(), this uses WriteSector() if the drive is in 18 bit
+  // mode, which handles the mapped image and the image format ...
+  //--
+  if (m_f18Bit) return WriteSector(lLBA, alData18);
+  LockImage();
+  bool fOK = WriteSector18(GetImage(), lLBA, alData18);
+  UnlockImage();
+  return fOK;
+}
+
+
+bool CDiskDrive::WriteSector16 (uint32_t lLBA, const uint32_t alData16[])
+{
+  //++
+  // Same as above, but for 16 bit sectors ...
+  //--
+  if (!m_f18Bit) return WriteSector(lLBA, alData16);
+  LockImage();
+  bool fOK = WriteSector16(GetImage(), lLBA, alData16);
+  UnlockImage();
+  return fOK;
+}
+
+
+/* static */ bool CDiskDrive::ConvertImage (const string &strInput, IMAGE_FORMAT nInput,
+                     const string &strOutput, IMAGE_FORMAT nOutput,
+                     bool f18Bit, uint32_t &nSectors)
+{
+  //++
+  //   Copy an image file from one format to another - simh to packed or
+  // packed to simh (18 bit packs only), or either one to or from a chunked
+  // container.  This is just a big sequential copy, CONVERT_CHUNK sectors at
+  // a time, and the conversion is cheap compared to the file I/O, so it runs
+  // at about the speed of the disk.  A partial sector at the end of the input
+  // is padded with zeros.  A chunked output needs to know the number of
+  // sectors up front, and that comes from the input file size ...
+  //
+  //   A chunked container holds exactly the same sectors as a simh image (or
+  // a 16 bit image, which is the same thing), so between those two formats
+  // the sectors are copied unchanged.  Only the packed format needs the data
+  // unpacked and packed again ...
+  //--
+  const uint32_t cbIn  = GetImageSectorSize(f18Bit, nInput);
+  const uint32_t cbOut = GetImageSectorSize(f18Bit, nOutput);
+  const bool fRaw = (nInput != FORMAT_PACKED) && (nOutput != FORMAT_PACKED);
+  uint8_t *pabIn = NULL, *pabOut = NULL;  FILE *pIn = NULL, *pOut = NULL;
+  CChunkedImage *pChunkedIn = NULL, *pChunkedOut = NULL;  uint32_t nTotal = 0;
+  uint32_t alSector[SECTOR_SIZE];  bool fOK = false;
+  nSectors = 0;
+  assert((nInput != FORMAT_CHUNKED) || (nOutput != FORMAT_CHUNKED));
+  assert(f18Bit || fRaw);
+
+  // Open both files and allocate the buffers ...
+  if (nInput == FORMAT_CHUNKED) {
+    pChunkedIn = new CChunkedImage();
+    if (!pChunkedIn->Open(strInput, true)) goto done;
+    if (pChunkedIn->GetSectorSize() != cbIn) {
+      LOGS(ERROR, strInput << " is not a " << (f18Bit ? 18 : 16) << " bit image");  goto done;
+    }
+    nTotal = pChunkedIn->GetSectors();
+  } else if ((pIn = fopen(strInput.c_str(), "rb")) == NULL) {
+    LOGS(ERROR, "unable to open " << strInput);  goto done;
+  }
+  if ((pOut = fopen(strOutput.c_str(), "wb")) == NULL) {
+    LOGS(ERROR, "unable to create " << strOutput);  goto done;
+  }
+  if (nOutput == FORMAT_CHUNKED) {
+    uint64_t cbLogical, cbAllocated;
+    fclose(pOut);  pOut = NULL;
+    if (!CSparseImage::GetFileSizes(strInput, cbLogical, cbAllocated)) {
+      LOGS(ERROR, "unable to get the size of " << strInput);  goto done;
+    }
+    pChunkedOut = new CChunkedImage();
+    if (!pChunkedOut->Open(strOutput, false, cbOut, (uint32_t) ((cbLogical + cbIn - 1) / cbIn))) goto done;
+  }
+  //   Note that both buffers are allocated as quadwords so that the simh
+  // sectors are properly aligned for Unpack18() and Pack18() ...
+  pabIn  = (uint8_t *) new uint64_t[((size_t) cbIn  * CONVERT_CHUNK + 7) / 8];
+  pabOut = (uint8_t *) new uint64_t[((size_t) cbOut * CONVERT_CHUNK + 7) / 8];
+
+  // Now just copy until we run out of input ...
+  for (;;) {
+    uint32_t nChunk;
+    if (pChunkedIn != NULL) {
+      nChunk = ((nTotal - nSectors) < CONVERT_CHUNK) ? (nTotal - nSectors) : CONVERT_CHUNK;
+      if (nChunk == 0) break;
+      for (uint32_t i = 0;  i < nChunk;  ++i) {
+        if (!pChunkedIn->Read(nSectors+i, pabIn + (size_t) i*cbIn)) goto done;
+      }
+    } else {
+      size_t cbRead = fread(pabIn, 1, (size_t) cbIn * CONVERT_CHUNK, pIn);
+      if (cbRead == 0) break;
+      nChunk = (uint32_t) ((cbRead + cbIn - 1) / cbIn);
+      memset(pabIn+cbRead, 0, (size_t) nChunk*cbIn - cbRead);
+    }
+    if (fRaw) {
+      memcpy(pabOut, pabIn, (size_t) nChunk*cbIn);
+    } else for (uint32_t i = 0;  i < nChunk;  ++i) {
+      if (nInput == FORMAT_PACKED)
+        UnpackPacked18(pabIn + (size_t) i*cbIn, alSector);
+      else
+        Unpack18((const uint64_t *) (pabIn + (size_t) i*cbIn), alSector);
+      if (nOutput == FORMAT_PACKED)
+        PackPacked18(alSector, pabOut + (size_t) i*cbOut);
+      else
+        Pack18(alSector, (uint64_t *) (pabOut + (size_t) i*cbOut));
+    }
+    if (pChunkedOut != NULL) {
+      for (uint32_t i = 0;  i < nChunk;  ++i) {
+        if (!pChunkedOut->Write(nSectors+i, pabOut + (size_t) i*cbOut)) goto done;
+      }
+    } else if (fwrite(pabOut, cbOut, nChunk, pOut) != nChunk) {
+      LOGS(ERROR, "error writing " << strOutput);  goto done;
+    }
+    nSectors += nChunk;
+  }
+  if ((pIn != NULL) && ferror(pIn)) {
+    LOGS(ERROR, "error reading " << strInput);  goto done;
+  }
+  fOK = true;
+
+done:
+  if (pIn != NULL) fclose(pIn);
+  if ((pOut != NULL) && (fclose(pOut) != 0)) {
+    LOGS(ERROR, "error writing " << strOutput);  fOK = false;
+  }
+  if ((pChunkedOut != NULL) && !pChunkedOut->Close()) fOK = false;
+  delete pChunkedIn;  delete pChunkedOut;
+  delete[] (uint64_t *) pabIn;  delete[] (uint64_t *) pabOut;
+  return fOK;
+}
+
+
+bool CDiskDrive::ReadMapped (uint32_t lLBA, uint32_t alData[]) const
+{
+  //++
+  //   Unpack a sector straight out of the mapped image into the FPGA format.
+  // A sector past the end of a (short, read only) image reads as zeros ...
+  //--
+  assert(m_pMap != NULL);
+  uint32_t cbSector = ((const CDiskImageFile *) m_pImage)->GetSectorSize();
+  const uint8_t *pbSector = m_pMap->GetData((uint64_t) lLBA * cbSector, cbSector);
+  if (pbSector == NULL) {
+    memset(alData, 0, SECTOR_SIZE*sizeof(uint32_t));  return true;
+  }
+  UnpackSector(pbSector, alData);
+  return true;
+}
+
+
+bool CDiskDrive::WriteMapped (uint32_t lLBA, const uint32_t alData[])
+{
+  //++
+  //   Pack a sector from the FPGA format straight into the mapped image.
+  // This fails only if the image is read only or the sector is past the end
+  // of the pack ...
+  //--
+  assert(m_pMap != NULL);
+  uint32_t cbSector = GetImage()->GetSectorSize();
+  uint8_t *pbSector = m_pMap->GetData((uint64_t) lLBA * cbSector, cbSector);
+  if (m_pMap->IsReadOnly() || (pbSector == NULL)) return false;
+  PackSector(alData, pbSector);
+  m_pMap->SetDirty();
+  return true;
+}
+
+
 void CDiskDrive::DoRead(uint16_t wCommand)
 {
   //++
@@ -336,30 +1252,123 @@ void CDiskDrive::DoRead(uint16_t wCommand)
   // deal.  It's also possible for the FPGA data transfer to fail, or for
   // the disk I/O to fail.  It's not clear what we should do in any of these
   // cases, but for now we print an error message and mark the disk offline.
+  //
+  //   The image file I/O and the 16/18 bit unpacking are done separately
+  // here, rather than via ReadSector18() or ReadSector16(), so that each one
+  // can be timed for the latency statistics.
+  //
+  //   A mapped image skips the separate image and unpack steps and converts
+  // the data straight out of the mapping, so there's no CONVERT time.  A RAM
+  // image goes through ReadImage() like any other, but the IMAGE time is just
+  // a memcpy().
+  //
+  //   Without a sector cache there's no need for the unpacked sector at all,
+  // so data from the image file or the mapped image is streamed straight into
+  // the FIFO and unpacked on the way.  The IMAGE time is the same, but the
+  // CONVERT time moves into the FIFO time.  A mapped sector is streamed with
+  // the image locked, since the write behind thread could otherwise change it
+  // halfway through.
+  //
+  //   The UPE transfer lock is held only while the data is going into the
+  // FIFO, and NOT while we're reading the image, so a unit that's waiting on
+  // slow storage doesn't keep every other unit off the MASSBUS.  Waiting for
+  // the lock counts as FIFO time.
+  //
+  //   If there's a sector cache it gets the first shot, then the write
+  // behind queue, and then the read ahead staging buffer.  The queue has to
+  // come before read ahead, since a prefetched copy of a sector that's still
+  // waiting to be written is stale.  A read ahead hit is copied into the cache too, so
+  // the two work together.  After every successful read the read ahead engine
+  // is told about it, and it may start prefetching the rest of the cylinder.
   //--
   assert(IsOnline());
   uint32_t alSector[SECTOR_SIZE];
+  uint64_t aqData[SECTOR_SIZE/2];       // big enough for any image format
+  uint16_t nCylinder;  uint8_t nHead, nSector;
+  m_Latency.SetClass(CLatency::READ);
 
   // Figure out which sector we want to read ...
-  uint32_t lLBA = GetDesiredLBA();
+  uint32_t lLBA = GetDesiredLBA(nCylinder, nHead, nSector);
+  SetCommandLBA(lLBA);
   if (lLBA == CDiskType::INVALID_SECTOR) {
     LOGS(WARNING, "unit " << *this << " invalid sector address, C/H/S = "
-      << GetDesiredCylinder() << "/" << GetDesiredHead() << "/" << GetDesiredSector());
+      << nCylinder << "/" << (int) nHead << "/" << (int) nSector);
     goto offline;
   }
-  LOGS(TRACE, "unit " << *this << " read sector, C/H/S = "
-      << GetDesiredCylinder() << "/" << GetDesiredHead() << "/" << GetDesiredSector()
-      <<", LBA = " << lLBA);
+  TRACEF("unit %c%d read sector, C/H/S = %d/%d/%d, LBA = %u",
+    GetMBA().GetName(), m_nUnit, nCylinder, nHead, nSector, lLBA);
+
+  //   If the sector is in the cache then it's already unpacked and it can
+  // go straight to the FPGA ...
+  m_Latency.Mark(CLatency::REGISTER);
+  if (m_pCache != NULL) {
+    const uint32_t *plCached = m_pCache->Find(lLBA);
+    if (plCached != NULL) {
+      m_UPE.LockTransfer();
+      m_UPE.WriteData(plCached, SECTOR_SIZE);
+      m_UPE.UnlockTransfer();
+      m_Latency.Mark(CLatency::FIFO);
+      m_ctrReads.Increment();
+      goto advance;
+    }
+  }
 
-  // Read the image file ...
-  if (Is18Bit()) {
-    if (!ReadSector18(lLBA, alSector)) goto offline;
+  //   Next try the write behind queue and the read ahead buffer and, if
+  // those fail, read the image file and unpack the data ...
+  if ((m_pWriteBehind != NULL) && m_pWriteBehind->Find(lLBA, alSector)) {
+    m_Latency.Mark(CLatency::IMAGE);
+  } else if ((m_pReadAhead != NULL) && m_pReadAhead->Fetch(lLBA, alSector)) {
+    m_Latency.Mark(CLatency::IMAGE);
+  } else if (m_pMap != NULL) {
+    LockImage();
+    if (m_pCache == NULL) {
+      uint32_t cbSector = GetImage()->GetSectorSize();
+      const uint8_t *pbSector = m_pMap->GetData((uint64_t) lLBA * cbSector, cbSector);
+      if (pbSector != NULL) {
+        m_Latency.Mark(CLatency::IMAGE);
+        m_UPE.LockTransfer();
+        m_UPE.WriteStream(CImageStream(*this, pbSector), SECTOR_SIZE);
+        m_UPE.UnlockTransfer();
+        UnlockImage();
+        goto streamed;
+      }
+    }
+    bool fOK = ReadMapped(lLBA, alSector);
+    UnlockImage();
+    if (!fOK) goto offline;
+    m_Latency.Mark(CLatency::IMAGE);
   } else {
-    if (!ReadSector16(lLBA, alSector)) goto offline;
+    LockImage();
+    bool fOK = ReadImage(lLBA, aqData);
+    UnlockImage();
+    if (!fOK) goto offline;
+    m_Latency.Mark(CLatency::IMAGE);
+    if (m_pCache == NULL) {
+      m_UPE.LockTransfer();
+      m_UPE.WriteStream(CImageStream(*this, aqData), SECTOR_SIZE);
+      m_UPE.UnlockTransfer();
+      goto streamed;
+    }
+    UnpackSector(aqData, alSector);
   }
+  if (m_pCache != NULL) m_pCache->Store(lLBA, alSector);
+  m_Latency.Mark(CLatency::CONVERT);
 
   // Then stuff the data into the FPGA and we're done ...
+  m_UPE.LockTransfer();
   m_UPE.WriteData(alSector, SECTOR_SIZE);
+  m_UPE.UnlockTransfer();
+streamed:
+  m_Latency.Mark(CLatency::FIFO);
+  m_ctrReads.Increment();
+
+advance:
+  //   Let the read ahead engine see this read.  It never reads past the end
+  // of the current cylinder ...
+  if (m_pReadAhead != NULL) {
+    uint32_t lLimit = (nCylinder+1) * GetType()->GetHeads() * GetType()->GetSectors(m_f18Bit);
+    m_pReadAhead->Advance(lLBA, lLimit);
+  }
   return;
 
 offline:
@@ -373,34 +1382,95 @@ void CDiskDrive::DoWrite (uint16_t wCommand)
   //++
   //   And this method handles the MASSBUS WRITE and WRITE WITH HEADER 
   // commands.  It's pretty much the obvious complement of DoRead().
+  //
+  //   Unless the image is mapped, the data is streamed out of the FIFO and
+  // packed into the image format as it arrives, so there's no separate
+  // CONVERT step for the image write.  The mapped image still gets the data
+  // unpacked, since it's packed into the mapping with the image locked.  As
+  // in DoRead(), the UPE transfer lock is held only while the data comes out
+  // of the FIFO and is released before the image is written (or synced).
   //--
   assert(IsOnline());
   uint32_t alSector[SECTOR_SIZE];
+  uint64_t aqData[SECTOR_SIZE/2];       // big enough for any image format
+  uint16_t nCylinder;  uint8_t nHead, nSector;  bool fFIFO;
+  m_Latency.SetClass(CLatency::WRITE);
 
   // Figure out which sector we want to write ...
-  uint32_t lLBA = GetDesiredLBA();
+  uint32_t lLBA = GetDesiredLBA(nCylinder, nHead, nSector);
+  SetCommandLBA(lLBA);
   if (lLBA == CDiskType::INVALID_SECTOR) {
     LOGS(WARNING, "unit " << *this << " invalid sector address, C/H/S = "
-      << GetDesiredCylinder() << "/" << GetDesiredHead() << "/" << GetDesiredSector());
+      << nCylinder << "/" << (int) nHead << "/" << (int) nSector);
     goto offline;
   }
-  LOGS(TRACE, "unit " << *this << " write sector, C/H/S = "
-      << GetDesiredCylinder() << "/" << GetDesiredHead() << "/" << GetDesiredSector()
-      <<", LBA = " << lLBA);
+  TRACEF("unit %c%d write sector, C/H/S = %d/%d/%d, LBA = %u",
+    GetMBA().GetName(), m_nUnit, nCylinder, nHead, nSector, lLBA);
 
   // Now get data from the FPGA and ...
-  if (!m_UPE.ReadData(alSector, SECTOR_SIZE)) goto offline;
+  m_Latency.Mark(CLatency::REGISTER);
+  m_UPE.LockTransfer();
+  if (m_pMap == NULL) {
+    CImageStream stream(*this, aqData);
+    fFIFO = m_UPE.ReadStream(stream, SECTOR_SIZE);
+  } else {
+    fFIFO = m_UPE.ReadData(alSector, SECTOR_SIZE);
+  }
+  m_UPE.UnlockTransfer();
+  if (!fFIFO) goto offline;
+  m_Latency.Mark(CLatency::FIFO);
   if (IsReadOnly()) {
     LOGS(WARNING, "unit " << *this << " write to read only unit");
     goto offline;
   }
 
-  // And write it to the image file ...
-  if (Is18Bit()) {
-    if (!WriteSector18(lLBA, alSector)) goto offline;
+  //   With write behind, the packed data is unpacked again right here, so
+  // that the queue and the cache see exactly what a read from the image would
+  // see, and then the sector is queued.  Put() fails only if some earlier
+  // write failed, and it may have to wait if the queue is full ...
+  if (m_pWriteBehind != NULL) {
+    if (m_pMap != NULL) PackSector(alSector, aqData);
+    UnpackSector(aqData, alSector);
+    m_Latency.Mark(CLatency::CONVERT);
+    if (!m_pWriteBehind->Put(lLBA, alSector)) goto offline;
+    m_Latency.Mark(CLatency::IMAGE);
+    if (m_pCache != NULL) m_pCache->Store(lLBA, alSector);
+    m_ctrWrites.Increment();
+    return;
+  }
+
+  //   Write it to the image file (it's already packed, unless the image is
+  // mapped, in which case WriteMapped() packs it).  The cached copy (if any) is
+  // invalidated first, in case the write fails.  Any read ahead copy is
+  // invalidated afterwards, with the image still locked, so that a prefetch
+  // that read the old data can't slip in between ...
+  if (m_pCache != NULL) m_pCache->Invalidate(lLBA);
+  if (m_pMap != NULL) {
+    LockImage();
+    bool fOK = WriteMapped(lLBA, alSector);
+    if (m_pReadAhead != NULL) m_pReadAhead->Invalidate(lLBA);
+    UnlockImage();
+    if (!fOK) goto offline;
   } else {
-    if (!WriteSector16(lLBA, alSector)) goto offline;
+    LockImage();
+    bool fOK = WriteImage(lLBA, aqData);
+    if (m_pReadAhead != NULL) m_pReadAhead->Invalidate(lLBA);
+    UnlockImage();
+    if (!fOK || !WaitDurable()) goto offline;
+  }
+  m_Latency.Mark(CLatency::IMAGE);
+
+  //   And update the cache.  Note that we cache the data exactly the way
+  // a read would unpack it from the image, not the raw FIFO data ...
+  if (m_pCache != NULL) {
+    if (m_pMap != NULL)
+      ReadMapped(lLBA, alSector);
+    else
+      UnpackSector(aqData, alSector);
+    m_pCache->Store(lLBA, alSector);
+    m_Latency.Mark(CLatency::CONVERT);
   }
+  m_ctrWrites.Increment();
   return;
 
 offline:
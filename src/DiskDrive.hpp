@@ -33,10 +33,21 @@
 #include <iostream>             // C++ style output for LOGS() ...
 using std::string;              // ...
 using std::ostream;             // ...
+#include "Mutex.hpp"            // UPELIB CMutex class
 class CDriveType;               // we need forward pointers for this class
 class CImageFile;               //   ... and this one ....
 class CDECUPE;                  //   ... and this ...
 class CMBA;                     //   ... one more ...
+class CSectorCache;             //   ... and this one too ...
+class CReadAhead;               //   ... and this one too ...
+class CMappedImage;             //   ... and this one too ...
+class CWriteBehind;             //   ... and this one too ...
+class COverlayImage;            //   ... and this one too ...
+class CBaseCache;               //   ... and this one too ...
+class CSparseImage;             //   ... and this one too ...
+class CChunkedImage;            //   ... and this one too ...
+class CRamImage;                //   ... and this one too ...
+class CImageSync;               //   ... and the last one ...
 
 
 class CDiskDrive : public CBaseDrive {
@@ -44,6 +55,24 @@ class CDiskDrive : public CBaseDrive {
   // Methods and properties unique to disk drives ...
   //--
 
+  // Constants ...
+public:
+  enum {
+    DEFAULT_FLUSH = 30,         // default mapped image flush interval (seconds)
+    PACKED_SECTOR = (SECTOR_SIZE/4)*9, // bytes per sector in packed format
+    CONVERT_CHUNK = 1024,       // sectors per chunk for ConvertImage()
+  };
+  //   Image file formats for 18 bit packs.  SIMH stores one 36 bit word right
+  // justified in a 64 bit quadword, and PACKED stores two 36 bit words in nine
+  // bytes with no wasted bits.  16 bit packs are always two bytes per word.
+  // CHUNKED is a compressed container (see ChunkedImage.hpp) for either kind
+  // of pack, holding sectors in the simh or the 16 bit layout.
+  enum IMAGE_FORMAT {
+    FORMAT_SIMH    = 0,         // simh 36 bits in 64 (the default)
+    FORMAT_PACKED  = 1,         // 72 bits in 9 bytes
+    FORMAT_CHUNKED = 2,         // compressed chunks of simh or 16 bit sectors
+  };
+
   // Constructor and destructor ...
 public:
   CDiskDrive (CMBA &mba, uint8_t nUnit, uint8_t nIDT);
@@ -55,9 +84,64 @@ public:
   const CDiskType *GetType() const {return (const CDiskType *) m_pType;}
   // Return a type cast pointer to the CDiskImageFile object for this drive ...
   CDiskImageFile *GetImage() {return (CDiskImageFile *) m_pImage;}
+  // Set the 18 bit flag and the image format ...
+  void SetFormat (bool f18Bit, IMAGE_FORMAT nFormat);
+  IMAGE_FORMAT GetFormat() const {return m_nFormat;}
   // Test whether the drive is 18 bit formatted ...
-  void Set18Bit (bool f18Bit = true);
+  void Set18Bit (bool f18Bit = true) {SetFormat(f18Bit, m_nFormat);}
   bool Is18Bit() const {return m_f18Bit;}
+  //   Set the sector cache memory budget (in bytes) for this drive, or zero
+  // for no cache, and return the current cache (NULL if none) ...
+  void SetCache (uint64_t cbCache);
+  const CSectorCache *GetCache() const {return m_pCache;}
+  //   Map the image file into memory (or unmap it), and set the interval,
+  // in seconds, for flushing the mapped, chunked or RAM image back to disk
+  // (0 means only flush when the drive is spun down or detached) ...
+  bool SetMap (bool fMap);
+  bool IsMapped() const {return m_pMap != NULL;}
+  void SetFlushInterval (uint32_t nSeconds) {m_nFlushInterval = nSeconds;  m_dSinceFlush = 0;}
+  uint32_t GetFlushInterval() const {return m_nFlushInterval;}
+  // Enable or disable sequential read ahead for this drive ...
+  void SetReadAhead (bool fReadAhead);
+  const CReadAhead *GetReadAhead() const {return m_pReadAhead;}
+  // Enable or disable the write behind queue for this drive ...
+  void SetWriteBehind (bool fWriteBehind);
+  const CWriteBehind *GetWriteBehind() const {return m_pWriteBehind;}
+  //   Attach a copy on write delta file to this drive (the image itself is
+  // the read only base), or remove it if strOverlay is empty.  cbCache is the
+  // size of the base cache shared with other units on the same base ...
+  bool SetOverlay (const string &strOverlay, bool fReadOnly=false, uint64_t cbCache=0);
+  const COverlayImage *GetOverlay() const {return m_pOverlay;}
+  const CBaseCache *GetBaseCache() const {return m_pBaseCache;}
+  // Copy the delta back to the base image and empty it ...
+  bool CommitOverlay (uint32_t &nSectors);
+  //   Use sparse image file I/O, which skips zero sectors and punches holes,
+  // or go back to the regular image file I/O ...
+  bool SetSparse (bool fSparse);
+  const CSparseImage *GetSparse() const {return m_pSparse;}
+  //   Return the compressed container, if the format is CHUNKED.  If the
+  // container couldn't be opened then this is NULL even so ...
+  const CChunkedImage *GetChunked() const {return m_pChunked;}
+  //   Load the whole image into memory (optionally in huge pages), with a
+  // background checkpoint every flush interval, or write it back and go
+  // back to the regular image I/O ...
+  bool SetRam (bool fRam, bool fHuge=false);
+  const CRamImage *GetRam() const {return m_pRam;}
+  //   Set the durability policy for the image - how soon after a write it's
+  // synced to the disk, and whether the write waits for that.  The interval
+  // is in milliseconds, and SYNC_NONE removes any policy ...
+  bool SetSync (int nPolicy, uint32_t lInterval=0);
+  const CImageSync *GetSync() const {return m_pSync;}
+  //   Lock and unlock the image file.  This must be held for every image file
+  // access, since the read ahead thread and the UI use it too ...
+  void LockImage() {m_ImageLock.Enter();}
+  void UnlockImage() {m_ImageLock.Leave();}
+  //   Write one sector to the image file (sparse, chunked or overlay), under
+  // the RAM image if there is one, and flush anything buffered (and wait for
+  // it to be synced, with /SYNC=WRITE).  Only the RAM image checkpoint uses
+  // these directly ...
+  bool WriteBacking (uint32_t lLBA, const void *pData);
+  bool SyncBacking();
 
   // Public disk drive methods ...
 public:
@@ -75,6 +159,12 @@ public:
   virtual void SetSerialNumber(uint16_t nSerial);
   // Execute a MASSBUS command
   virtual void DoCommand (uint32_t lCommand);
+  //   DoRead() and DoWrite() take the UPE transfer lock themselves, just for
+  // the FIFO part, so CMBA never needs to hold it for a disk ...
+  virtual bool IsTransfer (uint32_t lCommand) const {return false;}
+  // Flush the mapped or chunked image periodically ...
+  virtual bool Periodic (double dSeconds);
+  virtual void Housekeeping();
   // Spin up and spin down ...
   void SpinUp();
   void SpinDown();
@@ -85,20 +175,40 @@ public:
   //   Notice that these routines come in two flavors - a static method that
   // takes the image file and 18 bit flag as parameters, and a member method
   // that uses the current values from this object.  The static methods are
-  // needed by the user interface for the DUMP DISK commands ...
+  // needed by the user interface for the DUMP DISK commands.  The member
+  // methods lock the image file; the static ones don't ...
   static bool ReadSector16(CDiskImageFile *pImage, uint32_t lLBA, uint32_t alData16[]);
-  bool ReadSector16(uint32_t lLBA, uint32_t alData16[])
-    {return ReadSector16(GetImage(), lLBA, alData16);}
+  bool ReadSector16(uint32_t lLBA, uint32_t alData16[]);
   static bool ReadSector18(CDiskImageFile *pImage, uint32_t lLBA, uint32_t alData18[]);
-  bool ReadSector18(uint32_t lLBA, uint32_t alData18[])
-    {return ReadSector18(GetImage(), lLBA, alData18);}
+  bool ReadSector18(uint32_t lLBA, uint32_t alData18[]);
+  //   Read or write a sector in whatever mode the drive is currently using.
+  // ReadSector() sees any data still in the write behind queue, but
+  // WriteSector() goes straight to the image (it's what the write behind
+  // thread uses) ...
+  bool ReadSector(uint32_t lLBA, uint32_t alData[]);
+  bool WriteSector(uint32_t lLBA, const uint32_t alData[]);
   // Write sectors in 16 or 18 bit mode ...
   static bool WriteSector16(CDiskImageFile *pImage, uint32_t lLBA, const uint32_t alData16[]);
-  bool WriteSector16(uint32_t lLBA, const uint32_t alData16[])
-    {return WriteSector16(GetImage(), lLBA, alData16);}
+  bool WriteSector16(uint32_t lLBA, const uint32_t alData16[]);
   static bool WriteSector18(CDiskImageFile *pImage, uint32_t lLBA, const uint32_t alData18[]);
-  bool WriteSector18(uint32_t lLBA, const uint32_t alData18[])
-    {return WriteSector18(GetImage(), lLBA, alData18);}
+  bool WriteSector18(uint32_t lLBA, const uint32_t alData18[]);
+  //   Convert one sector between the image file format (36 bit words in 64
+  // bit quadwords, or 16 bit words) and the FPGA format (18 or 16 bit data
+  // right justified in 32 bit longwords).  clData is the number of FPGA
+  // words to convert, if it's less than a whole sector ...
+  static void Unpack18 (const uint64_t aqData[], uint32_t alData18[], uint32_t clData=SECTOR_SIZE);
+  static void Pack18 (const uint32_t alData18[], uint64_t aqData[], uint32_t clData=SECTOR_SIZE);
+  static void Unpack16 (const uint16_t awData[], uint32_t alData16[], uint32_t clData=SECTOR_SIZE);
+  static void Pack16 (const uint32_t alData16[], uint16_t awData[], uint32_t clData=SECTOR_SIZE);
+  static void UnpackPacked18 (const uint8_t abData[], uint32_t alData18[], uint32_t clData=SECTOR_SIZE);
+  static void PackPacked18 (const uint32_t alData18[], uint8_t abData[], uint32_t clData=SECTOR_SIZE);
+  // Return the image file sector size for an 18 or 16 bit pack ...
+  static uint32_t GetImageSectorSize (bool f18Bit, IMAGE_FORMAT nFormat);
+  //   Copy an image file from one format to another (including into or out
+  // of a chunked container), and return the number of sectors converted ...
+  static bool ConvertImage (const string &strInput, IMAGE_FORMAT nInput,
+                            const string &strOutput, IMAGE_FORMAT nOutput,
+                            bool f18Bit, uint32_t &nSectors);
 
   // Disallow copy and assignment operations with CDiskDrive objects...
 private:
@@ -115,8 +225,36 @@ protected:
   uint16_t GetDesiredCylinder() const { return        m_UPE.ReadMBR(m_nUnit, RPDC); }
   uint8_t GetDesiredHead()      const { return HIBYTE(m_UPE.ReadMBR(m_nUnit, RPDA)); }
   uint8_t GetDesiredSector()    const { return LOBYTE(m_UPE.ReadMBR(m_nUnit, RPDA)); }
-  // Use the above routines and compute the desired LBA ...
-  uint32_t GetDesiredLBA() const;
+  //   Read RPDC and RPDA (exactly once each!) and compute the desired LBA.  The
+  // C/H/S values are returned too, so that the caller has a consistent snapshot
+  // for error messages without going back to the FPGA ...
+  uint32_t GetDesiredLBA (uint16_t &nCylinder, uint8_t &nHead, uint8_t &nSector) const;
+  // Return the size, in bytes, of a full pack image in the current format ...
+  uint64_t GetPackSize() const;
+  //   Read or write a sector directly from or to the mapped image, unpacking
+  // or packing it on the fly.  The image must be locked by the caller ...
+  bool ReadMapped (uint32_t lLBA, uint32_t alData[]) const;
+  bool WriteMapped (uint32_t lLBA, const uint32_t alData[]);
+  //   Read or write one sector in the image file format, going to the delta
+  // and the base cache if there's an overlay, or to the RAM image if there
+  // is one.  ReadBase() skips all that and reads the image file (sparse,
+  // chunked or not).  The image must be locked ...
+  bool ReadImage (uint32_t lLBA, void *pData);
+  bool WriteImage (uint32_t lLBA, const void *pData);
+  bool ReadBase (uint32_t lLBA, void *pData);
+  // Wait for a write to be synced, with /SYNC=WRITE ...
+  bool WaitDurable();
+  //   Open (or reopen) the compressed container for the CHUNKED format, or
+  // close it.  SetFormat() calls this ...
+  bool SetChunked (bool fChunked);
+  // Wait for the write behind queue (if any) to empty ...
+  void DrainWrites();
+  //   Convert one sector between the current image format and the FPGA, or
+  // just clData words of it starting with word nFirst ...
+  void UnpackSector (const void *pData, uint32_t alData[], uint32_t nFirst=0, uint32_t clData=SECTOR_SIZE) const;
+  void PackSector (const uint32_t alData[], void *pData, uint32_t nFirst=0, uint32_t clData=SECTOR_SIZE) const;
+  // Stream image file data straight to or from the FPGA FIFO ...
+  class CImageStream;
 #ifdef _DEBUG
   void DumpSector (uint32_t *plData, uint32_t clData);
 #endif
@@ -124,5 +262,19 @@ protected:
   // Local members ...
 protected:
   bool      m_f18Bit;         // the pack on this drive is 18 bit formatted
+  IMAGE_FORMAT m_nFormat;     // image file format
   uint32_t  m_nSectorSize;    // logical disk sector size in the image file
+  CSectorCache *m_pCache;     // sector cache for this drive (NULL if none)
+  CReadAhead *m_pReadAhead;   // read ahead engine (NULL if none)
+  CMappedImage *m_pMap;       // memory mapped image (NULL if not mapped)
+  CWriteBehind *m_pWriteBehind; // write behind queue (NULL if none)
+  COverlayImage *m_pOverlay;  // copy on write delta (NULL if none)
+  CBaseCache *m_pBaseCache;   // shared base image cache (NULL if none)
+  CSparseImage *m_pSparse;    // sparse image file I/O (NULL if none)
+  CChunkedImage *m_pChunked;  // compressed container (NULL if none)
+  CRamImage *m_pRam;          // RAM resident image (NULL if none)
+  CImageSync *m_pSync;        // image durability policy (NULL if none)
+  uint32_t  m_nFlushInterval; // seconds between flushes or checkpoints
+  double    m_dSinceFlush;    // seconds since the last flush
+  CMutex    m_ImageLock;      // serializes access to the image file
 };
@@ -0,0 +1,227 @@
+//++
+// DriveWorker.cpp -> CDriveWorker (per drive command thread) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CDriveWorker class.  See DriveWorker.hpp for
+// all the details.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "UPE.hpp"              // UPE library FPGA interface methods
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // UPE library image file methods
+#include "MBS.hpp"              // global declarations for this project
+#include "MASSBUS.h"            // MASSBUS commands and registers
+#include "DriveType.hpp"        // internal drive type class
+#include "DECUPE.hpp"           // DEC specific UPE/FPGA class definitions
+#include "BaseDrive.hpp"        // common methods for all MASSBUS drives
+#include "MBA.hpp"              // MASSBUS adapter (and QUEUED_COMMAND)
+#include "DriveWorker.hpp"      // declarations for this module
+using std::unique_lock;         // ...
+using std::mutex;               // ...
+
+
+CDriveWorker::CDriveWorker (CMBA &mba, CBaseDrive &unit, uint32_t nPaused)
+  : m_MBA(mba), m_Unit(unit), m_Thread(&CDriveWorker::WorkLoop),
+    m_fStarted(false), m_fExit(false), m_fBusy(false), m_fHousekeep(false),
+    m_nPaused(nPaused),
+    m_nHead(0), m_nCount(0), m_nMaxDepth(0), m_llDepthSum(0), m_cQueued(0),
+    m_cStalls(0), m_cExecuted(0), m_llWaitSum(0), m_llMaxWait(0),
+    m_nRealTimeGen(0)
+{
+  //++
+  //   The thread isn't started until Begin() is called.  If the UI has the
+  // unit locked right now (it usually does - the UI is adding this unit!) then
+  // the caller passes the current pause depth so that the new worker matches ...
+  //--
+  string sName = m_Unit.GetName() + " worker";
+  m_Thread.SetName(sName.c_str());
+  m_Thread.SetParameter(this);
+}
+
+
+CDriveWorker::~CDriveWorker()
+{
+  //++
+  //   Stop the thread.  Anything still in the queue is thrown away, but by
+  // now the unit is being removed so there's nobody left to execute it for.
+  // The UPE still has to hear that those commands are done, though ...
+  //--
+  End();
+  if (m_nCount > 0)
+    LOGS(WARNING, "unit " << m_Unit << " " << m_nCount << " queued commands discarded");
+  for (uint32_t i = 0;  i < m_nCount;  ++i)  m_MBA.GetUPE().CommandDone();
+}
+
+
+bool CDriveWorker::Begin()
+{
+  //++
+  // Start the worker thread ...
+  //--
+  m_fStarted = m_Thread.Begin();
+  return m_fStarted;
+}
+
+
+void CDriveWorker::End()
+{
+  //++
+  //   Tell the worker thread to stop and wait for it to exit.  If it's in the
+  // middle of a command, that gets finished first ...
+  //--
+  if (!m_fStarted) return;
+  {
+    unique_lock<mutex> lock(m_mtxQueue);
+    m_fExit = true;
+  }
+  m_cvWork.notify_all();
+  m_Thread.WaitExit();
+  m_fStarted = false;
+}
+
+
+bool CDriveWorker::IsIdle() const
+{
+  //++
+  // Return true if nothing is waiting in the queue or being executed ...
+  //--
+  unique_lock<mutex> lock(m_mtxQueue);
+  return (m_nCount == 0) && !m_fBusy;
+}
+
+
+bool CDriveWorker::Put (const CMBA::QUEUED_COMMAND &qc)
+{
+  //++
+  //   Add one command to the end of the queue.  Unlike CWriteBehind, nothing
+  // here is ever coalesced - every command the host sent has to be executed,
+  // and in the order it was sent.  If the queue is full, then just return
+  // false and let the caller decide what to do.  Once the worker has been
+  // stopped, commands are quietly discarded - the unit is going away.
+  //--
+  unique_lock<mutex> lock(m_mtxQueue);
+  if (m_fExit) return true;
+  if (m_nCount >= QUEUE_SIZE) {++m_cStalls;  return false;}
+  ++m_cQueued;  m_llDepthSum += m_nCount;
+  m_aQueue[Index(m_nCount)] = qc;
+  if (++m_nCount > m_nMaxDepth) m_nMaxDepth = m_nCount;
+  m_cvWork.notify_one();
+  return true;
+}
+
+
+void CDriveWorker::Housekeep()
+{
+  //++
+  //   Ask for the unit's Housekeeping() to be done.  This is called by the
+  // channel thread, which mustn't wait for the housekeeping itself, so we
+  // just set a flag and wake up the worker ...
+  //--
+  unique_lock<mutex> lock(m_mtxQueue);
+  m_fHousekeep = true;
+  m_cvWork.notify_one();
+}
+
+
+void CDriveWorker::Pause()
+{
+  //++
+  //   Stop taking commands from the queue, and wait for the one that's being
+  // executed now (if any) to finish ...
+  //--
+  unique_lock<mutex> lock(m_mtxQueue);
+  ++m_nPaused;
+  while (m_fBusy)  m_cvSpace.wait(lock);
+}
+
+
+void CDriveWorker::Resume()
+{
+  //++
+  // Undo one Pause() and, if that was the last one, get back to work ...
+  //--
+  unique_lock<mutex> lock(m_mtxQueue);
+  assert(m_nPaused > 0);
+  if (--m_nPaused == 0) m_cvWork.notify_all();
+}
+
+
+void CDriveWorker::DoWork()
+{
+  //++
+  //   This is the body of the worker thread.  It takes the oldest command
+  // from the queue and executes it with CMBA::DoCommand(), which does all the
+  // latency accounting and holds the UPE transfer lock if the drive needs it.  The
+  // queue lock is NOT held while the command is executing, so the channel
+  // thread can go on queuing more.  We pass our own unit to DoCommand(), so
+  // it doesn't have to look in the CMBA unit table at all.  The time each
+  // command spent waiting in the queue is measured from the time it was read
+  // from the UPE FIFO.  If the MASSBUS real time policy has changed, we pick
+  // it up just before the next command.
+  //
+  //   Housekeeping (e.g. flushing a mapped image) is done the same way as a
+  // command - it's busy while it runs, and it waits while we're paused.  It
+  // goes ahead of any queued commands, otherwise a busy unit would never get
+  // around to it.
+  //--
+  unique_lock<mutex> lock(m_mtxQueue);
+  while (!m_fExit) {
+    if (((m_nCount == 0) && !m_fHousekeep) || (m_nPaused > 0)) {m_cvWork.wait(lock);  continue;}
+    if (m_fHousekeep) {
+      m_fHousekeep = false;  m_fBusy = true;
+      lock.unlock();
+      m_Unit.Housekeeping();
+      lock.lock();
+      m_fBusy = false;  m_cvSpace.notify_all();
+      continue;
+    }
+    CMBA::QUEUED_COMMAND qc = m_aQueue[m_nHead];
+    m_nHead = Index(1);  --m_nCount;  m_fBusy = true;
+    lock.unlock();
+    m_MBA.ApplyRealTime(m_nRealTimeGen, true);
+    uint64_t llWait = std::chrono::duration_cast<std::chrono::nanoseconds>
+      (std::chrono::steady_clock::now() - qc.tmArrival).count();
+    m_MBA.DoCommand(m_Unit, qc);
+    lock.lock();
+    m_fBusy = false;  ++m_cExecuted;  m_llWaitSum += llWait;
+    if (llWait > m_llMaxWait) m_llMaxWait = llWait;
+    m_cvSpace.notify_all();
+  }
+}
+
+
+/* static */ void* THREAD_ATTRIBUTES CDriveWorker::WorkLoop (void *pParam)
+{
+  //++
+  // Thread entry point - just call DoWork() for the right object ...
+  //--
+  CThread *pThread = (CThread *) pParam;
+  CDriveWorker *pWorker = (CDriveWorker *) pThread->GetParameter();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " is running");
+  pWorker->DoWork();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " terminated");
+  return pThread->End();
+}
@@ -0,0 +1,145 @@
+//++
+// DriveWorker.hpp -> CDriveWorker (per drive command thread) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Originally the MASSBUS channel thread executed every command itself, so
+// if the image file for one unit was stuck (say on a slow NFS server) then
+// every other unit on the same bus was stuck too, and so was the channel
+// thread - nothing even read the command FIFO.  Now every unit has its own
+// CDriveWorker, and the channel thread just reads the command FIFO and hands
+// each command to the worker for its unit.  The commands for any one unit are
+// still executed one at a time and in order, but the units no longer wait for
+// each other's image I/O.
+//
+//   The MASSBUS itself can only transfer data for one drive at a time, and
+// the UPE has only one data FIFO, so commands that move data still have to
+// take turns for the UPE transfer lock (CDECUPE::LockTransfer()).  A disk
+// holds it only while it's actually moving data through the FIFO - the image
+// I/O happens before (for a read) or after (for a write) - so a disk that's
+// stuck on slow storage doesn't keep anybody else off the bus.  A tape drive
+// still holds it for the whole of any command that uses the FIFO.  The
+// MASSBUS registers are separate for every unit, so nothing else needs to be
+// serialized.
+//
+//   The UI lock still means that no commands are executing.  CMBA::LockUnit()
+// waits for the unit's worker to finish its current command, and the worker
+// doesn't start another one until the lock is released.  Commands just wait
+// in the queue meanwhile, so the drive (and its CLatency) code can go on
+// assuming that the UI never changes anything under a running command.
+//
+//   Each queue holds QUEUE_SIZE commands, which is far more than the FPGA can
+// ever have outstanding for one unit.  If one ever does fill up then Put()
+// returns false and the channel thread tries again a bit later - it can't
+// wait here, because it might be holding up the UI (see CMBA::Dispatch()).
+// The worker keeps the queue depth and the time commands spent waiting in the
+// queue, for SHOW STATISTICS.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <mutex>                // C++ std::mutex
+#include <condition_variable>   // C++ std::condition_variable
+#include "Thread.hpp"           // UPELIB CThread portable thread library
+class CBaseDrive;               // we need a forward pointer for this class
+
+
+class CDriveWorker {
+  //++
+  // Command queue and thread for one MASSBUS unit ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    QUEUE_SIZE = 64,            // maximum number of queued commands
+  };
+
+  // Constructor and destructor ...
+public:
+  CDriveWorker (CMBA &mba, CBaseDrive &unit, uint32_t nPaused=0);
+  virtual ~CDriveWorker();
+private:
+  // Disallow copy and assignment operations with CDriveWorker objects...
+  CDriveWorker(const CDriveWorker &) = delete;
+  CDriveWorker& operator= (const CDriveWorker &) = delete;
+
+  // Public properties ...
+public:
+  // Return the current and maximum queue depth ...
+  uint32_t GetDepth() const {return m_nCount;}
+  uint32_t GetMaxDepth() const {return m_nMaxDepth;}
+  // Return the average queue depth seen by Put() ...
+  double GetAverageDepth() const
+    {return (m_cQueued > 0) ? ((double) m_llDepthSum / m_cQueued) : 0.0;}
+  // Return the number of commands executed and the time they waited ...
+  uint64_t GetExecuted() const {return m_cExecuted;}
+  double GetAverageWait() const
+    {return (m_cExecuted > 0) ? ((double) m_llWaitSum / m_cExecuted / 1000.0) : 0.0;}
+  double GetMaxWait() const {return m_llMaxWait / 1000.0;}
+  // Return the number of times Put() found the queue full ...
+  uint64_t GetStalls() const {return m_cStalls;}
+  // Return true if nothing is queued or executing ...
+  bool IsIdle() const;
+
+  // Public methods ...
+public:
+  // Start or stop the background thread ...
+  bool Begin();
+  void End();
+  // Queue a command for this unit (returns false if the queue is full) ...
+  bool Put (const CMBA::QUEUED_COMMAND &qc);
+  //   Ask the worker to call the unit's Housekeeping() before the next
+  // command (see CBaseDrive::Periodic()) ...
+  void Housekeep();
+  //   Stop executing commands (after waiting for the current one to finish)
+  // or start again.  These nest - CMBA::LockUnit() and UnlockUnit() use them ...
+  void Pause();
+  void Resume();
+
+  // Private methods ...
+private:
+  // The background thread that executes the queue ...
+  static void* THREAD_ATTRIBUTES WorkLoop (void *pParam);
+  void DoWork();
+  // Return the index of the n-th oldest queue entry ...
+  uint32_t Index (uint32_t n) const {return (m_nHead+n) % QUEUE_SIZE;}
+
+  // Private member data ...
+private:
+  CMBA                   &m_MBA;        // the MASSBUS we belong to
+  CBaseDrive             &m_Unit;       // and the unit we're working for
+  CThread                 m_Thread;     // background command thread
+  bool                    m_fStarted;   // the thread was started
+  mutable std::mutex      m_mtxQueue;   // protects everything below
+  std::condition_variable m_cvWork;     // signalled when a command is queued
+  std::condition_variable m_cvSpace;    // signalled when a command is done
+  bool                    m_fExit;      // true to stop the thread
+  bool                    m_fBusy;      // a command is being executed
+  bool                    m_fHousekeep; // call the unit's Housekeeping()
+  uint32_t                m_nPaused;    // Pause() calls not yet resumed
+  CMBA::QUEUED_COMMAND    m_aQueue[QUEUE_SIZE]; // the queue itself
+  uint32_t                m_nHead;      // index of the oldest entry
+  uint32_t                m_nCount;     // number of entries queued
+  uint32_t                m_nMaxDepth;  // largest m_nCount ever seen
+  uint64_t                m_llDepthSum; // sum of the depths seen by Put()
+  uint64_t                m_cQueued;    // total commands queued
+  uint64_t                m_cStalls;    // times Put() found the queue full
+  uint64_t                m_cExecuted;  // total commands executed
+  uint64_t                m_llWaitSum;  // total time waiting in the queue (ns)
+  uint64_t                m_llMaxWait;  // longest wait in the queue (ns)
+  uint32_t                m_nRealTimeGen; // real time policy generation applied
+};
@@ -0,0 +1,86 @@
+//++
+// Epoch.hpp -> CEpoch (read side protection for lock free tables)
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   CEpoch is a very small version of read-copy-update.  It protects a table
+// of pointers (e.g. the CMBA unit table) that's read all the time by the
+// MASSBUS threads and changed only rarely by the UI.  Readers never wait -
+//
+//      epoch.Enter();
+//      CBaseDrive *pUnit = m_apUnits[n];   // an atomic load
+//      ... use pUnit, but don't keep it after Leave() ...
+//      epoch.Leave();
+//
+// and the writer replaces the pointer atomically, then waits for a "grace
+// period" before deleting the old object -
+//
+//      CBaseDrive *pOld = m_apUnits[n];  m_apUnits[n] = NULL;
+//      epoch.Synchronize();  delete pOld;
+//
+//   Synchronize() just waits until no reader is inside an Enter()/Leave()
+// pair.  Any reader that enters after the new pointer was stored must see
+// the new pointer (everything here is sequentially consistent), so once the
+// count has been zero even for an instant nobody can still have the old one.
+// That can starve the writer if readers overlap continuously, but our readers
+// are the channel thread, which leaves after every command, and the writer is
+// the UI, which can afford to wait a few microseconds.
+//
+//   Note that a reader must NOT wait for anything the writer might be holding
+// while it's inside an Enter()/Leave() pair - that's a deadlock!
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, etc ...
+#include <atomic>               // C++ std::atomic template
+#include <thread>               // C++ std::this_thread::yield()
+
+
+class CEpoch {
+  //++
+  // Read side critical sections and grace periods ...
+  //--
+
+  // Constructor and destructor ...
+public:
+  CEpoch() : m_nReaders(0), m_cGraces(0) {};
+  ~CEpoch() {};
+private:
+  // Disallow copy and assignment operations with CEpoch objects...
+  CEpoch(const CEpoch &) = delete;
+  CEpoch& operator= (const CEpoch &) = delete;
+
+  // Public properties ...
+public:
+  // Return the number of grace periods the writer has waited for ...
+  uint64_t GetGraces() const {return m_cGraces;}
+
+  // Public methods ...
+public:
+  // Enter and leave a read side critical section ...
+  void Enter() {++m_nReaders;}
+  void Leave() {--m_nReaders;}
+  // Wait until every reader that might have an old pointer is done ...
+  void Synchronize() {
+    while (m_nReaders.load() != 0)  std::this_thread::yield();
+    ++m_cGraces;
+  }
+
+  // Private member data ...
+private:
+  std::atomic<uint32_t> m_nReaders; // number of readers inside Enter()/Leave()
+  uint64_t              m_cGraces;  // number of calls to Synchronize()
+};
@@ -0,0 +1,324 @@
+//++
+// FlightRecorder.cpp -> CFlightRecorder (MASSBUS command history) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CFlightRecorder class.  See FlightRecorder.hpp
+// for all the details.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <string.h>             // memcpy(), memset(), etc ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "UPE.hpp"              // UPE library FPGA interface methods
+#include "MBS.hpp"              // global declarations for this project
+#include "MASSBUS.h"            // MASSBUS commands and registers
+#include "DECUPE.hpp"           // DEC specific UPE/FPGA interface methods
+#include "FlightRecorder.hpp"   // declarations for this module
+
+
+CFlightRecorder::CFlightRecorder() : m_llNext(0)
+{
+  //++
+  //   The slots are all empty to start with.  Command numbers start from
+  // zero, so an empty slot gets a number that no command will ever have ...
+  //--
+  static_assert(sizeof(SLOT) == 64, "CFlightRecorder::SLOT should be one cache line");
+  for (uint32_t i = 0;  i < HISTORY_SIZE;  ++i) {
+    m_aSlots[i].nVersion = 0;  m_aSlots[i].nPad = 0;
+    memset(&m_aSlots[i].Entry, 0, sizeof(ENTRY));
+    m_aSlots[i].Entry.llNumber = ~0ULL;
+  }
+}
+
+
+CFlightRecorder::SLOT *CFlightRecorder::Lock (uint64_t llNumber, bool fNew)
+{
+  //++
+  //   Claim the slot for command llNumber so that we can update it.  That
+  // means changing the version from even to odd, and the compare and swap
+  // makes sure that nobody else changed the slot between the time we looked
+  // at it and the time we got it.  If fNew is true then this is a brand new
+  // command and the slot is ours no matter what was in it before (although
+  // we have to wait if somebody is still updating the command that used it
+  // HISTORY_SIZE commands ago!).  Otherwise this is an update to an existing
+  // command, and we give up if the slot has been reused for a newer one ...
+  //--
+  SLOT *pSlot = &m_aSlots[llNumber & (HISTORY_SIZE-1)];
+  for (;;) {
+    uint32_t nVersion = pSlot->nVersion.load(std::memory_order_relaxed);
+    if ((nVersion & 1) != 0) {
+      if (!fNew) return NULL;
+      CPU_PAUSE();  continue;
+    }
+    if (!fNew && (pSlot->Entry.llNumber != llNumber)) return NULL;
+    if (pSlot->nVersion.compare_exchange_weak(nVersion, nVersion+1, std::memory_order_acquire)) {
+      //   Make sure that nobody can see the new data before they see the odd
+      // version number ...
+      std::atomic_thread_fence(std::memory_order_release);
+      return pSlot;
+    }
+  }
+}
+
+
+/*static*/ void CFlightRecorder::Unlock (SLOT *pSlot)
+{
+  //++
+  // Make the version even again, which publishes the new data ...
+  //--
+  pSlot->nVersion.fetch_add(1, std::memory_order_release);
+}
+
+
+uint64_t CFlightRecorder::Start (uint32_t lCommand, uint8_t nUnit, TIMESTAMP tmArrival)
+{
+  //++
+  // Record the start of a new command and return its sequence number ...
+  //--
+  uint64_t llNumber = m_llNext.fetch_add(1, std::memory_order_relaxed);
+  SLOT *pSlot = Lock(llNumber, true);
+  ENTRY &e = pSlot->Entry;
+  e.llNumber = llNumber;  e.llArrival = ToNanoseconds(tmArrival);
+  e.lCommand = lCommand;  e.lLBA = NO_LBA;  e.nUnit = nUnit;
+  e.nResult = PENDING;  e.nClass = CLatency::NONE;  e.nPad = 0;
+  memset(e.alPhase, 0, sizeof(e.alPhase));
+  Unlock(pSlot);
+  return llNumber;
+}
+
+
+void CFlightRecorder::Finish (uint64_t llNumber, RESULT nResult, const CLatency &latency, uint32_t lLBA)
+{
+  //++
+  //   Record the end of a command.  If the slot has already been reused, then
+  // this command is too old to matter and we just forget about it ...
+  //--
+  SLOT *pSlot = Lock(llNumber, false);
+  if (pSlot == NULL) return;
+  ENTRY &e = pSlot->Entry;
+  for (uint32_t i = 0;  i < CLatency::MAXPHASE;  ++i) {
+    uint64_t llPhase = latency.GetPhase((CLatency::PHASE) i);
+    e.alPhase[i] = (llPhase < 0xFFFFFFFFULL) ? (uint32_t) llPhase : 0xFFFFFFFFUL;
+  }
+  e.nResult = nResult;  e.nClass = latency.GetClass();  e.lLBA = lLBA;
+  Unlock(pSlot);
+}
+
+
+void CFlightRecorder::Record (uint32_t lCommand, uint8_t nUnit, TIMESTAMP tmArrival, RESULT nResult)
+{
+  //++
+  //   Record a command that was thrown away without being executed (e.g. it
+  // was for a unit that doesn't exist).  This isn't the usual case, so it's
+  // OK that it takes two updates ...
+  //--
+  uint64_t llNumber = Start(lCommand, nUnit, tmArrival);
+  SLOT *pSlot = Lock(llNumber, false);
+  if (pSlot == NULL) return;
+  pSlot->Entry.nResult = nResult;
+  Unlock(pSlot);
+}
+
+
+size_t CFlightRecorder::Snapshot (ENTRY *pEntries, size_t nMax) const
+{
+  //++
+  //   Copy the most recent nMax entries (or fewer, if there aren't that many)
+  // to the caller's array, oldest first.  Each slot is copied and then the
+  // version is checked - if it's odd, or it changed while we were copying,
+  // then somebody was updating the slot and we try again.  A slot that's
+  // still being updated after a few tries, or that doesn't hold the command
+  // we expected (it's just been claimed for a newer one) is skipped.  This is
+  // also used by the fatal signal handler, so it never waits for anything ...
+  //--
+  uint64_t llNext = m_llNext.load(std::memory_order_acquire);
+  uint64_t llCount = (llNext < HISTORY_SIZE) ? llNext : HISTORY_SIZE;
+  if (llCount > nMax) llCount = nMax;
+  size_t nCopied = 0;
+  for (uint64_t llNumber = llNext-llCount;  llNumber < llNext;  ++llNumber) {
+    const SLOT *pSlot = &m_aSlots[llNumber & (HISTORY_SIZE-1)];
+    for (uint32_t nTry = 0;  nTry < 4;  ++nTry) {
+      uint32_t nVersion = pSlot->nVersion.load(std::memory_order_acquire);
+      if ((nVersion & 1) != 0) {CPU_PAUSE();  continue;}
+      memcpy(&pEntries[nCopied], &pSlot->Entry, sizeof(ENTRY));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (pSlot->nVersion.load(std::memory_order_relaxed) != nVersion) continue;
+      if (pEntries[nCopied].llNumber == llNumber) ++nCopied;
+      break;
+    }
+  }
+  return nCopied;
+}
+
+
+/*static*/ const char *CFlightRecorder::FunctionName (bool fTape, uint32_t lCommand)
+{
+  //++
+  //   Return the name of the function in a command longword.  For disks that's
+  // just the function code bits of RPCR.  Tapes have several command registers
+  // (see CTapeDrive::DoCommand()) but the function codes are the same for all
+  // of them, except for the formatter reset in TMHCR ...
+  //--
+  uint32_t lFunction = CDECUPE::ExtractCommand(lCommand);
+  if (fTape) {
+    if (CDECUPE::IsEndofBlock(lCommand)) return "END BLOCK";
+    if (CDECUPE::ExtractRegister(lCommand) == TMHCR) return "FMT RESET";
+    switch (lFunction & TMCMD_M_MASK) {
+      case TMCMD_NOP:           return "NOP";
+      case TMCMD_UNLOAD:        return "UNLOAD";
+      case TMCMD_REWIND:        return "REWIND";
+      case TMCMD_SENSE:         return "SENSE";
+      case TMCMD_DSE:           return "ERASE";
+      case TMCMD_WTM_PE:
+      case TMCMD_WTM_GCR:       return "WRITE MARK";
+      case TMCMD_SP_FWD_REC:    return "SPACE FR";
+      case TMCMD_SP_REV_REC:    return "SPACE RR";
+      case TMCMD_SP_FWD_FILE:   return "SPACE FF";
+      case TMCMD_SP_REV_FILE:   return "SPACE RF";
+      case TMCMD_SP_FWD_EITHER: return "SPACE FE";
+      case TMCMD_SP_REV_EITHER: return "SPACE RE";
+      case TMCMD_ERG_PE:
+      case TMCMD_ERG_GCR:       return "WRITE GAP";
+      case TMCMD_CLOSE_PE:
+      case TMCMD_CLOSE_GCR:     return "CLOSE FILE";
+      case TMCMD_SP_LEOT:
+      case TMCMD_SP_FILE_LEOT:  return "SPACE LEOT";
+      case TMCMD_WRT_CK_FWD:
+      case TMCMD_WRT_CK_REV:    return "WRITE CHK";
+      case TMCMD_WRT_PE:
+      case TMCMD_WRT_GCR:       return "WRITE";
+      case TMCMD_RD_FWD:        return "READ FWD";
+      case TMCMD_RD_EXSNS:      return "EXT SENSE";
+      case TMCMD_RD_REV:        return "READ REV";
+      default:                  return "?";
+    }
+  } else {
+    switch (lFunction & RPCMD_MASK) {
+      case RPCMD_NOP:           return "NOP";
+      case RPCMD_UNLOAD:        return "UNLOAD";
+      case RPCMD_SEEK:          return "SEEK";
+      case RPCMD_RECAL:         return "RECAL";
+      case RPCMD_CLEAR:         return "CLEAR";
+      case RPCMD_RELEASE:       return "RELEASE";
+      case RPCMD_OFFSET:        return "OFFSET";
+      case RPCMD_RETURN:        return "RETURN";
+      case RPCMD_READIN:        return "READIN";
+      case RPCMD_PACKACK:       return "PACKACK";
+      case RPCMD_SEARCH:        return "SEARCH";
+      case RPCMD_WCHECK:        return "WRITE CHK";
+      case RPCMD_WHCHECK:       return "WRITE CHKH";
+      case RPCMD_WRITE:         return "WRITE";
+      case RPCMD_WHEADER:       return "WRITE HDR";
+      case RPCMD_READ:          return "READ";
+      case RPCMD_RHEADER:       return "READ HDR";
+      default:                  return "?";
+    }
+  }
+}
+
+
+/*static*/ char *CFlightRecorder::PutString (char *psz, char *pszEnd, const char *pszText, int nWidth)
+{
+  //++
+  //   Append a string to a buffer, padded with spaces to at least abs(nWidth)
+  // characters - on the left (right justified) if nWidth is positive, and on
+  // the right if it's negative.  Nothing is ever stored at or past pszEnd, and
+  // the return value is the new end of the buffer.  The result ISN'T null
+  // terminated - that's up to the caller.  This has to be async signal safe,
+  // so no library calls here ...
+  //--
+  int cchText = 0;
+  while (pszText[cchText] != '\0') ++cchText;
+  int cchPad = ((nWidth < 0) ? -nWidth : nWidth) - cchText;
+  if (nWidth > 0)
+    for (;  (cchPad > 0) && (psz < pszEnd);  --cchPad)  *psz++ = ' ';
+  for (int i = 0;  (i < cchText) && (psz < pszEnd);  ++i)  *psz++ = pszText[i];
+  for (;  (cchPad > 0) && (psz < pszEnd);  --cchPad)  *psz++ = ' ';
+  return psz;
+}
+
+
+/*static*/ char *CFlightRecorder::PutNumber (char *psz, char *pszEnd, uint64_t llValue, unsigned nRadix, int nWidth, unsigned nDigits, unsigned nDecimals)
+{
+  //++
+  //   Append an unsigned number, in decimal or octal, to a buffer.  It has at
+  // least nDigits digits (with leading zeros), and if nDecimals isn't zero
+  // then that many of them come after a decimal point - e.g. 1234 with one
+  // decimal place prints as "123.4".  That's how we avoid floating point,
+  // which isn't safe in a signal handler.  The padding and the return value
+  // are the same as PutString() ...
+  //--
+  char szNumber[32];  char *pszNumber = &szNumber[sizeof(szNumber)-1];
+  *pszNumber = '\0';
+  if (nDecimals > 0) nDigits = (nDigits > nDecimals+1) ? nDigits : nDecimals+1;
+  for (unsigned i = 0;  (llValue != 0) || (i < nDigits) || (i == 0);  ++i) {
+    if ((nDecimals > 0) && (i == nDecimals)) *--pszNumber = '.';
+    *--pszNumber = (char) ('0' + (llValue % nRadix));  llValue /= nRadix;
+  }
+  return PutString(psz, pszEnd, pszNumber, nWidth);
+}
+
+
+/*static*/ size_t CFlightRecorder::Format (const ENTRY &e, bool fTape, uint64_t llNow, char *pszBuffer, size_t cbBuffer)
+{
+  //++
+  //   Format one entry to match Heading().  The age is how long ago the
+  // command arrived, in milliseconds, and the phase times are microseconds.
+  // Commands that haven't finished (or never started) don't have any phase
+  // times yet.  Note that this is also used by the fatal signal handler, so
+  // it mustn't allocate memory, use stdio or use floating point - the times
+  // are rounded to tenths and printed with PutNumber() ...
+  //--
+  static const char *const apszResults[] = {"PENDING", "DONE", "FAILED", "OFFLINE", "NOUNIT"};
+  static const CLatency::PHASE anPhases[] = {
+    CLatency::QUEUE, CLatency::REGISTER, CLatency::IMAGE,
+    CLatency::CONVERT, CLatency::FIFO, CLatency::TOTAL
+  };
+  if (cbBuffer == 0) return 0;
+  char *psz = pszBuffer, *pszEnd = pszBuffer + cbBuffer - 1;
+  uint64_t llAge = (llNow > e.llArrival) ? (llNow - e.llArrival) : 0;
+  psz = PutNumber(psz, pszEnd, e.llNumber, 10, 8);
+  psz = PutString(psz, pszEnd, " ");
+  psz = PutNumber(psz, pszEnd, (llAge + 50000) / 100000, 10, 8, 0, 1);
+  psz = PutString(psz, pszEnd, " ");
+  psz = PutNumber(psz, pszEnd, e.nUnit);
+  psz = PutString(psz, pszEnd, "  ");
+  psz = PutNumber(psz, pszEnd, CDECUPE::ExtractRegister(e.lCommand), 8, 0, 2);
+  psz = PutString(psz, pszEnd, "  ");
+  psz = PutNumber(psz, pszEnd, CDECUPE::ExtractCommand(e.lCommand), 8, 0, 6);
+  psz = PutString(psz, pszEnd, " ");
+  psz = PutString(psz, pszEnd, FunctionName(fTape, e.lCommand), -10);
+  psz = PutString(psz, pszEnd, " ");
+  if (e.lLBA == NO_LBA)
+    psz = PutString(psz, pszEnd, "-", 9);
+  else
+    psz = PutNumber(psz, pszEnd, e.lLBA, 10, 9);
+  psz = PutString(psz, pszEnd, " ");
+  psz = PutString(psz, pszEnd, (e.nResult <= NOUNIT) ? apszResults[e.nResult] : "?", -7);
+  for (size_t i = 0;  i < sizeof(anPhases)/sizeof(anPhases[0]);  ++i) {
+    int nWidth = (i == 0) ? 7 : 6;
+    psz = PutString(psz, pszEnd, " ");
+    if ((e.nResult == DONE) || (e.nResult == FAILED))
+      psz = PutNumber(psz, pszEnd, ((uint64_t) e.alPhase[anPhases[i]] + 50) / 100, 10, nWidth, 0, 1);
+    else
+      psz = PutString(psz, pszEnd, "-", nWidth);
+  }
+  *psz = '\0';
+  return psz - pszBuffer;
+}
@@ -0,0 +1,146 @@
+//++
+// FlightRecorder.hpp -> CFlightRecorder (MASSBUS command history) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   When a host hangs waiting for a drive, the log usually doesn't say much
+// about what the drive was doing at the time.  CFlightRecorder is the answer
+// to that - every CMBA has one, and it's always on.  It remembers the last
+// HISTORY_SIZE commands executed on that MASSBUS - the raw command longword,
+// the unit, the LBA (for disks), how it turned out, and the time spent in
+// each CLatency phase.  SHOW HISTORY prints it, and CMBA dumps the most recent
+// part of it to the log whenever a unit goes offline in the middle of a
+// command (e.g. the "offline:" paths in CDiskDrive::DoRead() and DoWrite()).
+// MBS also dumps every MASSBUS's history to stderr on a fatal signal.
+//
+//   Recording a command has to be cheap, since it happens for every single
+// command, and it can't take any locks, since the unit workers for different
+// units record their commands at the same time.  Each entry is one 64 byte
+// slot, and a writer claims the next slot with an atomic increment.  Every
+// slot has a version number (a "seqlock") which is odd while somebody is
+// writing it, so a reader can copy an entry without stopping anybody and
+// then check the version to see whether it got a consistent copy.  A command
+// is recorded twice - once by Start() when it begins, so a command that never
+// finishes still shows up as PENDING, and again by Finish() when it's done.
+//
+//   If a command takes so long that HISTORY_SIZE newer commands have been
+// recorded in the meantime, then its slot has been reused and Finish() just
+// gives up.  Nobody will miss it - it has already scrolled out of the history.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <stddef.h>             // size_t, etc ...
+#include <atomic>               // C++ std::atomic template
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
+#include "Latency.hpp"          // CLatency phases and classes
+
+
+class CFlightRecorder {
+  //++
+  // Lock free history of the last few MASSBUS commands ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    HISTORY_SIZE = 256,         // commands remembered (must be a power of 2)
+    DUMP_COUNT   =  32,         // commands logged when a unit goes offline
+    NO_LBA       = 0xFFFFFFFFUL,// command didn't address any sector
+  };
+  // What happened to a command ...
+  enum RESULT {
+    PENDING,                    // started but not finished (yet!)
+    DONE,                       // finished normally
+    FAILED,                     // the unit went offline doing this command
+    OFFLINE,                    // ignored because the unit is offline
+    NOUNIT,                     // ignored because the unit doesn't exist
+  };
+  typedef std::chrono::steady_clock::time_point TIMESTAMP;
+  //   One recorded command.  The phase times are nanoseconds, and anything
+  // over four seconds or so is just saturated ...
+  struct ENTRY {
+    uint64_t llNumber;                      // command sequence number
+    uint64_t llArrival;                     // steady_clock time (nanoseconds)
+    uint32_t lCommand;                      // raw command FIFO longword
+    uint32_t lLBA;                          // disk sector or NO_LBA
+    uint32_t alPhase[CLatency::MAXPHASE];   // time spent in each phase
+    uint8_t  nUnit;                         // unit number
+    uint8_t  nResult;                       // a RESULT code
+    uint8_t  nClass;                        // a CLatency::CLASS
+    uint8_t  nPad;                          // (unused)
+  };
+
+  // Constructor and destructor ...
+public:
+  CFlightRecorder();
+  virtual ~CFlightRecorder() {};
+private:
+  CFlightRecorder(const CFlightRecorder &) = delete;
+  CFlightRecorder& operator= (const CFlightRecorder &) = delete;
+
+  // Public methods ...
+public:
+  //   Record the start of a command and return its sequence number, which
+  // must be passed to Finish() later ...
+  uint64_t Start (uint32_t lCommand, uint8_t nUnit, TIMESTAMP tmArrival);
+  //   Record the end of a command, along with the phase times and class from
+  // the drive's CLatency (which must have already been End()ed) ...
+  void Finish (uint64_t llNumber, RESULT nResult, const CLatency &latency, uint32_t lLBA);
+  // Record a command that was never executed at all ...
+  void Record (uint32_t lCommand, uint8_t nUnit, TIMESTAMP tmArrival, RESULT nResult);
+  //   Copy up to nMax of the most recent entries, oldest first, and return
+  // the number copied.  This never waits for anything ...
+  size_t Snapshot (ENTRY *pEntries, size_t nMax) const;
+  // Return the total number of commands recorded so far ...
+  uint64_t GetCount() const {return m_llNext.load(std::memory_order_relaxed);}
+  //   Format an entry (or the column headings) for messages and return the
+  // length.  llNow is the current time, in the same units as llArrival ...
+  static size_t Format (const ENTRY &e, bool fTape, uint64_t llNow, char *pszBuffer, size_t cbBuffer);
+  static const char *Heading() {return
+    "  Number  Age(ms) U Reg Command Function         LBA Result    Queue    Reg  Image   Conv   FIFO  Total (us)";}
+  // Return the current time, in ENTRY::llArrival units ...
+  static uint64_t Now() {return ToNanoseconds(std::chrono::steady_clock::now());}
+  //   Append a string or a number to a buffer without any library calls.
+  // These are async signal safe, so the fatal signal handler can use them
+  // for its own messages too ...
+  static char *PutString (char *psz, char *pszEnd, const char *pszText, int nWidth=0);
+  static char *PutNumber (char *psz, char *pszEnd, uint64_t llValue, unsigned nRadix=10,
+                          int nWidth=0, unsigned nDigits=0, unsigned nDecimals=0);
+
+  // Private methods ...
+private:
+  //   A slot in the history.  Don't copy these directly - the version has to
+  // be checked!  The padding makes each one exactly 64 bytes ...
+  struct SLOT {
+    std::atomic<uint32_t> nVersion;       // odd while an update is in progress
+    uint32_t              nPad;           // (unused)
+    ENTRY                 Entry;          // the command itself
+  };
+  // Claim a slot for updating, or return NULL if it's been reused ...
+  SLOT *Lock (uint64_t llNumber, bool fNew);
+  // Finish updating a slot ...
+  static void Unlock (SLOT *pSlot);
+  static uint64_t ToNanoseconds (TIMESTAMP tm)
+    {return std::chrono::duration_cast<std::chrono::nanoseconds>(tm.time_since_epoch()).count();}
+  // Return the name of a command function ...
+  static const char *FunctionName (bool fTape, uint32_t lCommand);
+
+  // Private member data ...
+private:
+  std::atomic<uint64_t> m_llNext;         // next command sequence number
+  SLOT                  m_aSlots[HISTORY_SIZE];
+};
@@ -0,0 +1,558 @@
+//++
+// ImageSync.cpp -> CImageSync (image durability) and CGroupCommit methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CImageSync and CGroupCommit classes.  See
+// ImageSync.hpp for the details, and CDiskDrive::SetSync() for where the
+// CImageSync objects come from.  There's one version of the file I/O routines
+// for Windows and another for everything else.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <stdlib.h>             // strtoul(), etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memset(), strerror(), etc ...
+#include <ctype.h>              // toupper(), isdigit(), etc ...
+#include <errno.h>              // errno, etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <algorithm>            // std::find(), etc ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#ifdef _WIN32
+#include <windows.h>            // CreateFile(), FlushFileBuffers(), etc ...
+#else
+#include <fcntl.h>              // open(), etc ...
+#include <unistd.h>             // close(), pread(), pwrite(), fdatasync(), etc ...
+#include <sys/stat.h>           // stat() ...
+#endif
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageSync.hpp"        // declarations for this module
+using std::unique_lock;         // ...
+using std::lock_guard;          // ...
+using std::mutex;               // ...
+
+// The group commit registry ...
+mutex CGroupCommit::m_mtxRegistry;
+std::map<string, CGroupCommit *> CGroupCommit::m_mapGroups;
+
+
+CImageSync::CImageSync()
+  : m_cbSector(0), m_nPolicy(SYNC_NONE), m_lInterval(0), m_pGroup(NULL),
+    m_llWritten(0), m_llSynced(0), m_llDurable(0), m_cSyncs(0), m_cSynced(0),
+    m_cWaits(0), m_cErrors(0), m_dTotalSeconds(0)
+{
+  //++
+  // Nothing happens until Open() is called ...
+  //--
+#ifdef _WIN32
+  m_hFile = INVALID_HANDLE_VALUE;
+#else
+  m_fd = -1;
+#endif
+}
+
+
+/*static*/ bool CImageSync::ParsePolicy (const string &strArg, SYNC_POLICY &nPolicy, uint32_t &lInterval)
+{
+  //++
+  //   Parse the argument to /SYNC.  NONE and WRITE are just keywords, and
+  // INTERVAL takes an optional number of milliseconds (INTERVAL=ms or
+  // INTERVAL:ms).  A number all by itself is an interval, too.  Keywords can
+  // be abbreviated to a single letter ...
+  //--
+  string str;
+  for (string::const_iterator it = strArg.begin();  it != strArg.end();  ++it)
+    str += (char) toupper(*it);
+  lInterval = 0;
+  if (str.empty()) return false;
+  if (string("NONE").compare(0, str.size(), str) == 0) {
+    nPolicy = SYNC_NONE;  return true;
+  }
+  if (string("WRITE").compare(0, str.size(), str) == 0) {
+    nPolicy = SYNC_WRITE;  return true;
+  }
+  nPolicy = SYNC_INTERVAL;  lInterval = DEFAULT_INTERVAL;
+  size_t nDelimiter = str.find_first_of("=:");
+  string strKey = str.substr(0, nDelimiter);
+  if (!strKey.empty() && !isdigit((unsigned char) strKey[0])) {
+    if (string("INTERVAL").compare(0, strKey.size(), strKey) != 0) return false;
+    if (nDelimiter == string::npos) return true;
+    str = str.substr(nDelimiter+1);
+  }
+  if (str.empty() || !isdigit((unsigned char) str[0])) return false;
+  char *pszEnd;  unsigned long lValue = strtoul(str.c_str(), &pszEnd, 10);
+  if ((*pszEnd != '\0') || (lValue == 0) || (lValue > MAX_INTERVAL)) return false;
+  lInterval = (uint32_t) lValue;
+  return true;
+}
+
+
+string CImageSync::GetPolicyName() const
+{
+  //++
+  // Return the policy the way the user would type it ...
+  //--
+  switch (m_nPolicy) {
+    case SYNC_WRITE:    return "WRITE";
+    case SYNC_INTERVAL: return "INTERVAL=" + std::to_string(m_lInterval);
+    default:            return "NONE";
+  }
+}
+
+
+bool CImageSync::Open (const string &strFileName, uint32_t cbSector, SYNC_POLICY nPolicy, uint32_t lInterval)
+{
+  //++
+  //   Open the file that gets written, and join the group commit for the
+  // file system it's on.  The file must already exist - the image or the
+  // overlay has already opened it by now.  Returns false if the file can't
+  // be opened or the group commit thread can't be started ...
+  //--
+  assert(!IsOpen() && (nPolicy != SYNC_NONE));
+  m_strFileName = strFileName;  m_cbSector = cbSector;
+  m_nPolicy = nPolicy;  m_lInterval = lInterval;
+  m_llWritten = m_llSynced = m_llDurable = 0;
+#ifdef _WIN32
+  m_hFile = CreateFileA(strFileName.c_str(), GENERIC_READ|GENERIC_WRITE,
+    FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_hFile == INVALID_HANDLE_VALUE) {
+    LOGS(ERROR, "unable to open " << strFileName << " for sync, error " << GetLastError());
+    return false;
+  }
+#else
+  m_fd = open(strFileName.c_str(), O_RDWR);
+  if (m_fd < 0) {
+    LOGS(ERROR, "unable to open " << strFileName << " for sync - " << strerror(errno));
+    return false;
+  }
+#endif
+  m_pGroup = CGroupCommit::Open(strFileName, this);
+  if (m_pGroup == NULL) {
+    Close();  return false;
+  }
+  LOGS(DEBUG, "sync " << GetPolicyName() << " for " << strFileName);
+  return true;
+}
+
+
+void CImageSync::Close()
+{
+  //++
+  //   Leave the group commit (after which the thread will never touch us
+  // again) and then sync anything that's still outstanding ourselves ...
+  //--
+  if (m_pGroup != NULL) {
+    CGroupCommit::Close(m_pGroup, this);  m_pGroup = NULL;
+  }
+  if (!IsOpen()) return;
+  if (!Sync())
+    LOGS(ERROR, "final sync failed for " << m_strFileName << " - data may be lost");
+#ifdef _WIN32
+  CloseHandle(m_hFile);  m_hFile = INVALID_HANDLE_VALUE;
+#else
+  close(m_fd);  m_fd = -1;
+#endif
+}
+
+
+uint32_t CImageSync::GetUnsynced() const
+{
+  //++
+  // Return the number of sector writes since the last sync started ...
+  //--
+  lock_guard<mutex> lock(m_mtxSync);
+  return (uint32_t) (m_llWritten - m_llSynced);
+}
+
+
+bool CImageSync::Read (uint32_t lLBA, void *pData)
+{
+  //++
+  // Read one sector from a plain image file ...
+  //--
+  assert(IsOpen());
+  if (ReadAt((uint64_t) lLBA * m_cbSector, pData, m_cbSector)) return true;
+  LOGS(ERROR, "error reading sector " << lLBA << " from " << m_strFileName);
+  return false;
+}
+
+
+bool CImageSync::Write (uint32_t lLBA, const void *pData)
+{
+  //++
+  //   Write one sector to a plain image file.  Note that this doesn't count
+  // the write - CDiskDrive calls Written() for every write, whichever way it
+  // goes to the file ...
+  //--
+  assert(IsOpen());
+  if (WriteAt((uint64_t) lLBA * m_cbSector, pData, m_cbSector)) return true;
+  LOGS(ERROR, "error writing sector " << lLBA << " to " << m_strFileName);
+  return false;
+}
+
+
+void CImageSync::Written()
+{
+  //++
+  //   Count one more sector written.  If it's the first write since the last
+  // sync then it starts the clock, and the group commit thread needs to know.
+  // The group thread never syncs while it holds its lock, so Kick() is quick ...
+  //--
+  bool fFirst;
+  {
+    lock_guard<mutex> lock(m_mtxSync);
+    fFirst = (m_llWritten == m_llSynced);
+    if (fFirst) m_tmDirty = std::chrono::steady_clock::now();
+    ++m_llWritten;
+  }
+  if (fFirst && (m_pGroup != NULL)) m_pGroup->Kick();
+}
+
+
+bool CImageSync::WaitDurable()
+{
+  //++
+  //   With /SYNC=WRITE, wait until the sync that covers every write so far
+  // is done, and return false if it failed.  With any other policy this
+  // returns right away ...
+  //--
+  if (m_nPolicy != SYNC_WRITE) return true;
+  unique_lock<mutex> lock(m_mtxSync);
+  uint64_t llWait = m_llWritten;
+  if (m_llDurable >= llWait) return true;
+  ++m_cWaits;
+  while (m_llSynced < llWait) m_cvDurable.wait(lock);
+  return m_llDurable >= llWait;
+}
+
+
+bool CImageSync::GetDue (TIME_POINT &tmDue) const
+{
+  //++
+  //   If any writes are waiting to be synced, return true and the time when
+  // they have to be synced by.  For /SYNC=WRITE that's just the group commit
+  // window after the first one ...
+  //--
+  lock_guard<mutex> lock(m_mtxSync);
+  if (m_llWritten == m_llSynced) return false;
+  uint32_t lDelay = (m_nPolicy == SYNC_WRITE) ? (uint32_t) GROUP_WINDOW : m_lInterval;
+  tmDue = m_tmDirty + std::chrono::milliseconds(lDelay);
+  return true;
+}
+
+
+bool CImageSync::Sync()
+{
+  //++
+  //   Sync every write that's been done so far, and then wake up anybody
+  // who's waiting for them.  Writes that come along while the sync is in
+  // progress aren't covered by it, and they start a new clock.  This is
+  // called by the group commit thread, and by Close() after we've left the
+  // group, so it's never called twice at once ...
+  //--
+  uint64_t llSync, cSectors;
+  {
+    lock_guard<mutex> lock(m_mtxSync);
+    llSync = m_llWritten;  cSectors = llSync - m_llSynced;
+  }
+  if (cSectors == 0) return true;
+  std::chrono::steady_clock::time_point tmStart = std::chrono::steady_clock::now();
+  bool fOK = FlushFile();
+  std::chrono::steady_clock::time_point tmEnd = std::chrono::steady_clock::now();
+  {
+    lock_guard<mutex> lock(m_mtxSync);
+    m_llSynced = llSync;
+    if (fOK) m_llDurable = llSync;  else ++m_cErrors;
+    if (m_llWritten > llSync) m_tmDirty = tmEnd;
+    ++m_cSyncs;  m_cSynced += cSectors;
+    m_dTotalSeconds += std::chrono::duration<double>(tmEnd - tmStart).count();
+  }
+  m_cvDurable.notify_all();
+  return fOK;
+}
+
+
+#ifdef _WIN32
+bool CImageSync::IsOpen() const
+{
+  //++
+  // Return true if the file is open ...
+  //--
+  return m_hFile != INVALID_HANDLE_VALUE;
+}
+
+
+bool CImageSync::ReadAt (uint64_t llOffset, void *pData, uint32_t cbData)
+{
+  //++
+  //   Read with an explicit offset.  Anything past the end of the file reads
+  // as zeros ...
+  //--
+  OVERLAPPED ov;  DWORD cbRead = 0;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD) (llOffset & 0xFFFFFFFFUL);  ov.OffsetHigh = (DWORD) (llOffset >> 32);
+  if (!ReadFile(m_hFile, pData, cbData, &cbRead, &ov) && (GetLastError() != ERROR_HANDLE_EOF))
+    return false;
+  if (cbRead < cbData) memset((uint8_t *) pData + cbRead, 0, cbData - cbRead);
+  return true;
+}
+
+
+bool CImageSync::WriteAt (uint64_t llOffset, const void *pData, uint32_t cbData)
+{
+  //++
+  // Write with an explicit offset ...
+  //--
+  OVERLAPPED ov;  DWORD cbWritten = 0;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD) (llOffset & 0xFFFFFFFFUL);  ov.OffsetHigh = (DWORD) (llOffset >> 32);
+  return WriteFile(m_hFile, pData, cbData, &cbWritten, &ov) && (cbWritten == cbData);
+}
+
+
+bool CImageSync::FlushFile()
+{
+  //++
+  //   FlushFileBuffers() writes everything written to the file by anybody,
+  // not just by this handle ...
+  //--
+  if (FlushFileBuffers(m_hFile)) return true;
+  LOGS(ERROR, "unable to sync " << m_strFileName << ", error " << GetLastError());
+  return false;
+}
+
+
+/*static*/ string CGroupCommit::GetFileSystem (const string &strFileName)
+{
+  //++
+  //   The volume mount point (e.g. "C:\") identifies the file system.  If we
+  // can't get that, then the file is in a group all by itself ...
+  //--
+  char szVolume[MAX_PATH];
+  if (!GetVolumePathNameA(strFileName.c_str(), szVolume, sizeof(szVolume))) return strFileName;
+  string strKey(szVolume);
+  for (string::iterator it = strKey.begin();  it != strKey.end();  ++it) *it = (char) toupper(*it);
+  return strKey;
+}
+#else
+bool CImageSync::IsOpen() const
+{
+  //++
+  // Return true if the file is open ...
+  //--
+  return m_fd >= 0;
+}
+
+
+bool CImageSync::ReadAt (uint64_t llOffset, void *pData, uint32_t cbData)
+{
+  //++
+  //   Read with an explicit offset.  Anything past the end of the file reads
+  // as zeros ...
+  //--
+  ssize_t cbRead = pread(m_fd, pData, cbData, (off_t) llOffset);
+  if (cbRead < 0) return false;
+  if ((uint32_t) cbRead < cbData) memset((uint8_t *) pData + cbRead, 0, cbData - cbRead);
+  return true;
+}
+
+
+bool CImageSync::WriteAt (uint64_t llOffset, const void *pData, uint32_t cbData)
+{
+  //++
+  // Write with an explicit offset ...
+  //--
+  return pwrite(m_fd, pData, cbData, (off_t) llOffset) == (ssize_t) cbData;
+}
+
+
+bool CImageSync::FlushFile()
+{
+  //++
+  //   fdatasync() writes all the data written to the file by anybody, not
+  // just by this descriptor, and skips the metadata that isn't needed to read
+  // it back (e.g. the modification time).  MacOS doesn't have it, but fsync()
+  // is the same thing there ...
+  //--
+#ifdef __APPLE__
+  if (fsync(m_fd) == 0) return true;
+#else
+  if (fdatasync(m_fd) == 0) return true;
+#endif
+  LOGS(ERROR, "unable to sync " << m_strFileName << " - " << strerror(errno));
+  return false;
+}
+
+
+/*static*/ string CGroupCommit::GetFileSystem (const string &strFileName)
+{
+  //++
+  //   The device number identifies the file system.  If we can't get that,
+  // then the file is in a group all by itself ...
+  //--
+  struct stat st;
+  if (stat(strFileName.c_str(), &st) != 0) return strFileName;
+  return "dev " + std::to_string((unsigned long long) st.st_dev);
+}
+#endif
+
+
+CGroupCommit::CGroupCommit (const string &strKey)
+  : m_strKey(strKey), m_Thread(&CGroupCommit::GroupLoop), m_fStarted(false), m_fExit(false),
+    m_cRounds(0), m_cFileSyncs(0)
+{
+  //++
+  // The thread is started by Open() ...
+  //--
+  m_Thread.SetName("group commit");
+  m_Thread.SetParameter(this);
+}
+
+
+CGroupCommit::~CGroupCommit()
+{
+  //++
+  // Stop the thread.  All the members are gone by now ...
+  //--
+  assert(m_vecMembers.empty());
+  if (!m_fStarted) return;
+  {
+    lock_guard<mutex> lock(m_mtxGroup);
+    m_fExit = true;
+  }
+  m_cvWake.notify_all();
+  m_Thread.WaitExit();
+}
+
+
+/*static*/ CGroupCommit *CGroupCommit::Open (const string &strFileName, CImageSync *pMember)
+{
+  //++
+  //   Find the group for the file system that strFileName is on, or create a
+  // new one and start its thread, and add pMember to it.  Returns NULL if the
+  // thread can't be started ...
+  //--
+  lock_guard<mutex> lock(m_mtxRegistry);
+  string strKey = GetFileSystem(strFileName);
+  std::map<string, CGroupCommit *>::iterator it = m_mapGroups.find(strKey);
+  CGroupCommit *pGroup;
+  if (it != m_mapGroups.end()) {
+    pGroup = it->second;
+  } else {
+    pGroup = new CGroupCommit(strKey);
+    pGroup->m_fStarted = pGroup->m_Thread.Begin();
+    if (!pGroup->m_fStarted) {
+      LOGS(ERROR, "unable to start group commit thread for " << strFileName);
+      delete pGroup;  return NULL;
+    }
+    m_mapGroups[strKey] = pGroup;
+    LOGS(DEBUG, "group commit started for " << strKey);
+  }
+  lock_guard<mutex> lockGroup(pGroup->m_mtxGroup);
+  pGroup->m_vecMembers.push_back(pMember);
+  return pGroup;
+}
+
+
+/*static*/ void CGroupCommit::Close (CGroupCommit *pGroup, CImageSync *pMember)
+{
+  //++
+  //   Remove a member from the group.  The thread might already have picked
+  // it for the current round, so wait for the round to finish before we
+  // return - after that the thread can't find it anymore.  The last member
+  // out deletes the group (which stops the thread) ...
+  //--
+  if (pGroup == NULL) return;
+  lock_guard<mutex> lock(m_mtxRegistry);
+  {
+    lock_guard<mutex> lockGroup(pGroup->m_mtxGroup);
+    std::vector<CImageSync *>::iterator it = std::find(pGroup->m_vecMembers.begin(), pGroup->m_vecMembers.end(), pMember);
+    if (it != pGroup->m_vecMembers.end()) pGroup->m_vecMembers.erase(it);
+  }
+  { lock_guard<mutex> lockRound(pGroup->m_mtxRound); }
+  if (!pGroup->m_vecMembers.empty()) return;
+  m_mapGroups.erase(pGroup->m_strKey);
+  delete pGroup;
+}
+
+
+void CGroupCommit::Kick()
+{
+  //++
+  // Wake up the thread so that it can figure out a new due time ...
+  //--
+  { lock_guard<mutex> lock(m_mtxGroup); }
+  m_cvWake.notify_one();
+}
+
+
+void CGroupCommit::DoGroups()
+{
+  //++
+  //   This is the body of the group commit thread.  Every time around it asks
+  // each member when its next sync is due, and then either sleeps until the
+  // earliest one or, if any are already due, syncs all of those in one round.
+  // The group lock is released for the round (so that writes never wait for
+  // the disk) but the round lock is taken first, before the group lock is
+  // dropped, so that Close() can tell when a round has finished with its
+  // member ...
+  //--
+  unique_lock<mutex> lock(m_mtxGroup);
+  while (!m_fExit) {
+    CImageSync::TIME_POINT tmNow = std::chrono::steady_clock::now(), tmNext, tmDue;
+    bool fWait = false;  std::vector<CImageSync *> vecDue;
+    for (std::vector<CImageSync *>::iterator it = m_vecMembers.begin();  it != m_vecMembers.end();  ++it) {
+      if (!(*it)->GetDue(tmDue)) continue;
+      if (tmDue <= tmNow) {
+        vecDue.push_back(*it);
+      } else if (!fWait || (tmDue < tmNext)) {
+        tmNext = tmDue;  fWait = true;
+      }
+    }
+    if (vecDue.empty()) {
+      if (fWait)
+        m_cvWake.wait_until(lock, tmNext);
+      else
+        m_cvWake.wait(lock);
+      continue;
+    }
+    unique_lock<mutex> lockRound(m_mtxRound);
+    lock.unlock();
+    for (std::vector<CImageSync *>::iterator it = vecDue.begin();  it != vecDue.end();  ++it)
+      (*it)->Sync();
+    ++m_cRounds;  m_cFileSyncs += vecDue.size();
+    lockRound.unlock();
+    lock.lock();
+  }
+}
+
+
+/* static */ void* THREAD_ATTRIBUTES CGroupCommit::GroupLoop (void *pParam)
+{
+  //++
+  // Thread entry point - just call DoGroups() for the right object ...
+  //--
+  CThread *pThread = (CThread *) pParam;
+  CGroupCommit *pGroup = (CGroupCommit *) pThread->GetParameter();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " is running");
+  pGroup->DoGroups();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " terminated");
+  return pThread->End();
+}
@@ -0,0 +1,232 @@
+//++
+// ImageSync.hpp -> CImageSync (image durability) and CGroupCommit classes
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Normally a sector the host writes goes no further than the host OS page
+// cache, and it gets to the disk whenever the OS gets around to it.  If the
+// power fails first, then the write is lost even though the PDP-10 was told
+// it was done.  ATTACH /SYNC picks how hard MBS tries to prevent that -
+//
+//      /SYNC=NONE          - never sync (the old behavior, and the default)
+//      /SYNC=INTERVAL=ms   - sync no later than ms milliseconds after a write
+//      /SYNC=WRITE         - don't finish a write until it's on the disk
+//
+//   Syncing every single write separately would be very slow, so the syncs
+// are done by a group commit thread instead.  There's one CGroupCommit for
+// every file system that has synced images on it, and it's shared by all
+// the units with images there.  With /SYNC=WRITE a write waits for up to
+// GROUP_WINDOW milliseconds, so that all the writes from all the units that
+// finish in that window are made durable by the same round of syncs.  The
+// thread syncs each file with outstanding writes once per round, and then
+// wakes up every waiter at once.  Units with /SYNC=INTERVAL just get synced
+// when their interval is up, and nobody waits.
+//
+//   CImageSync is one unit's side of this.  It has its own file descriptor
+// (or handle) for the file that actually gets written - the delta for an
+// overlay, and the image itself otherwise - and it counts the sectors that
+// have been written but not synced yet.  Syncing any descriptor for a file
+// syncs all the data written to it, so this works for the overlay and the
+// sparse image, which both write straight through to the OS.  A plain image
+// file is a different story, since UPELIB's CDiskImageFile buffers writes
+// in the C library where no sync can see them.  For that case CImageSync
+// also does the positional I/O for the whole image, and CDiskDrive sends all
+// reads and writes through it instead.  A chunked container buffers the whole
+// chunk in memory, and a mapped image is written back by the page cache, so
+// neither can be synced this way.
+//
+//   A write is "durable" once the sync that started after it has succeeded.
+// Each CImageSync counts the writes (the "generation") and remembers the
+// generation that the last successful sync covered, so WaitDurable() can
+// tell exactly when it's done.  If the sync fails then the writes it was for
+// fail too - there's no way to know what made it to the disk.
+//
+//   Locking - the CImageSync counters have their own mutex, and so does the
+// CGroupCommit member list.  The group thread takes the list lock and then a
+// member's lock, but never holds either one while it's actually syncing, so
+// a write (which counts itself with the drive's image lock held) never waits
+// for the disk.  Written() may be called with the image lock held, but
+// WaitDurable() should be called without it.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+#include <map>                  // C++ std::map template
+#include <mutex>                // C++ std::mutex
+#include <condition_variable>   // C++ std::condition_variable
+#include <chrono>               // C++ std::chrono::steady_clock, etc ...
+#include "Thread.hpp"           // UPELIB CThread portable thread library
+using std::string;              // ...
+class CGroupCommit;             // we need a forward pointer for this class
+
+
+class CImageSync {
+  //++
+  // One unit's image durability policy ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum SYNC_POLICY {
+    SYNC_NONE       = 0,        // never sync
+    SYNC_INTERVAL   = 1,        // sync every so many milliseconds
+    SYNC_WRITE      = 2,        // every write waits for the sync
+  };
+  enum {
+    DEFAULT_INTERVAL = 1000,    // default for /SYNC=INTERVAL, in milliseconds
+    MAX_INTERVAL     = 3600000, // longest interval allowed (one hour)
+    GROUP_WINDOW     = 2,       // /SYNC=WRITE group commit window, in milliseconds
+  };
+  typedef std::chrono::steady_clock::time_point TIME_POINT;
+
+  // Constructor and destructor ...
+public:
+  CImageSync();
+  virtual ~CImageSync() {Close();}
+private:
+  // Disallow copy and assignment operations with CImageSync objects...
+  CImageSync(const CImageSync &) = delete;
+  CImageSync& operator= (const CImageSync &) = delete;
+
+  // Public properties ...
+public:
+  bool IsOpen() const;
+  string GetFileName() const {return m_strFileName;}
+  SYNC_POLICY GetPolicy() const {return m_nPolicy;}
+  uint32_t GetInterval() const {return m_lInterval;}
+  // Return the number of sector writes that haven't been synced yet ...
+  uint32_t GetUnsynced() const;
+  // Return the sync statistics ...
+  uint64_t GetSyncs() const {return m_cSyncs;}
+  uint64_t GetSynced() const {return m_cSynced;}
+  uint64_t GetWaits() const {return m_cWaits;}
+  uint64_t GetErrors() const {return m_cErrors;}
+  double GetAverageMilliseconds() const
+    {return (m_cSyncs > 0) ? (m_dTotalSeconds * 1000.0 / m_cSyncs) : 0.0;}
+  // Return the policy as a string, e.g. "INTERVAL=1000" ...
+  string GetPolicyName() const;
+
+  // Public methods ...
+public:
+  // Parse a /SYNC argument - NONE, WRITE, INTERVAL=ms or just ms ...
+  static bool ParsePolicy (const string &strArg, SYNC_POLICY &nPolicy, uint32_t &lInterval);
+  //   Open the file that gets written, and join the group commit for its file
+  // system.  Close() syncs anything outstanding and leaves the group ...
+  bool Open (const string &strFileName, uint32_t cbSector, SYNC_POLICY nPolicy, uint32_t lInterval);
+  void Close();
+  // Read or write one sector of a plain image file ...
+  bool Read (uint32_t lLBA, void *pData);
+  bool Write (uint32_t lLBA, const void *pData);
+  // Count one sector written (the image may be locked) ...
+  void Written();
+  // Wait until everything written so far is on the disk (image NOT locked) ...
+  bool WaitDurable();
+
+  // Group commit interface ...
+public:
+  //   Return true and the time the next sync is due if anything is waiting
+  // to be synced ...
+  bool GetDue (TIME_POINT &tmDue) const;
+  // Sync everything written so far and wake up anybody waiting ...
+  bool Sync();
+
+  // Private methods ...
+private:
+  bool ReadAt (uint64_t llOffset, void *pData, uint32_t cbData);
+  bool WriteAt (uint64_t llOffset, const void *pData, uint32_t cbData);
+  bool FlushFile();
+
+  // Private member data ...
+private:
+#ifdef _WIN32
+  void     *m_hFile;            // Windows file handle
+#else
+  int       m_fd;               // file descriptor for the image
+#endif
+  string                  m_strFileName;  // the file we sync
+  uint32_t                m_cbSector;     // image sector size, in bytes
+  SYNC_POLICY             m_nPolicy;      // durability policy
+  uint32_t                m_lInterval;    // sync interval, in milliseconds
+  CGroupCommit           *m_pGroup;       // group commit for our file system
+  mutable std::mutex      m_mtxSync;      // protects everything below
+  std::condition_variable m_cvDurable;    // signalled after every sync
+  uint64_t                m_llWritten;    // generation of the last write
+  uint64_t                m_llSynced;     // generation covered by the last sync
+  uint64_t                m_llDurable;    //   ... and the last successful sync
+  TIME_POINT              m_tmDirty;      // time of the first unsynced write
+  uint64_t                m_cSyncs;       // number of syncs done
+  uint64_t                m_cSynced;      // number of sector writes synced
+  uint64_t                m_cWaits;       // writes that waited for a sync
+  uint64_t                m_cErrors;      // syncs that failed
+  double                  m_dTotalSeconds;// total time spent syncing
+};
+
+
+class CGroupCommit {
+  //++
+  // Group commit thread shared by all the images on one file system ...
+  //--
+
+  // Constructor and destructor ...
+private:
+  // Use Open() and Close() instead of new and delete ...
+  CGroupCommit (const string &strKey);
+  virtual ~CGroupCommit();
+  // Disallow copy and assignment operations with CGroupCommit objects...
+  CGroupCommit(const CGroupCommit &) = delete;
+  CGroupCommit& operator= (const CGroupCommit &) = delete;
+
+  // Public properties ...
+public:
+  // Return the number of rounds and the number of file syncs done ...
+  uint64_t GetRounds() const {return m_cRounds;}
+  uint64_t GetFileSyncs() const {return m_cFileSyncs;}
+
+  // Public methods ...
+public:
+  //   Find (or create, and start the thread for) the group commit for the
+  // file system that strFileName is on, and add a member to it ...
+  static CGroupCommit *Open (const string &strFileName, CImageSync *pMember);
+  // Remove a member, and delete the group when there are none ...
+  static void Close (CGroupCommit *pGroup, CImageSync *pMember);
+  // Tell the thread that a member has something new to sync ...
+  void Kick();
+
+  // Private methods ...
+private:
+  // Return the key for the file system that a file is on ...
+  static string GetFileSystem (const string &strFileName);
+  // The background thread that does the syncs ...
+  static void* THREAD_ATTRIBUTES GroupLoop (void *pParam);
+  void DoGroups();
+
+  // Private member data ...
+private:
+  static std::mutex m_mtxRegistry;                        // protects m_mapGroups
+  static std::map<string, CGroupCommit *> m_mapGroups;    // all groups
+  string                    m_strKey;     // our key in m_mapGroups
+  CThread                   m_Thread;     // the group commit thread
+  bool                      m_fStarted;   // the thread was started
+  std::mutex                m_mtxGroup;   // protects the rest of this
+  std::mutex                m_mtxRound;   // held while a round is syncing
+  std::condition_variable   m_cvWake;     // signalled by Kick() and Close()
+  bool                      m_fExit;      // true to stop the thread
+  std::vector<CImageSync *> m_vecMembers; // all the images in this group
+  uint64_t                  m_cRounds;    // number of group commit rounds
+  uint64_t                  m_cFileSyncs; // number of files synced
+};
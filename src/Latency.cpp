@@ -0,0 +1,163 @@
+//++
+// Latency.cpp -> CHistogram and CLatency (command latency statistics) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CHistogram and CLatency classes.  See the
+// comments in Latency.hpp for the details.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memset(), etc ...
+#include "Latency.hpp"          // declarations for this module
+
+
+void CHistogram::Reset()
+{
+  //++
+  // Clear all the buckets and the totals ...
+  //--
+  memset(m_alBuckets, 0, sizeof(m_alBuckets));
+  m_llCount = m_llSum = m_llMax = 0;
+}
+
+
+/* static */ uint32_t CHistogram::Bucket (uint64_t llValue)
+{
+  //++
+  //   Figure out which bucket a value belongs in.  Values less than
+  // SUB_BUCKETS get a bucket all to themselves.  Above that, find the most
+  // significant bit, and then the next SUB_BITS bits select one of the
+  // linear buckets for that power of two.  Anything too big for the
+  // histogram goes in the last bucket.
+  //--
+  if (llValue < SUB_BUCKETS) return (uint32_t) llValue;
+  uint32_t nShift = 0;
+  while (llValue >= (2*SUB_BUCKETS)) {llValue >>= 1;  ++nShift;}
+  uint32_t nBucket = (nShift+1)*SUB_BUCKETS + ((uint32_t) llValue - SUB_BUCKETS);
+  return (nBucket < BUCKETS) ? nBucket : (BUCKETS-1);
+}
+
+
+/* static */ uint64_t CHistogram::UpperLimit (uint32_t nBucket)
+{
+  //++
+  // Return the largest value that falls into the specified bucket ...
+  //--
+  assert(nBucket < BUCKETS);
+  if (nBucket < SUB_BUCKETS) return nBucket;
+  uint32_t nShift = nBucket/SUB_BUCKETS - 1;
+  uint64_t llLower = ((uint64_t) (SUB_BUCKETS + nBucket%SUB_BUCKETS)) << nShift;
+  return llLower + (1ULL << nShift) - 1;
+}
+
+
+uint64_t CHistogram::GetPercentile (double dPercent) const
+{
+  //++
+  //   Return the upper limit of the bucket that contains the dPercent-th
+  // sample.  That's a slightly pessimistic answer, which is the right way to
+  // err when we're comparing against a timeout, but it's never more than the
+  // largest value we actually saw ...
+  //--
+  if (m_llCount == 0) return 0;
+  uint64_t llTarget = (uint64_t) ((dPercent/100.0) * m_llCount + 0.5);
+  if (llTarget < 1) llTarget = 1;
+  uint64_t llSeen = 0;
+  for (uint32_t i = 0;  i < BUCKETS;  ++i) {
+    llSeen += m_alBuckets[i];
+    if (llSeen >= llTarget) {
+      uint64_t llLimit = UpperLimit(i);
+      return (llLimit < m_llMax) ? llLimit : m_llMax;
+    }
+  }
+  return m_llMax;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+void CLatency::Begin (TIMESTAMP tmArrival)
+{
+  //++
+  //   Start timing a new command.  tmArrival is the time that the command was
+  // read from the UPE FIFO, and everything from then until now was spent
+  // waiting in the command ring ...
+  //--
+  m_tmArrival = tmArrival;  m_tmMark = std::chrono::steady_clock::now();
+  memset(m_allPhase, 0, sizeof(m_allPhase));
+  m_allPhase[QUEUE] = Elapsed(m_tmArrival, m_tmMark);
+  m_lPhasesUsed = (1UL << QUEUE);  m_nClass = NONE;
+}
+
+
+void CLatency::End()
+{
+  //++
+  //   Finish timing the current command.  Any time since the last mark is
+  // charged to the REGISTER phase, and then every phase that was actually
+  // used is recorded in the histograms for this command's class.  The class
+  // and phase times are left alone, for the flight recorder (Begin() clears
+  // them for the next command) ...
+  //--
+  Mark(REGISTER);
+  m_allPhase[TOTAL] = Elapsed(m_tmArrival, m_tmMark);
+  m_lPhasesUsed |= 1UL << TOTAL;
+  if (m_nClass == NONE) return;
+  for (uint32_t i = 0;  i < MAXPHASE;  ++i) {
+    if ((m_lPhasesUsed & (1UL << i)) != 0)
+      m_aHistograms[m_nClass][i].Record(m_allPhase[i]);
+  }
+}
+
+
+void CLatency::Reset()
+{
+  //++
+  // Reset all the histograms for this drive ...
+  //--
+  for (uint32_t i = 0;  i < MAXCLASS;  ++i)
+    for (uint32_t j = 0;  j < MAXPHASE;  ++j)
+      m_aHistograms[i][j].Reset();
+}
+
+
+/* static */ const char *CLatency::PhaseName (PHASE nPhase)
+{
+  //++
+  // Return the name of a command phase ...
+  //--
+  static const char *const apszNames[MAXPHASE] =
+    {"Queue", "Register", "Image", "Convert", "FIFO", "Total"};
+  assert(nPhase < MAXPHASE);
+  return apszNames[nPhase];
+}
+
+
+/* static */ const char *CLatency::ClassName (CLASS nClass)
+{
+  //++
+  // Return the name of a command class ...
+  //--
+  static const char *const apszNames[MAXCLASS] =
+    {"READ", "WRITE", "MOTION", "SENSE"};
+  assert(nClass < MAXCLASS);
+  return apszNames[nClass];
+}
@@ -0,0 +1,168 @@
+//++
+// Latency.hpp -> CHistogram and CLatency (command latency statistics) classes
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   CHistogram is a fixed size, log-linear histogram of time intervals in
+// nanoseconds.  Every power of two gets SUB_BUCKETS equal width buckets, so
+// the resolution is always within about 6% of the value, from nanoseconds up
+// to about a minute, in a couple of KB and with no allocation at all.  That
+// is plenty to get meaningful p99 and p99.9 numbers.
+//
+//   CLatency keeps one histogram for each phase of a command (time waiting
+// in the command ring, MASSBUS register access, image file I/O, 16/18 bit
+// data conversion and data FIFO transfer) and each class of command (read,
+// write, motion and sense).  Every drive has one.  CMBA calls Begin() with
+// the time the command was taken from the UPE FIFO and End() after the drive
+// has finished it, and the drive code calls Mark() at the end of each phase
+// to charge the time since the previous mark to that phase.  Whatever isn't
+// charged to any phase explicitly - command dispatch and MASSBUS register
+// access, mostly - ends up in the REGISTER phase.  The drive also has to tell
+// us the command class with SetClass(); commands that never get a class (e.g.
+// unimplemented ones) aren't recorded.
+//
+//   Timestamps come from std::chrono::steady_clock, which on any modern
+// Linux or Windows system is a TSC read in user mode and costs a few tens of
+// nanoseconds.  All the updating is done by the unit's worker thread while
+// it's executing the command, and CMBA::LockUnit() pauses the worker, so the
+// UI must lock the unit to look at or reset the histograms.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
+
+
+class CHistogram {
+  //++
+  // Log-linear histogram of nanosecond intervals ...
+  //--
+
+  // Histogram geometry ...
+public:
+  enum {
+    SUB_BITS    = 4,                    // log2(buckets per power of two)
+    SUB_BUCKETS = 1 << SUB_BITS,        // linear buckets per power of two
+    MAX_BITS    = 36,                   // largest interval is 2^36ns (~68s)
+    BUCKETS     = (MAX_BITS-SUB_BITS+1) * SUB_BUCKETS
+  };
+
+  // Constructor ...
+public:
+  CHistogram() {Reset();}
+  virtual ~CHistogram() {};
+
+  // Public histogram methods ...
+public:
+  // Clear all buckets ...
+  void Reset();
+  // Record one interval ...
+  void Record (uint64_t llNanoseconds) {
+    ++m_alBuckets[Bucket(llNanoseconds)];  ++m_llCount;  m_llSum += llNanoseconds;
+    if (llNanoseconds > m_llMax) m_llMax = llNanoseconds;
+  }
+  // Return the number of samples, average and maximum ...
+  uint64_t GetCount() const {return m_llCount;}
+  uint64_t GetMean() const {return (m_llCount > 0) ? (m_llSum / m_llCount) : 0;}
+  uint64_t GetMax() const {return m_llMax;}
+  // Return the value at or below which dPercent of the samples fall ...
+  uint64_t GetPercentile (double dPercent) const;
+
+  // Private methods ...
+private:
+  // Convert an interval to a bucket index, and a bucket to its upper limit ...
+  static uint32_t Bucket (uint64_t llValue);
+  static uint64_t UpperLimit (uint32_t nBucket);
+
+  // Private member data ...
+private:
+  uint32_t m_alBuckets[BUCKETS];        // sample counts for each bucket
+  uint64_t m_llCount;                   // total number of samples
+  uint64_t m_llSum;                     // sum of all samples (for the mean)
+  uint64_t m_llMax;                     // largest sample
+};
+
+
+class CLatency {
+  //++
+  // Per phase and per command class latency histograms for one drive ...
+  //--
+
+  // Command phases and classes ...
+public:
+  enum PHASE {
+    QUEUE,                      // waiting in the command ring
+    REGISTER,                   // dispatch and MASSBUS register access
+    IMAGE,                      // image file I/O
+    CONVERT,                    // 16/18 bit data conversion
+    FIFO,                       // data FIFO transfer
+    TOTAL,                      // the whole thing, start to finish
+    MAXPHASE
+  };
+  enum CLASS {
+    READ,                       // read data (disk or tape)
+    WRITE,                      // write data
+    MOTION,                     // tape motion (space, rewind, etc)
+    SENSE,                      // tape sense and extended sense
+    MAXCLASS,
+    NONE = MAXCLASS             // not (yet) classified
+  };
+  typedef std::chrono::steady_clock::time_point TIMESTAMP;
+
+  // Constructor ...
+public:
+  CLatency() : m_nClass(NONE) {};
+  virtual ~CLatency() {};
+
+  // Public methods ...
+public:
+  // Start and finish timing a command ...
+  void Begin (TIMESTAMP tmArrival);
+  void End();
+  // Set the class of the current command ...
+  void SetClass (CLASS nClass) {m_nClass = nClass;}
+  //   Return the class and the phase times (in nanoseconds) of the current
+  // command or, after End(), of the last one ...
+  CLASS GetClass() const {return m_nClass;}
+  uint64_t GetPhase (PHASE nPhase) const {return m_allPhase[nPhase];}
+  // Charge the time since the last mark to the specified phase ...
+  void Mark (PHASE nPhase) {
+    TIMESTAMP tmNow = std::chrono::steady_clock::now();
+    m_allPhase[nPhase] += Elapsed(m_tmMark, tmNow);
+    m_tmMark = tmNow;  m_lPhasesUsed |= 1UL << nPhase;
+  }
+  // Return a histogram, and reset all of them ...
+  const CHistogram &GetHistogram (CLASS nClass, PHASE nPhase) const
+    {return m_aHistograms[nClass][nPhase];}
+  void Reset();
+  // Return the name of a phase or class for messages ...
+  static const char *PhaseName (PHASE nPhase);
+  static const char *ClassName (CLASS nClass);
+
+  // Private methods ...
+private:
+  static uint64_t Elapsed (TIMESTAMP tmStart, TIMESTAMP tmEnd)
+    {return std::chrono::duration_cast<std::chrono::nanoseconds>(tmEnd - tmStart).count();}
+
+  // Private member data ...
+private:
+  CHistogram m_aHistograms[MAXCLASS][MAXPHASE]; // all the histograms
+  CLASS      m_nClass;                          // class of the current command
+  TIMESTAMP  m_tmArrival;                       // time the command arrived
+  TIMESTAMP  m_tmMark;                          // time of the last Mark()
+  uint64_t   m_allPhase[MAXPHASE];              // time charged to each phase
+  uint32_t   m_lPhasesUsed;                     // bitmap of phases Mark()ed
+};
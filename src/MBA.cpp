@@ -27,7 +27,20 @@
 // the CommandLoop() method which endlessly reads and executes MASSBUS commands
 // from the FPGA/UPE. It's not thread safe for the background code or the UI to
 // directly call any method that modifies this object - instead, the UI needs
-// to use the LockUI() and UnlockUI() methods to guarantee exclusive access.
+// to use the LockUnit() and UnlockUnit() methods (or LockUI() and UnlockUI()
+// for the whole bus) to guarantee exclusive access.
+//
+//   The channel thread doesn't actually execute the commands any more - it
+// just hands each one to the CDriveWorker for its unit, and that worker's
+// thread calls our DoCommand().  LockUnit() pauses the unit's worker, so the
+// UI still never sees a command in progress, but only that one unit waits
+// for the UI.  See DriveWorker.hpp ...
+//
+//   The channel thread never takes any UI lock - it finds the units and their
+// workers through m_apUnits[] and m_apWorkers[], which are atomic pointers
+// protected by m_Epoch.  The UI publishes a new unit by storing the pointer,
+// and removes one by clearing the pointer and then waiting for the channel
+// thread to be done with the old one.  See Epoch.hpp ...
 //
 // Bob Armstrong <bob@jfcl.com>   [1-OCT-2013]
 //
@@ -42,6 +55,7 @@
 #include <vector>               // C++ std::vector template
 #include <unordered_set>        // C++ std::unordered_set (a simple list) template
 #include <unordered_map>        // C++ std::unordered_map (aka hash table) template
+#include <thread>               // C++ std::this_thread::sleep_for()
 #include <iostream>             // C++ style output for ERRORS() and DEBUGS() ...
 #include <sstream>              // ostringstream, et al, for LOGS() ...
 #include "Mutex.hpp"            // CMutex critical section lock
@@ -58,11 +72,16 @@
 #include "DiskDrive.hpp"        // disk specific emulation
 #include "TapeDrive.hpp"        // tape specific emulation
 #include "MBA.hpp"              // declarations for this module
+#include "DriveWorker.hpp"      // per unit command worker threads
+#include "RealTime.hpp"         // real time scheduling policy
+#include "TraceLog.hpp"         // deferred TRACE message logging
 
 
 
 CMBA::CMBA (char chBus, CDECUPE &upe)
-  : m_chBus(chBus), m_UPE(upe), m_ChannelThread(&CMBA::CommandLoop)
+  : m_chBus(chBus), m_UPE(upe), m_fWorkers(true),
+    m_ChannelThread(&CMBA::CommandLoop), m_cBatches(0), m_nLargestBatch(0),
+    m_tmLastSample(std::chrono::steady_clock::now()), m_nRealTimeGen(0)
 {
   //++
   //   The constructor simply initializes an empty collection of drives.
@@ -70,7 +89,9 @@ CMBA::CMBA (char chBus, CDECUPE &upe)
   // associated with this MASSBUS - since each FPGA is connected to exactly
   // one bus, all drives in this collection share the same UPE.
   //--
-  for (uint8_t i = 0;  i < MAXUNIT;  ++i)  m_apUnits[i] = NULL;
+  for (uint8_t i = 0;  i < MAXUNIT;  ++i) {
+    m_apUnits[i] = NULL;  m_apWorkers[i] = NULL;  m_anPauseDepth[i] = 0;
+  }
   string sName = string("MASSBUS ") + string(1, GetName());
   m_ChannelThread.SetName(sName.c_str());
   m_ChannelThread.SetParameter(this);
@@ -80,11 +101,15 @@ CMBA::CMBA (char chBus, CDECUPE &upe)
 CMBA::~CMBA()
 {
   //++
-  // The destructor deletes all the attached units, if any ...
+  //   The destructor deletes all the attached units, if any.  The workers
+  // have to go first, since they might still be using the units ...
   //--
   m_ChannelThread.WaitExit();
   for (uint8_t i = 0;  i < MAXUNIT;  ++i)
-    if (UnitExists(i)) delete m_apUnits[i];
+    if (m_apWorkers[i] != NULL) delete m_apWorkers[i].load();
+  for (uint8_t i = 0;  i < MAXUNIT;  ++i)
+    if (UnitExists(i)) delete m_apUnits[i].load();
+  if (m_RealTime.IsLock()) CRealTime::UnlockMemory();
 }
 
 
@@ -95,9 +120,22 @@ CBaseDrive &CMBA::AddUnit (uint8_t nUnit, CBaseDrive &Unit)
   // that once added the drive becomes the "property" of this collection - 
   // it'll be deleted by the RemoveDrive() method.  The caller isn't expected
   // to explicitly delete it.
+  //
+  //   We also create and start the worker thread for the new unit here.  If
+  // that fails then the unit still works - the channel thread just executes
+  // its commands itself, the same as with SET UPE/NOWORKERS.  The worker is
+  // completely set up before it's published, and it starts out paused if
+  // the UI has this unit locked right now (it usually does!).  If this bus
+  // has memory locked, then the new unit's buffers are brought in now.
   //--
   assert(!UnitExists(nUnit) && IsCompatible(Unit));
-  m_apUnits[nUnit] = &Unit;  SetDriveMap();
+  if (GetRealTime().IsLock()) Unit.Prefault();
+  CDriveWorker *pWorker = new CDriveWorker(*this, Unit, m_anPauseDepth[nUnit]);
+  if (!pWorker->Begin()) {
+    LOGS(ERROR, "unit " << Unit << " unable to start worker thread");
+    delete pWorker;  pWorker = NULL;
+  }
+  m_apUnits[nUnit] = &Unit;  m_apWorkers[nUnit] = pWorker;  SetDriveMap();
   LOGS(DEBUG, Unit.GetType() << " unit " << nUnit << " connected to MASSBUS " << GetName());
   return Unit;
 }
@@ -119,10 +157,18 @@ CBaseDrive &CMBA::AddUnit (uint8_t nUnit, uint8_t nIDT)
 void CMBA::RemoveUnit (uint8_t nUnit)
 {
   //++
-  // Remove a drive from this collection and delete the CBaseDrive object!
+  //   Remove a drive from this collection and delete the CBaseDrive object!
+  // The pointers are cleared first, and then we wait for the channel thread
+  // to finish with the old ones before deleting anything.  The worker is
+  // stopped first, and anything the channel thread gives it after that is
+  // just thrown away ...
   //--
   assert(UnitExists(nUnit));
-  delete m_apUnits[nUnit];  m_apUnits[nUnit] = NULL;  SetDriveMap();
+  CBaseDrive *pUnit = m_apUnits[nUnit];  CDriveWorker *pWorker = m_apWorkers[nUnit];
+  m_apWorkers[nUnit] = NULL;  m_apUnits[nUnit] = NULL;  SetDriveMap();
+  if (pWorker != NULL) pWorker->End();
+  m_Epoch.Synchronize();
+  delete pWorker;  delete pUnit;
   LOGS(DEBUG, "unit " << nUnit << " disconnected from MASSBUS " << GetName());
 }
 
@@ -146,7 +192,7 @@ uint8_t CMBA::FindUnit (const string &strAlias) const
   //--
   for (uint8_t i = 0;  i < MAXUNIT;  ++i) {
     if (!UnitExists(i)) continue;
-    if (strAlias == m_apUnits[i]->GetAlias()) return i;
+    if (strAlias == Unit(i)->GetAlias()) return i;
   }
   return MAXUNIT;
 }
@@ -187,7 +233,7 @@ uint32_t CMBA::UnitsOnline() const
   //--
   uint32_t nCount = 0;
   for (uint8_t i = 0;  i < MAXUNIT;  ++i)
-    if (UnitExists(i)  &&  m_apUnits[i]->IsOnline())  ++nCount;
+    if (UnitExists(i)  &&  Unit(i)->IsOnline())  ++nCount;
   return nCount;
 }
 
@@ -220,7 +266,7 @@ bool CMBA::IsCompatible (uint8_t nIDT) const
 }
 
 
-void CMBA::DoCommand (uint32_t lCommand)
+void CMBA::DoCommand (const QUEUED_COMMAND &qc)
 {
   //++
   //   This method is called when we find a word in the MASSBUS command silo.
@@ -233,18 +279,329 @@ void CMBA::DoCommand (uint32_t lCommand)
   // address of the MASSBUS register, which tells us which unit is selected.
   // We don't have to worry about that here, but that's why we pass along all
   // 32 bits from the command silo to the device's DoCommand() method.
+  //
+  //   The drive's latency statistics are started here, using the time the
+  // command was read from the FIFO, and finished after it's done.
+  //
+  //   This version is used only when the channel thread executes a command
+  // itself, and the caller must have the unit locked (see Dispatch()).
   //--
+  uint32_t lCommand = qc.lCommand;
   assert(CDECUPE::IsCommandValid(lCommand));
   uint8_t nUnit = CDECUPE::ExtractUnit(lCommand);
-  if (!UnitExists(nUnit)) {
+  CBaseDrive *pUnit = m_apUnits[nUnit];
+  if (pUnit == NULL) {
     LOGF(WARNING, "received command (0x%08X) for non-existent unit %d", lCommand, nUnit);
+    m_History.Record(lCommand, nUnit, qc.tmArrival, CFlightRecorder::NOUNIT);
+    m_UPE.CommandDone();
+  } else {
+    DoCommand(*pUnit, qc);
+  }
+}
+
+
+void CMBA::DoCommand (CBaseDrive &Unit, const QUEUED_COMMAND &qc)
+{
+  //++
+  //   Execute one command for a specific unit.  This is normally called by
+  // the unit's worker thread, so commands for different units can be
+  // executing at the same time.  The MASSBUS and the UPE data FIFO can only
+  // handle one transfer at a time though, so if the drive says this command
+  // needs it we hold the UPE transfer lock for the whole command.  Disks say
+  // no, and lock just the FIFO part themselves (see CDiskDrive::DoRead() and
+  // DoWrite()) so that their image I/O doesn't hold up other units.
+  //
+  //   Every command is also recorded in the flight recorder, and if the unit
+  // was online before the command and isn't afterwards (e.g. the "offline:"
+  // paths in CDiskDrive::DoRead() and DoWrite()) then the last few commands
+  // are logged, so there's some record of what led up to it.
+  //
+  //   Lastly, the UPE is told that the command is finished.  That has to be
+  // done here and not when the channel thread goes back for the next command,
+  // because with the unit workers that can happen long before this is done.
+  //--
+  uint32_t lCommand = qc.lCommand;
   //   Note that tape drives accept many commands (e.g. READ SENSE, formatter
   // clear, etc) even while the unit is offline.  That's because the formatter
   // is online, even if the specific slave is not.
-  } else if (!IsTape() && !m_apUnits[nUnit]->IsOnline()) {
-    LOGF(WARNING, "received command (0x%08X) for offline unit %d", lCommand, nUnit);
-  } else
-    m_apUnits[nUnit]->DoCommand(lCommand);
+  bool fOnline = Unit.IsOnline();
+  if (!IsTape() && !fOnline) {
+    LOGF(WARNING, "received command (0x%08X) for offline unit %d", lCommand, Unit.GetUnit());
+    m_History.Record(lCommand, Unit.GetUnit(), qc.tmArrival, CFlightRecorder::OFFLINE);
+    m_UPE.CommandDone();  return;
+  }
+  uint64_t llNumber = m_History.Start(lCommand, Unit.GetUnit(), qc.tmArrival);
+  Unit.SetCommandLBA(CFlightRecorder::NO_LBA);
+  bool fTransfer = Unit.IsTransfer(lCommand);
+  if (fTransfer) m_UPE.LockTransfer();
+  Unit.GetLatency().Begin(qc.tmArrival);
+  Unit.DoCommand(lCommand);
+  Unit.GetLatency().End();
+  if (fTransfer) m_UPE.UnlockTransfer();
+  bool fFailed = fOnline && !Unit.IsOnline();
+  m_History.Finish(llNumber, fFailed ? CFlightRecorder::FAILED : CFlightRecorder::DONE,
+    Unit.GetLatency(), Unit.GetCommandLBA());
+  if (fFailed) {
+    LOGS(ERROR, "unit " << Unit << " went offline - recent commands on MASSBUS " << GetName() << " follow");
+    LogHistory();
+  }
+  m_UPE.CommandDone();
+}
+
+
+void CMBA::LogHistory (uint32_t nCount) const
+{
+  //++
+  //   Log the last nCount commands from the flight recorder, oldest first.
+  // This is called by the unit's worker (or the channel thread) right after
+  // the command that failed, so the failed command is the last one for that
+  // unit - there may be newer commands for other units though ...
+  //--
+  CFlightRecorder::ENTRY aEntries[CFlightRecorder::HISTORY_SIZE];
+  char szBuffer[CLog::MAXMSG];
+  if (nCount > CFlightRecorder::HISTORY_SIZE) nCount = CFlightRecorder::HISTORY_SIZE;
+  size_t nEntries = m_History.Snapshot(aEntries, nCount);
+  uint64_t llNow = CFlightRecorder::Now();
+  LOGF(ERROR, "%s", CFlightRecorder::Heading());
+  for (size_t i = 0;  i < nEntries;  ++i) {
+    CFlightRecorder::Format(aEntries[i], IsTape(), llNow, szBuffer, sizeof(szBuffer));
+    LOGF(ERROR, "%s", szBuffer);
+  }
+}
+
+
+uint32_t CMBA::DrainCommands (uint32_t lFirst)
+{
+  //++
+  //   This routine adds the command lFirst (which came from WaitCommand()) to
+  // the command ring, and then moves every other command that's currently in
+  // the UPE FIFO to the ring as well.  When the host is busy (e.g. TOPS-20
+  // paging to several units at once) commands queue up back to back and it's
+  // a lot cheaper to pick them all up at once.  It returns the number of
+  // commands added to the ring.
+  //
+  //   Note that if the ring fills up then we just stop - anything left in the
+  // FIFO will still be there the next time around.
+  //--
+  QUEUED_COMMAND qc;  uint32_t nCount = 0;
+  for (qc.lCommand = lFirst;  CDECUPE::IsCommandValid(qc.lCommand);  qc.lCommand = m_UPE.ReadCommand()) {
+    qc.tmArrival = std::chrono::steady_clock::now();
+    if (!m_CommandRing.Put(qc)) {
+      LOGF(WARNING, "command ring overflow on MASSBUS %c", GetName());
+      m_UPE.CommandDone();  break;
+    }
+    if (++nCount >= COMMAND_RING_SIZE) break;
+  }
+  return nCount;
+}
+
+
+void CMBA::Dispatch (const QUEUED_COMMAND &qc)
+{
+  //++
+  //   Give a command to the worker for its unit, and the worker will execute
+  // it as soon as it's done with anything ahead of it.  If the workers are
+  // disabled, or this unit doesn't have one, then just execute the command
+  // right here in the channel thread the old fashioned way.  Note that even
+  // when the workers are disabled, we still have to use the worker if it has
+  // anything left in its queue - otherwise this command could pass them!
+  //
+  //   No lock is needed to find the worker - m_Epoch keeps it from being
+  // deleted while we're using it.  But we must never wait while we're inside
+  // the epoch, so if the worker's queue is full (the UI might have the unit
+  // locked) we leave, sleep a bit, and try again.  Executing a command here
+  // does need the unit lock, and we take that only after leaving the epoch.
+  //--
+  uint8_t nUnit = CDECUPE::ExtractUnit(qc.lCommand);
+  for (;;) {
+    m_Epoch.Enter();
+    CDriveWorker *pWorker = m_apWorkers[nUnit];
+    if ((pWorker == NULL)  ||  (!m_fWorkers && pWorker->IsIdle())) break;
+    bool fQueued = pWorker->Put(qc);
+    m_Epoch.Leave();
+    if (fQueued) return;
+    std::this_thread::sleep_for(std::chrono::milliseconds(DISPATCH_RETRY));
+  }
+  m_Epoch.Leave();
+  m_aUnitLock[nUnit].lock();
+  DoCommand(qc);
+  m_aUnitLock[nUnit].unlock();
+}
+
+
+void CMBA::SetRealTime (const CRealTime &policy)
+{
+  //++
+  //   Change the real time scheduling policy for this MASSBUS.  A thread can
+  // only change its own scheduling, so all we do here is remember the policy
+  // and bump the generation - the channel thread and the workers notice that
+  // and apply it to themselves (see ApplyRealTime()).  Memory locking is the
+  // exception; that's process wide and we can do it right here.  If memory
+  // is locked then the caller should have the UI lock, since we prefault the
+  // unit buffers too ...
+  //--
+  {
+    std::lock_guard<std::mutex> lock(m_mtxRealTime);
+    if (policy.IsLock() && !m_RealTime.IsLock())
+      CRealTime::LockMemory();
+    else if (!policy.IsLock() && m_RealTime.IsLock())
+      CRealTime::UnlockMemory();
+    m_RealTime = policy;  ++m_nRealTimeGen;
+  }
+  LOGS(DEBUG, "MASSBUS " << GetName() << " policy set to " << policy.GetName());
+  if (!policy.IsLock()) return;
+  for (uint8_t i = 0;  i < MAXUNIT;  ++i)
+    if (UnitExists(i)) Unit(i)->Prefault();
+}
+
+
+CRealTime CMBA::GetRealTime() const
+{
+  //++
+  // Return a copy of the current real time policy ...
+  //--
+  std::lock_guard<std::mutex> lock(m_mtxRealTime);
+  return m_RealTime;
+}
+
+
+void CMBA::ApplyRealTime (uint32_t &nGeneration, bool fWorker)
+{
+  //++
+  //   If the policy has changed since the caller last applied it, then apply
+  // the new one to the calling thread and remember what it actually got.  The
+  // workers get one more SCHED_FIFO priority level than the channel thread,
+  // so a worker with a transfer to do isn't stuck behind the channel thread
+  // polling the FIFO on the same CPU.  This costs one atomic load when there's
+  // nothing to do, so it's cheap enough to call for every command.
+  //--
+  uint32_t nCurrent = m_nRealTimeGen;
+  if (nCurrent == nGeneration) return;
+  CRealTime policy = GetRealTime();
+  string strEffective = policy.Apply(fWorker ? 1 : 0);
+  std::lock_guard<std::mutex> lock(m_mtxRealTime);
+  if (fWorker) m_strWorkerPolicy = strEffective;  else m_strChannelPolicy = strEffective;
+  nGeneration = nCurrent;
+}
+
+
+string CMBA::GetChannelPolicy() const
+{
+  //++
+  // Return the policy the channel thread actually got ...
+  //--
+  std::lock_guard<std::mutex> lock(m_mtxRealTime);
+  return m_strChannelPolicy;
+}
+
+
+string CMBA::GetWorkerPolicy() const
+{
+  //++
+  // Return the policy the last worker to apply one actually got ...
+  //--
+  std::lock_guard<std::mutex> lock(m_mtxRealTime);
+  return m_strWorkerPolicy;
+}
+
+
+void CMBA::LockUnit (uint8_t nUnit)
+{
+  //++
+  //   Acquire the UI lock for one unit and pause its worker.  Pause() waits
+  // for the current command (if any) to finish, so once we return nothing is
+  // executing on this unit and nothing will until UnlockUnit().  Commands
+  // that arrive meanwhile just wait in the worker's queue, and the other
+  // units aren't affected at all.  Note that the lock is recursive, so we
+  // count the pauses too - AddUnit() needs to know.  The unit doesn't even
+  // have to exist - CONNECT locks the unit number before there's a unit.
+  //--
+  assert(nUnit < MAXUNIT);
+  m_aUnitLock[nUnit].lock();  ++m_anPauseDepth[nUnit];
+  CDriveWorker *pWorker = m_apWorkers[nUnit];
+  if (pWorker != NULL) pWorker->Pause();
+}
+
+
+void CMBA::UnlockUnit (uint8_t nUnit)
+{
+  //++
+  //   Resume the unit's worker and release the lock.  Note that the worker
+  // may not be the same one we paused (or there may not be one at all), if
+  // the unit was connected or disconnected meanwhile ...
+  //--
+  assert((nUnit < MAXUNIT) && (m_anPauseDepth[nUnit] > 0));
+  CDriveWorker *pWorker = m_apWorkers[nUnit];
+  if (pWorker != NULL) pWorker->Resume();
+  --m_anPauseDepth[nUnit];  m_aUnitLock[nUnit].unlock();
+}
+
+
+void CMBA::LockUI()
+{
+  //++
+  //   Acquire the UI lock for the whole bus, and then lock every unit.  Once
+  // we return nothing is executing on this MASSBUS and nothing will until
+  // UnlockUI().  The units are always locked in the same order, so this
+  // can't deadlock with another LockUI() or with LockUnit().
+  //--
+  m_UIlock.Enter();
+  for (uint8_t i = 0;  i < MAXUNIT;  ++i)  LockUnit(i);
+}
+
+
+void CMBA::UnlockUI()
+{
+  //++
+  // Unlock all the units (in reverse order) and release the UI lock ...
+  //--
+  for (uint8_t i = MAXUNIT;  i > 0;  --i)  UnlockUnit(i-1);
+  m_UIlock.Leave();
+}
+
+
+void CMBA::SampleStatistics()
+{
+  //++
+  //   If at least SAMPLE_INTERVAL milliseconds have passed since the last
+  // time, sample the UPE counters and update the UPE and drive rates.  This
+  // is called only by the channel thread, either between command batches or
+  // after WaitCommand() times out, and so it's guaranteed to happen at least
+  // once a second or so even when the bus is idle.  The counters only need
+  // the epoch to keep the unit from being deleted while we're looking at it.
+  //
+  //   The drive's Periodic() housekeeping needs the unit lock, so that the UI
+  // isn't changing the unit at the same time.  But the channel thread must
+  // never wait for the UI, so if the unit is locked we just skip it this time
+  // around.  Note that this does NOT pause the unit workers - a unit that's
+  // stuck in its image I/O would stall the whole channel again if it did.
+  // That means Periodic() can run while the unit is executing a command, and
+  // has to lock whatever it touches.  Anything slow, like flushing the image
+  // file, is handed to the unit's worker to do in Housekeeping().  Only if
+  // the unit has no worker (and so the channel thread executes its commands
+  // anyway) do we do that here.
+  //--
+  TIMESTAMP tmNow = std::chrono::steady_clock::now();
+  double dSeconds = std::chrono::duration<double>(tmNow - m_tmLastSample).count();
+  if (dSeconds < (SAMPLE_INTERVAL / 1000.0)) return;
+  m_tmLastSample = tmNow;
+  m_UPE.SampleCounters(dSeconds);
+  for (uint8_t i = 0;  i < MAXUNIT;  ++i) {
+    m_Epoch.Enter();
+    CBaseDrive *pUnit = m_apUnits[i];
+    if (pUnit != NULL) pUnit->SampleCounters(dSeconds);
+    m_Epoch.Leave();
+    if (!m_aUnitLock[i].try_lock()) continue;
+    pUnit = m_apUnits[i];
+    if ((pUnit != NULL) && pUnit->Periodic(dSeconds)) {
+      CDriveWorker *pWorker = m_apWorkers[i];
+      if (pWorker != NULL)
+        pWorker->Housekeep();
+      else
+        pUnit->Housekeeping();
+    }
+    m_aUnitLock[i].unlock();
+  }
 }
 
 
@@ -257,17 +614,30 @@ void* THREAD_ATTRIBUTES CMBA::CommandLoop (void *pParam)
   // BeginThread() method and terminated by the ExitThread() method. The latter
   // works by setting the m_fExitLoop flag to true and then waiting for this
   // procedure to exit.
+  //
+  //   Each time WaitCommand() returns a command, we drain anything else that's
+  // waiting in the FIFO into the command ring and then dispatch the whole batch
+  // to the unit workers.  Note that this thread never waits for the UI, unless
+  // the workers are disabled (see Dispatch()).  A new real time policy gets
+  // applied the next time around, which is at most a second or so later.
   //--
   CThread *pThread = (CThread *) pParam;
   CMBA *pMBA = (CMBA *) pThread->GetParameter();
+  uint32_t nGeneration = 0;
   LOGS(DEBUG, "thread for " << pThread->GetName() << " is running");
   while (!pThread->IsExitRequested()) {
+    pMBA->ApplyRealTime(nGeneration, false);
     uint32_t cmd = pMBA->m_UPE.WaitCommand();
     if (cmd == CDECUPE::ERROR) break;
+    pMBA->SampleStatistics();
     if (cmd == CDECUPE::TIMEOUT) continue;
-    pMBA->m_UIlock.Enter();
-    pMBA->DoCommand(cmd);
-    pMBA->m_UIlock.Leave();
+    uint32_t nBatch = pMBA->DrainCommands(cmd);
+    if (nBatch > 1)
+      TRACEF("%d commands batched on MASSBUS %c", nBatch, pMBA->GetName());
+    ++pMBA->m_cBatches;
+    if (nBatch > pMBA->m_nLargestBatch) pMBA->m_nLargestBatch = nBatch;
+    QUEUED_COMMAND qc;
+    while (pMBA->m_CommandRing.Get(qc))  pMBA->Dispatch(qc);
   }
   LOGS(DEBUG, "thread for " << pThread->GetName() << " terminated");
   return pThread->End();
@@ -364,12 +734,13 @@ uint32_t CMBAs::UnitsOnline() const
 }
 
 
-bool CMBAs::Create(char chBus, CDECUPE *pUPE, CMBA *&pMBA)
+bool CMBAs::Create(char chBus, CDECUPE *pUPE, const CRealTime &policy, CMBA *&pMBA)
 {
   //++
   //   This method will create a new MASSBUS (CMBA) object, connect it to the
   // UPE specified, add it to this collection, and then start the background
-  // service thread running.
+  // service thread running.  The real time policy is set before the thread
+  // starts, so the thread applies it before it reads the first command.
   //--
   if ((pMBA = FindBus(chBus)) != NULL) {
     LOGS(ERROR, "MASSBUS " << chBus << " is already in use");  return false;
@@ -377,6 +748,7 @@ bool CMBAs::Create(char chBus, CDECUPE *pUPE, CMBA *&pMBA)
 
   // Create the CMBA object and add it to the collection ...
   pMBA = new CMBA(chBus, *pUPE);  Add(*pMBA);
+  if (!policy.IsDefault()) pMBA->SetRealTime(policy);
 
   // Start the background service thread and we're done ...
   if (!pMBA->BeginThread()) return false;
@@ -35,10 +35,18 @@
 #include <iostream>             // C++ style output for LOGS() ...
 using std::string;              // ...
 using std::ostream;             // ...
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
+#include <atomic>               // C++ std::atomic template
+#include <mutex>                // C++ std::recursive_mutex
 class CDECUPE;                  // we need forward pointers for this class
 class CBaseDrive;               //   ... and this one ....
+class CDriveWorker;             //   ... and this one too ...
 #include "Mutex.hpp"            // we need the delaration for the CMutex class
 #include "Thread.hpp"           //   ... and the CThread class ...
+#include "RingBuffer.hpp"       //   ... and the CRingBuffer template ...
+#include "Epoch.hpp"            //   ... and the CEpoch class ...
+#include "RealTime.hpp"         //   ... and the CRealTime class ...
+#include "FlightRecorder.hpp"   //   ... and the CFlightRecorder class ...
 
 
 // CMBA class definition ...
@@ -71,11 +79,33 @@ class CMBA {
   //    }
   //
   //  Not as cool as an iterator, but it gets the job done.
+  //
+  //   Only the UI ever changes m_apUnits[] or m_apWorkers[], and it always
+  // does that with the unit locked (see LockUnit()).  The MASSBUS threads
+  // read them without any lock at all - the pointers are atomic, and the
+  // reads are protected by m_Epoch, so a unit or a worker is never deleted
+  // while the channel thread might still be using it.
   //--
 
   // The maximum number of drives that can be attached to a MASSBUS ...
 public:
   static const size_t MAXUNIT = 8;
+  // The maximum number of commands that we'll handle in one batch ...
+  static const uint32_t COMMAND_RING_SIZE = 64;
+  // How often the statistics counters are sampled (in milliseconds) ...
+  static const uint32_t SAMPLE_INTERVAL = 1000;
+  // How long to wait before retrying a full worker queue (in milliseconds) ...
+  static const uint32_t DISPATCH_RETRY = 1;
+
+  //   Every command we pop from the UPE FIFO goes into the command ring along
+  // with the time it arrived.  The channel thread then executes the whole
+  // batch with a single acquisition of the UI lock ...
+public:
+  typedef std::chrono::steady_clock::time_point TIMESTAMP;
+  struct QUEUED_COMMAND {
+    uint32_t  lCommand;           // command longword from the UPE FIFO
+    TIMESTAMP tmArrival;          // time that we read it from the FIFO
+  };
 
   // Public MBA properties ...
 public:
@@ -108,13 +138,49 @@ public:
   // Map the units connected ...
   void SetDriveMap() const;
   // Execute a MASSBUS command from the FPGA ...
-  void DoCommand(uint32_t lCommand);
+  void DoCommand(const QUEUED_COMMAND &qc);
+  //   Execute a command for a specific unit (called by the unit's worker,
+  // which already knows which unit it belongs to) ...
+  void DoCommand(CBaseDrive &Unit, const QUEUED_COMMAND &qc);
+  // Enable or disable the per unit worker threads ...
+  void SetWorkers(bool fWorkers) {m_fWorkers = fWorkers;}
+  bool IsWorkers() const {return m_fWorkers;}
+  // Return the worker for a unit (NULL if the unit doesn't exist) ...
+  const CDriveWorker *GetWorker(uint8_t n) const
+    {assert(n < MAXUNIT);  return m_apWorkers[n].load();}
+  // Return statistics on command batching ...
+  uint64_t GetBatchCount() const {return m_cBatches;}
+  uint32_t GetLargestBatch() const {return m_nLargestBatch;}
+  // Sample the UPE and drive statistics counters, if it's time ...
+  void SampleStatistics();
   // Start or stop the background thread for this MBA ...
   bool BeginThread() {return m_ChannelThread.Begin();}
   void ExitThread() {m_ChannelThread.WaitExit();}
-  // Set or release the UI lock on this MBA ...
-  void LockUI() {m_UIlock.Enter();}
-  void UnlockUI() {m_UIlock.Leave();}
+  //   Set or return the real time scheduling policy for this MASSBUS.  The
+  // threads pick up a new policy the next time around their loops ...
+  void SetRealTime (const CRealTime &policy);
+  CRealTime GetRealTime() const;
+  //   Apply the current policy to the calling thread, if it has changed since
+  // generation nGeneration (which is then updated).  The channel thread and
+  // the unit workers call this - see RealTime.hpp ...
+  void ApplyRealTime (uint32_t &nGeneration, bool fWorker);
+  //   Return the policy the channel thread and the workers actually got, the
+  // last time they applied one ...
+  string GetChannelPolicy() const;
+  string GetWorkerPolicy() const;
+  //   Return the flight recorder for this MASSBUS, and log the last nCount
+  // commands in it (see FlightRecorder.hpp) ...
+  const CFlightRecorder &GetHistory() const {return m_History;}
+  void LogHistory (uint32_t nCount=CFlightRecorder::DUMP_COUNT) const;
+  //   Set or release the UI lock on one unit.  This pauses the worker for
+  // that unit, so no command for it is executing while the UI has the lock,
+  // but the other units keep right on going ...
+  void LockUnit(uint8_t nUnit);
+  void UnlockUnit(uint8_t nUnit);
+  //   Set or release the UI lock on this whole MBA.  This locks every unit,
+  // so use it only for things that really affect the whole bus ...
+  void LockUI();
+  void UnlockUI();
 
   // Public MBA methods to access individual units ...
 public:
@@ -123,14 +189,14 @@ public:
     {return (n < MAXUNIT) ? (m_apUnits[n] != NULL) : false;}
   // Return a pointer to a particular unit or NULL if it's disconnected.
   CBaseDrive *Unit(uint8_t n)
-    {assert(n < MAXUNIT);  return m_apUnits[n];}
+    {assert(n < MAXUNIT);  return m_apUnits[n].load();}
   const CBaseDrive *Unit(uint8_t n) const
-    {assert(n < MAXUNIT);  return m_apUnits[n];}
+    {assert(n < MAXUNIT);  return m_apUnits[n].load();}
   // Return a reference to a particular unit and fail if it's not connected.
   CBaseDrive& operator[] (uint8_t n)
-    {assert((n < MAXUNIT) && (m_apUnits[n] != NULL));  return *m_apUnits[n];}
+    {assert((n < MAXUNIT) && (m_apUnits[n] != NULL));  return *m_apUnits[n].load();}
   const CBaseDrive& operator[] (uint8_t n) const
-    {assert((n < MAXUNIT) && (m_apUnits[n] != NULL));  return *m_apUnits[n];}
+    {assert((n < MAXUNIT) && (m_apUnits[n] != NULL));  return *m_apUnits[n].load();}
 
   // Search for a drive with a particular alias ...
   uint8_t FindUnit(const string &strAlias) const;
@@ -144,14 +210,33 @@ private:
 private:
   // The background task that manages this MBA ...
   static void* THREAD_ATTRIBUTES CommandLoop (void *pParam);
+  // Move commands from the UPE FIFO to the command ring ...
+  uint32_t DrainCommands (uint32_t lFirst);
+  // Hand one command to the worker for its unit, or execute it now ...
+  void Dispatch (const QUEUED_COMMAND &qc);
 
   // Local members ...
 protected:
   char         m_chBus;           // number of this MASSBUS
   CDECUPE      &m_UPE;            // UPE object associated with this bus
-  CBaseDrive  *m_apUnits[MAXUNIT];// unit data blocks for each MASSBUS unit
-  CMutex       m_UIlock;          // CRITICAL_SECTION lock for UI access
+  std::atomic<CBaseDrive *>   m_apUnits[MAXUNIT];   // unit data blocks for each MASSBUS unit
+  std::atomic<CDriveWorker *> m_apWorkers[MAXUNIT]; // command worker for each unit
+  std::atomic<bool> m_fWorkers;   // true to use the unit workers
+  CEpoch       m_Epoch;           // protects lock free m_apUnits[] readers
+  CMutex       m_UIlock;          // CRITICAL_SECTION lock for LockUI()
+  std::recursive_mutex m_aUnitLock[MAXUNIT]; // UI lock for each unit
+  uint32_t     m_anPauseDepth[MAXUNIT];   // LockUnit() calls not yet unlocked
   CThread      m_ChannelThread;   // background thread to service this channel
+  CRingBuffer<QUEUED_COMMAND, COMMAND_RING_SIZE> m_CommandRing; // commands waiting
+  uint64_t     m_cBatches;        // number of command batches executed
+  uint32_t     m_nLargestBatch;   // largest single batch so far
+  TIMESTAMP    m_tmLastSample;    // time the counters were last sampled
+  mutable std::mutex m_mtxRealTime; // protects the real time policy members
+  CRealTime    m_RealTime;        // real time policy for our threads
+  std::atomic<uint32_t> m_nRealTimeGen; // incremented by SetRealTime()
+  string       m_strChannelPolicy;// policy the channel thread actually got
+  string       m_strWorkerPolicy; // policy the last worker actually got
+  CFlightRecorder m_History;      // the last few commands on this bus
 };
 
 
@@ -203,7 +288,7 @@ public:
   CMBA &Add(char chBus, CDECUPE &upe) {return Add(*new CMBA(chBus, upe));}
   CMBA &Add(CDECUPE &upe) {return Add((char) ('A'+Count()), upe);}
   // Create a new MBA instance, add it to this collection, and start it..
-  bool Create(char chBus, CDECUPE *pUPE, CMBA *&pMBA);
+  bool Create(char chBus, CDECUPE *pUPE, const CRealTime &policy, CMBA *&pMBA);
 
   // Disallow copy and assignment operations with CMBAs objects...
 private:
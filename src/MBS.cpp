@@ -32,6 +32,12 @@
 #include <stdlib.h>             // exit(), system(), etc ...
 #include <stdint.h>	        // uint8_t, uint32_t, etc ...
 #include <assert.h>             // assert() (what else??)
+#include <signal.h>             // signal(), raise(), SIGSEGV, etc ...
+#ifdef _WIN32
+#include <io.h>                 // _write() ...
+#else
+#include <unistd.h>             // write(), STDERR_FILENO, etc ...
+#endif
 #include "UPELIB.hpp"           // UPE library definitions
 #include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
 #include "UPE.hpp"              // UPE library FPGA interface methods
@@ -50,6 +56,9 @@
 #include "TapeDrive.hpp"        // tape specific methods
 #include "MBA.hpp"              // MASSBUS drive collection class
 #include "UserInterface.hpp"    // MBS user interface parse table definitions
+#include "SectorKernels.hpp"    // SIMD sector pack/unpack kernels
+#include "TraceLog.hpp"         // deferred TRACE message logging
+#include "FlightRecorder.hpp"   // MASSBUS command history
 
 
 // Global objects ....
@@ -80,6 +89,63 @@ static bool ConfirmExit (CCmdParser &cmd)
 }
 
 
+static void WriteStderr (const char *pszBuffer, const char *pszEnd)
+{
+  //++
+  //   Write the characters from pszBuffer up to (but not including) pszEnd
+  // straight to the stderr file handle, bypassing stdio.  This is async
+  // signal safe, and it's all FatalSignal() uses for output ...
+  //--
+#ifdef _WIN32
+  _write(2, pszBuffer, (unsigned) (pszEnd - pszBuffer));
+#else
+  ssize_t cbWritten = write(STDERR_FILENO, pszBuffer, pszEnd - pszBuffer);
+  (void) cbWritten;
+#endif
+}
+
+
+static void FatalSignal (int nSignal)
+{
+  //++
+  //   This is called for a fatal signal (SIGSEGV and friends).  It dumps the
+  // flight recorder for every MASSBUS to stderr, and then lets the signal do
+  // whatever it would have done anyway.  The log file isn't safe to use here
+  // (somebody may have crashed holding its lock!) and neither is the heap or
+  // stdio, so everything is static, formatted by CFlightRecorder's async
+  // signal safe routines, and written straight to the stderr file handle.
+  // Even so, this is just a best effort - after all, we're crashing ...
+  //--
+  static CFlightRecorder::ENTRY s_aEntries[CFlightRecorder::HISTORY_SIZE];
+  static char s_szBuffer[256];
+  char *pszEnd = &s_szBuffer[sizeof(s_szBuffer)-1];
+  signal(nSignal, SIG_DFL);
+  char *psz = CFlightRecorder::PutString(s_szBuffer, pszEnd, "\n" PROGRAM ": fatal signal ");
+  psz = CFlightRecorder::PutNumber(psz, pszEnd, (uint64_t) nSignal);
+  psz = CFlightRecorder::PutString(psz, pszEnd, "\n");
+  WriteStderr(s_szBuffer, psz);
+  if (g_pMBAs != NULL) {
+    uint64_t llNow = CFlightRecorder::Now();
+    for (CMBAs::const_iterator it = g_pMBAs->begin();  it != g_pMBAs->end();  ++it) {
+      const CMBA *pMBA = *it;
+      size_t nEntries = pMBA->GetHistory().Snapshot(s_aEntries, CFlightRecorder::HISTORY_SIZE);
+      char szName[2] = {pMBA->GetName(), '\0'};
+      psz = CFlightRecorder::PutString(s_szBuffer, pszEnd, "\nCommand history for MASSBUS ");
+      psz = CFlightRecorder::PutString(psz, pszEnd, szName);
+      psz = CFlightRecorder::PutString(psz, pszEnd, "\n");
+      psz = CFlightRecorder::PutString(psz, pszEnd, CFlightRecorder::Heading());
+      psz = CFlightRecorder::PutString(psz, pszEnd, "\n");
+      WriteStderr(s_szBuffer, psz);
+      for (size_t i = 0;  i < nEntries;  ++i) {
+        psz = s_szBuffer + CFlightRecorder::Format(s_aEntries[i], pMBA->IsTape(), llNow, s_szBuffer, sizeof(s_szBuffer)-1);
+        *psz++ = '\n';  WriteStderr(s_szBuffer, psz);
+      }
+    }
+  }
+  raise(nSignal);
+}
+
+
 int main(int argc, char *argv[])
 {
   //++
@@ -114,6 +180,15 @@ int main(int argc, char *argv[])
 #endif
   CMDOUTS("UPE Library v" << UPEVER << " PLX SDK library v" << CUPE::GetSDKVersion());
 
+  //   Pick the fastest sector pack/unpack routines for this CPU.  This checks
+  // them against the plain C++ versions first, and we'd rather know about
+  // any problem now than after it has scrambled somebody's disk pack ...
+  CSectorKernels::Select();
+
+  //   Start the logger thread for TRACEF() messages.  Tracing is still
+  // disabled until somebody says SET TRACE/ENABLE ...
+  CTraceLog::Begin();
+
   // Create the UPE collection and populate it with all known FPGA/UPE boards.
   g_pUPEs = new CUPEs(NewDECUPE);
   g_pUPEs->Enumerate();
@@ -127,6 +202,14 @@ int main(int argc, char *argv[])
   // the operator issues CREATE commands ...
   g_pMBAs = new CMBAs();
 
+  //   If we crash, dump the MASSBUS command history on the way out.  There's
+  // no guarantee that works, but whatever it gets is more than we'd have ...
+  signal(SIGSEGV, FatalSignal);  signal(SIGILL, FatalSignal);
+  signal(SIGFPE, FatalSignal);   signal(SIGABRT, FatalSignal);
+#ifdef SIGBUS
+  signal(SIGBUS, FatalSignal);
+#endif
+
   //   Lastly, create the command line parser.  If a startup script was
   // specified on the command line, now is the time to execute it...
   m_pParser = new CCmdParser(PROGRAM, CUI::g_aVerbs, &ConfirmExit, m_pConsole);
@@ -146,6 +229,7 @@ shutdown:
   delete m_pParser;   // the command line parser can go away first
   delete g_pMBAs;     // spin down disks, and delete all MBAs
   delete g_pUPEs;     // disconnect all UPEs
+  CTraceLog::End();   // log any trace records that are left
   delete m_pLog;      // close the log file
   delete m_pConsole;  // lastly (always lastly!) close the console window
 #ifdef _DEBUG
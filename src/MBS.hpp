@@ -50,6 +50,18 @@
 #define LH36(x)		((uint32_t) (((x) & 0777777000000ULL) >> 18))
 #define MK36(h,l)	((uint64_t) (( (uint64_t) ((h) & 0777777ULL) << 18) | (uint64_t) ((l) & 0777777ULL)))
 
+//   CPU_PAUSE() goes in the body of any tight spin wait loop.  On x86 it's the
+// PAUSE instruction, which tells the processor that we're busy waiting so that
+// it doesn't penalize us with a memory order mis-speculation when the loop
+// finally exits (and it's kinder to the other hyperthread, too).  On anything
+// else it's just a no-op.
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>          // _mm_pause() intrinsic
+#define CPU_PAUSE()     _mm_pause()
+#else
+#define CPU_PAUSE()     ((void) 0)
+#endif
+
 //   These globals are declarated in MBS.cpp and are used more or less
 // everywhere in the MBS program ...
 //extern class CLog     *g_pLog;      // message logging object (including console!)
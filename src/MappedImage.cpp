@@ -0,0 +1,200 @@
+//++
+// MappedImage.cpp -> CMappedImage (memory mapped disk image) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CMappedImage class.  There's one version of
+// Map(), Unmap() and Sync() for Windows and another for everything else.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // strerror(), etc ...
+#include <errno.h>              // errno, ENOMEM, etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#ifdef _WIN32
+#include <windows.h>            // CreateFileMapping(), MapViewOfFile(), etc ...
+#else
+#include <fcntl.h>              // open(), O_RDWR, etc ...
+#include <unistd.h>             // close(), ftruncate(), etc ...
+#include <sys/stat.h>           // fstat() ...
+#include <sys/mman.h>           // mmap(), msync(), madvise(), etc ...
+#endif
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "MappedImage.hpp"      // declarations for this module
+
+
+CMappedImage::CMappedImage()
+  : m_pbBase(NULL), m_cbMapped(0), m_fReadOnly(false), m_fDirty(false)
+{
+  //++
+  // The constructor doesn't do anything - call Map() to get started ...
+  //--
+#ifdef _WIN32
+  m_hFile = INVALID_HANDLE_VALUE;  m_hMapping = NULL;
+#else
+  m_fd = -1;
+#endif
+}
+
+
+#ifdef _WIN32
+bool CMappedImage::Map (const string &strFileName, bool fReadOnly, uint64_t cbImage)
+{
+  //++
+  // Windows version of Map() ...
+  //--
+  assert(!IsMapped());
+  m_strFileName = strFileName;  m_fReadOnly = fReadOnly;  m_fDirty = false;
+  m_hFile = CreateFileA(strFileName.c_str(), fReadOnly ? GENERIC_READ : (GENERIC_READ|GENERIC_WRITE),
+    FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_hFile == INVALID_HANDLE_VALUE) {
+    LOGS(ERROR, "unable to open " << strFileName << " for mapping, error " << GetLastError());
+    return false;
+  }
+  LARGE_INTEGER liSize;
+  if (!GetFileSizeEx(m_hFile, &liSize)) goto failed;
+  m_cbMapped = cbImage;
+  if (fReadOnly && ((uint64_t) liSize.QuadPart < cbImage)) m_cbMapped = liSize.QuadPart;
+  if (m_cbMapped == 0) {
+    LOGS(ERROR, "unable to map empty file " << strFileName);
+    Unmap();  return false;
+  }
+
+  // Creating a writable mapping bigger than the file extends the file ...
+  m_hMapping = CreateFileMapping(m_hFile, NULL, fReadOnly ? PAGE_READONLY : PAGE_READWRITE,
+    (DWORD) (m_cbMapped >> 32), (DWORD) (m_cbMapped & 0xFFFFFFFFUL), NULL);
+  if (m_hMapping == NULL) goto failed;
+  m_pbBase = (uint8_t *) MapViewOfFile(m_hMapping, fReadOnly ? FILE_MAP_READ : FILE_MAP_WRITE,
+    0, 0, (SIZE_T) m_cbMapped);
+  if (m_pbBase == NULL) goto failed;
+  LOGS(DEBUG, "mapped " << m_cbMapped << " bytes of " << strFileName);
+  return true;
+
+failed:
+  LOGS(ERROR, "unable to map " << strFileName << ", error " << GetLastError());
+  Unmap();  return false;
+}
+
+
+void CMappedImage::Unmap()
+{
+  //++
+  // Flush any changes, unmap the view and close everything ...
+  //--
+  if (m_pbBase != NULL) {
+    Sync();  UnmapViewOfFile(m_pbBase);  m_pbBase = NULL;
+  }
+  if (m_hMapping != NULL) {CloseHandle(m_hMapping);  m_hMapping = NULL;}
+  if (m_hFile != INVALID_HANDLE_VALUE) {CloseHandle(m_hFile);  m_hFile = INVALID_HANDLE_VALUE;}
+  m_cbMapped = 0;
+}
+
+
+bool CMappedImage::Sync()
+{
+  //++
+  //   Write any dirty pages back to the file and wait for them to get to the
+  // disk.  Nothing happens if nothing has changed since the last time.  The
+  // mapping stays dirty if the flush fails, so the next Sync() tries again ...
+  //--
+  if (!IsMapped() || !m_fDirty) return true;
+  if (FlushViewOfFile(m_pbBase, 0) && FlushFileBuffers(m_hFile)) {
+    m_fDirty = false;  return true;
+  }
+  LOGS(ERROR, "unable to flush " << m_strFileName << ", error " << GetLastError());
+  return false;
+}
+
+#else
+
+bool CMappedImage::Map (const string &strFileName, bool fReadOnly, uint64_t cbImage)
+{
+  //++
+  // Linux (or any POSIX system) version of Map() ...
+  //--
+  assert(!IsMapped());
+  m_strFileName = strFileName;  m_fReadOnly = fReadOnly;  m_fDirty = false;
+  struct stat st;  void *pMap;
+  m_fd = open(strFileName.c_str(), fReadOnly ? O_RDONLY : O_RDWR);
+  if (m_fd < 0) goto failed;
+  if (fstat(m_fd, &st) != 0) goto failed;
+
+  //   A read only file gets mapped at whatever size it is, but a writable
+  // one gets extended to a full pack first.  Otherwise a write past the end
+  // of the file would get a SIGBUS ...
+  if (fReadOnly) {
+    m_cbMapped = ((uint64_t) st.st_size < cbImage) ? (uint64_t) st.st_size : cbImage;
+    if (m_cbMapped == 0) {
+      LOGS(ERROR, "unable to map empty file " << strFileName);
+      Unmap();  return false;
+    }
+  } else {
+    m_cbMapped = cbImage;
+    if (((uint64_t) st.st_size < cbImage) && (ftruncate(m_fd, (off_t) cbImage) != 0)) goto failed;
+  }
+
+  //   Map it, and then tell the kernel that we'll want the whole thing.  An
+  // RP07 pack is only a few hundred megabytes, so reading it all in now
+  // beats taking a page fault in the middle of a MASSBUS transfer later ...
+  pMap = mmap(NULL, (size_t) m_cbMapped, fReadOnly ? PROT_READ : (PROT_READ|PROT_WRITE),
+    MAP_SHARED, m_fd, 0);
+  if (pMap == MAP_FAILED) goto failed;
+  m_pbBase = (uint8_t *) pMap;
+  if (madvise(m_pbBase, (size_t) m_cbMapped, MADV_WILLNEED) != 0)
+    LOGS(WARNING, "madvise failed for " << strFileName << " - " << strerror(errno));
+  LOGS(DEBUG, "mapped " << m_cbMapped << " bytes of " << strFileName);
+  return true;
+
+failed:
+  LOGS(ERROR, "unable to map " << strFileName << " - " << strerror(errno));
+  Unmap();  return false;
+}
+
+
+void CMappedImage::Unmap()
+{
+  //++
+  // Flush any changes, unmap the file and close it ...
+  //--
+  if (m_pbBase != NULL) {
+    Sync();  munmap(m_pbBase, (size_t) m_cbMapped);  m_pbBase = NULL;
+  }
+  if (m_fd >= 0) {close(m_fd);  m_fd = -1;}
+  m_cbMapped = 0;
+}
+
+
+bool CMappedImage::Sync()
+{
+  //++
+  //   Write any dirty pages back to the file and wait for them to get to the
+  // disk.  Nothing happens if nothing has changed since the last time.  The
+  // mapping stays dirty if msync() fails, so the next Sync() tries again ...
+  //--
+  if (!IsMapped() || !m_fDirty) return true;
+  if (msync(m_pbBase, (size_t) m_cbMapped, MS_SYNC) == 0) {
+    m_fDirty = false;  return true;
+  }
+  LOGS(ERROR, "unable to sync " << m_strFileName << " - " << strerror(errno));
+  return false;
+}
+#endif
@@ -0,0 +1,97 @@
+//++
+// MappedImage.hpp -> CMappedImage (memory mapped disk image) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   CMappedImage maps an entire disk image file into our address space, so
+// that CDiskDrive can unpack sectors straight from the file data into the
+// FPGA buffer (and pack them straight back again) with no system call and
+// no intermediate buffer.  Even the biggest pack we emulate, an RP07, is
+// only a few hundred megabytes, so mapping every drive is no big deal.
+//
+//   The UPELIB CDiskImageFile object still opens the file in the usual way -
+// it handles creating the file, the share mode and the read only checks -
+// and this object then opens it a second time to map it.  On Windows this
+// means the file can't be mapped if it was attached with /SHARE=NONE.
+//
+//   If the file is writable but shorter than a full pack, then it's extended
+// to the full size before mapping, which costs nothing on a file system that
+// supports sparse files.  A read only file is mapped as is, and any sectors
+// past the end of the file read as zeros.
+//
+//   Changes go to the file whenever the OS feels like it, and Sync() forces
+// them out.  CDiskDrive calls Sync() when the drive is spun down or detached
+// and also periodically from the MASSBUS thread.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <string>               // C++ std::string class, et al ...
+using std::string;              // ...
+
+
+class CMappedImage {
+  //++
+  // Memory mapped image file ...
+  //--
+
+  // Constructor and destructor ...
+public:
+  CMappedImage();
+  virtual ~CMappedImage() {Unmap();}
+private:
+  // Disallow copy and assignment operations with CMappedImage objects...
+  CMappedImage(const CMappedImage &) = delete;
+  CMappedImage& operator= (const CMappedImage &) = delete;
+
+  // Public properties ...
+public:
+  // Return true if the file is mapped ...
+  bool IsMapped() const {return m_pbBase != NULL;}
+  bool IsReadOnly() const {return m_fReadOnly;}
+  // Return the number of bytes mapped ...
+  uint64_t GetLength() const {return m_cbMapped;}
+  //   Return a pointer to cbData bytes starting at offset llOffset, or NULL
+  // if any of that lies past the end of the mapping ...
+  uint8_t *GetData (uint64_t llOffset, uint32_t cbData) const
+    {return ((llOffset+cbData) <= m_cbMapped) ? (m_pbBase+llOffset) : NULL;}
+  // Note that the mapped data has been changed ...
+  void SetDirty() {m_fDirty = true;}
+  bool IsDirty() const {return m_fDirty;}
+
+  // Public methods ...
+public:
+  // Map a file (extending it to cbImage bytes if it's writable) ...
+  bool Map (const string &strFileName, bool fReadOnly, uint64_t cbImage);
+  // Flush all changes to the file and unmap it ...
+  void Unmap();
+  // Write any changes back to the file ...
+  bool Sync();
+
+  // Private member data ...
+private:
+#ifdef _WIN32
+  void     *m_hFile;            // Windows file handle
+  void     *m_hMapping;         // Windows file mapping object handle
+#else
+  int       m_fd;               // file descriptor for the mapped file
+#endif
+  uint8_t  *m_pbBase;           // address of the mapped data
+  uint64_t  m_cbMapped;         // number of bytes mapped
+  bool      m_fReadOnly;        // the mapping is read only
+  bool      m_fDirty;           // changed since the last Sync()
+  string    m_strFileName;      // name of the mapped file, for messages
+};
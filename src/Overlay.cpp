@@ -0,0 +1,348 @@
+//++
+// Overlay.cpp -> COverlayImage (copy on write delta) and CBaseCache methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the COverlayImage and CBaseCache classes.  See
+// Overlay.hpp for the details, including the delta file layout.  The header
+// fields are stored in the host byte order, the same as the image files.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memcpy(), memset(), etc ...
+#include <stdio.h>              // fopen(), fread(), fwrite(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#ifdef _WIN32
+#include <io.h>                 // _commit(), _fileno() ...
+#else
+#include <unistd.h>             // fsync() ...
+#endif
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "SectorCache.hpp"      // SLRU cache of unpacked sectors
+#include "Overlay.hpp"          // declarations for this module
+using std::unique_lock;         // ...
+using std::mutex;               // ...
+
+// Delta file header signature ...
+static const char g_szMagic[8] = {'M', 'B', 'S', 'D', 'E', 'L', 'T', 'A'};
+
+// Static CBaseCache members ...
+mutex CBaseCache::m_mtxRegistry;
+std::map<string, CBaseCache *> CBaseCache::m_mapCaches;
+
+
+static bool SeekFile (FILE *pFile, uint64_t llOffset)
+{
+  //++
+  //   Seek to an absolute 64 bit offset.  Image files are well over 2Gb for
+  // the bigger packs, so plain fseek() won't do ...
+  //--
+#ifdef _WIN32
+  return _fseeki64(pFile, (__int64) llOffset, SEEK_SET) == 0;
+#else
+  return fseeko(pFile, (off_t) llOffset, SEEK_SET) == 0;
+#endif
+}
+
+
+static bool SyncFile (FILE *pFile)
+{
+  //++
+  //   Write everything in the stdio buffer to the file, and then make sure
+  // it's really on the disk (not just in the OS cache) ...
+  //--
+  if (fflush(pFile) != 0) return false;
+#ifdef _WIN32
+  return _commit(_fileno(pFile)) == 0;
+#else
+  return fsync(fileno(pFile)) == 0;
+#endif
+}
+
+
+COverlayImage::COverlayImage()
+  : m_pFile(NULL), m_cbSector(0), m_nSectors(0), m_nAllocated(0)
+{
+  //++
+  // The constructor doesn't do anything - call Open() to get started ...
+  //--
+}
+
+
+bool COverlayImage::Open (const string &strFileName, const string &strBase, uint32_t cbSector, uint32_t nSectors)
+{
+  //++
+  //   Open an existing delta file, or create a new one if it doesn't exist.
+  // An existing delta has to have the same sector size and pack size as the
+  // base.  If it was created for a base image with a different name we only
+  // complain about it, since the base might have just been moved ...
+  //--
+  assert(!IsOpen() && (cbSector > 0) && (nSectors > 0));
+  m_strFileName = strFileName;  m_strBase = strBase;
+  m_cbSector = cbSector;  m_nSectors = nSectors;  m_nAllocated = 0;
+  //   The bitmap size is rounded up to a multiple of the header size, so that
+  // the data area is nicely aligned ...
+  size_t cbBitmap = ((((size_t) nSectors+7) / 8 + HEADER_SIZE-1) / HEADER_SIZE) * HEADER_SIZE;
+  m_abBitmap.assign(cbBitmap, 0);
+  m_pFile = fopen(strFileName.c_str(), "r+b");
+  if (m_pFile == NULL) return Create();
+
+  // Read and check the header ...
+  uint8_t abHeader[HEADER_SIZE];  uint32_t lVersion, cbFile, nFile;
+  if (fread(abHeader, 1, HEADER_SIZE, m_pFile) != HEADER_SIZE) goto invalid;
+  if (memcmp(abHeader, g_szMagic, sizeof(g_szMagic)) != 0) goto invalid;
+  memcpy(&lVersion, &abHeader[ 8], sizeof(uint32_t));
+  memcpy(&cbFile,   &abHeader[12], sizeof(uint32_t));
+  memcpy(&nFile,    &abHeader[16], sizeof(uint32_t));
+  abHeader[HEADER_SIZE-1] = 0;
+  if (lVersion != VERSION) goto invalid;
+  if ((cbFile != cbSector) || (nFile != nSectors)) {
+    LOGS(ERROR, "overlay " << strFileName << " is for a different pack type or format");
+    Close();  return false;
+  }
+  if (strBase != (const char *) &abHeader[24])
+    LOGS(WARNING, "overlay " << strFileName << " was created for " << (const char *) &abHeader[24]);
+
+  // Read the bitmap and count the sectors in use ...
+  if (fread(&m_abBitmap[0], 1, cbBitmap, m_pFile) != cbBitmap) goto invalid;
+  for (uint32_t i = 0;  i < nSectors;  ++i)
+    if (Contains(i)) ++m_nAllocated;
+  LOGS(DEBUG, "overlay " << strFileName << " opened with " << m_nAllocated << " sectors");
+  return true;
+
+invalid:
+  LOGS(ERROR, strFileName << " is not a valid overlay file");
+  Close();  return false;
+}
+
+
+bool COverlayImage::Create()
+{
+  //++
+  //   Create a new, empty, delta file (or truncate an existing one).  Only the
+  // header and the bitmap are actually written - the data area is left for
+  // the file system to fill in as sectors are written ...
+  //--
+  assert(m_pFile == NULL);
+  uint8_t abHeader[HEADER_SIZE];  uint32_t lVersion = VERSION;
+  memset(abHeader, 0, sizeof(abHeader));
+  memcpy(abHeader, g_szMagic, sizeof(g_szMagic));
+  memcpy(&abHeader[ 8], &lVersion,   sizeof(uint32_t));
+  memcpy(&abHeader[12], &m_cbSector, sizeof(uint32_t));
+  memcpy(&abHeader[16], &m_nSectors, sizeof(uint32_t));
+  strncpy((char *) &abHeader[24], m_strBase.c_str(), HEADER_SIZE-24-1);
+  memset(&m_abBitmap[0], 0, m_abBitmap.size());  m_nAllocated = 0;
+  if ((m_pFile = fopen(m_strFileName.c_str(), "w+b")) == NULL) {
+    LOGS(ERROR, "unable to create overlay " << m_strFileName);  return false;
+  }
+  if (   (fwrite(abHeader, 1, HEADER_SIZE, m_pFile) != HEADER_SIZE)
+      || (fwrite(&m_abBitmap[0], 1, m_abBitmap.size(), m_pFile) != m_abBitmap.size())
+      || (fflush(m_pFile) != 0)) {
+    LOGS(ERROR, "error writing overlay " << m_strFileName);
+    Close();  return false;
+  }
+  LOGS(DEBUG, "overlay " << m_strFileName << " created for " << m_strBase);
+  return true;
+}
+
+
+void COverlayImage::Close()
+{
+  //++
+  // Close the delta file.  Everything has already been written ...
+  //--
+  if (m_pFile != NULL) fclose(m_pFile);
+  m_pFile = NULL;
+}
+
+
+bool COverlayImage::Read (uint32_t lLBA, void *pData)
+{
+  //++
+  //   Read one sector from the delta.  It's up to the caller to make sure
+  // that the sector is actually there first ...
+  //--
+  assert(IsOpen() && Contains(lLBA));
+  if (SeekFile(m_pFile, SectorOffset(lLBA)) && (fread(pData, 1, m_cbSector, m_pFile) == m_cbSector))
+    return true;
+  LOGS(ERROR, "error reading sector " << lLBA << " from overlay " << m_strFileName);
+  return false;
+}
+
+
+bool COverlayImage::Write (uint32_t lLBA, const void *pData)
+{
+  //++
+  //   Write one sector to the delta.  If it's a new sector then the bitmap
+  // is updated too, but only after the data has been written ...
+  //--
+  assert(IsOpen());
+  if (lLBA >= m_nSectors) return false;
+  if (!SeekFile(m_pFile, SectorOffset(lLBA))
+   || (fwrite(pData, 1, m_cbSector, m_pFile) != m_cbSector)) goto failed;
+  if (!Contains(lLBA)) {
+    m_abBitmap[lLBA >> 3] |= (uint8_t) (1 << (lLBA & 7));  ++m_nAllocated;
+    if (!SeekFile(m_pFile, HEADER_SIZE + (lLBA >> 3))
+     || (fputc(m_abBitmap[lLBA >> 3], m_pFile) == EOF)) goto failed;
+  }
+  if (fflush(m_pFile) != 0) goto failed;
+  return true;
+
+failed:
+  LOGS(ERROR, "error writing sector " << lLBA << " to overlay " << m_strFileName);
+  return false;
+}
+
+
+bool COverlayImage::Commit (const string &strBase, uint32_t &nSectors)
+{
+  //++
+  //   Copy every sector in the delta back to the base image, and then empty
+  // the delta.  If anything goes wrong then the delta is left alone, so it's
+  // always safe to try again (the base might be partly updated, but it'll
+  // only have sectors from the delta in it).  The base is synced before the
+  // delta is emptied - otherwise a power failure right after this could lose
+  // the committed sectors from both files.  The caller has to make sure that
+  // no other unit is using the base image!
+  //--
+  assert(IsOpen());
+  nSectors = 0;
+  FILE *pBase = fopen(strBase.c_str(), "r+b");
+  if (pBase == NULL) {
+    LOGS(ERROR, "unable to open " << strBase << " for writing");  return false;
+  }
+  std::vector<uint8_t> abSector(m_cbSector);
+  for (uint32_t lLBA = 0;  lLBA < m_nSectors;  ++lLBA) {
+    if (!Contains(lLBA)) continue;
+    if (!Read(lLBA, &abSector[0])) goto failed;
+    if (!SeekFile(pBase, (uint64_t) lLBA * m_cbSector)
+     || (fwrite(&abSector[0], 1, m_cbSector, pBase) != m_cbSector)) goto failed;
+    ++nSectors;
+  }
+  if (!SyncFile(pBase)) goto failed;
+  if (fclose(pBase) != 0) {
+    LOGS(ERROR, "error writing " << strBase);  return false;
+  }
+
+  // The base is updated, so start over with an empty delta ...
+  LOGS(DEBUG, nSectors << " sectors committed from " << m_strFileName << " to " << strBase);
+  Close();
+  return Create();
+
+failed:
+  LOGS(ERROR, "commit of " << m_strFileName << " to " << strBase << " failed");
+  fclose(pBase);  return false;
+}
+
+
+CBaseCache::CBaseCache (const string &strKey, uint32_t cbSector, uint64_t cbBudget, uint32_t nSectors)
+  : m_strKey(strKey), m_cbSector(cbSector), m_nUsers(0)
+{
+  //++
+  //   Create the cache.  The entries hold raw image sectors, and there's never
+  // any need for more of them than nSectors, the size of the base image ...
+  //--
+  assert((cbSector % sizeof(uint32_t)) == 0);
+  m_pCache = new CSectorCache(cbBudget, cbSector / sizeof(uint32_t), nSectors);
+}
+
+
+CBaseCache::~CBaseCache()
+{
+  //++
+  // Delete the cache ...
+  //--
+  delete m_pCache;
+}
+
+
+/*static*/ CBaseCache *CBaseCache::Open (const string &strBase, uint32_t cbSector, uint64_t cbBudget, uint32_t nSectors)
+{
+  //++
+  //   Find the cache for this base image and sector size, or create a new one
+  // if there isn't one and cbBudget isn't zero.  The sector size is part of
+  // the key, since the same base could be attached as 16 and 18 bits (not
+  // that that makes much sense!) ...
+  //--
+  unique_lock<mutex> lock(m_mtxRegistry);
+  string strKey = strBase + "|" + std::to_string(cbSector);
+  std::map<string, CBaseCache *>::iterator it = m_mapCaches.find(strKey);
+  CBaseCache *pCache;
+  if (it != m_mapCaches.end()) {
+    pCache = it->second;
+  } else {
+    if (cbBudget == 0) return NULL;
+    pCache = new CBaseCache(strKey, cbSector, cbBudget, nSectors);
+    m_mapCaches[strKey] = pCache;
+    LOGS(DEBUG, "base cache for " << strBase << " " << pCache->m_pCache->GetCapacity() << " sectors");
+  }
+  ++pCache->m_nUsers;
+  return pCache;
+}
+
+
+/*static*/ void CBaseCache::Close (CBaseCache *pCache)
+{
+  //++
+  // Drop one user, and delete the cache when the last user is gone ...
+  //--
+  if (pCache == NULL) return;
+  unique_lock<mutex> lock(m_mtxRegistry);
+  assert(pCache->m_nUsers > 0);
+  if (--pCache->m_nUsers > 0) return;
+  m_mapCaches.erase(pCache->m_strKey);
+  delete pCache;
+}
+
+
+bool CBaseCache::Find (uint32_t lLBA, void *pData)
+{
+  //++
+  //   Copy a cached base sector to pData and return true, or return false if
+  // it isn't cached.  The data has to be copied while the cache is locked ...
+  //--
+  unique_lock<mutex> lock(m_mtxCache);
+  const uint32_t *plData = m_pCache->Find(lLBA);
+  if (plData == NULL) return false;
+  memcpy(pData, plData, m_cbSector);
+  return true;
+}
+
+
+void CBaseCache::Store (uint32_t lLBA, const void *pData)
+{
+  //++
+  // Add a base sector to the cache ...
+  //--
+  unique_lock<mutex> lock(m_mtxCache);
+  m_pCache->Store(lLBA, (const uint32_t *) pData);
+}
+
+
+void CBaseCache::Flush()
+{
+  //++
+  // Throw away everything (after a COMMIT changes the base) ...
+  //--
+  unique_lock<mutex> lock(m_mtxCache);
+  m_pCache->Flush();
+}
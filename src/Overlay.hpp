@@ -0,0 +1,166 @@
+//++
+// Overlay.hpp -> COverlayImage (copy on write delta) and CBaseCache classes
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   The museum runs lots of drives with copies of the same TOPS-10 and TOPS-20
+// system packs.  Rather than giving each drive its own full size copy of the
+// pack, ATTACH /OVERLAY attaches the drive to a shared, read only, "base"
+// image plus a private "delta" file.  Every sector the host writes goes to
+// the delta, and reads come from the delta if the sector has ever been
+// written and from the base otherwise.  Creating a new delta takes no time
+// at all, and it's only as big as the sectors that have actually changed.
+//
+//   The delta file starts with a HEADER_SIZE byte header that identifies the
+// base image and the sector size, followed by a bitmap with one bit for
+// every sector on the pack (set if that sector is in the delta), followed by
+// the sectors themselves.  Sector n is always at the same place in the data
+// area, just like in a regular image file, so on any file system with sparse
+// file support the delta takes up space only for the sectors written.  The
+// whole bitmap is kept in memory, and each time a new sector is added the
+// sector is written first and then the bitmap byte.  COMMIT copies all the
+// sectors in the delta back to the base and then empties the delta.
+//
+//   CBaseCache is a cache of raw base image sectors shared by every overlay
+// unit that uses the same base.  Since the base is never written (except by
+// COMMIT, which requires that nobody else be using it) no unit can ever see
+// stale data in it.  The cache data is in the image file format, so that one
+// copy works for the read path of every unit.  The operating system's page
+// cache is naturally shared too, since all the units read the same file.
+//
+//   Neither class does any locking of its own for the overlay - the drive's
+// image lock covers that - but CBaseCache has its own mutex since it's
+// shared by drives that run on different MASSBUS threads.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <stdio.h>              // FILE, fopen(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+#include <map>                  // C++ std::map template
+#include <mutex>                // C++ std::mutex
+using std::string;              // ...
+class CSectorCache;             // we need a forward pointer for this class
+
+
+class COverlayImage {
+  //++
+  // Copy on write delta file ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    HEADER_SIZE = 4096,         // size of the file header, in bytes
+    VERSION     = 1,            // current delta file format version
+  };
+
+  // Constructor and destructor ...
+public:
+  COverlayImage();
+  virtual ~COverlayImage() {Close();}
+private:
+  // Disallow copy and assignment operations with COverlayImage objects...
+  COverlayImage(const COverlayImage &) = delete;
+  COverlayImage& operator= (const COverlayImage &) = delete;
+
+  // Public properties ...
+public:
+  bool IsOpen() const {return m_pFile != NULL;}
+  string GetFileName() const {return m_strFileName;}
+  // Return the number of sectors on the pack and the number in the delta ...
+  uint32_t GetSectors() const {return m_nSectors;}
+  uint32_t GetAllocated() const {return m_nAllocated;}
+  // Return true if sector lLBA has been written to the delta ...
+  bool Contains (uint32_t lLBA) const
+    {return (lLBA < m_nSectors) && ((m_abBitmap[lLBA >> 3] & (1 << (lLBA & 7))) != 0);}
+
+  // Public methods ...
+public:
+  // Open (or create) a delta file for the base image ...
+  bool Open (const string &strFileName, const string &strBase, uint32_t cbSector, uint32_t nSectors);
+  void Close();
+  // Read or write one sector in the delta ...
+  bool Read (uint32_t lLBA, void *pData);
+  bool Write (uint32_t lLBA, const void *pData);
+  // Copy the delta back to the base image and then empty it ...
+  bool Commit (const string &strBase, uint32_t &nSectors);
+
+  // Private methods ...
+private:
+  // Return the offset of sector lLBA in the delta ...
+  uint64_t SectorOffset (uint32_t lLBA) const
+    {return HEADER_SIZE + (uint64_t) m_abBitmap.size() + (uint64_t) lLBA * m_cbSector;}
+  // Write a new, empty, delta file ...
+  bool Create();
+
+  // Private member data ...
+private:
+  FILE                 *m_pFile;        // the delta file
+  string                m_strFileName;  // and its name
+  string                m_strBase;      // name of the base image
+  uint32_t              m_cbSector;     // image file sector size, in bytes
+  uint32_t              m_nSectors;     // number of sectors on the pack
+  uint32_t              m_nAllocated;   // number of sectors in the delta
+  std::vector<uint8_t>  m_abBitmap;     // one bit for every sector
+};
+
+
+class CBaseCache {
+  //++
+  // Raw sector cache shared by all overlays on the same base ...
+  //--
+
+  // Constructor and destructor ...
+private:
+  // Use Open() and Close() instead of new and delete ...
+  CBaseCache (const string &strKey, uint32_t cbSector, uint64_t cbBudget, uint32_t nSectors);
+  virtual ~CBaseCache();
+  // Disallow copy and assignment operations with CBaseCache objects...
+  CBaseCache(const CBaseCache &) = delete;
+  CBaseCache& operator= (const CBaseCache &) = delete;
+
+  // Public properties ...
+public:
+  // Return the number of units sharing this cache ...
+  uint32_t GetUsers() const {return m_nUsers;}
+  // Return the underlying cache, for statistics ...
+  const CSectorCache *GetCache() const {return m_pCache;}
+
+  // Public methods ...
+public:
+  //   Find (or create) the cache for a base image, and count one more user.
+  // The first unit to ask for a cache sets its size.  Returns NULL if there's
+  // no cache for this base and cbBudget is zero ...
+  static CBaseCache *Open (const string &strBase, uint32_t cbSector, uint64_t cbBudget, uint32_t nSectors);
+  // Count one less user, and delete the cache when there are none ...
+  static void Close (CBaseCache *pCache);
+  // Find, store or discard raw image sectors ...
+  bool Find (uint32_t lLBA, void *pData);
+  void Store (uint32_t lLBA, const void *pData);
+  void Flush();
+
+  // Private member data ...
+private:
+  static std::mutex m_mtxRegistry;                      // protects m_mapCaches
+  static std::map<string, CBaseCache *> m_mapCaches;    // all base caches
+  string        m_strKey;       // our key in m_mapCaches
+  uint32_t      m_cbSector;     // image sector size, in bytes
+  uint32_t      m_nUsers;       // number of units using this cache
+  std::mutex    m_mtxCache;     // serializes access to the cache
+  CSectorCache *m_pCache;       // the cache itself
+};
@@ -0,0 +1,232 @@
+//++
+// PLXDMA.cpp -> CPLXDMA (PLX 9054 DMA transfer engine) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CPLXDMA class, which transfers data to and
+// from the UPE data FIFO using the PLX 9054 DMA engine.  See PLXDMA.hpp for
+// more details.
+//
+//   One thing to keep in mind about reads is that the FIFO might not have all
+// the data we want yet.  The DMA engine doesn't care - it just reads the FIFO
+// address as many times as we ask, and any read that finds the FIFO empty
+// returns a longword without the VALID bit.  Reading an empty FIFO doesn't pop
+// anything, so the valid words we get are still in order and we just squeeze
+// out the invalid ones.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memset(), memcpy(), etc ...
+#ifdef _WIN32
+#include <windows.h>            // VirtualAlloc(), VirtualLock(), etc ...
+#else
+#include <stdlib.h>             // posix_memalign(), free() ...
+#include <sys/mman.h>           // mlock(), munlock() ...
+#endif
+#include <PlxApi.h>             // PLX 9054 PCI interface API declarations
+#include "UPELIB.hpp"           // UPE library definitions
+#include "UPE.hpp"              // UPE library FPGA interface methods
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "MBS.hpp"              // global declarations for this project
+#include "DECUPE.hpp"           // DEC specific UPE/FPGA interface methods
+#include "PLXDMA.hpp"           // declarations for this module
+
+
+CPLXDMA::CPLXDMA()
+  : m_fOpen(false), m_lLocalAddress(0), m_plBuffer(NULL)
+{
+  //++
+  // The constructor doesn't do anything - call Open() to get started ...
+  //--
+  memset(&m_plxKey, 0, sizeof(m_plxKey));
+  memset(&m_plxDevice, 0, sizeof(m_plxDevice));
+}
+
+
+/* static */ uint32_t *CPLXDMA::AllocateBuffer (uint32_t cbBuffer)
+{
+  //++
+  //   Allocate a page aligned buffer and lock it in physical memory.  If we
+  // can't lock it that's not fatal - the PLX driver will pin the pages during
+  // each transfer anyway - but it'll be slower ...
+  //--
+  void *pBuffer = NULL;
+#ifdef _WIN32
+  pBuffer = VirtualAlloc(NULL, cbBuffer, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+  if (pBuffer == NULL) return NULL;
+  if (!VirtualLock(pBuffer, cbBuffer))
+    LOGF(WARNING, "unable to lock DMA buffer in memory");
+#else
+  if (posix_memalign(&pBuffer, 4096, cbBuffer) != 0) return NULL;
+  if (mlock(pBuffer, cbBuffer) != 0)
+    LOGF(WARNING, "unable to lock DMA buffer in memory");
+#endif
+  return (uint32_t *) pBuffer;
+}
+
+
+/* static */ void CPLXDMA::FreeBuffer (uint32_t *plBuffer, uint32_t cbBuffer)
+{
+  //++
+  // Unlock and free the DMA bounce buffer ...
+  //--
+  if (plBuffer == NULL) return;
+#ifdef _WIN32
+  VirtualUnlock(plBuffer, cbBuffer);
+  VirtualFree(plBuffer, 0, MEM_RELEASE);
+#else
+  munlock(plBuffer, cbBuffer);
+  free(plBuffer);
+#endif
+}
+
+
+bool CPLXDMA::Open (const PLX_DEVICE_KEY *pplxKey, uint32_t lFIFOoffset)
+{
+  //++
+  //   Open our own handle for the PLX device, figure out the local bus address
+  // of the data FIFO, allocate the bounce buffer and then open the DMA channel.
+  // If any of that fails, then we log a message, clean up, and return false.
+  // The caller should just go on using PIO in that case.
+  //--
+  PLX_STATUS ret;  PLX_DMA_PROP prop;  uint32_t lLAS0BA;
+  assert(!IsOpen() && (pplxKey != NULL));
+  memcpy(&m_plxKey, pplxKey, sizeof(m_plxKey));
+
+  // Open the device ...
+  if ((ret = PlxPci_DeviceOpen(&m_plxKey, &m_plxDevice)) != ApiSuccess) {
+    LOGF(WARNING, "PlxPci_DeviceOpen() failed (%d) - DMA not available", ret);
+    return false;
+  }
+
+  //   The UPE window is local address space 0, and LAS0BA tells us where that
+  // lives on the local bus.  Bit 0 is the space enable and bits 1..3 are the
+  // space type - the rest is the address ...
+  lLAS0BA = PlxPci_PlxRegisterRead(&m_plxDevice, PLX_LAS0BA, &ret);
+  if ((ret != ApiSuccess) || !ISSET(lLAS0BA, 1)) {
+    LOGF(WARNING, "unable to read PLX LAS0BA (%d) - DMA not available", ret);
+    goto close;
+  }
+  m_lLocalAddress = (lLAS0BA & ~0xFUL) + lFIFOoffset;
+
+  // Allocate the bounce buffer ...
+  m_plBuffer = AllocateBuffer(BUFFER_SIZE*sizeof(uint32_t));
+  if (m_plBuffer == NULL) {
+    LOGF(WARNING, "unable to allocate DMA buffer - DMA not available");
+    goto close;
+  }
+
+  //   And open the DMA channel.  The FIFO is always a 32 bit wide, constant
+  // local address, and we use READY# to pace the transfer ...
+  memset(&prop, 0, sizeof(prop));
+  prop.ReadyInput     = 1;
+  prop.ConstAddrLocal = 1;
+  prop.LocalBusWidth  = 2;
+  if ((ret = PlxPci_DmaChannelOpen(&m_plxDevice, DMA_CHANNEL, &prop)) != ApiSuccess) {
+    LOGF(WARNING, "PlxPci_DmaChannelOpen() failed (%d) - DMA not available", ret);
+    goto close;
+  }
+  m_fOpen = true;
+  LOGF(DEBUG, "DMA channel %d opened, FIFO local address 0x%08X", DMA_CHANNEL, m_lLocalAddress);
+  return true;
+
+  // Here if something fails after the device is opened ...
+close:
+  FreeBuffer(m_plBuffer, BUFFER_SIZE*sizeof(uint32_t));  m_plBuffer = NULL;
+  PlxPci_DeviceClose(&m_plxDevice);
+  return false;
+}
+
+
+void CPLXDMA::Close()
+{
+  //++
+  // Close the DMA channel and the device, and free the bounce buffer ...
+  //--
+  if (!IsOpen()) return;
+  PlxPci_DmaChannelClose(&m_plxDevice, DMA_CHANNEL);
+  PlxPci_DeviceClose(&m_plxDevice);
+  FreeBuffer(m_plBuffer, BUFFER_SIZE*sizeof(uint32_t));
+  m_plBuffer = NULL;  m_fOpen = false;
+}
+
+
+bool CPLXDMA::Transfer (uint32_t clData, bool fToPC)
+{
+  //++
+  //   Move clData longwords between the bounce buffer and the FIFO, in the
+  // direction specified, and wait for the DMA to finish.  Returns false if the
+  // PLX library reports any error.
+  //--
+  assert(IsOpen() && (clData > 0) && (clData <= BUFFER_SIZE));
+  PLX_DMA_PARAMS dma;  PLX_STATUS ret;
+  memset(&dma, 0, sizeof(dma));
+  dma.UserVa    = (U64) (uintptr_t) m_plBuffer;
+  dma.LocalAddr = m_lLocalAddress;
+  dma.ByteCount = clData * sizeof(uint32_t);
+  dma.Direction = fToPC ? PLX_DMA_LOC_TO_PCI : PLX_DMA_PCI_TO_LOC;
+  ret = PlxPci_DmaTransferUserBuffer(&m_plxDevice, DMA_CHANNEL, &dma, DMA_TIMEOUT);
+  if (ret == ApiSuccess) return true;
+  LOGF(WARNING, "PlxPci_DmaTransferUserBuffer() failed (%d)", ret);
+  return false;
+}
+
+
+uint32_t CPLXDMA::ReadFIFO (uint32_t alData[], uint32_t clData)
+{
+  //++
+  //   DMA clData longwords from the "to PC" FIFO, and then pack the valid ones
+  // into the caller's buffer.  Returns the number of valid words, which may be
+  // anything from zero to clData, or FAILED if the DMA failed.
+  //--
+  if (clData > BUFFER_SIZE) clData = BUFFER_SIZE;
+  if (!Transfer(clData, true)) return FAILED;
+  uint32_t nValid = 0;
+  for (uint32_t i = 0;  i < clData;  ++i) {
+    if (CDECUPE::IsDataValid(m_plBuffer[i]))
+      alData[nValid++] = MASK18(m_plBuffer[i]);
+  }
+  return nValid;
+}
+
+
+uint32_t CPLXDMA::WriteFIFO (const uint32_t alData[], uint32_t clData)
+{
+  //++
+  //   Copy clData words to the bounce buffer and DMA them to the "from PC"
+  // FIFO.  Returns the number of words written (always clData for now), or
+  // FAILED if the DMA failed.  It's up to the caller not to overflow the FIFO!
+  //--
+  if (clData > BUFFER_SIZE) clData = BUFFER_SIZE;
+  for (uint32_t i = 0;  i < clData;  ++i)  m_plBuffer[i] = MASK18(alData[i]);
+  return Transfer(clData, false) ? clData : FAILED;
+}
+
+
+uint32_t CPLXDMA::WriteStream (const CFIFOStream &src, uint32_t nFirst, uint32_t clData)
+{
+  //++
+  //   This is the same as WriteFIFO(), except that the stream converts the
+  // data straight into the bounce buffer and there's no copy at all.  The
+  // stream data is already masked, too ...
+  //--
+  if (clData > BUFFER_SIZE) clData = BUFFER_SIZE;
+  src.Get(nFirst, clData, m_plBuffer);
+  return Transfer(clData, false) ? clData : FAILED;
+}
@@ -0,0 +1,90 @@
+//++
+// PLXDMA.hpp -> CPLXDMA (PLX 9054 DMA transfer engine) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   CPLXDMA moves blocks of data between the PC and the UPE data FIFO using
+// one of the PLX 9054 DMA channels, rather than one 32 bit PIO access at a
+// time.  The UPELIB CUPE class owns the PLX device and doesn't know anything
+// about DMA, so we simply open our own handle to the same device using the
+// same PLX device key.  The PLX driver is quite happy with that.
+//
+//   All transfers go through a single, page aligned, locked "bounce" buffer
+// allocated when the DMA channel is opened.  That keeps the driver from
+// having to pin and unpin the caller's pages on every transfer, and it gives
+// us somewhere to put the 32 bit FIFO longwords (complete with the VALID bit)
+// before we unpack them.  The local side of the transfer is always the one
+// data FIFO address, so the channel is opened in constant local address mode.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, etc ...
+#include <PlxApi.h>             // PLX 9054 PCI interface API declarations
+#include "TransferEngine.hpp"   // abstract transfer engine interface
+
+
+class CPLXDMA : public CTransferEngine {
+  //++
+  // PLX 9054 DMA data FIFO transfers ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    DMA_CHANNEL     =     0,    // PLX DMA channel that we use
+    DMA_TIMEOUT     =   100,    // DMA completion timeout (milliseconds)
+    BUFFER_SIZE     = 65536,    // bounce buffer size (longwords)
+    PLX_LAS0BA      =  0x04,    // local address space 0 base register offset
+  };
+
+  // Constructor and destructor ...
+public:
+  CPLXDMA();
+  virtual ~CPLXDMA() {Close();}
+private:
+  // Disallow copy and assignment operations with CPLXDMA objects...
+  CPLXDMA(const CPLXDMA &) = delete;
+  CPLXDMA& operator= (const CPLXDMA &) = delete;
+
+  // Public properties and methods ...
+public:
+  //   Open the device and DMA channel.  lFIFOoffset is the offset of the data
+  // FIFO within the UPE shared memory window ...
+  bool Open (const PLX_DEVICE_KEY *pplxKey, uint32_t lFIFOoffset);
+  void Close();
+  bool IsOpen() const {return m_fOpen;}
+  // CTransferEngine methods ...
+  virtual const char *GetTransferName() const {return "DMA";}
+  virtual uint32_t ReadFIFO (uint32_t alData[], uint32_t clData);
+  virtual uint32_t WriteFIFO (const uint32_t alData[], uint32_t clData);
+  virtual uint32_t WriteStream (const CFIFOStream &src, uint32_t nFirst, uint32_t clData);
+
+  // Private methods ...
+private:
+  // Transfer one block to or from the bounce buffer ...
+  bool Transfer (uint32_t clData, bool fToPC);
+  // Allocate and free the locked bounce buffer ...
+  static uint32_t *AllocateBuffer (uint32_t cbBuffer);
+  static void FreeBuffer (uint32_t *plBuffer, uint32_t cbBuffer);
+
+  // Private member data ...
+private:
+  PLX_DEVICE_KEY    m_plxKey;       // device key for the UPE's PLX chip
+  PLX_DEVICE_OBJECT m_plxDevice;    // our own PLX device handle
+  bool              m_fOpen;        // true if the DMA channel is open
+  uint32_t          m_lLocalAddress;// local bus address of the data FIFO
+  uint32_t         *m_plBuffer;     // locked, page aligned bounce buffer
+};
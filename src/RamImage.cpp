@@ -0,0 +1,312 @@
+//++
+// RamImage.cpp -> CRamImage (RAM resident disk image) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CRamImage class.  See RamImage.hpp for the
+// details, and CDiskDrive::SetRam() for how the image gets loaded.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memcpy(), strerror(), etc ...
+#include <errno.h>              // errno, ENOMEM, etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#include <chrono>               // steady_clock, seconds, etc ...
+#ifdef _WIN32
+#include <windows.h>            // VirtualAlloc(), GetLargePageMinimum(), etc ...
+#else
+#include <sys/mman.h>           // mmap(), munmap(), madvise(), etc ...
+#endif
+#include "UPELIB.hpp"           // UPE library definitions
+#include "UPE.hpp"              // UPE library FPGA interface methods
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // UPE library image file methods
+#include "MBS.hpp"              // global declarations for this project
+#include "MASSBUS.h"            // MASSBUS commands and registers
+#include "DriveType.hpp"        // internal drive type class
+#include "DECUPE.hpp"           // DEC specific UPE/FPGA class definitions
+#include "BaseDrive.hpp"        // common methods for all MASSBUS drives
+#include "DiskDrive.hpp"        // disk specific emulation
+#include "RamImage.hpp"         // declarations for this module
+using std::unique_lock;         // ...
+using std::lock_guard;          // ...
+using std::mutex;               // ...
+
+
+CRamImage::CRamImage (CDiskDrive &disk)
+  : m_Disk(disk), m_Thread(&CRamImage::CheckpointLoop), m_fExit(false), m_fStarted(false),
+    m_pbData(NULL), m_cbAllocated(0), m_fHuge(false), m_cbSector(0), m_nSectors(0),
+    m_nDirty(0), m_cCheckpoints(0), m_cWritten(0), m_cErrors(0), m_dLastSeconds(0)
+{
+  //++
+  // Nothing happens until Allocate() and Begin() are called ...
+  //--
+  string sName = m_Disk.GetName() + " checkpoint";
+  m_Thread.SetName(sName.c_str());
+  m_Thread.SetParameter(this);
+}
+
+
+CRamImage::~CRamImage()
+{
+  //++
+  //   Stop the checkpoint thread and free the memory.  CDiskDrive::SetRam()
+  // has already written the last checkpoint, so anything still dirty now is
+  // a checkpoint that failed ...
+  //--
+  End();
+  if (m_nDirty > 0)
+    LOGS(ERROR, "unit " << m_Disk << " " << m_nDirty << " sectors never checkpointed - data lost");
+  Free();
+}
+
+
+bool CRamImage::Allocate (uint32_t cbSector, uint32_t nSectors, bool fHuge)
+{
+  //++
+  //   Allocate (zeroed) memory for the whole pack.  If fHuge is true then try
+  // for huge pages first - that needs huge pages reserved by the system
+  // administrator on Linux, or the "lock pages in memory" privilege on
+  // Windows.  If that fails we ask for transparent huge pages on Linux, and
+  // just use normal pages on Windows ...
+  //--
+  assert(m_pbData == NULL);
+  m_cbSector = cbSector;  m_nSectors = nSectors;  m_fHuge = false;
+  m_cbAllocated = (size_t) cbSector * nSectors;
+#ifdef _WIN32
+  if (fHuge) {
+    size_t cbLarge = GetLargePageMinimum();
+    if (cbLarge != 0) {
+      size_t cbRounded = (m_cbAllocated + cbLarge - 1) & ~(cbLarge - 1);
+      m_pbData = (uint8_t *) VirtualAlloc(NULL, cbRounded, MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES, PAGE_READWRITE);
+      if (m_pbData != NULL) {m_cbAllocated = cbRounded;  m_fHuge = true;}
+    }
+  }
+  if (m_pbData == NULL)
+    m_pbData = (uint8_t *) VirtualAlloc(NULL, m_cbAllocated, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+  if (m_pbData == NULL) {
+    LOGF(ERROR, "unable to allocate %llu bytes - error %d", (unsigned long long) m_cbAllocated, GetLastError());
+    return false;
+  }
+#else
+  void *pData = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (fHuge) {
+    const size_t cbHuge = 2*1024*1024;
+    size_t cbRounded = (m_cbAllocated + cbHuge - 1) & ~(cbHuge - 1);
+    pData = mmap(NULL, cbRounded, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (pData != MAP_FAILED) {m_cbAllocated = cbRounded;  m_fHuge = true;}
+  }
+#endif
+  if (pData == MAP_FAILED) {
+    pData = mmap(NULL, m_cbAllocated, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (pData == MAP_FAILED) {
+      LOGS(ERROR, "unable to allocate " << m_cbAllocated << " bytes - " << strerror(errno));
+      return false;
+    }
+#ifdef MADV_HUGEPAGE
+    if (fHuge) madvise(pData, m_cbAllocated, MADV_HUGEPAGE);
+#endif
+  }
+  m_pbData = (uint8_t *) pData;
+#endif
+  m_aqDirty.assign((nSectors + 63) / 64, 0);  m_nDirty = 0;
+  LOGS(DEBUG, "unit " << m_Disk << " RAM image " << GetBytes() << " bytes" << (m_fHuge ? " in huge pages" : ""));
+  return true;
+}
+
+
+void CRamImage::Free()
+{
+  //++
+  // Give the memory back ...
+  //--
+  if (m_pbData == NULL) return;
+#ifdef _WIN32
+  VirtualFree(m_pbData, 0, MEM_RELEASE);
+#else
+  munmap(m_pbData, m_cbAllocated);
+#endif
+  m_pbData = NULL;  m_cbAllocated = 0;
+}
+
+
+bool CRamImage::Begin()
+{
+  //++
+  // Start the checkpoint thread ...
+  //--
+  m_fStarted = m_Thread.Begin();
+  return m_fStarted;
+}
+
+
+void CRamImage::End()
+{
+  //++
+  //   Tell the checkpoint thread to stop and wait for it.  If it's in the
+  // middle of a checkpoint then that finishes first ...
+  //--
+  if (!m_fStarted) return;
+  {
+    unique_lock<mutex> lock(m_mtxWake);
+    m_fExit = true;
+  }
+  m_cvWake.notify_all();
+  m_Thread.WaitExit();
+  m_fStarted = false;
+}
+
+
+void CRamImage::SetDirty (uint32_t lLBA, bool fDirty)
+{
+  //++
+  // Set or clear the dirty bit for sector lLBA, and keep count ...
+  //--
+  uint64_t qBit = 1ULL << (lLBA & 63);  uint64_t &qWord = m_aqDirty[lLBA >> 6];
+  if (fDirty && ((qWord & qBit) == 0)) {
+    qWord |= qBit;  ++m_nDirty;
+  } else if (!fDirty && ((qWord & qBit) != 0)) {
+    qWord &= ~qBit;  --m_nDirty;
+  }
+}
+
+
+bool CRamImage::Read (uint32_t lLBA, void *pData) const
+{
+  //++
+  // Read one sector, straight from memory ...
+  //--
+  if (lLBA >= m_nSectors) return false;
+  memcpy(pData, GetSector(lLBA), m_cbSector);
+  return true;
+}
+
+
+bool CRamImage::Write (uint32_t lLBA, const void *pData)
+{
+  //++
+  // Write one sector and remember that it has to be checkpointed ...
+  //--
+  if (lLBA >= m_nSectors) return false;
+  memcpy(GetSector(lLBA), pData, m_cbSector);
+  SetDirty(lLBA, true);
+  return true;
+}
+
+
+bool CRamImage::Checkpoint()
+{
+  //++
+  // Write a checkpoint, after waiting for any other one to finish ...
+  //--
+  lock_guard<mutex> lock(m_mtxBacking);
+  return WriteDirty(false);
+}
+
+
+bool CRamImage::WriteDirty (bool fLocked)
+{
+  //++
+  //   Write every dirty sector back to the backing image.  The dirty sectors
+  // are collected CHECKPOINT_BATCH at a time with the image locked, and their
+  // dirty bits are cleared, and then they're written with the image unlocked.
+  // A sector written again in the meantime just gets dirty again and goes in
+  // the next checkpoint.  If a write fails the sector is marked dirty again,
+  // so it'll be retried the next time.  If fLocked is true then the caller
+  // has the image locked the whole time, and nothing can get dirty again.
+  //--
+  std::chrono::steady_clock::time_point tmStart = std::chrono::steady_clock::now();
+  std::vector<uint8_t> abBatch((size_t) CHECKPOINT_BATCH * m_cbSector);
+  uint32_t alBatch[CHECKPOINT_BATCH];
+  uint32_t lNext = 0, nWritten = 0;  bool fOK = true;
+  while (lNext < m_nSectors) {
+    //   Collect the next batch.  Whole words of the bitmap are skipped at a
+    // time, since most of the pack is usually clean ...
+    uint32_t nBatch = 0;
+    if (!fLocked) m_Disk.LockImage();
+    while ((lNext < m_nSectors) && (nBatch < CHECKPOINT_BATCH)) {
+      if (((lNext & 63) == 0) && (m_aqDirty[lNext >> 6] == 0)) {lNext += 64;  continue;}
+      if (IsDirty(lNext)) {
+        memcpy(&abBatch[(size_t) nBatch * m_cbSector], GetSector(lNext), m_cbSector);
+        SetDirty(lNext, false);  alBatch[nBatch++] = lNext;
+      }
+      ++lNext;
+    }
+    if (!fLocked) m_Disk.UnlockImage();
+
+    // And write it ...
+    for (uint32_t i = 0;  i < nBatch;  ++i) {
+      if (m_Disk.WriteBacking(alBatch[i], &abBatch[(size_t) i * m_cbSector])) {
+        ++nWritten;  continue;
+      }
+      LOGS(ERROR, "unit " << m_Disk << " checkpoint failed for LBA " << alBatch[i]);
+      if (!fLocked) m_Disk.LockImage();
+      SetDirty(alBatch[i], true);
+      if (!fLocked) m_Disk.UnlockImage();
+      ++m_cErrors;  fOK = false;
+    }
+  }
+  if ((nWritten > 0) && !m_Disk.SyncBacking()) fOK = false;
+  m_cWritten += nWritten;  ++m_cCheckpoints;
+  m_dLastSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+  if (nWritten > 0)
+    LOGS(DEBUG, "unit " << m_Disk << " checkpoint wrote " << nWritten << " sectors in " << m_dLastSeconds << " seconds");
+  return fOK;
+}
+
+
+void CRamImage::DoCheckpoints()
+{
+  //++
+  //   This is the body of the checkpoint thread.  It just sleeps for the
+  // drive's flush interval and then writes a checkpoint, over and over.  A
+  // flush interval of zero means checkpoints are only written at spin down
+  // and detach.  The interval is checked every time around, so a new one
+  // takes effect after the current sleep ...
+  //--
+  unique_lock<mutex> lock(m_mtxWake);
+  while (!m_fExit) {
+    uint32_t nInterval = m_Disk.GetFlushInterval();
+    if (nInterval == 0)
+      m_cvWake.wait(lock);
+    else
+      m_cvWake.wait_for(lock, std::chrono::seconds(nInterval));
+    if (m_fExit) break;
+    lock.unlock();
+    Checkpoint();
+    lock.lock();
+  }
+}
+
+
+/* static */ void* THREAD_ATTRIBUTES CRamImage::CheckpointLoop (void *pParam)
+{
+  //++
+  // Thread entry point - just call DoCheckpoints() for the right object ...
+  //--
+  CThread *pThread = (CThread *) pParam;
+  CRamImage *pRam = (CRamImage *) pThread->GetParameter();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " is running");
+  pRam->DoCheckpoints();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " terminated");
+  return pThread->End();
+}
@@ -0,0 +1,140 @@
+//++
+// RamImage.hpp -> CRamImage (RAM resident disk image) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   ATTACH /RAM loads the whole pack into memory when the drive is attached,
+// and after that every read and write is just a memcpy() - the image file is
+// never touched by the MASSBUS thread at all.  The pack sizes are fixed by
+// the drive type, so the memory needed is known up front (an RP07 in the simh
+// format is the worst case, at about 890MB).  /HUGEPAGES asks for the
+// memory to be backed by huge (or "large") pages, which saves a lot of TLB
+// misses on a pack that size.  If huge pages aren't available then normal
+// pages are used instead.
+//
+//   Every sector written is marked in a dirty bitmap, and a background
+// checkpoint thread writes the dirty sectors back to the image every /FLUSH
+// seconds.  CDiskDrive also checkpoints when the drive is spun down and when
+// it's detached (which includes when MBS exits).  The RAM image sits above
+// CDiskDrive::WriteBacking(), so the image it writes back to can be a plain
+// file, a sparse file, a chunked container or an overlay.
+//
+//   The sector data and the bitmap belong to the image lock, like any other
+// image data.  The checkpoint copies a batch of dirty sectors (and clears
+// their bits) with the image lock held, and then writes them with the image
+// lock released, so a slow file system never holds up the MASSBUS.  While
+// the RAM image exists, the backing image belongs to the checkpoint instead -
+// it's serialized by LockBacking() and UnlockBacking(), which must be taken
+// BEFORE the image lock if both are needed.  The very last checkpoint, when
+// the RAM image goes away, is written with both locks held so that nothing
+// can change in between.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <vector>               // C++ std::vector template
+#include <mutex>                // C++ std::mutex
+#include <condition_variable>   // C++ std::condition_variable
+#include "Thread.hpp"           // UPELIB CThread portable thread library
+class CDiskDrive;               // we need a forward pointer for this class
+
+
+class CRamImage {
+  //++
+  // RAM resident disk image ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    CHECKPOINT_BATCH = 256,     // sectors copied per image lock
+  };
+
+  // Constructor and destructor ...
+public:
+  CRamImage (CDiskDrive &disk);
+  virtual ~CRamImage();
+private:
+  // Disallow copy and assignment operations with CRamImage objects...
+  CRamImage(const CRamImage &) = delete;
+  CRamImage& operator= (const CRamImage &) = delete;
+
+  // Public properties ...
+public:
+  // Return the size of the image in memory, and whether it's in huge pages ...
+  uint64_t GetBytes() const {return (uint64_t) m_cbSector * m_nSectors;}
+  bool IsHuge() const {return m_fHuge;}
+  // Return the number of sectors waiting to be checkpointed ...
+  uint32_t GetDirty() const {return m_nDirty;}
+  // Return the checkpoint statistics ...
+  uint64_t GetCheckpoints() const {return m_cCheckpoints;}
+  uint64_t GetWritten() const {return m_cWritten;}
+  uint64_t GetErrors() const {return m_cErrors;}
+  double GetLastSeconds() const {return m_dLastSeconds;}
+
+  // Public methods ...
+public:
+  // Allocate the memory (it's all zeros) and return a pointer to any sector ...
+  bool Allocate (uint32_t cbSector, uint32_t nSectors, bool fHuge);
+  uint8_t *GetSector (uint32_t lLBA) const {return m_pbData + (size_t) lLBA*m_cbSector;}
+  // Start or stop the checkpoint thread ...
+  bool Begin();
+  void End();
+  // Read or write one sector (the image must be locked) ...
+  bool Read (uint32_t lLBA, void *pData) const;
+  bool Write (uint32_t lLBA, const void *pData);
+  //   Write every dirty sector back to the image.  CheckpointLocked() is the
+  // same, but the caller already holds the backing lock and the image lock ...
+  bool Checkpoint();
+  bool CheckpointLocked() {return WriteDirty(true);}
+  // Keep the checkpoint away from the backing image ...
+  void LockBacking() {m_mtxBacking.lock();}
+  void UnlockBacking() {m_mtxBacking.unlock();}
+
+  // Private methods ...
+private:
+  // The background thread that writes checkpoints ...
+  static void* THREAD_ATTRIBUTES CheckpointLoop (void *pParam);
+  void DoCheckpoints();
+  // Write all the dirty sectors, with or without the image already locked ...
+  bool WriteDirty (bool fLocked);
+  // Test, set or clear the dirty bit for a sector ...
+  bool IsDirty (uint32_t lLBA) const {return (m_aqDirty[lLBA >> 6] & (1ULL << (lLBA & 63))) != 0;}
+  void SetDirty (uint32_t lLBA, bool fDirty);
+  // Free the memory ...
+  void Free();
+
+  // Private member data ...
+private:
+  CDiskDrive             &m_Disk;       // the drive we belong to
+  CThread                 m_Thread;     // background checkpoint thread
+  std::mutex              m_mtxWake;    // protects m_fExit
+  std::condition_variable m_cvWake;     // signalled to stop the thread
+  bool                    m_fExit;      // true to stop the thread
+  bool                    m_fStarted;   // the thread was started
+  std::mutex              m_mtxBacking; // owns the backing image
+  uint8_t                *m_pbData;     // the sector data
+  size_t                  m_cbAllocated;// size of the memory allocated
+  bool                    m_fHuge;      // the memory is in huge pages
+  uint32_t                m_cbSector;   // image sector size, in bytes
+  uint32_t                m_nSectors;   // number of sectors on the pack
+  uint32_t                m_nDirty;     // number of dirty sectors
+  std::vector<uint64_t>   m_aqDirty;    // one bit for every sector
+  uint64_t                m_cCheckpoints; // number of checkpoints written
+  uint64_t                m_cWritten;   // total sectors checkpointed
+  uint64_t                m_cErrors;    // sectors that couldn't be written
+  double                  m_dLastSeconds; // time taken by the last checkpoint
+};
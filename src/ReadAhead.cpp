@@ -0,0 +1,214 @@
+//++
+// ReadAhead.cpp -> CReadAhead (sequential disk read ahead) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CReadAhead class.  See ReadAhead.hpp for all
+// the details.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memcpy(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "UPE.hpp"              // UPE library FPGA interface methods
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // UPE library image file methods
+#include "MBS.hpp"              // global declarations for this project
+#include "MASSBUS.h"            // MASSBUS commands and registers
+#include "DriveType.hpp"        // internal drive type class
+#include "DECUPE.hpp"           // DEC specific UPE/FPGA class definitions
+#include "BaseDrive.hpp"        // common methods for all MASSBUS drives
+#include "DiskDrive.hpp"        // disk specific emulation
+#include "ReadAhead.hpp"        // declarations for this module
+using std::unique_lock;         // ...
+using std::mutex;               // ...
+
+
+CReadAhead::CReadAhead (CDiskDrive &disk)
+  : m_Disk(disk), m_Thread(&CReadAhead::PrefetchLoop), m_fExit(false),
+    m_lLastLBA(0), m_nRun(0), m_nWindow(MIN_WINDOW), m_lNext(0), m_lEnd(0),
+    m_cReads(0), m_cHits(0), m_cLate(0), m_cPrefetched(0), m_cWasted(0)
+{
+  //++
+  //   Initialize the staging buffer.  The thread isn't started until Begin()
+  // is called ...
+  //--
+  for (uint32_t i = 0;  i < MAX_WINDOW;  ++i) {
+    m_aSlots[i].lLBA = 0;  m_aSlots[i].nState = EMPTY;  m_aSlots[i].fStale = false;
+  }
+  string sName = m_Disk.GetName() + " read ahead";
+  m_Thread.SetName(sName.c_str());
+  m_Thread.SetParameter(this);
+}
+
+
+CReadAhead::~CReadAhead()
+{
+  //++
+  //   Tell the background thread to stop, wake it up if it's waiting, and
+  // then wait for it to exit ...
+  //--
+  {
+    unique_lock<mutex> lock(m_mtxSlots);
+    m_fExit = true;
+  }
+  m_cvWork.notify_all();
+  m_Thread.WaitExit();
+}
+
+
+bool CReadAhead::Begin()
+{
+  //++
+  // Start the read ahead thread ...
+  //--
+  return m_Thread.Begin();
+}
+
+
+bool CReadAhead::Fetch (uint32_t lLBA, uint32_t alData[])
+{
+  //++
+  //   If sector lLBA is in the staging buffer, copy it to alData[] and return
+  // true.  If it's still being read then we wait for it - it'll get here
+  // sooner than if we started over and read it ourselves - but that means
+  // we're not far enough ahead, so the window grows.  If it's not here at
+  // all, return false and the caller has to read it the hard way.
+  //--
+  unique_lock<mutex> lock(m_mtxSlots);
+  SLOT &slot = m_aSlots[lLBA % MAX_WINDOW];
+  ++m_cReads;
+  if ((slot.lLBA != lLBA) || (slot.nState == EMPTY)) return false;
+  if (slot.nState == PENDING) {
+    ++m_cLate;
+    if (m_nWindow < MAX_WINDOW) m_nWindow *= 2;
+    while ((slot.lLBA == lLBA) && (slot.nState == PENDING))  m_cvDone.wait(lock);
+    if ((slot.lLBA != lLBA) || (slot.nState != READY)) return false;
+  }
+  memcpy(alData, slot.alData, sizeof(slot.alData));
+  slot.nState = EMPTY;  ++m_cHits;
+  return true;
+}
+
+
+void CReadAhead::Advance (uint32_t lLBA, uint32_t lLimit)
+{
+  //++
+  //   This is called after every read with the sector that was just read
+  // and the first sector that's NOT on the same cylinder.  If this read
+  // continues a sequential run, then extend the prefetch range to cover the
+  // current window (but not past lLimit) and wake up the background thread.
+  // If the host has gone off somewhere else, then cancel any prefetch that
+  // hasn't started yet.
+  //--
+  unique_lock<mutex> lock(m_mtxSlots);
+  m_nRun = (lLBA == (m_lLastLBA+1)) ? (m_nRun+1) : 0;
+  m_lLastLBA = lLBA;
+  if (m_nRun < TRIGGER) {
+    m_lNext = m_lEnd = 0;  return;
+  }
+  uint32_t lEnd = lLBA + 1 + m_nWindow;
+  if (lEnd > lLimit) lEnd = lLimit;
+  if ((m_lNext <= lLBA) || (m_lNext > lEnd)) m_lNext = lLBA + 1;
+  m_lEnd = lEnd;
+  if (m_lNext < m_lEnd) m_cvWork.notify_one();
+}
+
+
+void CReadAhead::Invalidate (uint32_t lLBA)
+{
+  //++
+  //   Sector lLBA has been written, so throw away any copy we have.  If it's
+  // being read right now, then mark it stale and the thread will throw it
+  // away when it's done ...
+  //--
+  unique_lock<mutex> lock(m_mtxSlots);
+  SLOT &slot = m_aSlots[lLBA % MAX_WINDOW];
+  if (slot.lLBA != lLBA) return;
+  if (slot.nState == PENDING)
+    slot.fStale = true;
+  else
+    slot.nState = EMPTY;
+}
+
+
+void CReadAhead::Flush()
+{
+  //++
+  //   Throw away everything in the staging buffer, cancel any prefetch range
+  // and start sequential detection over.  Like Invalidate(), any read that's
+  // in progress is marked stale ...
+  //--
+  unique_lock<mutex> lock(m_mtxSlots);
+  for (uint32_t i = 0;  i < MAX_WINDOW;  ++i) {
+    if (m_aSlots[i].nState == PENDING)
+      m_aSlots[i].fStale = true;
+    else
+      m_aSlots[i].nState = EMPTY;
+  }
+  m_lNext = m_lEnd = 0;  m_nRun = 0;
+}
+
+
+void CReadAhead::DoPrefetch()
+{
+  //++
+  //   This is the body of the read ahead thread.  It waits for Advance() to
+  // give it a range of sectors, and then reads them one at a time into the
+  // staging buffer.  The lock is released while the image file is being read
+  // so that the MASSBUS thread can keep going.  If we have to reuse a slot
+  // that holds a sector nobody ever asked for, then that prefetch was wasted
+  // and the window shrinks.
+  //--
+  unique_lock<mutex> lock(m_mtxSlots);
+  while (!m_fExit) {
+    if (m_lNext >= m_lEnd) {m_cvWork.wait(lock);  continue;}
+    uint32_t lLBA = m_lNext++;
+    SLOT &slot = m_aSlots[lLBA % MAX_WINDOW];
+    if ((slot.lLBA == lLBA) && (slot.nState != EMPTY)) continue;
+    if (slot.nState == READY) {
+      ++m_cWasted;
+      if (m_nWindow > MIN_WINDOW) m_nWindow /= 2;
+    }
+    slot.lLBA = lLBA;  slot.nState = PENDING;  slot.fStale = false;
+    lock.unlock();
+    bool fOK = m_Disk.ReadSector(lLBA, slot.alData);
+    lock.lock();
+    if (fOK) ++m_cPrefetched;
+    slot.nState = (fOK && !slot.fStale) ? READY : EMPTY;
+    m_cvDone.notify_all();
+  }
+}
+
+
+/* static */ void* THREAD_ATTRIBUTES CReadAhead::PrefetchLoop (void *pParam)
+{
+  //++
+  // Thread entry point - just call DoPrefetch() for the right object ...
+  //--
+  CThread *pThread = (CThread *) pParam;
+  CReadAhead *pReadAhead = (CReadAhead *) pThread->GetParameter();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " is running");
+  pReadAhead->DoPrefetch();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " terminated");
+  return pThread->End();
+}
@@ -0,0 +1,126 @@
+//++
+// ReadAhead.hpp -> CReadAhead (sequential disk read ahead) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A multi sector (aka spiral) read on an RP or RM drive shows up here as a
+// series of separate READ commands for consecutive LBAs, and normally each
+// one waits for its own image file read.  CReadAhead watches the LBAs that
+// CDiskDrive::DoRead() asks for and, once it sees TRIGGER consecutive sectors
+// in a row, has a background thread read the next few sectors into a staging
+// buffer.  With luck, the next READ finds its sector there already unpacked
+// and ready to go to the FPGA.
+//
+//   The prefetch window is adaptive.  It starts out at MIN_WINDOW sectors,
+// doubles (up to MAX_WINDOW) every time a read finds its sector still being
+// fetched, which means we're not far enough ahead, and halves every time a
+// prefetched sector is thrown away unused.  It never goes past the end of
+// the current cylinder, since that's where the host is most likely to stop.
+//
+//   The staging buffer has MAX_WINDOW slots and sector n always goes in slot
+// n % MAX_WINDOW.  Each slot is either EMPTY, PENDING (the background thread
+// is reading it now) or READY.  The slots and the prefetch range are protected
+// by m_mtxSlots, but the sector data is read outside the lock - the only
+// thread that ever touches the data in a PENDING slot is the one reading it.
+// CDiskDrive has to call Invalidate() for every sector it writes, so that we
+// never serve stale data, and Flush() whenever the pack format changes.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <mutex>                // C++ std::mutex
+#include <condition_variable>   // C++ std::condition_variable
+#include "Thread.hpp"           // UPELIB CThread portable thread library
+class CDiskDrive;               // we need a forward pointer for this class
+
+
+class CReadAhead {
+  //++
+  // Sequential read ahead for one disk drive ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    MIN_WINDOW = 4,             // smallest (and initial) prefetch window
+    MAX_WINDOW = 64,            // largest prefetch window (and slot count)
+    TRIGGER    = 2,             // consecutive reads needed to start
+  };
+
+  // Constructor and destructor ...
+public:
+  CReadAhead (CDiskDrive &disk);
+  virtual ~CReadAhead();
+private:
+  // Disallow copy and assignment operations with CReadAhead objects...
+  CReadAhead(const CReadAhead &) = delete;
+  CReadAhead& operator= (const CReadAhead &) = delete;
+
+  // Public properties ...
+public:
+  // Return the current window size and the read ahead statistics ...
+  uint32_t GetWindow() const {return m_nWindow;}
+  uint64_t GetReads() const {return m_cReads;}
+  uint64_t GetHits() const {return m_cHits;}
+  uint64_t GetLate() const {return m_cLate;}
+  uint64_t GetPrefetched() const {return m_cPrefetched;}
+  uint64_t GetWasted() const {return m_cWasted;}
+
+  // Public methods ...
+public:
+  // Start the background thread ...
+  bool Begin();
+  // Return a prefetched sector, if we have it ...
+  bool Fetch (uint32_t lLBA, uint32_t alData[]);
+  // Note that lLBA was read, and prefetch ahead of it (up to lLimit) ...
+  void Advance (uint32_t lLBA, uint32_t lLimit);
+  // Discard a sector (because it was written) or everything ...
+  void Invalidate (uint32_t lLBA);
+  void Flush();
+
+  // Private methods ...
+private:
+  // The background thread that reads ahead ...
+  static void* THREAD_ATTRIBUTES PrefetchLoop (void *pParam);
+  void DoPrefetch();
+
+  // Private member data ...
+private:
+  enum {EMPTY, PENDING, READY};
+  struct SLOT {
+    uint32_t lLBA;                      // sector in this slot
+    uint8_t  nState;                    // EMPTY, PENDING or READY
+    bool     fStale;                    // invalidated while PENDING
+    uint32_t alData[SECTOR_SIZE];       // sector data, unpacked
+  };
+  CDiskDrive             &m_Disk;       // the drive we're reading ahead for
+  CThread                 m_Thread;     // background read ahead thread
+  std::mutex              m_mtxSlots;   // protects everything below
+  std::condition_variable m_cvWork;     // signalled when there's work to do
+  std::condition_variable m_cvDone;     // signalled when a read finishes
+  bool                    m_fExit;      // true to stop the thread
+  SLOT                    m_aSlots[MAX_WINDOW]; // staging buffer
+  uint32_t                m_lLastLBA;   // last sector read by the host
+  uint32_t                m_nRun;       // number of sequential reads so far
+  uint32_t                m_nWindow;    // current prefetch window
+  uint32_t                m_lNext;      // next sector to prefetch
+  uint32_t                m_lEnd;       // end of the prefetch range
+  uint64_t                m_cReads;     // total reads seen
+  uint64_t                m_cHits;      // reads served from the buffer
+  uint64_t                m_cLate;      // ... that had to wait for it
+  uint64_t                m_cPrefetched;// sectors read ahead
+  uint64_t                m_cWasted;    // ... and thrown away unused
+};
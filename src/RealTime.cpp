@@ -0,0 +1,342 @@
+//++
+// RealTime.cpp -> CRealTime (thread scheduling policy) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CRealTime class.  See RealTime.hpp for the
+// details.  There's one version of Apply() and LockMemory() for Windows and
+// another for Linux (everything else, really, but Linux is all we test).
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <stdlib.h>             // strtoul(), etc ...
+#include <string.h>             // strerror(), etc ...
+#include <ctype.h>              // toupper(), etc ...
+#include <errno.h>              // errno, etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
+#include <thread>               // C++ std::this_thread::sleep_until() ...
+#ifdef _WIN32
+#include <windows.h>            // SetThreadAffinityMask(), etc ...
+#else
+#include <pthread.h>            // pthread_setaffinity_np(), etc ...
+#include <sched.h>              // SCHED_FIFO, cpu_set_t, etc ...
+#include <sys/mman.h>           // mlockall(), munlockall() ...
+#endif
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "Thread.hpp"           // UPE library portable thread library
+#include "Latency.hpp"          // CHistogram class
+#include "RealTime.hpp"         // declarations for this module
+using std::lock_guard;          // ...
+using std::mutex;               // ...
+using std::ostringstream;       // ...
+
+// The process wide memory lock ...
+mutex    CRealTime::m_mtxLock;
+uint32_t CRealTime::m_nLocks = 0;
+bool     CRealTime::m_fLocked = false;
+
+// Everything the probe thread needs to know ...
+struct PROBE_PARAMETERS {
+  const CRealTime *pPolicy;     // the policy to test
+  uint32_t         nSamples;    // number of samples to take
+  uint32_t         lPeriod;     // sample period in microseconds
+  CHistogram      *pHistogram;  // where to record the results
+  string           strEffective;// what Apply() got for the probe thread
+};
+
+
+string CRealTime::GetName() const
+{
+  //++
+  // Return the policy as a string, e.g. "CPU 2, REALTIME, LOCK" ...
+  //--
+  ostringstream ss;
+  if (m_nCPU == ANY_CPU)
+    ss << "any CPU";
+  else
+    ss << "CPU " << m_nCPU;
+  ss << ((m_nPriority == PRIORITY_REALTIME) ? ", REALTIME" : ", NORMAL");
+  if (m_fLock) ss << ", LOCK";
+  return ss.str();
+}
+
+
+/*static*/ bool CRealTime::IsMemoryLocked()
+{
+  //++
+  // Return true if mlockall() is in effect right now ...
+  //--
+  lock_guard<mutex> lock(m_mtxLock);
+  return m_fLocked;
+}
+
+
+/*static*/ bool CRealTime::ParseCPU (const string &strArg, int &nCPU)
+{
+  //++
+  //   Parse the argument for /CPU=n - it's either a decimal CPU number or the
+  // keyword ANY.  Note that we don't check that the CPU actually exists here -
+  // if it doesn't, Apply() will fail and the effective policy will say so.
+  //--
+  string strUpper;
+  for (string::const_iterator it = strArg.begin();  it != strArg.end();  ++it)
+    strUpper += (char) toupper(*it);
+  if (strUpper == "ANY") {nCPU = ANY_CPU;  return true;}
+  char *pszEnd;
+  unsigned long n = strtoul(strArg.c_str(), &pszEnd, 10);
+  if (strArg.empty() || (*pszEnd != '\0') || (n > MAX_CPU)) return false;
+  nCPU = (int) n;  return true;
+}
+
+
+/*static*/ void CRealTime::Prefault (volatile void *pBuffer, size_t cbBuffer)
+{
+  //++
+  //   Touch every page of a buffer, so that it's actually in memory.  This is
+  // only useful after LockMemory() - otherwise the OS can just page it out
+  // again - and it does read and write every page, so the caller had better
+  // own the buffer ...
+  //--
+  volatile uint8_t *pb = (volatile uint8_t *) pBuffer;
+  for (size_t i = 0;  i < cbBuffer;  i += PREFAULT_STEP)  pb[i] = pb[i];
+  if (cbBuffer > 0) pb[cbBuffer-1] = pb[cbBuffer-1];
+}
+
+
+/*static*/ void CRealTime::PrefaultStack()
+{
+  //++
+  //   Touch STACK_PREFAULT bytes of the calling thread's stack.  With MCL_FUTURE
+  // the stack pages stay put once they've been touched, so the thread won't
+  // take a page fault the first time it calls something deep.  Unlike
+  // Prefault(), this just writes zeros - the array is never initialized, so
+  // there's nothing worth reading back ...
+  //--
+  volatile uint8_t abStack[STACK_PREFAULT];
+  for (size_t i = 0;  i < sizeof(abStack);  i += PREFAULT_STEP)  abStack[i] = 0;
+  abStack[sizeof(abStack)-1] = 0;
+}
+
+
+#ifdef _WIN32
+string CRealTime::Apply (int nBoost) const
+{
+  //++
+  //   Windows version - set the calling thread's affinity mask and priority.
+  // THREAD_PRIORITY_TIME_CRITICAL is the highest we can ask for, so nBoost
+  // doesn't do anything here.  Note that TIME_CRITICAL only really means
+  // "real time" if the process is in the REALTIME_PRIORITY_CLASS, and that's
+  // up to whoever starts MBS ...
+  //--
+  ostringstream ss;
+  DWORD_PTR lProcess, lSystem, lMask;
+  if (!GetProcessAffinityMask(GetCurrentProcess(), &lProcess, &lSystem))
+    lProcess = (DWORD_PTR) -1;
+  if (m_nCPU == ANY_CPU) {
+    lMask = lProcess;
+  } else if (m_nCPU < (int) (8*sizeof(DWORD_PTR))) {
+    lMask = ((DWORD_PTR) 1) << m_nCPU;
+  } else
+    lMask = 0;
+  if ((lMask != 0) && (SetThreadAffinityMask(GetCurrentThread(), lMask) != 0)) {
+    if (m_nCPU == ANY_CPU) ss << "any CPU"; else ss << "CPU " << m_nCPU;
+  } else {
+    LOGS(WARNING, "unable to run on CPU " << m_nCPU << " (error " << GetLastError() << ")");
+    ss << "any CPU";
+  }
+
+  int nPriority = (m_nPriority == PRIORITY_REALTIME)
+                ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_NORMAL;
+  if (!SetThreadPriority(GetCurrentThread(), nPriority))
+    LOGS(WARNING, "unable to set thread priority (error " << GetLastError() << ")");
+  nPriority = GetThreadPriority(GetCurrentThread());
+  if (nPriority == THREAD_PRIORITY_TIME_CRITICAL)
+    ss << ", TIME_CRITICAL";
+  else
+    ss << ", priority " << nPriority;
+
+  if (m_fLock) PrefaultStack();
+  return ss.str();
+}
+
+
+/*static*/ bool CRealTime::LockMemory()
+{
+  //++
+  //   Windows has VirtualLock() but nothing like mlockall(), and locking every
+  // region by hand isn't worth the trouble.  Count the request so that
+  // UnlockMemory() still balances, but say that it didn't work ...
+  //--
+  lock_guard<mutex> lock(m_mtxLock);
+  if (m_nLocks++ == 0)
+    LOGS(WARNING, "memory locking is not supported on Windows");
+  return false;
+}
+
+
+/*static*/ void CRealTime::UnlockMemory()
+{
+  //++
+  // Windows version - just undo the count ...
+  //--
+  lock_guard<mutex> lock(m_mtxLock);
+  if (m_nLocks > 0) --m_nLocks;
+}
+
+#else
+string CRealTime::Apply (int nBoost) const
+{
+  //++
+  //   Linux version - set the calling thread's CPU affinity and scheduling
+  // policy, and then ask the kernel what we actually got.  SCHED_FIFO needs
+  // CAP_SYS_NICE (or a big enough RLIMIT_RTPRIO) and a failure here is just a
+  // warning - MBS still works, just with more jitter.  /CPU=ANY sets the mask
+  // to every CPU; the kernel quietly limits that to the CPUs in our cpuset.
+  //--
+  pthread_t self = pthread_self();
+  cpu_set_t cpus;  CPU_ZERO(&cpus);
+  if (m_nCPU == ANY_CPU) {
+    for (int i = 0;  i < CPU_SETSIZE;  ++i)  CPU_SET(i, &cpus);
+  } else
+    CPU_SET(m_nCPU, &cpus);
+  int err = pthread_setaffinity_np(self, sizeof(cpus), &cpus);
+  if (err != 0)
+    LOGS(WARNING, "unable to run on CPU " << m_nCPU << " - " << strerror(err));
+
+  struct sched_param param;  int nPolicy;
+  if (m_nPriority == PRIORITY_REALTIME) {
+    nPolicy = SCHED_FIFO;
+    param.sched_priority = FIFO_PRIORITY + nBoost;
+    int nMax = sched_get_priority_max(SCHED_FIFO);
+    if (param.sched_priority > nMax) param.sched_priority = nMax;
+  } else {
+    nPolicy = SCHED_OTHER;  param.sched_priority = 0;
+  }
+  err = pthread_setschedparam(self, nPolicy, &param);
+  if (err != 0)
+    LOGS(WARNING, "unable to set scheduling policy - " << strerror(err));
+
+  if (m_fLock) PrefaultStack();
+
+  // Now report what really happened ...
+  ostringstream ss;
+  if (pthread_getaffinity_np(self, sizeof(cpus), &cpus) == 0) {
+    int nCount = CPU_COUNT(&cpus);
+    if (nCount == 1) {
+      for (int i = 0;  i < CPU_SETSIZE;  ++i)
+        if (CPU_ISSET(i, &cpus)) {ss << "CPU " << i;  break;}
+    } else
+      ss << nCount << " CPUs";
+  } else
+    ss << "any CPU";
+  if (pthread_getschedparam(self, &nPolicy, &param) == 0) {
+    if (nPolicy == SCHED_FIFO)
+      ss << ", SCHED_FIFO " << param.sched_priority;
+    else if (nPolicy == SCHED_RR)
+      ss << ", SCHED_RR " << param.sched_priority;
+    else
+      ss << ", SCHED_OTHER";
+  }
+  return ss.str();
+}
+
+
+/*static*/ bool CRealTime::LockMemory()
+{
+  //++
+  //   Lock all current and future memory with mlockall().  This is counted -
+  // only the first call does anything, and UnlockMemory() doesn't unlock
+  // until every LockMemory() has been undone.  Remember that MCL_FUTURE
+  // applies to everything, including /RAM disk images, so there had better
+  // be enough memory!  Returns true if memory is locked now.
+  //--
+  lock_guard<mutex> lock(m_mtxLock);
+  if (m_nLocks++ == 0) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+      LOGS(WARNING, "unable to lock memory - " << strerror(errno));
+      m_fLocked = false;
+    } else
+      m_fLocked = true;
+  }
+  return m_fLocked;
+}
+
+
+/*static*/ void CRealTime::UnlockMemory()
+{
+  //++
+  // Undo one LockMemory() and, if that's the last one, unlock everything ...
+  //--
+  lock_guard<mutex> lock(m_mtxLock);
+  if (m_nLocks == 0) return;
+  if ((--m_nLocks == 0) && m_fLocked) {
+    munlockall();  m_fLocked = false;
+  }
+}
+#endif
+
+
+/*static*/ void* THREAD_ATTRIBUTES CRealTime::ProbeLoop (void *pParam)
+{
+  //++
+  //   This is the jitter probe thread.  It applies the policy to itself, then
+  // wakes up every lPeriod microseconds and records how late it was.  The
+  // wake up times are absolute, so a late sample doesn't push the others back,
+  // but if we ever get more than a whole period behind then we start over from
+  // now rather than firing a burst of samples to catch up.
+  //--
+  CThread *pThread = (CThread *) pParam;
+  PROBE_PARAMETERS *p = (PROBE_PARAMETERS *) pThread->GetParameter();
+  p->strEffective = p->pPolicy->Apply();
+  std::chrono::microseconds period(p->lPeriod);
+  std::chrono::steady_clock::time_point tmNext = std::chrono::steady_clock::now() + period;
+  for (uint32_t i = 0;  i < p->nSamples;  ++i) {
+    std::this_thread::sleep_until(tmNext);
+    std::chrono::steady_clock::time_point tmNow = std::chrono::steady_clock::now();
+    uint64_t llLate = std::chrono::duration_cast<std::chrono::nanoseconds>(tmNow - tmNext).count();
+    p->pHistogram->Record(llLate);
+    tmNext += period;
+    if (tmNext < tmNow) tmNext = tmNow + period;
+  }
+  return pThread->End();
+}
+
+
+bool CRealTime::Probe (uint32_t nSamples, uint32_t lPeriod, CHistogram &hist, string &strEffective) const
+{
+  //++
+  //   Run the jitter probe and wait for it to finish.  The probe uses its own
+  // thread so that it gets exactly this policy, and the caller (the UI) isn't
+  // affected.  The caller's histogram is reset first.  Returns false only if
+  // the thread couldn't be started at all ...
+  //--
+  PROBE_PARAMETERS params;
+  params.pPolicy = this;  params.nSamples = nSamples;
+  params.lPeriod = (lPeriod > 0) ? lPeriod : (uint32_t) PROBE_PERIOD;
+  params.pHistogram = &hist;  hist.Reset();
+  CThread thread(&CRealTime::ProbeLoop);
+  thread.SetName("jitter probe");  thread.SetParameter(&params);
+  if (!thread.Begin()) return false;
+  thread.WaitExit();
+  strEffective = params.strEffective;
+  return true;
+}
@@ -0,0 +1,133 @@
+//++
+// RealTime.hpp -> CRealTime (thread scheduling policy) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   The MASSBUS threads normally run at the usual priority and the OS is free
+// to move them from one CPU to another.  Most of the time that's fine, but
+// the data transfer code spins waiting for the FIFO, and if the scheduler
+// picks that moment to run something else then the FPGA can time out and
+// the host sees an error.  CRealTime describes how a MASSBUS's threads should
+// be scheduled instead -
+//
+//      /CPU=n              - run only on CPU n (or /CPU=ANY, the default)
+//      /PRIORITY=REALTIME  - use SCHED_FIFO (or /PRIORITY=NORMAL, the default)
+//      /LOCK               - lock all of MBS in memory (or /NOLOCK)
+//
+//   A thread can only change its own scheduling through UPELIB's CThread, so
+// CMBA just remembers the policy and bumps a generation number, and each
+// MASSBUS thread notices that and calls Apply() on itself.  Apply() returns
+// a description of what the thread actually got (e.g. "CPU 2, SCHED_FIFO
+// 50"), which isn't always what was asked for - SCHED_FIFO and mlockall()
+// both need privileges on Linux, and Windows has no mlockall() at all.  The
+// unit workers get one more SCHED_FIFO priority level than the channel
+// thread, so that a worker that has a transfer to do preempts the channel
+// thread polling the command FIFO on the same CPU.
+//
+//   Memory locking is process wide, so LockMemory() and UnlockMemory() keep a
+// count of the MASSBUSes that want it.  Prefault() touches the buffers that
+// aren't already in memory, so the first transfer doesn't take page faults.
+//
+//   Probe() measures scheduling jitter - a thread with the same policy wakes
+// up every lPeriod microseconds and records how late it was, in a
+// CHistogram.  It's a lot like the Linux cyclictest program.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <stddef.h>             // size_t, etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <mutex>                // C++ std::mutex
+#include "Thread.hpp"           // UPELIB CThread portable thread library
+using std::string;              // ...
+class CHistogram;               // we need a forward pointer for this class
+
+
+class CRealTime {
+  //++
+  // Scheduling policy for one MASSBUS's threads ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum PRIORITY {
+    PRIORITY_NORMAL   = 0,      // normal time sharing
+    PRIORITY_REALTIME = 1,      // SCHED_FIFO (or TIME_CRITICAL on Windows)
+  };
+  enum {
+    ANY_CPU        = -1,        // not pinned to any CPU
+    MAX_CPU        = 1023,      // largest CPU number we accept
+    FIFO_PRIORITY  = 50,        // SCHED_FIFO priority for the channel thread
+    STACK_PREFAULT = 65536,     // bytes of stack touched by Apply()
+    PREFAULT_STEP  = 4096,      // smallest page size we expect to see
+    PROBE_PERIOD   = 1000,      // default jitter probe period (microseconds)
+  };
+
+  // Constructor and destructor ...
+public:
+  CRealTime() : m_nCPU(ANY_CPU), m_nPriority(PRIORITY_NORMAL), m_fLock(false) {};
+  virtual ~CRealTime() {};
+
+  // Public properties ...
+public:
+  int GetCPU() const {return m_nCPU;}
+  void SetCPU (int nCPU) {m_nCPU = nCPU;}
+  PRIORITY GetPriority() const {return m_nPriority;}
+  void SetPriority (PRIORITY nPriority) {m_nPriority = nPriority;}
+  bool IsLock() const {return m_fLock;}
+  void SetLock (bool fLock) {m_fLock = fLock;}
+  // Return true if this is just the default policy ...
+  bool IsDefault() const
+    {return (m_nCPU == ANY_CPU) && (m_nPriority == PRIORITY_NORMAL) && !m_fLock;}
+  // Return the policy as a string, e.g. "CPU 2, REALTIME, LOCK" ...
+  string GetName() const;
+  // Return true if memory is locked right now ...
+  static bool IsMemoryLocked();
+
+  // Public methods ...
+public:
+  // Parse a /CPU argument - either a CPU number or ANY ...
+  static bool ParseCPU (const string &strArg, int &nCPU);
+  //   Apply this policy to the calling thread, with nBoost added to the
+  // SCHED_FIFO priority, and return what the thread actually got ...
+  string Apply (int nBoost=0) const;
+  // Lock or unlock all process memory (counted) ...
+  static bool LockMemory();
+  static void UnlockMemory();
+  // Touch every page in a buffer so it's in memory ...
+  static void Prefault (volatile void *pBuffer, size_t cbBuffer);
+  //   Measure the scheduling jitter seen by a thread with this policy.  The
+  // thread wakes up nSamples times, every lPeriod microseconds, and records
+  // how late it was in the histogram.  strEffective gets the policy the probe
+  // thread actually got ...
+  bool Probe (uint32_t nSamples, uint32_t lPeriod, CHistogram &hist, string &strEffective) const;
+
+  // Private methods ...
+private:
+  // Touch STACK_PREFAULT bytes of the calling thread's stack ...
+  static void PrefaultStack();
+  // The jitter probe thread ...
+  static void* THREAD_ATTRIBUTES ProbeLoop (void *pParam);
+
+  // Private member data ...
+private:
+  int       m_nCPU;             // CPU to run on, or ANY_CPU
+  PRIORITY  m_nPriority;        // normal or real time
+  bool      m_fLock;            // lock memory
+  static std::mutex m_mtxLock;  // protects m_nLocks and m_fLocked
+  static uint32_t   m_nLocks;   // number of LockMemory() calls outstanding
+  static bool       m_fLocked;  // true if mlockall() succeeded
+};
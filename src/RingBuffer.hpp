@@ -0,0 +1,90 @@
+//++
+// RingBuffer.hpp -> CRingBuffer (lock free single producer/consumer queue)
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   CRingBuffer is a fixed size circular queue that's safe to use between
+// exactly two threads WITHOUT any locking, provided that one thread only ever
+// calls Put() (the producer) and the other only ever calls Get() (the
+// consumer).  The head index is written only by the producer and the tail
+// index only by the consumer, and the acquire/release ordering on those two
+// indices is all the synchronization we need.
+//
+//   The size must be a power of two, and note that the indices are allowed to
+// run freely and wrap around at 2^32 - only the low order bits are used to
+// address the buffer.  That makes the difference between them the number of
+// entries in the queue, even after they wrap.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, etc ...
+#include <atomic>               // C++ std::atomic template
+
+
+template <typename T, uint32_t SIZE>
+class CRingBuffer {
+  //++
+  // Lock free, single producer, single consumer circular buffer ...
+  //--
+
+  // Constructor and destructor ...
+public:
+  CRingBuffer() : m_nHead(0), m_nTail(0) {
+    static_assert((SIZE & (SIZE-1)) == 0, "CRingBuffer SIZE must be a power of two");
+  }
+  ~CRingBuffer() {};
+private:
+  // Disallow copy and assignment operations with CRingBuffer objects...
+  CRingBuffer(const CRingBuffer &) = delete;
+  CRingBuffer& operator= (const CRingBuffer &) = delete;
+
+  // Public properties ...
+public:
+  // Return the capacity and the current number of entries ...
+  static uint32_t Size() {return SIZE;}
+  uint32_t Count() const
+    {return m_nHead.load(std::memory_order_acquire) - m_nTail.load(std::memory_order_acquire);}
+  bool IsEmpty() const {return Count() == 0;}
+  bool IsFull()  const {return Count() >= SIZE;}
+
+  // Public methods ...
+public:
+  // Add an entry to the queue (producer only!) ...
+  bool Put (const T &t) {
+    uint32_t nHead = m_nHead.load(std::memory_order_relaxed);
+    if ((nHead - m_nTail.load(std::memory_order_acquire)) >= SIZE) return false;
+    m_aData[nHead & (SIZE-1)] = t;
+    m_nHead.store(nHead+1, std::memory_order_release);
+    return true;
+  }
+  // Remove the oldest entry from the queue (consumer only!) ...
+  bool Get (T &t) {
+    uint32_t nTail = m_nTail.load(std::memory_order_relaxed);
+    if (nTail == m_nHead.load(std::memory_order_acquire)) return false;
+    t = m_aData[nTail & (SIZE-1)];
+    m_nTail.store(nTail+1, std::memory_order_release);
+    return true;
+  }
+  //   Discard everything in the queue.  This is only safe to call from the
+  // consumer thread, since it simply advances the tail to match the head...
+  void Flush() {m_nTail.store(m_nHead.load(std::memory_order_acquire), std::memory_order_release);}
+
+  // Private member data ...
+private:
+  T                     m_aData[SIZE];  // the actual queue entries
+  std::atomic<uint32_t> m_nHead;        // next entry to be written (producer)
+  std::atomic<uint32_t> m_nTail;        // next entry to be read (consumer)
+};
@@ -0,0 +1,186 @@
+//++
+// SectorCache.cpp -> CSectorCache (per drive SLRU sector cache) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CSectorCache class.  See SectorCache.hpp for
+// a description of the replacement policy.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <stdlib.h>             // strtoull(), etc ...
+#include <string.h>             // memcpy(), etc ...
+#include <ctype.h>              // toupper(), isdigit(), etc ...
+#include "SectorCache.hpp"      // declarations for this module
+
+
+CSectorCache::CSectorCache (uint64_t cbBudget, uint32_t clSector, uint32_t nMaxSectors)
+  : m_cbBudget(cbBudget), m_clSector(clSector),
+    m_cHits(0), m_cMisses(0), m_cEvictions(0)
+{
+  //++
+  //   Figure out how many sectors fit in the memory budget and allocate all
+  // the entries and buffers now.  Only the sector data is counted against the
+  // budget - the entries and the hash table add a few percent more.  There's
+  // no point in a cache bigger than the whole pack, so nMaxSectors (the pack
+  // size) is a limit too, and that also keeps a silly budget from running us
+  // out of memory.
+  //--
+  assert(clSector > 0);
+  uint64_t nSectors = cbBudget / (clSector * sizeof(uint32_t));
+  if ((nMaxSectors > 0) && (nSectors > nMaxSectors)) nSectors = nMaxSectors;
+  if (nSectors < MIN_SECTORS) nSectors = MIN_SECTORS;
+  if (nSectors > (NIL-1)) nSectors = NIL-1;
+  m_nCapacity = (uint32_t) nSectors;
+  m_nMaxProtected = (uint32_t) (((uint64_t) m_nCapacity * PROTECTED_PERCENT) / 100);
+  m_aEntries.resize(m_nCapacity);
+  m_alData.resize((size_t) m_nCapacity * m_clSector);
+  m_mapLBA.reserve(m_nCapacity);
+  Flush();
+}
+
+
+/* static */ bool CSectorCache::ParseSize (const char *psz, uint64_t &cbSize)
+{
+  //++
+  //   Convert a string like "65536", "512K", "64M" or "2G" to a number of
+  // bytes.  The suffix may be upper or lower case and may be followed by an
+  // optional "B".  Returns false if the string isn't in that format, or if
+  // the result won't fit in 64 bits.
+  //--
+  char *pszEnd;  unsigned nShift = 0;
+  if ((psz == NULL) || !isdigit(*psz)) return false;
+  cbSize = strtoull(psz, &pszEnd, 10);
+  switch (toupper(*pszEnd)) {
+    case 'K': nShift = 10;  ++pszEnd;  break;
+    case 'M': nShift = 20;  ++pszEnd;  break;
+    case 'G': nShift = 30;  ++pszEnd;  break;
+    default:                           break;
+  }
+  if ((cbSize >> (64-nShift-1) >> 1) != 0) return false;
+  cbSize <<= nShift;
+  if (toupper(*pszEnd) == 'B') ++pszEnd;
+  return *pszEnd == '\0';
+}
+
+
+void CSectorCache::Unlink (uint32_t nEntry)
+{
+  //++
+  // Remove an entry from whichever LRU list it's on ...
+  //--
+  ENTRY &e = m_aEntries[nEntry];
+  LIST &l = e.fProtected ? m_Protected : m_Probation;
+  if (e.nPrev != NIL) m_aEntries[e.nPrev].nNext = e.nNext;  else l.nHead = e.nNext;
+  if (e.nNext != NIL) m_aEntries[e.nNext].nPrev = e.nPrev;  else l.nTail = e.nPrev;
+  e.nPrev = e.nNext = NIL;  --l.nCount;
+}
+
+
+void CSectorCache::LinkHead (uint32_t nEntry, bool fProtected)
+{
+  //++
+  // Make an entry the most recently used one in the specified segment ...
+  //--
+  ENTRY &e = m_aEntries[nEntry];
+  LIST &l = fProtected ? m_Protected : m_Probation;
+  e.fProtected = fProtected;  e.nPrev = NIL;  e.nNext = l.nHead;
+  if (l.nHead != NIL) m_aEntries[l.nHead].nPrev = nEntry;  else l.nTail = nEntry;
+  l.nHead = nEntry;  ++l.nCount;
+}
+
+
+const uint32_t *CSectorCache::Find (uint32_t lLBA)
+{
+  //++
+  //   Look up a sector.  If it's found then it moves to the head of the
+  // protected segment - if it was probationary, that's a promotion, and if
+  // that overfills the protected segment then the least recently used
+  // protected sector gets demoted to probation.
+  //--
+  std::unordered_map<uint32_t, uint32_t>::const_iterator it = m_mapLBA.find(lLBA);
+  if (it == m_mapLBA.end()) {++m_cMisses;  return NULL;}
+  uint32_t nEntry = it->second;  ++m_cHits;
+  Unlink(nEntry);  LinkHead(nEntry, true);
+  if (m_Protected.nCount > m_nMaxProtected) {
+    uint32_t nDemote = m_Protected.nTail;
+    Unlink(nDemote);  LinkHead(nDemote, false);
+  }
+  return Data(nEntry);
+}
+
+
+void CSectorCache::Store (uint32_t lLBA, const uint32_t alData[])
+{
+  //++
+  //   Add a sector to the cache.  If it's already cached (e.g. the host is
+  // writing a sector it read earlier) then we just update the data and leave
+  // it in the same segment.  Otherwise we take a free entry or, if there are
+  // none, evict the least recently used probationary sector, and the new
+  // sector starts out on probation.
+  //--
+  std::unordered_map<uint32_t, uint32_t>::const_iterator it = m_mapLBA.find(lLBA);
+  uint32_t nEntry;
+  if (it != m_mapLBA.end()) {
+    nEntry = it->second;
+    bool fProtected = m_aEntries[nEntry].fProtected;
+    Unlink(nEntry);  LinkHead(nEntry, fProtected);
+  } else {
+    if (m_nFree != NIL) {
+      nEntry = m_nFree;  m_nFree = m_aEntries[nEntry].nNext;
+    } else {
+      nEntry = (m_Probation.nTail != NIL) ? m_Probation.nTail : m_Protected.nTail;
+      assert(nEntry != NIL);
+      Unlink(nEntry);  m_mapLBA.erase(m_aEntries[nEntry].lLBA);  ++m_cEvictions;
+    }
+    m_aEntries[nEntry].lLBA = lLBA;  m_mapLBA[lLBA] = nEntry;
+    LinkHead(nEntry, false);
+  }
+  memcpy(Data(nEntry), alData, m_clSector * sizeof(uint32_t));
+}
+
+
+void CSectorCache::Invalidate (uint32_t lLBA)
+{
+  //++
+  // Remove one sector from the cache, if it's there ...
+  //--
+  std::unordered_map<uint32_t, uint32_t>::iterator it = m_mapLBA.find(lLBA);
+  if (it == m_mapLBA.end()) return;
+  uint32_t nEntry = it->second;
+  Unlink(nEntry);  m_mapLBA.erase(it);
+  m_aEntries[nEntry].nNext = m_nFree;  m_nFree = nEntry;
+}
+
+
+void CSectorCache::Flush()
+{
+  //++
+  //   Empty the cache and put all the entries on the free list.  The hit and
+  // miss counts are left alone ...
+  //--
+  m_mapLBA.clear();
+  m_Probation.nHead = m_Probation.nTail = NIL;  m_Probation.nCount = 0;
+  m_Protected.nHead = m_Protected.nTail = NIL;  m_Protected.nCount = 0;
+  for (uint32_t i = 0;  i < m_nCapacity;  ++i) {
+    m_aEntries[i].nPrev = NIL;  m_aEntries[i].fProtected = false;
+    m_aEntries[i].nNext = ((i+1) < m_nCapacity) ? (i+1) : NIL;
+  }
+  m_nFree = (m_nCapacity > 0) ? 0 : NIL;
+}
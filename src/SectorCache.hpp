@@ -0,0 +1,137 @@
+//++
+// SectorCache.hpp -> CSectorCache (per drive SLRU sector cache) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   CSectorCache keeps recently used disk sectors in memory, already unpacked
+// into the FPGA's 18 or 16 bit format, so that a cache hit can go straight to
+// CDECUPE::WriteData() without touching the image file or the unpack code.
+// Every disk drive attached with /CACHE has one of these.  The cache never
+// holds the only copy of a sector.  Normally it's write through - CDiskDrive
+// writes the image file first and then updates the cache.  With /WRITEBEHIND
+// the sector goes into the write behind queue and the cache together, and
+// the image file is written later, but a read always checks that queue
+// before the image file.  Either way, dropping the cache at any time is
+// harmless.
+//
+//   The replacement policy is segmented LRU.  New sectors go into the
+// "probationary" segment, and only a second reference promotes a sector to the
+// "protected" segment, which is limited to PROTECTED_PERCENT of the cache.
+// When the protected segment is full its least recently used sector is
+// demoted back to probation, and it's always the least recently used
+// probationary sector that gets evicted.  The upshot is that one long
+// sequential pass (a backup, say) can only flush the probationary segment and
+// the home blocks, bitmaps, directories and other frequently used sectors
+// survive in the protected segment.
+//
+//   All the sector buffers are allocated up front, and the LRU lists are
+// linked by array index rather than by pointer.  The cache has no locking of
+// its own - it's only ever used by the unit's worker thread (or by the UI
+// while it holds the unit lock).
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <stddef.h>             // size_t, etc ...
+#include <vector>               // C++ std::vector template
+#include <unordered_map>        // C++ std::unordered_map (aka hash table) template
+
+
+class CSectorCache {
+  //++
+  // Segmented LRU cache of unpacked disk sectors ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    PROTECTED_PERCENT = 80,     // maximum size of the protected segment
+    MIN_SECTORS       = 16,     // smallest cache we'll bother with
+  };
+  static const uint64_t MAX_BUDGET = 4ULL << 30;  // largest /CACHE= allowed
+  static const uint32_t NIL = 0xFFFFFFFFUL;  // end of list marker
+
+  // Constructor and destructor ...
+public:
+  CSectorCache (uint64_t cbBudget, uint32_t clSector, uint32_t nMaxSectors);
+  virtual ~CSectorCache() {};
+private:
+  // Disallow copy and assignment operations with CSectorCache objects...
+  CSectorCache(const CSectorCache &) = delete;
+  CSectorCache& operator= (const CSectorCache &) = delete;
+
+  // Public cache properties ...
+public:
+  // Return the cache capacity (in sectors and bytes) and the number in use ...
+  uint32_t GetCapacity() const {return m_nCapacity;}
+  uint64_t GetBudget() const {return m_cbBudget;}
+  uint32_t GetCount() const {return (uint32_t) m_mapLBA.size();}
+  // Return the hit, miss and eviction counts ...
+  uint64_t GetHits() const {return m_cHits;}
+  uint64_t GetMisses() const {return m_cMisses;}
+  uint64_t GetEvictions() const {return m_cEvictions;}
+  // Compute a size in bytes from a string like "64M" ...
+  static bool ParseSize (const char *psz, uint64_t &cbSize);
+
+  // Public cache methods ...
+public:
+  //   Find a sector in the cache.  Returns a pointer to the cached data, or
+  // NULL if it's not cached.  The pointer is good only until the next call
+  // to Store(), Invalidate() or Flush() ...
+  const uint32_t *Find (uint32_t lLBA);
+  // Add a sector to the cache, or update it if it's already there ...
+  void Store (uint32_t lLBA, const uint32_t alData[]);
+  // Remove a sector, or everything, from the cache ...
+  void Invalidate (uint32_t lLBA);
+  void Flush();
+
+  // Private methods ...
+private:
+  // Link and unlink cache entries from the LRU lists ...
+  void Unlink (uint32_t nEntry);
+  void LinkHead (uint32_t nEntry, bool fProtected);
+  // Return a pointer to the data buffer for a cache entry ...
+  uint32_t *Data (uint32_t nEntry) {return &m_alData[(size_t) nEntry * m_clSector];}
+
+  // Private member data ...
+private:
+  //   Every cache entry has one of these, and the entries are linked into
+  // the probationary, protected or free lists via the nPrev and nNext fields.
+  struct ENTRY {
+    uint32_t lLBA;              // sector cached in this entry
+    uint32_t nPrev, nNext;      // LRU list links (array indices)
+    bool     fProtected;        // true if this entry is protected
+  };
+  //   And each list has a head (most recently used), tail (least recently
+  // used) and count ...
+  struct LIST {
+    uint32_t nHead, nTail;      // first and last entries
+    uint32_t nCount;            // number of entries in this list
+  };
+  uint64_t              m_cbBudget;     // memory budget, in bytes
+  uint32_t              m_clSector;     // sector size, in longwords
+  uint32_t              m_nCapacity;    // total number of entries
+  uint32_t              m_nMaxProtected;// maximum size of protected segment
+  std::vector<ENTRY>    m_aEntries;     // all cache entries
+  std::vector<uint32_t> m_alData;       // sector data for all entries
+  std::unordered_map<uint32_t, uint32_t> m_mapLBA;  // LBA -> entry index
+  LIST                  m_Probation;    // probationary segment
+  LIST                  m_Protected;    // protected segment
+  uint32_t              m_nFree;        // list of free entries
+  uint64_t              m_cHits;        // number of cache hits
+  uint64_t              m_cMisses;      //   "    "    "   misses
+  uint64_t              m_cEvictions;   //   "    "  sectors evicted
+};
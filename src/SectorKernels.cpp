@@ -0,0 +1,527 @@
+//++
+// SectorKernels.cpp -> CSectorKernels (sector pack/unpack kernels) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CSectorKernels class, and all the scalar,
+// SSE2 and AVX2 sector conversion routines.  The SIMD routines use compiler
+// intrinsics, and with gcc each one is tagged with a target attribute so that
+// this file (like the rest of MBS) can be compiled without any -m options.
+// They use unaligned loads and stores throughout, since the FPGA buffers and
+// the mapped image data aren't guaranteed to be aligned to anything.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memset(), memcmp(), etc ...
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "MBS.hpp"              // global declarations for this project
+#include "SectorKernels.hpp"    // declarations for this module
+
+//   The SIMD kernels exist only for x86 and x64.  With gcc (or clang) each
+// SIMD routine gets a target attribute, and the CPU is checked with the
+// __builtin_cpu_supports() intrinsic.  Visual C++ doesn't need the attribute,
+// but we have to do CPUID ourselves ...
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define SIMD_KERNELS
+#include <immintrin.h>          // SSE2 and AVX2 intrinsics
+#ifdef _MSC_VER
+#include <intrin.h>             // __cpuid(), _xgetbv(), etc ...
+#define TARGET(x)
+#else
+#define TARGET(x)       __attribute__((target(x)))
+#endif
+#endif
+
+// Benchmark() stores its checksum here so that the loop can't be optimized away ...
+static volatile uint32_t s_lSink;
+
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////   SCALAR KERNELS   //////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static bool ScalarSupported()
+{
+  //++
+  // The scalar kernels work everywhere ...
+  //--
+  return true;
+}
+
+
+static void ScalarUnpack18 (const uint64_t aqData[], uint32_t alData18[], uint32_t clData)
+{
+  //++
+  //   Unpack clData/2 36 bit image file words, right justified in 64 bit
+  // quadwords, into clData 18 bit halfwords for the FPGA ...
+  //--
+  for (uint32_t i = 0; i < clData/2; ++i) {
+    alData18[2*i] = LH36(aqData[i]);
+    alData18[2*i+1] = RH36(aqData[i]);
+  }
+}
+
+
+static void ScalarPack18 (const uint32_t alData18[], uint64_t aqData[], uint32_t clData)
+{
+  //++
+  // And pack 18 bit halfwords from the FPGA back into 36 bit words ...
+  //--
+  for (uint32_t i = 0; i < clData/2; ++i) {
+    uint32_t h = alData18[2*i];
+    uint32_t l = alData18[2*i+1];
+    aqData[i]  = MK36(h, l);
+  }
+}
+
+
+static void ScalarUnpack16 (const uint16_t awData[], uint32_t alData16[], uint32_t clData)
+{
+  //++
+  // Unpack clData 16 bit image file words into 32 bit longwords ...
+  //--
+  for (uint32_t i = 0; i < clData; ++i)
+    alData16[i] = MKLONG(0, awData[i]);
+}
+
+
+static void ScalarPack16 (const uint32_t alData16[], uint16_t awData[], uint32_t clData)
+{
+  //++
+  // And pack 32 bit longwords from the FPGA back into 16 bit words ...
+  //--
+  for (uint32_t i = 0; i < clData; ++i)
+    awData[i] = LOWORD(alData16[i]);
+}
+
+
+static bool ScalarIsZero (const uint64_t aqData[], uint32_t cqData)
+{
+  //++
+  //   Return true if cqData quadwords are all zero.  Real data almost always
+  // has something in the first few words, so check four at a time and quit
+  // as soon as we find anything ...
+  //--
+  for (uint32_t i = 0;  i < cqData;  i += 4)
+    if ((aqData[i] | aqData[i+1] | aqData[i+2] | aqData[i+3]) != 0) return false;
+  return true;
+}
+
+
+#ifdef SIMD_KERNELS
+////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////   SSE2 KERNELS   ///////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static bool SSE2Supported()
+{
+  //++
+  // Return true if this CPU has SSE2 (every x64 CPU does) ...
+  //--
+#ifdef _MSC_VER
+  int anInfo[4];  __cpuid(anInfo, 1);
+  return (anInfo[3] & (1 << 26)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+#endif
+}
+
+
+TARGET("sse2") static void SSE2Unpack18 (const uint64_t aqData[], uint32_t alData18[], uint32_t clData)
+{
+  //++
+  //   Each 64 bit lane holds one 36 bit word.  Shift the left half down, and
+  // the right half up into the high longword, and OR them together.  That
+  // leaves the LH in the first longword and the RH in the second, which is
+  // exactly the FPGA order ...
+  //--
+  const __m128i m18 = _mm_set1_epi64x(0777777);
+  for (uint32_t i = 0;  i < clData/2;  i += 2) {
+    __m128i q = _mm_loadu_si128((const __m128i *) &aqData[i]);
+    __m128i h = _mm_and_si128(_mm_srli_epi64(q, 18), m18);
+    __m128i l = _mm_and_si128(q, m18);
+    _mm_storeu_si128((__m128i *) &alData18[2*i], _mm_or_si128(h, _mm_slli_epi64(l, 32)));
+  }
+}
+
+
+TARGET("sse2") static void SSE2Pack18 (const uint32_t alData18[], uint64_t aqData[], uint32_t clData)
+{
+  //++
+  // The same thing in reverse - each 64 bit lane holds one LH/RH pair ...
+  //--
+  const __m128i m18 = _mm_set1_epi64x(0777777);
+  for (uint32_t i = 0;  i < clData/2;  i += 2) {
+    __m128i v = _mm_loadu_si128((const __m128i *) &alData18[2*i]);
+    __m128i h = _mm_and_si128(v, m18);
+    __m128i l = _mm_and_si128(_mm_srli_epi64(v, 32), m18);
+    _mm_storeu_si128((__m128i *) &aqData[i], _mm_or_si128(_mm_slli_epi64(h, 18), l));
+  }
+}
+
+
+TARGET("sse2") static void SSE2Unpack16 (const uint16_t awData[], uint32_t alData16[], uint32_t clData)
+{
+  //++
+  // Zero extend eight words at a time by interleaving them with zeros ...
+  //--
+  const __m128i zero = _mm_setzero_si128();
+  for (uint32_t i = 0;  i < clData;  i += 8) {
+    __m128i w = _mm_loadu_si128((const __m128i *) &awData[i]);
+    _mm_storeu_si128((__m128i *) &alData16[i],   _mm_unpacklo_epi16(w, zero));
+    _mm_storeu_si128((__m128i *) &alData16[i+4], _mm_unpackhi_epi16(w, zero));
+  }
+}
+
+
+TARGET("sse2") static void SSE2Pack16 (const uint32_t alData16[], uint16_t awData[], uint32_t clData)
+{
+  //++
+  //   SSE2 only has a saturating pack, so first sign extend the low word of
+  // each longword.  Then every value is in range and the pack just keeps the
+  // low 16 bits, which is what we want ...
+  //--
+  for (uint32_t i = 0;  i < clData;  i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i *) &alData16[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *) &alData16[i+4]);
+    a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+    b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+    _mm_storeu_si128((__m128i *) &awData[i], _mm_packs_epi32(a, b));
+  }
+}
+
+
+TARGET("sse2") static bool SSE2IsZero (const uint64_t aqData[], uint32_t cqData)
+{
+  //++
+  //   OR together 32 bytes at a time and compare that with zero.  SSE2 has no
+  // PTEST, so the compare result goes through PMOVMSKB instead ...
+  //--
+  const __m128i zero = _mm_setzero_si128();
+  for (uint32_t i = 0;  i < cqData;  i += 4) {
+    __m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *) &aqData[i]),
+                             _mm_loadu_si128((const __m128i *) &aqData[i+2]));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) return false;
+  }
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////   AVX2 KERNELS   ///////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static bool AVX2Supported()
+{
+  //++
+  //   Return true if this CPU has AVX2 AND the OS saves the YMM registers.
+  // gcc's __builtin_cpu_supports() checks both for us ...
+  //--
+#ifdef _MSC_VER
+  int anInfo[4];  __cpuid(anInfo, 0);
+  if (anInfo[0] < 7) return false;
+  __cpuid(anInfo, 1);
+  if ((anInfo[2] & (1 << 27)) == 0) return false;       // OSXSAVE
+  if ((_xgetbv(0) & 6) != 6) return false;              // XMM and YMM state
+  __cpuidex(anInfo, 7, 0);
+  return (anInfo[1] & (1 << 5)) != 0;                   // AVX2
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+
+TARGET("avx2") static void AVX2Unpack18 (const uint64_t aqData[], uint32_t alData18[], uint32_t clData)
+{
+  //++
+  // Same as SSE2Unpack18(), but four words at a time ...
+  //--
+  const __m256i m18 = _mm256_set1_epi64x(0777777);
+  for (uint32_t i = 0;  i < clData/2;  i += 4) {
+    __m256i q = _mm256_loadu_si256((const __m256i *) &aqData[i]);
+    __m256i h = _mm256_and_si256(_mm256_srli_epi64(q, 18), m18);
+    __m256i l = _mm256_and_si256(q, m18);
+    _mm256_storeu_si256((__m256i *) &alData18[2*i], _mm256_or_si256(h, _mm256_slli_epi64(l, 32)));
+  }
+}
+
+
+TARGET("avx2") static void AVX2Pack18 (const uint32_t alData18[], uint64_t aqData[], uint32_t clData)
+{
+  //++
+  // Same as SSE2Pack18(), but four words at a time ...
+  //--
+  const __m256i m18 = _mm256_set1_epi64x(0777777);
+  for (uint32_t i = 0;  i < clData/2;  i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) &alData18[2*i]);
+    __m256i h = _mm256_and_si256(v, m18);
+    __m256i l = _mm256_and_si256(_mm256_srli_epi64(v, 32), m18);
+    _mm256_storeu_si256((__m256i *) &aqData[i], _mm256_or_si256(_mm256_slli_epi64(h, 18), l));
+  }
+}
+
+
+TARGET("avx2") static void AVX2Unpack16 (const uint16_t awData[], uint32_t alData16[], uint32_t clData)
+{
+  //++
+  // AVX2 has a zero extend instruction, so this one is easy ...
+  //--
+  for (uint32_t i = 0;  i < clData;  i += 8) {
+    __m128i w = _mm_loadu_si128((const __m128i *) &awData[i]);
+    _mm256_storeu_si256((__m256i *) &alData16[i], _mm256_cvtepu16_epi32(w));
+  }
+}
+
+
+TARGET("avx2") static void AVX2Pack16 (const uint32_t alData16[], uint16_t awData[], uint32_t clData)
+{
+  //++
+  //   Same as SSE2Pack16(), except that the 256 bit pack works on each 128
+  // bit lane separately.  That leaves the four quadwords of the result in
+  // the order 0, 2, 1, 3, and the permute puts them back ...
+  //--
+  for (uint32_t i = 0;  i < clData;  i += 16) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) &alData16[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i *) &alData16[i+8]);
+    a = _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16);
+    b = _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16);
+    __m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+    _mm256_storeu_si256((__m256i *) &awData[i], w);
+  }
+}
+
+
+TARGET("avx2") static bool AVX2IsZero (const uint64_t aqData[], uint32_t cqData)
+{
+  //++
+  //   Test 32 bytes at a time with VPTEST.  Each sector is only a few cache
+  // lines, so there's no point in unrolling this any further ...
+  //--
+  for (uint32_t i = 0;  i < cqData;  i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) &aqData[i]);
+    if (!_mm256_testz_si256(v, v)) return false;
+  }
+  return true;
+}
+#endif      // SIMD_KERNELS
+
+
+////////////////////////////////////////////////////////////////////////////////
+///////////////////////////   KERNEL SELECTION   ///////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+//   This table lists all the kernel sets, best first.  The scalar set must
+// always be last, since Select() falls back to it and SelfTest() uses it as
+// the reference ...
+static const CSectorKernels::KERNELS g_aKernels[] = {
+#ifdef SIMD_KERNELS
+  {"AVX2",   &AVX2Supported,   &AVX2Unpack18,   &AVX2Pack18,   &AVX2Unpack16,   &AVX2Pack16,   &AVX2IsZero  },
+  {"SSE2",   &SSE2Supported,   &SSE2Unpack18,   &SSE2Pack18,   &SSE2Unpack16,   &SSE2Pack16,   &SSE2IsZero  },
+#endif
+  {"SCALAR", &ScalarSupported, &ScalarUnpack18, &ScalarPack18, &ScalarUnpack16, &ScalarPack16, &ScalarIsZero},
+};
+static const uint32_t g_nKernels = sizeof(g_aKernels) / sizeof(g_aKernels[0]);
+static const CSectorKernels::KERNELS &g_Scalar = g_aKernels[g_nKernels-1];
+
+// Use the scalar kernels until somebody calls Select() ...
+const CSectorKernels::KERNELS *CSectorKernels::m_pSelected = &g_aKernels[g_nKernels-1];
+
+
+/*static*/ uint32_t CSectorKernels::GetCount()
+{
+  //++
+  // Return the number of kernel sets compiled in ...
+  //--
+  return g_nKernels;
+}
+
+
+/*static*/ const CSectorKernels::KERNELS &CSectorKernels::GetKernels (uint32_t i)
+{
+  //++
+  // Return the i-th kernel set ...
+  //--
+  assert(i < g_nKernels);
+  return g_aKernels[i];
+}
+
+
+/*static*/ const char *CSectorKernels::GetKernelName (KERNEL nKernel)
+{
+  //++
+  // Return the name of one kernel, for messages ...
+  //--
+  switch (nKernel) {
+    case UNPACK18:  return "Unpack18";
+    case PACK18:    return "Pack18";
+    case UNPACK16:  return "Unpack16";
+    case PACK16:    return "Pack16";
+    case ISZERO:    return "IsZero";
+    default:        return "unknown";
+  }
+}
+
+
+/*static*/ bool CSectorKernels::SelfTest (const KERNELS &k)
+{
+  //++
+  //   Run every kernel in this set against the scalar version, for every
+  // possible 18 bit halfword (in both the left and right halves) and every
+  // 16 bit word.  The unused high order bits of the input are filled with
+  // junk, and the two output buffers start out different so that we'll notice
+  // any output that doesn't get written at all.  Returns false and logs the
+  // details if anything is different.
+  //
+  //   This is about 3,000 sectors all together, so it's not worth worrying
+  // about the time it takes.  The zero test gets every bit position in a
+  // full sector, both inside and past the length being tested ...
+  //--
+  uint64_t aqIn[SECTOR_SIZE/2], aqRef[SECTOR_SIZE/2], aqOut[SECTOR_SIZE/2];
+  uint32_t alIn[SECTOR_SIZE], alRef[SECTOR_SIZE], alOut[SECTOR_SIZE];
+  uint16_t awIn[SECTOR_SIZE], awRef[SECTOR_SIZE], awOut[SECTOR_SIZE];
+  uint32_t lSeed = 1;
+#define JUNK()  (lSeed = lSeed*1103515245UL + 12345UL)
+
+  //   Each 18 bit value appears once as a LH and once (complemented) as a RH.
+  // 2^18 values at 128 words per sector is 2048 sectors ...
+  for (uint32_t s = 0;  s < (1UL << 18)/(SECTOR_SIZE/2);  ++s) {
+    for (uint32_t i = 0;  i < SECTOR_SIZE/2;  ++i) {
+      uint32_t h = MASK18(s*(SECTOR_SIZE/2) + i), l = MASK18(~h);
+      aqIn[i] = ((uint64_t) JUNK() << 36) | ((uint64_t) h << 18) | l;
+      alIn[2*i]   = (JUNK() << 18) | h;
+      alIn[2*i+1] = (JUNK() << 18) | l;
+    }
+    memset(alRef, 0, sizeof(alRef));  memset(alOut, 0xFF, sizeof(alOut));
+    ScalarUnpack18(aqIn, alRef, SECTOR_SIZE);  k.pfnUnpack18(aqIn, alOut, SECTOR_SIZE);
+    if (memcmp(alRef, alOut, sizeof(alRef)) != 0) goto failed18;
+    memset(aqRef, 0, sizeof(aqRef));  memset(aqOut, 0xFF, sizeof(aqOut));
+    ScalarPack18(alIn, aqRef, SECTOR_SIZE);  k.pfnPack18(alIn, aqOut, SECTOR_SIZE);
+    if (memcmp(aqRef, aqOut, sizeof(aqRef)) != 0) goto failed18;
+  }
+
+  // And 2^16 values at 256 words per sector is 256 sectors ...
+  for (uint32_t s = 0;  s < (1UL << 16)/SECTOR_SIZE;  ++s) {
+    for (uint32_t i = 0;  i < SECTOR_SIZE;  ++i) {
+      awIn[i] = (uint16_t) (s*SECTOR_SIZE + i);
+      alIn[i] = (JUNK() << 16) | awIn[i];
+    }
+    memset(alRef, 0, sizeof(alRef));  memset(alOut, 0xFF, sizeof(alOut));
+    ScalarUnpack16(awIn, alRef, SECTOR_SIZE);  k.pfnUnpack16(awIn, alOut, SECTOR_SIZE);
+    if (memcmp(alRef, alOut, sizeof(alRef)) != 0) goto failed16;
+    memset(awRef, 0, sizeof(awRef));  memset(awOut, 0xFF, sizeof(awOut));
+    ScalarPack16(alIn, awRef, SECTOR_SIZE);  k.pfnPack16(alIn, awOut, SECTOR_SIZE);
+    if (memcmp(awRef, awOut, sizeof(awRef)) != 0) goto failed16;
+  }
+
+  // And the zero test, for every image sector size ...
+  static const uint32_t acqSizes[] = {64, 72, SECTOR_SIZE/2};
+  for (uint32_t s = 0;  s < sizeof(acqSizes)/sizeof(acqSizes[0]);  ++s) {
+    memset(aqIn, 0, sizeof(aqIn));
+    if (!k.pfnIsZero(aqIn, acqSizes[s])) goto failedzero;
+    for (uint32_t i = 0;  i < SECTOR_SIZE/2;  ++i) {
+      for (uint32_t b = 0;  b < 64;  ++b) {
+        aqIn[i] = 1ULL << b;
+        if (k.pfnIsZero(aqIn, acqSizes[s]) != (i >= acqSizes[s])) goto failedzero;
+      }
+      aqIn[i] = 0;
+    }
+  }
+#undef JUNK
+  return true;
+
+failed18:
+  LOGS(ERROR, k.pszName << " 18 bit kernels failed self test");
+  return false;
+failed16:
+  LOGS(ERROR, k.pszName << " 16 bit kernels failed self test");
+  return false;
+failedzero:
+  LOGS(ERROR, k.pszName << " zero test failed self test");
+  return false;
+}
+
+
+/*static*/ const CSectorKernels::KERNELS &CSectorKernels::Select()
+{
+  //++
+  //   Select the first (i.e. fastest) kernel set that this CPU supports and
+  // that passes the self test ...
+  //--
+  for (uint32_t i = 0;  i < g_nKernels-1;  ++i) {
+    const KERNELS &k = g_aKernels[i];
+    if (!(*k.pfnSupported)()) {
+      LOGS(DEBUG, k.pszName << " sector kernels not supported by this CPU");
+      continue;
+    }
+    if (!SelfTest(k)) continue;
+    m_pSelected = &k;
+    LOGS(DEBUG, "using " << k.pszName << " sector kernels");
+    return k;
+  }
+  m_pSelected = &g_Scalar;
+  LOGS(DEBUG, "using " << g_Scalar.pszName << " sector kernels");
+  return g_Scalar;
+}
+
+
+/*static*/ double CSectorKernels::Benchmark (const KERNELS &k, KERNEL nKernel, uint32_t nSectors)
+{
+  //++
+  //   Run one kernel nSectors times and return the speed in sectors per
+  // second.  The data all stays in the L1 cache, so this measures the
+  // conversion and nothing else.  The zero test gets an all zero, simh
+  // format, sector since that's the worst case.  A checksum of the output goes to s_lSink,
+  // which keeps the compiler from deciding that the whole loop is useless ...
+  //--
+  assert((*k.pfnSupported)());
+  uint64_t aqData[SECTOR_SIZE/2];  uint32_t alData[SECTOR_SIZE];
+  uint16_t awData[SECTOR_SIZE];  uint64_t aqZero[SECTOR_SIZE/2];  uint32_t lSum = 0;
+  memset(aqZero, 0, sizeof(aqZero));
+  for (uint32_t i = 0;  i < SECTOR_SIZE;  ++i) {
+    alData[i] = MASK18(i * 01234567UL);  awData[i] = (uint16_t) (i * 0123457UL);
+    if (i < SECTOR_SIZE/2) aqData[i] = MASK36((uint64_t) i * 0123456701234567ULL);
+  }
+
+  std::chrono::steady_clock::time_point tmStart = std::chrono::steady_clock::now();
+  for (uint32_t n = 0;  n < nSectors;  ++n) {
+    switch (nKernel) {
+      case UNPACK18:
+        (*k.pfnUnpack18)(aqData, alData, SECTOR_SIZE);  lSum += alData[n % SECTOR_SIZE];  break;
+      case PACK18:
+        (*k.pfnPack18)(alData, aqData, SECTOR_SIZE);  lSum += (uint32_t) aqData[n % (SECTOR_SIZE/2)];  break;
+      case UNPACK16:
+        (*k.pfnUnpack16)(awData, alData, SECTOR_SIZE);  lSum += alData[n % SECTOR_SIZE];  break;
+      case PACK16:
+        (*k.pfnPack16)(alData, awData, SECTOR_SIZE);  lSum += awData[n % SECTOR_SIZE];  break;
+      case ISZERO:
+        lSum += (*k.pfnIsZero)(aqZero, SECTOR_SIZE/2) ? 1 : 0;  break;
+      default:        assert(false);
+    }
+  }
+  double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+  s_lSink = lSum;
+  return (dSeconds > 0) ? (nSectors / dSeconds) : 0.0;
+}
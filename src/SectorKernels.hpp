@@ -0,0 +1,110 @@
+//++
+// SectorKernels.hpp -> CSectorKernels (sector pack/unpack kernels) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Every sector that goes between the image file and the FPGA has to be
+// converted - 36 bit words in 64 bit quadwords to and from 18 bit halfwords,
+// or 16 bit words to and from 32 bit longwords.  The CDiskDrive Unpack18(),
+// Pack18(), Unpack16() and Pack16() methods all call through this class,
+// which holds several sets of these four routines, plus a fifth that tests
+// whether an image sector is all zeros (for sparse images) -
+//
+//      AVX2    - 256 bit vectors, for Haswell and later x86 CPUs
+//      SSE2    - 128 bit vectors, for any x64 CPU
+//      SCALAR  - plain C++ loops, for everything else
+//
+// The SIMD versions are only compiled for x86 and x64.  Select() is called
+// once at startup.  It picks the fastest set that this CPU supports, but only
+// after checking it against the scalar code for every possible 16 and 18 bit
+// value (with junk in the unused high order bits, too).  Any set that fails
+// is skipped, so the worst case is the scalar code.  Until Select() is
+// called, the scalar set is used.
+//
+//   Every kernel converts clData FPGA words (halfwords or longwords), which
+// is normally a whole sector but may be any multiple of KERNEL_GRAIN.  That
+// lets the streaming FIFO transfers convert a sector a piece at a time.
+// The zero test works on image file sectors, which are always a multiple
+// of ZERO_GRAIN bytes.
+//
+//   The SHOW KERNELS command calls Benchmark() to report the speed of each
+// routine in every set that this CPU can run.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+
+
+class CSectorKernels {
+  //++
+  // Sector pack/unpack kernel selection ...
+  //--
+
+  // Constants and types ...
+public:
+  // The four conversions and the zero test, for Benchmark() ...
+  enum KERNEL {
+    UNPACK18 = 0,               // 36 bit quadwords -> 18 bit halfwords
+    PACK18   = 1,               // 18 bit halfwords -> 36 bit quadwords
+    UNPACK16 = 2,               // 16 bit words -> 32 bit longwords
+    PACK16   = 3,               // 32 bit longwords -> 16 bit words
+    ISZERO   = 4,               // test an image sector for all zeros
+    KERNEL_COUNT = 5            // number of kernels in each set
+  };
+  // clData must always be a multiple of KERNEL_GRAIN, and the number of
+  // bytes given to IsZero() a multiple of ZERO_GRAIN ...
+  enum {KERNEL_GRAIN = 16, ZERO_GRAIN = 32};
+  // One complete set of kernels ...
+  struct KERNELS {
+    const char *pszName;                                        // "AVX2", "SSE2", etc
+    bool (*pfnSupported) ();                                    // true if this CPU can run them
+    void (*pfnUnpack18) (const uint64_t aqData[], uint32_t alData18[], uint32_t clData);
+    void (*pfnPack18) (const uint32_t alData18[], uint64_t aqData[], uint32_t clData);
+    void (*pfnUnpack16) (const uint16_t awData[], uint32_t alData16[], uint32_t clData);
+    void (*pfnPack16) (const uint32_t alData16[], uint16_t awData[], uint32_t clData);
+    bool (*pfnIsZero) (const uint64_t aqData[], uint32_t cqData);
+  };
+
+  // This class is never instantiated ...
+private:
+  CSectorKernels() = delete;
+
+  // Public properties ...
+public:
+  // Return the kernel set currently in use ...
+  static const KERNELS &GetSelected() {return *m_pSelected;}
+  // Return the number of kernel sets and the i-th set (best first) ...
+  static uint32_t GetCount();
+  static const KERNELS &GetKernels (uint32_t i);
+  // Return the name of one of the kernels ...
+  static const char *GetKernelName (KERNEL nKernel);
+  // Return true if cbData bytes (quadword aligned) are all zero ...
+  static bool IsZero (const void *pData, uint32_t cbData)
+    {return (*m_pSelected->pfnIsZero)((const uint64_t *) pData, cbData / sizeof(uint64_t));}
+
+  // Public methods ...
+public:
+  // Check all the kernel sets and select the best one ...
+  static const KERNELS &Select();
+  // Compare one kernel set against the scalar code ...
+  static bool SelfTest (const KERNELS &k);
+  // Time one kernel and return the speed in sectors per second ...
+  static double Benchmark (const KERNELS &k, KERNEL nKernel, uint32_t nSectors);
+
+  // Private member data ...
+private:
+  static const KERNELS *m_pSelected;    // the set in use now
+};
@@ -0,0 +1,323 @@
+//++
+// SimUPE.cpp -> CUPESimulator (software only FPGA/UPE stand in) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CUPESimulator class, which emulates the FIFOs
+// of the UPE in software and provides a simple host (RH20) model to drive
+// them.  See SimUPE.hpp for more details.
+//
+//   Keep in mind that the PC side methods here are called by the MASSBUS
+// channel thread, while the host side methods are called by whatever thread
+// is running the host model (currently that's the UI thread, via the EXERCISE
+// command).  Each FIFO has one writer and one reader, so no locks are needed
+// for the data path.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
+#include <thread>               // C++ std::this_thread::yield()
+#include "UPELIB.hpp"           // UPE library definitions
+#include "UPE.hpp"              // UPE library FPGA interface methods
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "MBS.hpp"              // global declarations for this project
+#include "MASSBUS.h"            // MASSBUS commands and registers
+#include "DriveType.hpp"        // static drive type data
+#include "DECUPE.hpp"           // DEC specific UPE/FPGA interface methods
+#include "SimUPE.hpp"           // declarations for this module
+using std::chrono::steady_clock;
+using std::chrono::milliseconds;
+using std::chrono::microseconds;
+using std::chrono::duration_cast;
+
+
+CUPESimulator::CUPESimulator (CDECUPE &upe)
+  : m_UPE(upe), m_lSendCount(0), m_cIssued(0), m_cTaken(0),
+    m_cCompleted(0), m_cCommands(0), m_cOverruns(0)
+{
+  //++
+  //   The constructor just initializes the FIFOs (the CRingBuffer constructor
+  // takes care of that) and the counters.  Note that the UPE must be offline
+  // - there's no way to simulate a UPE that's connected to a real FPGA!
+  //--
+  assert(upe.IsOffline());
+}
+
+
+uint32_t CUPESimulator::ReadCommandFIFO()
+{
+  //++
+  //   Pop the next entry from the simulated command FIFO.  Just like the real
+  // FPGA, if the FIFO is empty then we return a longword without the VALID bit
+  // set.
+  //--
+  uint32_t lCommand;
+  if (!m_CommandFIFO.Get(lCommand)) return 0;
+  ++m_cTaken;  ++m_cCommands;
+  return lCommand;
+}
+
+
+uint32_t CUPESimulator::WaitCommand (uint32_t lTimeout)
+{
+  //++
+  //   This is the simulated equivalent of CDECUPE::WaitCommand() - it waits
+  // for something to show up in the command FIFO, or for the timeout (in
+  // milliseconds) to expire.  It returns the command, or zero on a timeout.
+  //--
+  uint32_t lCommand = ReadCommandFIFO();
+  if (CDECUPE::IsCommandValid(lCommand)) return lCommand;
+  std::unique_lock<std::mutex> lock(m_mtxCommand);
+  m_cvCommand.wait_for(lock, milliseconds(lTimeout),
+    [this] {return !m_CommandFIFO.IsEmpty();});
+  lock.unlock();
+  return ReadCommandFIFO();
+}
+
+
+uint32_t CUPESimulator::ReadDataFIFO()
+{
+  //++
+  //   Pop the next word from the "to PC" data FIFO.  Like the hardware, the
+  // VALID bit is set for real data and clear if the FIFO was empty.
+  //--
+  uint32_t lData;
+  if (!m_ToPCFIFO.Get(lData)) return 0;
+  return lData | CDECUPE::VALID;
+}
+
+
+void CUPESimulator::WriteDataFIFO (uint32_t lData)
+{
+  //++
+  //   Push one word into the "from PC" data FIFO.  If the FIFO is full then
+  // the data is lost - that's what the FPGA would do too, and that's why the
+  // tape code has to watch the FROMPC_ALMOST_FULL status bit.
+  //--
+  if (!m_FromPCFIFO.Put(MASK18(lData))) ++m_cOverruns;
+}
+
+
+uint32_t CUPESimulator::ReadFIFO (uint32_t alData[], uint32_t clData)
+{
+  //++
+  //   Take up to clData words from the "to PC" FIFO and return the number we
+  // actually got.  This is the block transfer equivalent of ReadDataFIFO(),
+  // except that the data is already masked and there's no VALID bit.
+  //--
+  uint32_t i;
+  for (i = 0;  i < clData;  ++i)
+    if (!m_ToPCFIFO.Get(alData[i])) break;
+  return i;
+}
+
+
+uint32_t CUPESimulator::WriteFIFO (const uint32_t alData[], uint32_t clData)
+{
+  //++
+  //   Put up to clData words in the "from PC" FIFO, stopping if it fills up,
+  // and return the number actually written.
+  //--
+  uint32_t i;
+  for (i = 0;  i < clData;  ++i)
+    if (!m_FromPCFIFO.Put(MASK18(alData[i]))) break;
+  return i;
+}
+
+
+uint32_t CUPESimulator::ReadFIFOstatus() const
+{
+  //++
+  //   Return the FIFO status bits, computed from the current number of words
+  // in each simulated FIFO.  The thresholds are arbitrary, but the important
+  // thing is that "almost full" and "almost empty" don't overlap...
+  //--
+  uint32_t lStatus = 0;
+  uint32_t nToPC = m_ToPCFIFO.Count(), nFromPC = m_FromPCFIFO.Count();
+  if (nToPC   == 0)                    lStatus |= CDECUPE::TOPC_EMPTY;
+  if (nToPC   <= ALMOST_EMPTY_LEVEL)   lStatus |= CDECUPE::TOPC_ALMOST_EMPTY;
+  if (nToPC   >= ALMOST_FULL_LEVEL)    lStatus |= CDECUPE::TOPC_ALMOST_FULL;
+  if (nToPC   >= DATA_FIFO_SIZE)       lStatus |= CDECUPE::TOPC_FULL;
+  if (nFromPC == 0)                    lStatus |= CDECUPE::FROMPC_EMPTY;
+  if (nFromPC <= ALMOST_EMPTY_LEVEL)   lStatus |= CDECUPE::FROMPC_ALMOST_EMPTY;
+  if (nFromPC >= ALMOST_FULL_LEVEL)    lStatus |= CDECUPE::FROMPC_ALMOST_FULL;
+  if (nFromPC >= DATA_FIFO_SIZE)       lStatus |= CDECUPE::FROMPC_FULL;
+  return lStatus;
+}
+
+
+uint16_t CUPESimulator::HostReadMBR (uint8_t nUnit, uint8_t nRegister) const
+{
+  //++
+  //   The MASSBUS registers are ordinary memory in the simulated window, so
+  // the host just reads them directly.
+  //--
+  assert((nUnit < 8) && (nRegister < 32));
+  return LOWORD(m_UPE.GetWindow()->alRegisters[nUnit][nRegister]);
+}
+
+
+void CUPESimulator::HostWriteMBR (uint8_t nUnit, uint8_t nRegister, uint16_t wValue)
+{
+  //++
+  // Write a MASSBUS register on behalf of the host ...
+  //--
+  assert((nUnit < 8) && (nRegister < 32));
+  m_UPE.GetWindow()->alRegisters[nUnit][nRegister] = wValue;
+}
+
+
+bool CUPESimulator::HostCommand (uint8_t nUnit, uint8_t nRegister, uint16_t wCommand)
+{
+  //++
+  //   This simulates the host writing a command to a drive's command register.
+  // The register itself is updated, and then the command, unit and register
+  // are packed into a command FIFO longword exactly the way the FPGA does it
+  // (see CDECUPE::ExtractCommand(), et al).  Lastly the "interrupt" is raised
+  // to wake up the channel thread.  Returns false if the FIFO is full.
+  //--
+  assert((nUnit < 8) && (nRegister < 32));
+  HostWriteMBR(nUnit, nRegister, wCommand);
+  uint32_t lCommand = CDECUPE::VALID | (nRegister << 19) | (nUnit << 16) | wCommand;
+  if (!m_CommandFIFO.Put(lCommand)) return false;
+  ++m_cIssued;
+  {std::lock_guard<std::mutex> lock(m_mtxCommand);}
+  m_cvCommand.notify_one();
+  return true;
+}
+
+
+uint32_t CUPESimulator::HostSend (const uint32_t alData[], uint32_t clData)
+{
+  //++
+  //   Put data into the "to PC" FIFO, just as if it came from the host over
+  // the MASSBUS.  Returns the number of words actually sent, which will be
+  // less than clData only if the FIFO fills up.
+  //--
+  uint32_t i;
+  for (i = 0;  i < clData;  ++i)
+    if (!m_ToPCFIFO.Put(MASK18(alData[i]))) break;
+  return i;
+}
+
+
+uint32_t CUPESimulator::HostReceive (uint32_t alData[], uint32_t clData, uint32_t lTimeout)
+{
+  //++
+  //   Take clData words out of the "from PC" FIFO, waiting up to lTimeout
+  // milliseconds for them to arrive.  Returns the number of words received.
+  //--
+  steady_clock::time_point tmEnd = steady_clock::now() + milliseconds(lTimeout);
+  uint32_t i = 0;
+  while (i < clData) {
+    if (m_FromPCFIFO.Get(alData[i])) {++i;  continue;}
+    if (steady_clock::now() >= tmEnd) break;
+    std::this_thread::yield();
+  }
+  return i;
+}
+
+
+bool CUPESimulator::HostWaitIdle (uint32_t lTimeout)
+{
+  //++
+  //   Wait for the PC to finish every command queued so far.  "Finished" means
+  // that CMBA::DoCommand() has returned (see CDECUPE::CommandDone()), so any
+  // image file I/O is done too.  Note that it's NOT enough for the channel
+  // thread to come back for another command - with the unit workers, it does
+  // that as soon as the command is queued.  Returns false on a timeout.
+  //--
+  steady_clock::time_point tmEnd = steady_clock::now() + milliseconds(lTimeout);
+  while (m_cCompleted.load() < m_cIssued.load()) {
+    if (steady_clock::now() >= tmEnd) return false;
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+
+void CUPESimulator::CountSector (uint8_t nUnit, bool fWrite)
+{
+  //++
+  //   The real FPGA counts every sector it transfers, per drive, in a pair of
+  // 20 bit counters in the shared memory window.  Do the same here so that
+  // SHOW STATISTICS has something to show for a simulated UPE ...
+  //--
+  assert(nUnit < 8);
+  volatile uint32_t *pl = fWrite ? &m_UPE.GetWindow()->alWriteCounters[nUnit]
+                                 : &m_UPE.GetWindow()->alReadCounters[nUnit];
+  *pl = (*pl + 1) & ((1UL << CDECUPE::COUNTER_BITS) - 1);
+}
+
+
+bool CUPESimulator::ExerciseDisk (uint8_t nUnit, const CDiskType *pType, bool f18Bit,
+                                  bool fWrite, uint32_t cOperations, EXERCISE_RESULT &result)
+{
+  //++
+  //   This is the host model's disk exerciser.  It reads or writes cOperations
+  // consecutive sectors, starting at LBA 0 and wrapping around at the end of
+  // the pack, through the entire MBS data path.  For each sector we load the
+  // RPDC and RPDA registers, queue a READ or WRITE command, and then either
+  // send a sector's worth of data (for writes) or collect one (for reads).
+  // Each operation waits for the previous one to finish, just as a real host
+  // would, so the elapsed time is an honest measure of MBS throughput.
+  //
+  //   Returns false only if the exercise has to be aborted because the PC
+  // stopped responding; individual transfer errors are counted in cErrors.
+  //--
+  assert(pType != NULL);
+  uint32_t alData[SECTOR_SIZE];
+  uint32_t lCapacity = pType->GetCylinders() * pType->GetHeads() * pType->GetSectors(f18Bit);
+  result.cCompleted = result.cErrors = 0;  result.llElapsed = 0;
+  m_FromPCFIFO.Flush();
+
+  steady_clock::time_point tmStart = steady_clock::now();
+  for (uint32_t i = 0;  i < cOperations;  ++i) {
+    // Figure out the disk address and load the RPDC/RPDA registers ...
+    uint32_t lLBA = i % lCapacity;
+    uint16_t nCylinder;  uint8_t nHead, nSector;
+    pType->LBAtoCHS(lLBA, nCylinder, nHead, nSector, f18Bit);
+    HostWriteMBR(nUnit, RPDC, nCylinder);
+    HostWriteMBR(nUnit, RPDA, MKWORD(nHead, nSector));
+
+    if (fWrite) {
+      //   For a write, put the data in the FIFO first and then issue the
+      // command.  A real host would send the data after the command, but
+      // the PC would just spin waiting for it anyway.
+      for (uint32_t j = 0;  j < SECTOR_SIZE;  ++j)
+        alData[j] = MASK18((lLBA << 8) | j);
+      if (HostSend(alData, SECTOR_SIZE) != SECTOR_SIZE) ++result.cErrors;
+      if (!HostCommand(nUnit, RPCR, RPCMD_WRITE)) return false;
+    } else {
+      // For reads, issue the command and then collect the data ...
+      if (!HostCommand(nUnit, RPCR, RPCMD_READ)) return false;
+      if (HostReceive(alData, SECTOR_SIZE) != SECTOR_SIZE) ++result.cErrors;
+    }
+
+    // Wait for the PC to finish, and we're done with this sector ...
+    if (!HostWaitIdle()) {
+      LOGF(WARNING, "simulated host timeout on unit %d, LBA %d", nUnit, lLBA);
+      return false;
+    }
+    CountSector(nUnit, fWrite);
+    ++result.cCompleted;
+  }
+  result.llElapsed = duration_cast<microseconds>(steady_clock::now() - tmStart).count();
+  return true;
+}
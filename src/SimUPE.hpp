@@ -0,0 +1,153 @@
+//++
+// SimUPE.hpp -> CUPESimulator (software only FPGA/UPE stand in) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   The CUPESimulator class lets an offline UPE do real work.  Most of the UPE
+// shared memory window (the MASSBUS registers, geometry, clock divisors, etc)
+// is just memory, and for an offline UPE it's already backed by an ordinary
+// block of PC memory.  The FIFOs are another story - reading the command or
+// data FIFO pops an entry, and plain memory can't do that.  This class
+// emulates the command FIFO, the "to PC" and "from PC" data FIFOs, the FIFO
+// status bits and the word count handshake, and CDECUPE redirects all FIFO
+// accesses here when the UPE is simulated.
+//
+//   The other half of this class is the "host model" - a minimal stand in for
+// the RH20 and the host CPU.  It can write MASSBUS registers, queue commands
+// in the command FIFO, feed data to the PC and collect data from it.  That's
+// enough to drive the whole CMBA::CommandLoop -> CDiskDrive -> CDECUPE data
+// path without any hardware, which is what the EXERCISE command uses to
+// measure throughput.
+//
+//   Each FIFO has exactly one producer and one consumer (either the MASSBUS
+// side or the thread running the host model) so they're all just lock free
+// CRingBuffer objects.  On the MASSBUS side the command FIFO belongs to the
+// channel thread, and the data FIFOs belong to whichever unit worker holds
+// the UPE transfer lock - only one at a time, so that's still one consumer.
+//
+//   The simulator is also a CTransferEngine, so SET UPE /DMA on a simulated
+// UPE moves whole blocks in and out of the simulated FIFOs at once.  That
+// makes it possible to exercise and benchmark the block transfer code path
+// without a real UPE.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, etc ...
+#include <atomic>               // C++ std::atomic template
+#include <mutex>                // C++ std::mutex
+#include <condition_variable>   // C++ std::condition_variable
+#include "RingBuffer.hpp"       // lock free single producer/consumer queue
+#include "TransferEngine.hpp"   // abstract data transfer engine interface
+class CDECUPE;                  // we need forward pointers for this class
+class CDiskType;                //   ... and this one ....
+
+
+class CUPESimulator : public CTransferEngine {
+  //++
+  // Software emulation of the UPE FIFOs plus a simple host model ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    COMMAND_FIFO_SIZE  =   64,  // depth of the simulated command FIFO
+    DATA_FIFO_SIZE     = 4096,  // depth of both simulated data FIFOs
+    ALMOST_EMPTY_LEVEL =  256,  // FIFO "almost empty" threshold
+    ALMOST_FULL_LEVEL  = DATA_FIFO_SIZE-256,  // and "almost full" threshold
+    HOST_TIMEOUT       = 1000,  // host model timeout (milliseconds)
+  };
+
+  // Results from the host model exerciser ...
+  struct EXERCISE_RESULT {
+    uint32_t cCompleted;        // number of operations completed
+    uint32_t cErrors;           // number of operations that failed
+    uint64_t llElapsed;         // total elapsed time (microseconds)
+  };
+
+  // Constructor and destructor ...
+public:
+  CUPESimulator (CDECUPE &upe);
+  virtual ~CUPESimulator() {};
+private:
+  // Disallow copy and assignment operations with CUPESimulator objects...
+  CUPESimulator(const CUPESimulator &) = delete;
+  CUPESimulator& operator= (const CUPESimulator &) = delete;
+
+  // PC side of the simulated FIFOs (called via CDECUPE) ...
+public:
+  // Pop the next command, or return zero (i.e. not VALID) if there is none ...
+  uint32_t ReadCommandFIFO();
+  // Called when the PC has completely finished one command ...
+  void CommandDone() {++m_cCompleted;}
+  // Wait (up to lTimeout milliseconds) for a command to appear ...
+  uint32_t WaitCommand (uint32_t lTimeout);
+  // Pop the next data word from the host, or zero if the FIFO is empty ...
+  uint32_t ReadDataFIFO();
+  // Push a data word to the host ...
+  void WriteDataFIFO (uint32_t lData);
+  // Read the FIFO status bits (TOPC_xyz and FROMPC_xyz) ...
+  uint32_t ReadFIFOstatus() const;
+  // Write the send word count register ...
+  void WriteSendCount (uint32_t lCount) {m_lSendCount.store(lCount);}
+  // Block transfers to and from the simulated data FIFOs ...
+  virtual const char *GetTransferName() const {return "SIM";}
+  virtual uint32_t ReadFIFO (uint32_t alData[], uint32_t clData);
+  virtual uint32_t WriteFIFO (const uint32_t alData[], uint32_t clData);
+
+  // Host side of the simulation (the "host model") ...
+public:
+  // Read or write a MASSBUS register the way the RH20 would ...
+  uint16_t HostReadMBR (uint8_t nUnit, uint8_t nRegister) const;
+  void HostWriteMBR (uint8_t nUnit, uint8_t nRegister, uint16_t wValue);
+  // Queue a command for the PC, exactly as the FPGA would ...
+  bool HostCommand (uint8_t nUnit, uint8_t nRegister, uint16_t wCommand);
+  // Send data to the PC, or receive data from it ...
+  uint32_t HostSend (const uint32_t alData[], uint32_t clData);
+  uint32_t HostReceive (uint32_t alData[], uint32_t clData, uint32_t lTimeout=HOST_TIMEOUT);
+  // Return the last word count (and exception flag) written by the PC ...
+  uint32_t GetSendCount() const {return m_lSendCount.load();}
+  // Wait for the PC to finish all the commands queued so far ...
+  bool HostWaitIdle (uint32_t lTimeout=HOST_TIMEOUT);
+  // Run a series of sequential disk transfers through the entire data path ...
+  bool ExerciseDisk (uint8_t nUnit, const CDiskType *pType, bool f18Bit,
+                     bool fWrite, uint32_t cOperations, EXERCISE_RESULT &result);
+
+  // Bump the simulated FPGA sector counters ...
+private:
+  void CountSector (uint8_t nUnit, bool fWrite);
+
+  // Simulation statistics ...
+public:
+  uint64_t GetCommandCount() const {return m_cCommands;}
+  uint64_t GetOverrunCount() const {return m_cOverruns;}
+
+  // Private member data ...
+private:
+  CDECUPE  &m_UPE;                          // the (offline) UPE we're simulating
+  CRingBuffer<uint32_t, COMMAND_FIFO_SIZE> m_CommandFIFO; // host -> PC commands
+  CRingBuffer<uint32_t, DATA_FIFO_SIZE> m_ToPCFIFO;       // host -> PC data
+  CRingBuffer<uint32_t, DATA_FIFO_SIZE> m_FromPCFIFO;     // PC -> host data
+  std::atomic<uint32_t>   m_lSendCount;     // last value written to lSendCount
+  std::atomic<uint64_t>   m_cIssued;        // commands queued by the host
+  std::atomic<uint64_t>   m_cTaken;         // commands popped by the PC
+  std::atomic<uint64_t>   m_cCompleted;     // commands finished by the PC
+  std::atomic<uint64_t>   m_cCommands;      // total commands processed
+  std::atomic<uint64_t>   m_cOverruns;      // words lost to a full FIFO
+  //   The real FPGA interrupts the PC when something is added to the command
+  // FIFO, and this condition variable plays the same role here ...
+  std::mutex              m_mtxCommand;     // mutex for the "interrupt"
+  std::condition_variable m_cvCommand;      // signalled by HostCommand()
+};
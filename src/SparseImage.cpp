@@ -0,0 +1,420 @@
+//++
+// SparseImage.cpp -> CSparseImage (sparse disk image file) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CSparseImage class.  Read(), Write() and the
+// bitmap are the same everywhere, and there's one version of the file I/O
+// routines for Windows and another for everything else.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memset(), strerror(), etc ...
+#include <errno.h>              // errno, ENXIO, etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#ifdef _WIN32
+#include <windows.h>            // CreateFile(), ReadFile(), etc ...
+#include <winioctl.h>           // FSCTL_SET_ZERO_DATA, etc ...
+#else
+#include <fcntl.h>              // open(), fallocate(), FALLOC_FL_PUNCH_HOLE, etc ...
+#include <unistd.h>             // close(), pread(), pwrite(), lseek(), etc ...
+#include <sys/stat.h>           // fstat(), stat() ...
+#endif
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "SectorKernels.hpp"    // SIMD zero test
+#include "SparseImage.hpp"      // declarations for this module
+
+
+CSparseImage::CSparseImage()
+  : m_fReadOnly(false), m_fPunch(false), m_cbSector(0), m_cbBlock(0), m_nSectors(0), m_nZero(0),
+    m_cElidedReads(0), m_cElidedWrites(0), m_cPunched(0)
+{
+  //++
+  // The constructor doesn't do anything - call Open() to get started ...
+  //--
+#ifdef _WIN32
+  m_hFile = INVALID_HANDLE_VALUE;
+#else
+  m_fd = -1;
+#endif
+}
+
+
+void CSparseImage::SetZero (uint32_t lLBA, bool fZero)
+{
+  //++
+  // Set or clear the zero bit for one sector, and keep count ...
+  //--
+  assert(lLBA < m_nSectors);
+  uint8_t bMask = (uint8_t) (1 << (lLBA & 7));
+  if (fZero == ((m_abZero[lLBA >> 3] & bMask) != 0)) return;
+  if (fZero) {
+    m_abZero[lLBA >> 3] |= bMask;  ++m_nZero;
+  } else {
+    m_abZero[lLBA >> 3] &= ~bMask;  --m_nZero;
+  }
+}
+
+
+void CSparseImage::MarkHole (uint64_t llStart, uint64_t llEnd)
+{
+  //++
+  //   Mark every sector that lies entirely between llStart and llEnd as zero.
+  // A sector that's only partly in the hole has to stay unknown ...
+  //--
+  uint64_t lFirst = (llStart + m_cbSector - 1) / m_cbSector;
+  uint64_t lLast  = llEnd / m_cbSector;
+  if (lLast > m_nSectors) lLast = m_nSectors;
+  for (uint64_t lLBA = lFirst;  lLBA < lLast;  ++lLBA) SetZero((uint32_t) lLBA, true);
+}
+
+
+bool CSparseImage::IsZeroRange (uint64_t llStart, uint64_t llEnd) const
+{
+  //++
+  //   Return true if every sector that overlaps the bytes from llStart up to
+  // (but not including) llEnd is known to be zero.  Sectors past the end of
+  // the pack don't count ...
+  //--
+  uint64_t lLast = (llEnd + m_cbSector - 1) / m_cbSector;
+  if (lLast > m_nSectors) lLast = m_nSectors;
+  for (uint64_t lLBA = llStart / m_cbSector;  lLBA < lLast;  ++lLBA)
+    if (!IsZero((uint32_t) lLBA)) return false;
+  return true;
+}
+
+
+bool CSparseImage::Punch (uint32_t lLBA)
+{
+  //++
+  //   Punch a hole for one sector.  The hole is stretched out to the start of
+  // the file system block if all the sectors before this one in the block are
+  // zero, and likewise to the end of the block.  The caller hasn't marked this
+  // sector as zero yet, but it doesn't count in either test ...
+  //--
+  uint64_t llStart = (uint64_t) lLBA * m_cbSector, llEnd = llStart + m_cbSector;
+  uint64_t llBlockStart = llStart - (llStart % m_cbBlock);
+  uint64_t llBlockEnd = ((llEnd + m_cbBlock - 1) / m_cbBlock) * m_cbBlock;
+  if ((llBlockStart < llStart) && IsZeroRange(llBlockStart, llStart)) llStart = llBlockStart;
+  if ((llBlockEnd > llEnd) && IsZeroRange(llEnd, llBlockEnd)) llEnd = llBlockEnd;
+  return PunchRange(llStart, llEnd);
+}
+
+
+bool CSparseImage::Open (const string &strFileName, bool fReadOnly, uint32_t cbSector, uint32_t nSectors)
+{
+  //++
+  //   Open the image file and build the bitmap of zero sectors.  Anything
+  // past the end of the file reads as zeros, so that's always in it ...
+  //--
+  assert(!IsOpen() && ((cbSector % CSectorKernels::ZERO_GRAIN) == 0));
+  m_strFileName = strFileName;  m_fReadOnly = fReadOnly;
+  m_cbSector = cbSector;  m_nSectors = nSectors;  m_nZero = 0;
+  m_cElidedReads = m_cElidedWrites = m_cPunched = 0;
+  m_abZero.assign(((size_t) nSectors + 7) / 8, 0);
+  uint64_t cbFile;
+#ifdef _WIN32
+  m_hFile = CreateFileA(strFileName.c_str(), fReadOnly ? GENERIC_READ : (GENERIC_READ|GENERIC_WRITE),
+    FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_hFile == INVALID_HANDLE_VALUE) {
+    LOGS(ERROR, "unable to open " << strFileName << ", error " << GetLastError());
+    return false;
+  }
+  LARGE_INTEGER liSize;  DWORD cbReturned;
+  if (!GetFileSizeEx(m_hFile, &liSize)) {
+    LOGS(ERROR, "unable to size " << strFileName << ", error " << GetLastError());
+    Close();  return false;
+  }
+  cbFile = liSize.QuadPart;
+  // NTFS allocates sparse files in 64K units ...
+  m_cbBlock = 65536;
+  // NTFS won't make holes in a file unless it's flagged as sparse first ...
+  m_fPunch = !fReadOnly
+    && DeviceIoControl(m_hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &cbReturned, NULL);
+#else
+  struct stat st;
+  m_fd = open(strFileName.c_str(), fReadOnly ? O_RDONLY : O_RDWR);
+  if ((m_fd < 0) || (fstat(m_fd, &st) != 0)) {
+    LOGS(ERROR, "unable to open " << strFileName << " - " << strerror(errno));
+    Close();  return false;
+  }
+  cbFile = st.st_size;  m_cbBlock = (st.st_blksize > 0) ? (uint32_t) st.st_blksize : 4096;
+#ifdef FALLOC_FL_PUNCH_HOLE
+  m_fPunch = !fReadOnly;
+#endif
+#endif
+  if (!Scan(cbFile))
+    LOGS(WARNING, "unable to find the holes in " << strFileName);
+  MarkHole(cbFile, (uint64_t) nSectors * cbSector);
+  LOGS(DEBUG, "sparse image " << strFileName << " has " << m_nZero << " of "
+    << nSectors << " sectors zero" << (m_fPunch ? "" : ", no hole punching"));
+  return true;
+}
+
+
+bool CSparseImage::Read (uint32_t lLBA, void *pData)
+{
+  //++
+  //   Read one sector.  If it's known to be zero then we're done right away,
+  // and if it turns out to be zero then we'll know for next time ...
+  //--
+  assert(IsOpen());
+  if (IsZero(lLBA)) {
+    memset(pData, 0, m_cbSector);  ++m_cElidedReads;  return true;
+  }
+  if (!ReadAt((uint64_t) lLBA * m_cbSector, pData, m_cbSector)) {
+    LOGS(ERROR, "error reading sector " << lLBA << " from " << m_strFileName);
+    return false;
+  }
+  if ((lLBA < m_nSectors) && CSectorKernels::IsZero(pData, m_cbSector)) SetZero(lLBA, true);
+  return true;
+}
+
+
+bool CSparseImage::Write (uint32_t lLBA, const void *pData)
+{
+  //++
+  //   Write one sector.  Writing zeros over a sector that's already zero does
+  // nothing at all, and otherwise writing zeros punches a hole (if we can).
+  // Anything else is written to the file normally ...
+  //--
+  assert(IsOpen());
+  if (m_fReadOnly || (lLBA >= m_nSectors)) {
+    LOGS(ERROR, "invalid write to sector " << lLBA << " of " << m_strFileName);
+    return false;
+  }
+  bool fZero = CSectorKernels::IsZero(pData, m_cbSector);
+  if (fZero) {
+    if (IsZero(lLBA)) {++m_cElidedWrites;  return true;}
+    if (m_fPunch && Punch(lLBA)) {
+      SetZero(lLBA, true);  ++m_cPunched;  return true;
+    }
+  }
+  if (!WriteAt((uint64_t) lLBA * m_cbSector, pData, m_cbSector)) {
+    LOGS(ERROR, "error writing sector " << lLBA << " to " << m_strFileName);
+    return false;
+  }
+  SetZero(lLBA, fZero);
+  return true;
+}
+
+
+#ifdef _WIN32
+bool CSparseImage::IsOpen() const
+{
+  //++
+  // Return true if the file is open ...
+  //--
+  return m_hFile != INVALID_HANDLE_VALUE;
+}
+
+
+void CSparseImage::Close()
+{
+  //++
+  // Close the file.  Every write has already been done ...
+  //--
+  if (m_hFile != INVALID_HANDLE_VALUE) CloseHandle(m_hFile);
+  m_hFile = INVALID_HANDLE_VALUE;
+}
+
+
+bool CSparseImage::Scan (uint64_t cbFile)
+{
+  //++
+  //   Ask NTFS for the allocated ranges in the file, and everything between
+  // them is a hole.  The ranges come back a buffer full at a time ...
+  //--
+  FILE_ALLOCATED_RANGE_BUFFER query, aRanges[64];  DWORD cbReturned;
+  uint64_t llPos = 0;
+  query.FileOffset.QuadPart = 0;  query.Length.QuadPart = cbFile;
+  for (;;) {
+    BOOL fOK = DeviceIoControl(m_hFile, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+      aRanges, sizeof(aRanges), &cbReturned, NULL);
+    if (!fOK && (GetLastError() != ERROR_MORE_DATA)) return false;
+    uint32_t nRanges = cbReturned / sizeof(aRanges[0]);
+    for (uint32_t i = 0;  i < nRanges;  ++i) {
+      MarkHole(llPos, aRanges[i].FileOffset.QuadPart);
+      llPos = aRanges[i].FileOffset.QuadPart + aRanges[i].Length.QuadPart;
+    }
+    if (fOK || (nRanges == 0)) break;
+    query.FileOffset.QuadPart = llPos;  query.Length.QuadPart = cbFile - llPos;
+  }
+  MarkHole(llPos, cbFile);
+  return true;
+}
+
+
+bool CSparseImage::ReadAt (uint64_t llOffset, void *pData, uint32_t cbData)
+{
+  //++
+  //   Read with an explicit offset.  Anything past the end of the file reads
+  // as zeros ...
+  //--
+  OVERLAPPED ov;  DWORD cbRead = 0;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD) (llOffset & 0xFFFFFFFFUL);  ov.OffsetHigh = (DWORD) (llOffset >> 32);
+  if (!ReadFile(m_hFile, pData, cbData, &cbRead, &ov) && (GetLastError() != ERROR_HANDLE_EOF))
+    return false;
+  if (cbRead < cbData) memset((uint8_t *) pData + cbRead, 0, cbData - cbRead);
+  return true;
+}
+
+
+bool CSparseImage::WriteAt (uint64_t llOffset, const void *pData, uint32_t cbData)
+{
+  //++
+  // Write with an explicit offset ...
+  //--
+  OVERLAPPED ov;  DWORD cbWritten = 0;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD) (llOffset & 0xFFFFFFFFUL);  ov.OffsetHigh = (DWORD) (llOffset >> 32);
+  return WriteFile(m_hFile, pData, cbData, &cbWritten, &ov) && (cbWritten == cbData);
+}
+
+
+bool CSparseImage::PunchRange (uint64_t llStart, uint64_t llEnd)
+{
+  //++
+  //   Zero a range with FSCTL_SET_ZERO_DATA, which deallocates any whole
+  // allocation units in it ...
+  //--
+  FILE_ZERO_DATA_INFORMATION fzd;  DWORD cbReturned;
+  fzd.FileOffset.QuadPart = llStart;  fzd.BeyondFinalZero.QuadPart = llEnd;
+  if (DeviceIoControl(m_hFile, FSCTL_SET_ZERO_DATA, &fzd, sizeof(fzd), NULL, 0, &cbReturned, NULL))
+    return true;
+  LOGS(WARNING, "unable to punch holes in " << m_strFileName << ", error " << GetLastError());
+  m_fPunch = false;  return false;
+}
+
+
+/*static*/ bool CSparseImage::GetFileSizes (const string &strFileName, uint64_t &cbLogical, uint64_t &cbAllocated)
+{
+  //++
+  //   The "compressed" size is the space actually allocated, whether the file
+  // is compressed or sparse ...
+  //--
+  WIN32_FILE_ATTRIBUTE_DATA fad;  DWORD dwHigh;
+  if (!GetFileAttributesExA(strFileName.c_str(), GetFileExInfoStandard, &fad)) return false;
+  cbLogical = ((uint64_t) fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+  DWORD dwLow = GetCompressedFileSizeA(strFileName.c_str(), &dwHigh);
+  if ((dwLow == INVALID_FILE_SIZE) && (GetLastError() != NO_ERROR)) return false;
+  cbAllocated = ((uint64_t) dwHigh << 32) | dwLow;
+  return true;
+}
+
+#else
+
+bool CSparseImage::IsOpen() const
+{
+  //++
+  // Return true if the file is open ...
+  //--
+  return m_fd >= 0;
+}
+
+
+void CSparseImage::Close()
+{
+  //++
+  // Close the file.  Every write has already been done ...
+  //--
+  if (m_fd >= 0) close(m_fd);
+  m_fd = -1;
+}
+
+
+bool CSparseImage::Scan (uint64_t cbFile)
+{
+  //++
+  //   Walk the file with SEEK_DATA and SEEK_HOLE.  A file system that doesn't
+  // really support them just reports the whole file as data, which is fine.
+  // SEEK_DATA fails with ENXIO if there's no more data after the offset ...
+  //--
+#ifdef SEEK_DATA
+  uint64_t llPos = 0;
+  while (llPos < cbFile) {
+    off_t llData = lseek(m_fd, (off_t) llPos, SEEK_DATA);
+    if (llData < 0) {
+      if (errno != ENXIO) return false;
+      MarkHole(llPos, cbFile);  break;
+    }
+    MarkHole(llPos, llData);
+    off_t llHole = lseek(m_fd, llData, SEEK_HOLE);
+    if (llHole < 0) return false;
+    llPos = llHole;
+  }
+#endif
+  return true;
+}
+
+
+bool CSparseImage::ReadAt (uint64_t llOffset, void *pData, uint32_t cbData)
+{
+  //++
+  //   Read with an explicit offset.  Anything past the end of the file reads
+  // as zeros ...
+  //--
+  ssize_t cbRead = pread(m_fd, pData, cbData, (off_t) llOffset);
+  if (cbRead < 0) return false;
+  if ((uint32_t) cbRead < cbData) memset((uint8_t *) pData + cbRead, 0, cbData - cbRead);
+  return true;
+}
+
+
+bool CSparseImage::WriteAt (uint64_t llOffset, const void *pData, uint32_t cbData)
+{
+  //++
+  // Write with an explicit offset ...
+  //--
+  return pwrite(m_fd, pData, cbData, (off_t) llOffset) == (ssize_t) cbData;
+}
+
+
+bool CSparseImage::PunchRange (uint64_t llStart, uint64_t llEnd)
+{
+  //++
+  //   Punch a hole in the file.  KEEP_SIZE means that punching the end of
+  // the file doesn't shrink it.  If the file system says it can't punch
+  // holes then don't bother asking again ...
+  //--
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (fallocate(m_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                (off_t) llStart, (off_t) (llEnd - llStart)) == 0) return true;
+  LOGS(WARNING, "unable to punch holes in " << m_strFileName << " - " << strerror(errno));
+  if (errno == EOPNOTSUPP) m_fPunch = false;
+#endif
+  return false;
+}
+
+
+/*static*/ bool CSparseImage::GetFileSizes (const string &strFileName, uint64_t &cbLogical, uint64_t &cbAllocated)
+{
+  //++
+  // st_blocks is always in 512 byte units, regardless of the block size ...
+  //--
+  struct stat st;
+  if (stat(strFileName.c_str(), &st) != 0) return false;
+  cbLogical = st.st_size;  cbAllocated = (uint64_t) st.st_blocks * 512;
+  return true;
+}
+#endif
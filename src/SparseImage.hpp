@@ -0,0 +1,130 @@
+//++
+// SparseImage.hpp -> CSparseImage (sparse disk image file) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A fresh pack, or one that's just been formatted, is almost all zeros.
+// ATTACH /SPARSE replaces the normal image file I/O with this class, which
+// keeps a bitmap of every sector that's known to be all zeros.  Reading one
+// of those sectors never touches the file system at all, and writing a
+// sector of zeros punches a hole in the file instead of writing the data.
+//
+//   The bitmap starts out with every sector that lies entirely in a hole (or
+// past the end of the file) when the image is opened - SEEK_DATA/SEEK_HOLE
+// on Linux, or FSCTL_QUERY_ALLOCATED_RANGES on Windows.  After that, any
+// sector that's read or written and turns out to be all zeros gets added,
+// and any sector written with real data gets removed.  Image sectors are
+// smaller than file system blocks, and punching a hole in part of a block
+// only zeros the data without freeing anything.  So the hole is widened to
+// whole blocks whenever the rest of the sectors in those blocks are known to
+// be zero too - that way a run of zero sectors frees every block in it.  If
+// the file system can't punch holes at all, zero sectors are just written
+// normally.
+//
+//   Like CMappedImage, this opens the file a second time for itself.  All
+// I/O is positional (pread() and pwrite(), or overlapped I/O on Windows) and
+// unbuffered, so there's never a seek and there's no stdio buffer that could
+// hold stale data across a hole punch.  The caller (CDiskDrive) must hold
+// the image lock for every call.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+using std::string;              // ...
+
+
+class CSparseImage {
+  //++
+  // Sparse disk image file ...
+  //--
+
+  // Constructor and destructor ...
+public:
+  CSparseImage();
+  virtual ~CSparseImage() {Close();}
+private:
+  // Disallow copy and assignment operations with CSparseImage objects...
+  CSparseImage(const CSparseImage &) = delete;
+  CSparseImage& operator= (const CSparseImage &) = delete;
+
+  // Public properties ...
+public:
+  bool IsOpen() const;
+  bool IsReadOnly() const {return m_fReadOnly;}
+  // Return true if the file system lets us punch holes in this file ...
+  bool CanPunch() const {return m_fPunch;}
+  // Return the number of sectors known to be zero ...
+  uint32_t GetZeroSectors() const {return m_nZero;}
+  // Return the number of reads and writes that never touched the file ...
+  uint64_t GetElidedReads() const {return m_cElidedReads;}
+  uint64_t GetElidedWrites() const {return m_cElidedWrites;}
+  // Return the number of zero sectors written by punching a hole ...
+  uint64_t GetPunched() const {return m_cPunched;}
+  // Return true if sector lLBA is known to be all zeros ...
+  bool IsZero (uint32_t lLBA) const
+    {return (lLBA < m_nSectors) && ((m_abZero[lLBA >> 3] & (1 << (lLBA & 7))) != 0);}
+
+  // Public methods ...
+public:
+  // Open the image and find the holes in it ...
+  bool Open (const string &strFileName, bool fReadOnly, uint32_t cbSector, uint32_t nSectors);
+  void Close();
+  // Read or write one sector ...
+  bool Read (uint32_t lLBA, void *pData);
+  bool Write (uint32_t lLBA, const void *pData);
+  //   Return the logical size of any file and the space actually allocated
+  // to it, both in bytes ...
+  static bool GetFileSizes (const string &strFileName, uint64_t &cbLogical, uint64_t &cbAllocated);
+
+  // Private methods ...
+private:
+  // Set or clear the bit for sector lLBA ...
+  void SetZero (uint32_t lLBA, bool fZero);
+  //   Mark every whole sector between llStart and llEnd as zero.  Scan() calls
+  // this for every hole in the file ...
+  void MarkHole (uint64_t llStart, uint64_t llEnd);
+  // Find all the holes in the file ...
+  bool Scan (uint64_t cbFile);
+  // Read or write bytes at the given offset ...
+  bool ReadAt (uint64_t llOffset, void *pData, uint32_t cbData);
+  bool WriteAt (uint64_t llOffset, const void *pData, uint32_t cbData);
+  // Return true if every sector that overlaps llStart..llEnd is zero ...
+  bool IsZeroRange (uint64_t llStart, uint64_t llEnd) const;
+  // Punch a hole for sector lLBA, and maybe some of its neighbors ...
+  bool Punch (uint32_t lLBA);
+  bool PunchRange (uint64_t llStart, uint64_t llEnd);
+
+  // Private member data ...
+private:
+#ifdef _WIN32
+  void     *m_hFile;            // Windows file handle
+#else
+  int       m_fd;               // file descriptor for the image
+#endif
+  string    m_strFileName;      // name of the image, for messages
+  bool      m_fReadOnly;        // the file is open read only
+  bool      m_fPunch;           // the file system supports hole punching
+  uint32_t  m_cbSector;         // image file sector size, in bytes
+  uint32_t  m_cbBlock;          // file system allocation unit, in bytes
+  uint32_t  m_nSectors;         // number of sectors on the pack
+  uint32_t  m_nZero;            // number of sectors known to be zero
+  uint64_t  m_cElidedReads;     // zero sectors read without any I/O
+  uint64_t  m_cElidedWrites;    // zero sectors written without any I/O
+  uint64_t  m_cPunched;         // zero sectors written as holes
+  std::vector<uint8_t> m_abZero;// one bit for every sector on the pack
+};
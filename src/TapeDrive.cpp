@@ -134,6 +134,8 @@
 #include "BaseDrive.hpp"        // basic MASSBUS drive emulation
 #include "TapeDrive.hpp"        // declarations for this module
 #include "MBA.hpp"              // MASSBUS drive collection class
+#include "RealTime.hpp"         // CRealTime::Prefault()
+#include "TraceLog.hpp"         // deferred TRACE message logging
 
 
 /*static*/ uint32_t CTapeDrive::Fiddle8to18(uint8_t bFormat, uint8_t abIn[], uint32_t alOut[], uint32_t cbIn, bool fReverse)
@@ -335,7 +337,7 @@ void CTapeDrive::SetMotionInt(uint16_t nCode, uint8_t nSlave, uint16_t nFailure)
   // if that slave exists in the first place!
   //--
   uint16_t nMIR = MK_TMMIR(nCode, nSlave, nFailure);
-  LOGF(TRACE, "SetMotionInt - nSlave=%d, nCode=%03o, nFailure=%03o (TMMIR=%06o)", nSlave, nCode, nFailure, nMIR);
+  TRACEF("SetMotionInt - nSlave=%d, nCode=%03o, nFailure=%03o (TMMIR=%06o)", nSlave, nCode, nFailure, nMIR);
   m_UPE.WriteMBR(m_nUnit, TMMIR, nMIR);
 }
 
@@ -352,7 +354,7 @@ void CTapeDrive::SetDataInt(uint16_t nCode, uint8_t nSlave, uint16_t nFailure)
   // also transfer data or generate a null transfer via CDECUPE::EmptyTransfer().
   //--
   uint16_t nDIR = MK_TMDIR(nCode, nFailure)|(nSlave==0 ? TMDIR_DPR : 0);
-  LOGF(TRACE, "SetDataInt - Slave=%d, nCode=%03o, nFailure=%03o, (TMDIR=%06o)", nSlave, nCode, nFailure, nDIR);
+  TRACEF("SetDataInt - Slave=%d, nCode=%03o, nFailure=%03o, (TMDIR=%06o)", nSlave, nCode, nFailure, nDIR);
   m_UPE.WriteMBR(m_nUnit, TMDIR, nDIR);
 }
 
@@ -367,7 +369,7 @@ void CTapeDrive::SetMotionCount(uint8_t nCount, uint8_t nSlave)
   // the command completes.
   //--
   uint16_t wMCR = MKWORD(nCount, LOBYTE(m_UPE.ReadMBR(m_nUnit, TMMCR0+nSlave)));
-  LOGF(TRACE, "SetMotionCount - Slave=%d, nCount=%d, (TMMCR%d=%06o)", nSlave, nCount, nSlave, wMCR);
+  TRACEF("SetMotionCount - Slave=%d, nCount=%d, (TMMCR%d=%06o)", nSlave, nCount, nSlave, wMCR);
   m_UPE.WriteMBR(m_nUnit, TMMCR0+nSlave, wMCR);
 }
 
@@ -641,6 +643,7 @@ void CTapeDrive::DoSpace(uint8_t nCount, bool fReverse, bool fFiles)
   if (!CheckOnline()) return;
   LOGS(DEBUG, "SPACE " << (fReverse ? "REVERSE " : "FORWARD ") << nCount <<
        " " << (fFiles ? "FILES" : "RECORDS") << " on " << *this);
+  m_Latency.Mark(CLatency::REGISTER);
   do {
     nRet = fFiles ? (fReverse ? GetImage()->SpaceReverseFile()
                      : GetImage()->SpaceForwardFile())
@@ -648,6 +651,7 @@ void CTapeDrive::DoSpace(uint8_t nCount, bool fReverse, bool fFiles)
                      : GetImage()->SpaceForwardRecord());
     if ((nRet > 0) && (nCount > 0)) --nCount;
   } while ((nRet > 0) && (nCount > 0));
+  m_Latency.Mark(CLatency::IMAGE);
   SetMotionCount(nCount);  ClearMotionGO();
   if (nRet == CTapeImageFile::BADTAPE)
     SetMotionInt(TMIC_BAD_TAPE);
@@ -710,7 +714,7 @@ void CTapeDrive::DoEraseTape()
   // data on the tape following the current point.  In our case that's exactly
   // the same thing that write gap does, so we just hand it off to that code.
   //--
-  LOGS(TRACE, "ERASE TAPE on " << *this);
+  TRACEF("ERASE TAPE on %c%d", GetMBA().GetName(), m_nUnit);
   DoWriteGap();
 }
 
@@ -729,7 +733,8 @@ void CTapeDrive::DoReadExtendedSense()
   // care what the data actually is - it just writes it to the error log.
   //--
   uint32_t alSense[TMES_LENGTH];
-  LOGS(TRACE, "READ EXTENDED SENSE on " << *this);
+  m_Latency.SetClass(CLatency::SENSE);
+  TRACEF("READ EXTENDED SENSE on %c%d", GetMBA().GetName(), m_nUnit);
   memset(alSense, 0, sizeof(alSense));
   SetDataInt(TMIC_DONE);
   m_UPE.WriteData(alSense, TMES_LENGTH);
@@ -742,9 +747,10 @@ void CTapeDrive::DoRead(bool fReverse, uint8_t bFormat, uint32_t lByteCount)
   //  Handle tape read operations, both forward and backward.  This hasn't been
   // very extensively tested, but this seems to be the basic  idea!
   //--
+  m_Latency.SetClass(CLatency::READ);
   if (!CheckOnline(false)) return;
   LOGS(DEBUG, "READ RECORD " << (fReverse ? "REVERSE" : "FORWARD") << " on " << *this);
-  LOGF(TRACE, "  >> Format=%o, Byte Count=%d", bFormat, lByteCount);
+  TRACEF("  >> Format=%o, Byte Count=%d", bFormat, lByteCount);
 
   // A "READ REVERSE" operation at BOT is an immediate failure ...
   if (fReverse && GetImage()->IsBOT()) {
@@ -754,11 +760,13 @@ void CTapeDrive::DoRead(bool fReverse, uint8_t bFormat, uint32_t lByteCount)
   }
 
   // Try to read the record ...
+  m_Latency.Mark(CLatency::REGISTER);
   int32_t cbRecord = GetImage()->ReadForwardRecord(m_abBuffer, CTapeImageFile::MAXRECLEN);
+  m_Latency.Mark(CLatency::IMAGE);
   if (cbRecord <= 0) {
     if (cbRecord == CTapeImageFile::TAPEMARK) {
       // Here if a tape mark is found during a read operation ...
-      LOGS(TRACE, "<TAPE MARK> on " << *this);
+      TRACEF("<TAPE MARK> on %c%d", GetMBA().GetName(), m_nUnit);
       //   Note that this code (and the other two subsequent error cases) clear
       // the byte count register to indicate that zero bytes were actually
       // transferred.  I'm not completely sure that's the right behavior (a byte
@@ -770,7 +778,7 @@ void CTapeDrive::DoRead(bool fReverse, uint8_t bFormat, uint32_t lByteCount)
       return;
     } else if (cbRecord == CTapeImageFile::EOTBOT) {
       // Here if end of tape is found during a read operation ...
-      LOGS(TRACE, "<END OF TAPE> on " << *this);
+      TRACEF("<END OF TAPE> on %c%d", GetMBA().GetName(), m_nUnit);
       m_UPE.WriteMBR(m_nUnit, TMBCR, 0);
       SetDataInt(TMIC_EOT);  m_UPE.EmptyTransfer(true);
       return;
@@ -793,7 +801,7 @@ void CTapeDrive::DoRead(bool fReverse, uint8_t bFormat, uint32_t lByteCount)
   //m_UPE.ClearBitMBR(m_nUnit, TMDCR, 1);
   m_UPE.ClearBitMBR(m_nUnit, TMTCR, TMTCR_M_REC_COUNT);
   m_UPE.WriteMBR(m_nUnit, TMBCR, LOWORD(cbRecord));
-  LOGF(TRACE, "  >> cbRecord=%d, TMTCR=%06o, TMBCR=0%06o",
+  TRACEF("  >> cbRecord=%d, TMTCR=%06o, TMBCR=0%06o",
        LOWORD(cbRecord), m_UPE.ReadMBR(m_nUnit, TMTCR), m_UPE.ReadMBR(m_nUnit, TMBCR));
   if ((uint32_t) cbRecord < lByteCount)
     SetDataInt(TMIC_SHORT_RECORD);
@@ -803,7 +811,9 @@ void CTapeDrive::DoRead(bool fReverse, uint8_t bFormat, uint32_t lByteCount)
     SetDataInt(TMIC_DONE);
 
   // Finally, unpack the data and send it to the host...
+  m_Latency.Mark(CLatency::REGISTER);
   uint32_t clRecord = Fiddle8to18(bFormat, m_abBuffer, m_alBuffer, cbRecord, fReverse);
+  m_Latency.Mark(CLatency::CONVERT);
   LOGS(DEBUG, "READ RECORD on " << *this << ", format " << bFormat << ", " << cbRecord << " bytes, " << clRecord << " halfwords");
   //DumpRecord(m_alBuffer, clRecord);
   //   This is an odd case - the TM78 manual says, verbatim - "All interrupt codes,
@@ -812,6 +822,8 @@ void CTapeDrive::DoRead(bool fReverse, uint8_t bFormat, uint32_t lByteCount)
   // do.  I'm not absolutely sure this is the right thing, since DEE aborts any
   // RH20 command list and short records aren't at all unusual when reading.
   m_UPE.WriteData(m_alBuffer, clRecord, ((uint32_t) cbRecord != lByteCount));
+  m_Latency.Mark(CLatency::FIFO);
+  m_ctrReads.Increment();
 }
 
 //   The way writing records works, at least in our implementation, is a little
@@ -845,20 +857,26 @@ void CTapeDrive::DoWrite(uint8_t bFormat, uint32_t lByteCount)
   //   THIS WAS NEVER REALLY FINISHED AND HASN'T BEEN TESTED MUCH, BUT HERE'S
   // THE BASIC IDEA!
   //--
+  m_Latency.SetClass(CLatency::WRITE);
   if (!CheckWritable(false)) return;
   uint32_t clRecord = (bFormat==TMAM_10_COMPATIBLE) ? (lByteCount*2/4) : (lByteCount*2/5);
-  LOGS(TRACE, "WRITE RECORD on " << *this);
-  LOGF(TRACE, "  >> Format=%o, Byte Count=%d, Halfword Count=%d", bFormat, lByteCount, clRecord);
+  TRACEF("WRITE RECORD on %c%d", GetMBA().GetName(), m_nUnit);
+  TRACEF("  >> Format=%o, Byte Count=%d, Halfword Count=%d", bFormat, lByteCount, clRecord);
 
   m_UPE.ClearBitMBR(m_nUnit, TMTCR, TMTCR_M_REC_COUNT);
   SetDataInt(TMIC_DONE);
 
+  m_Latency.Mark(CLatency::REGISTER);
   if (m_UPE.ReadData(m_alBuffer, clRecord)) {
     //  DumpRecord(m_alBuffer, clRecord);
+    m_Latency.Mark(CLatency::FIFO);
     uint32_t cbRecord = Fiddle18to8(bFormat, m_alBuffer, m_abBuffer, clRecord);
+    m_Latency.Mark(CLatency::CONVERT);
     GetImage()->WriteRecord(m_abBuffer, cbRecord);
+    m_Latency.Mark(CLatency::IMAGE);
+    m_ctrWrites.Increment();
   } else {
-    LOGF(TRACE, "  >> ERROR READING DATA FROM FIFO!!!");
+    TRACEF("  >> ERROR READING DATA FROM FIFO!!!");
   }
 
 }
@@ -872,6 +890,8 @@ void CTapeDrive::DoMotionCommand(uint8_t nSlave, uint8_t bFunction, uint8_t bCou
   //++
   //--
 
+  m_Latency.SetClass((bFunction == TMCMD_SENSE) ? CLatency::SENSE : CLatency::MOTION);
+
   //   Right now we only implement slave #0 and the only legal command
   // for any other slave is READ SENSE.  We have to implement that one,
   // because that's how TOPS10 knows which slaves exist!
@@ -977,7 +997,7 @@ void CTapeDrive::DoCommand(uint32_t lCommand)
 
   if (CDECUPE::IsEndofBlock(lCommand)) {
     // Handle the FPGA's EBL signal (currently unused) ...
-    LOGS(TRACE, "END OF BLOCK ignored on " << *this);
+    TRACEF("END OF BLOCK ignored on %c%d", GetMBA().GetName(), m_nUnit);
   } else if (bRegister == TMHCR) {
     // Handle TM78 reset - TBA!
     if (ISSET(wCommand, TMHCR_CLEAR)) {
@@ -999,6 +1019,29 @@ void CTapeDrive::DoCommand(uint32_t lCommand)
 }
 
 
+bool CTapeDrive::IsTransfer (uint32_t lCommand) const
+{
+  //++
+  //   Return true if this command is a data transfer.  Motion commands (e.g.
+  // rewind or space) go to one of the TMMCRn registers and never touch the
+  // data FIFO, so they can run while another formatter is transferring ...
+  //--
+  if (CDECUPE::IsEndofBlock(lCommand)) return false;
+  return CDECUPE::ExtractRegister(lCommand) == TMDCR;
+}
+
+
+void CTapeDrive::Prefault()
+{
+  //++
+  //   Touch the record buffers, so that the first big record after memory is
+  // locked doesn't take a page fault for every page of them ...
+  //--
+  CRealTime::Prefault(m_abBuffer, sizeof(m_abBuffer));
+  CRealTime::Prefault(m_alBuffer, sizeof(m_alBuffer));
+}
+
+
 #ifdef _DEBUG
 void CTapeDrive::DumpRecord(uint32_t *plData, uint32_t clData)
 {
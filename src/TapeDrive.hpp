@@ -81,6 +81,10 @@ public:
   virtual void GoOffline();
   // Execute a MASSBUS command ...
   virtual void DoCommand (uint32_t lCommand);
+  // Only commands written to the TMDCR transfer any data ...
+  virtual bool IsTransfer (uint32_t lCommand) const;
+  // Bring the record buffers into memory ...
+  virtual void Prefault();
   // Do a manual (i.e. operator initiated) rewind ...
   void ManualRewind();
 
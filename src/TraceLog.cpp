@@ -0,0 +1,262 @@
+//++
+// TraceLog.cpp -> CTraceLog (deferred TRACE message logging) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CTraceLog class.  See TraceLog.hpp for all the
+// details.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <stdio.h>              // snprintf(), etc ...
+#include <string.h>             // strchr(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#include <algorithm>            // std::sort(), etc ...
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
+#include <thread>               // C++ std::this_thread::sleep_for() ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "Thread.hpp"           // UPE library portable thread library
+#include "TraceLog.hpp"         // declarations for this module
+using std::lock_guard;          // ...
+using std::mutex;               // ...
+
+// Static data ...
+std::atomic<bool>   CTraceLog::m_fEnabled(false);
+mutex               CTraceLog::m_mtxRings;
+std::vector<CTraceLog::RING *> CTraceLog::m_vecRings;
+std::vector<CTraceLog::RECORD> CTraceLog::m_vecDrain;
+std::atomic<uint64_t> CTraceLog::m_cLogged(0);
+uint64_t            CTraceLog::m_cRetired = 0;
+CThread            *CTraceLog::m_pThread = NULL;
+
+//   Every thread that calls TRACEF() gets its own ring the first time, and
+// this thread local object remembers which one that is.  When the thread
+// exits the destructor marks the ring as orphaned, and the logger thread
+// deletes it after it has collected whatever is left in it.
+struct RING_OWNER {
+  CTraceLog::RING *pRing;       // this thread's ring (NULL if none yet)
+  RING_OWNER() : pRing(NULL) {};
+  ~RING_OWNER() {if (pRing != NULL) pRing->fOrphaned = true;}
+};
+static thread_local RING_OWNER t_Owner;
+
+
+/*static*/ void CTraceLog::Put (RECORD &rec)
+{
+  //++
+  //   Timestamp a record and add it to the calling thread's ring.  The very
+  // first time a thread gets here we have to create its ring, and that needs
+  // the ring list lock, but after that nothing here ever waits for anything.
+  // If the ring is full then the record is just counted and thrown away ...
+  //--
+  rec.llTime = std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+  RING *pRing = t_Owner.pRing;
+  if (pRing == NULL) {
+    pRing = t_Owner.pRing = new RING();
+    lock_guard<mutex> lock(m_mtxRings);
+    m_vecRings.push_back(pRing);
+  }
+  if (!pRing->Records.Put(rec))
+    pRing->cDropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+/*static*/ void CTraceLog::Format (const RECORD &rec, char *pszBuffer, size_t cbBuffer)
+{
+  //++
+  //   Format a trace record.  We can't just hand the format string and the
+  // raw arguments to snprintf(), because every argument was stored as 64 bits
+  // and the format says what size it really was.  So we do it one conversion
+  // at a time - each one gets its own snprintf() with the argument cast to the
+  // type the conversion expects.  Length modifiers (h, l, ll, z, I64, etc) are
+  // thrown away, and %d and friends use int unless there was an "l" ...
+  //--
+  const char *psz = rec.pszFormat;  size_t cb = 0;  uint32_t nArg = 0;
+  char szSpec[32];
+  if (cbBuffer == 0) return;
+  pszBuffer[0] = '\0';
+  while ((*psz != '\0') && (cb+1 < cbBuffer)) {
+    if (*psz != '%') {pszBuffer[cb++] = *psz++;  continue;}
+    if (*(psz+1) == '%') {pszBuffer[cb++] = '%';  psz += 2;  continue;}
+
+    // Collect the flags, width and precision, and skip any length ...
+    size_t n = 0;  bool fLong = false;
+    szSpec[n++] = *psz++;
+    while ((*psz != '\0') && (strchr("-+ #0123456789.", *psz) != NULL) && (n < sizeof(szSpec)-4))
+      szSpec[n++] = *psz++;
+    while ((*psz != '\0') && (strchr("hlLqjztI", *psz) != NULL)) {
+      if ((*psz == 'l') || (*psz == 'q') || (*psz == 'I')) fLong = true;
+      //   Microsoft's I64 and I32 are whole tokens - the digits aren't widths
+      // (and I32 isn't long at all) ...
+      if ((*psz == 'I') && (*(psz+1) == '6') && (*(psz+2) == '4')) psz += 2;
+      else if ((*psz == 'I') && (*(psz+1) == '3') && (*(psz+2) == '2')) {psz += 2;  fLong = false;}
+      ++psz;
+    }
+    char chConversion = *psz;
+    if (chConversion == '\0') break;
+    ++psz;
+    uint64_t llArg = (nArg < rec.nArgs) ? rec.allArgs[nArg++] : 0;
+
+    // And now format this one argument ...
+    int nDone;  size_t cbLeft = cbBuffer - cb;
+    switch (chConversion) {
+      case 'd': case 'i':
+        szSpec[n++] = 'l';  szSpec[n++] = 'l';  szSpec[n++] = chConversion;  szSpec[n] = '\0';
+        nDone = snprintf(pszBuffer+cb, cbLeft, szSpec,
+          fLong ? (long long) llArg : (long long) (int32_t) llArg);
+        break;
+      case 'u': case 'o': case 'x': case 'X':
+        szSpec[n++] = 'l';  szSpec[n++] = 'l';  szSpec[n++] = chConversion;  szSpec[n] = '\0';
+        nDone = snprintf(pszBuffer+cb, cbLeft, szSpec,
+          fLong ? (unsigned long long) llArg : (unsigned long long) (uint32_t) llArg);
+        break;
+      case 'c':
+        szSpec[n++] = 'c';  szSpec[n] = '\0';
+        nDone = snprintf(pszBuffer+cb, cbLeft, szSpec, (int) llArg);
+        break;
+      case 's':
+        szSpec[n++] = 's';  szSpec[n] = '\0';
+        nDone = snprintf(pszBuffer+cb, cbLeft, szSpec,
+          (llArg != 0) ? (const char *) (uintptr_t) llArg : "(null)");
+        break;
+      case 'p':
+        szSpec[n++] = 'p';  szSpec[n] = '\0';
+        nDone = snprintf(pszBuffer+cb, cbLeft, szSpec, (void *) (uintptr_t) llArg);
+        break;
+      default:
+        nDone = snprintf(pszBuffer+cb, cbLeft, "%%%c?", chConversion);
+        break;
+    }
+    if (nDone < 0) break;
+    cb = ((size_t) nDone < cbLeft) ? (cb + nDone) : (cbBuffer-1);
+  }
+  pszBuffer[cb] = '\0';
+}
+
+
+/*static*/ uint64_t CTraceLog::GetDropped()
+{
+  //++
+  // Return the total number of records discarded because a ring was full ...
+  //--
+  lock_guard<mutex> lock(m_mtxRings);
+  uint64_t cDropped = m_cRetired;
+  for (std::vector<RING *>::const_iterator it = m_vecRings.begin();  it != m_vecRings.end();  ++it)
+    cDropped += (*it)->cDropped;
+  return cDropped;
+}
+
+
+/*static*/ uint32_t CTraceLog::GetThreads()
+{
+  //++
+  // Return the number of threads that currently have a ring ...
+  //--
+  lock_guard<mutex> lock(m_mtxRings);
+  return (uint32_t) m_vecRings.size();
+}
+
+
+/*static*/ void CTraceLog::Drain()
+{
+  //++
+  //   Collect every record from every thread's ring, sort them by time, and
+  // then format and log them.  The ring list lock is only held while we're
+  // collecting, so a new thread never waits for the formatting.  Rings that
+  // belong to threads that have exited are deleted once they're empty (their
+  // discard counts are kept in m_cRetired).  Note that the LOGS() timestamp
+  // is the time the record was logged, which can be up to DRAIN_INTERVAL
+  // later than the time it was recorded ...
+  //--
+  m_vecDrain.clear();
+  {
+    lock_guard<mutex> lock(m_mtxRings);
+    for (std::vector<RING *>::iterator it = m_vecRings.begin();  it != m_vecRings.end();  ) {
+      RING *pRing = *it;  RECORD rec;
+      //   Check for an orphan BEFORE emptying the ring, so that anything the
+      // thread put there just before it exited is sure to be collected ...
+      bool fOrphaned = pRing->fOrphaned;
+      while (pRing->Records.Get(rec))  m_vecDrain.push_back(rec);
+      if (fOrphaned) {
+        m_cRetired += pRing->cDropped;
+        delete pRing;  it = m_vecRings.erase(it);
+      } else
+        ++it;
+    }
+  }
+  if (m_vecDrain.empty()) return;
+  std::stable_sort(m_vecDrain.begin(), m_vecDrain.end(),
+    [](const RECORD &a, const RECORD &b) {return a.llTime < b.llTime;});
+  char szBuffer[CLog::MAXMSG];
+  for (std::vector<RECORD>::const_iterator it = m_vecDrain.begin();  it != m_vecDrain.end();  ++it) {
+    Format(*it, szBuffer, sizeof(szBuffer));
+    LOGS(TRACE, szBuffer);
+  }
+  m_cLogged += m_vecDrain.size();
+}
+
+
+/*static*/ void* THREAD_ATTRIBUTES CTraceLog::LoggerLoop (void *pParam)
+{
+  //++
+  //   This is the logger thread - it just wakes up every DRAIN_INTERVAL
+  // milliseconds and logs whatever it finds.  There's one last Drain() after
+  // we're asked to exit, so nothing recorded before End() is lost ...
+  //--
+  CThread *pThread = (CThread *) pParam;
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " is running");
+  while (!pThread->IsExitRequested()) {
+    Drain();
+    std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_INTERVAL));
+  }
+  Drain();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " terminated");
+  return pThread->End();
+}
+
+
+/*static*/ bool CTraceLog::Begin()
+{
+  //++
+  // Start the logger thread ...
+  //--
+  if (m_pThread != NULL) return true;
+  m_pThread = new CThread(&CTraceLog::LoggerLoop);
+  m_pThread->SetName("trace logger");
+  if (m_pThread->Begin()) return true;
+  LOGS(ERROR, "unable to start the trace logger thread");
+  delete m_pThread;  m_pThread = NULL;
+  return false;
+}
+
+
+/*static*/ void CTraceLog::End()
+{
+  //++
+  //   Stop the logger thread, after it logs whatever is left.  Tracing is
+  // disabled first, since there won't be anybody to log the records ...
+  //--
+  m_fEnabled = false;
+  if (m_pThread == NULL) return;
+  m_pThread->WaitExit();
+  delete m_pThread;  m_pThread = NULL;
+}
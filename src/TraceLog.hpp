@@ -0,0 +1,148 @@
+//++
+// TraceLog.hpp -> CTraceLog (deferred TRACE message logging) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   LOGF() and LOGS() do all their formatting right away, in the thread that
+// calls them, and for TRACE messages on the MASSBUS command path that's far
+// too slow to leave turned on.  TRACEF() is the cheap alternative -
+//
+//      TRACEF("unit %c%d read sector, LBA = %d", chBus, nUnit, lLBA);
+//
+// If tracing is disabled (the default) then this is a single test of an
+// atomic flag, and the arguments aren't even evaluated - so it's fine to
+// pass things like ReadMBR() that cost a PCI read.  If tracing is enabled,
+// then the format string pointer and the raw argument values are copied into
+// a lock free ring buffer that belongs to the calling thread, and that's all.
+// A separate logger thread collects the records from every thread's ring,
+// sorts them by time, formats them, and passes them to LOGS(TRACE, ...), so
+// they still go to the log file (or not!) according to the usual log levels.
+//
+//   Since the formatting is done later, in another thread, there are a few
+// rules for TRACEF() arguments.  There can be at most MAXARGS of them, and
+// they must be integers, characters or pointers.  A %s argument must be a
+// string that lives forever (e.g. a string literal) - NEVER a c_str() from a
+// temporary std::string!  Floating point isn't supported at all.
+//
+//   If a thread's ring fills up (which means the logger thread can't keep up)
+// then new records are discarded and counted.  SHOW TRACE shows the totals.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <atomic>               // C++ std::atomic template
+#include <mutex>                // C++ std::mutex
+#include <vector>               // C++ std::vector template
+#include <type_traits>          // C++ std::is_integral, et al ...
+#include "Thread.hpp"           // UPELIB CThread portable thread library
+#include "RingBuffer.hpp"       // lock free CRingBuffer template
+
+
+//   This is the macro that everyone uses.  Note that the arguments aren't
+// evaluated at all unless tracing is enabled ...
+#define TRACEF(...) \
+  do {if (CTraceLog::IsEnabled()) CTraceLog::Record(__VA_ARGS__);} while (0)
+
+
+class CTraceLog {
+  //++
+  // Deferred, lock free TRACE message logging ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    MAXARGS        =    6,      // most arguments one TRACEF() can have
+    RING_SIZE      = 1024,      // records buffered for each thread
+    DRAIN_INTERVAL =   10,      // logger thread wakes up this often (ms)
+  };
+  // One trace record, exactly as TRACEF() left it ...
+  struct RECORD {
+    uint64_t    llTime;             // steady_clock time (nanoseconds)
+    const char *pszFormat;          // printf() style format string
+    uint32_t    nArgs;              // number of arguments used
+    uint64_t    allArgs[MAXARGS];   // and the raw argument values
+  };
+
+  // This class is never instantiated ...
+private:
+  CTraceLog() = delete;
+
+  // Public properties ...
+public:
+  // Return true if tracing is enabled (this is what TRACEF() tests) ...
+  static bool IsEnabled() {return m_fEnabled.load(std::memory_order_relaxed);}
+  static void SetEnabled (bool fEnabled) {m_fEnabled = fEnabled;}
+  // Return the number of records logged and discarded so far ...
+  static uint64_t GetLogged() {return m_cLogged;}
+  static uint64_t GetDropped();
+  // Return the number of threads that currently have a ring ...
+  static uint32_t GetThreads();
+
+  // Public methods ...
+public:
+  // Start and stop the logger thread ...
+  static bool Begin();
+  static void End();
+  //   Record one trace message.  This packs the arguments into a RECORD and
+  // puts it in the calling thread's ring - called only by TRACEF()!
+  template <typename... ARGS>
+  static void Record (const char *pszFormat, ARGS... args) {
+    static_assert(sizeof...(ARGS) <= MAXARGS, "too many TRACEF() arguments");
+    RECORD rec;  rec.pszFormat = pszFormat;  rec.nArgs = 0;
+    Pack(rec, args...);  Put(rec);
+  }
+  //   Format one record into a buffer, the same way LOGF() would have done it
+  // at the time ...
+  static void Format (const RECORD &rec, char *pszBuffer, size_t cbBuffer);
+
+  // Private methods ...
+private:
+  // Convert one argument to a raw 64 bit value ...
+  template <typename T>
+  static uint64_t ToArg (T t, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type* = 0)
+    {return (uint64_t) (int64_t) t;}
+  template <typename T>
+  static uint64_t ToArg (T *p) {return (uint64_t) (uintptr_t) p;}
+  // Pack all the arguments into the record ...
+  static void Pack (RECORD &rec) {}
+  template <typename T, typename... ARGS>
+  static void Pack (RECORD &rec, T t, ARGS... args)
+    {rec.allArgs[rec.nArgs++] = ToArg(t);  Pack(rec, args...);}
+  // Timestamp a record and add it to this thread's ring ...
+  static void Put (RECORD &rec);
+  // The logger thread ...
+  static void* THREAD_ATTRIBUTES LoggerLoop (void *pParam);
+  static void Drain();
+
+  // Private member data ...
+private:
+  // One thread's ring, and the count of records it had to discard ...
+  struct RING {
+    CRingBuffer<RECORD, RING_SIZE> Records;   // the records themselves
+    std::atomic<uint64_t> cDropped;           // records lost when it was full
+    std::atomic<bool>     fOrphaned;          // the thread has exited
+    RING() : cDropped(0), fOrphaned(false) {};
+  };
+  friend struct RING_OWNER;                 // marks a ring orphaned
+  static std::atomic<bool> m_fEnabled;      // true if tracing is enabled
+  static std::mutex        m_mtxRings;      // protects m_vecRings
+  static std::vector<RING *> m_vecRings;    // every thread's ring
+  static std::vector<RECORD> m_vecDrain;    // records collected by Drain()
+  static std::atomic<uint64_t> m_cLogged;   // records actually logged
+  static uint64_t          m_cRetired;      // records dropped by dead threads
+  static CThread          *m_pThread;       // the logger thread
+};
@@ -0,0 +1,111 @@
+//++
+// TransferEngine.hpp -> CTransferEngine (UPE data FIFO block transfer) interface
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   CTransferEngine is the abstract interface for anything that can move a
+// block of words in or out of the UPE data FIFO in one operation.  CDECUPE
+// uses one, if it has one, in place of its word at a time PIO loops.  There
+// are currently two implementations - CPLXDMA, which uses the PLX 9054 DMA
+// channels, and CUPESimulator, which moves data to and from its simulated
+// FIFOs.
+//
+//   The rules are simple - ReadFIFO() reads up to clData words and returns
+// the number of VALID words it actually got, already masked to 18 bits and
+// packed together in order.  Zero just means that the FIFO was empty and the
+// caller should try again.  WriteFIFO() writes up to clData words and returns
+// the number written.  Either one returns FAILED if the engine is broken, and
+// in that case the caller should give up on it and go back to PIO.
+//
+//   CFIFOStream is the other half of the streaming transfers.  Instead of
+// handing CDECUPE a buffer full of FPGA words, the disk code hands it a
+// stream that converts image file data to FPGA words (or back again) a few
+// words at a time, right where they're needed.  Get() produces clData words,
+// starting with word nFirst, already masked to 18 bits.  Put() consumes them
+// the same way.  nFirst and clData are always multiples of CHUNK, and CHUNK
+// is a multiple of CSectorKernels::KERNEL_GRAIN, so the sector kernels can do
+// the conversion directly.
+//
+//   A transfer engine can take words straight from a stream with
+// WriteStream().  The default just gets them a CHUNK at a time and calls
+// WriteFIFO(), but an engine with its own buffer (like DMA) can do better
+// by converting right into that buffer.  WriteStream() returns FAILED only
+// if nothing at all was written - if it fails part way through, it returns
+// the number of words that did get written and the caller does the rest.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, etc ...
+
+
+class CFIFOStream {
+  //++
+  // Producer and consumer of FIFO data ...
+  //--
+
+public:
+  // Number of words converted by each call to Get() or Put() ...
+  enum {CHUNK = 32};
+
+public:
+  CFIFOStream() {};
+  virtual ~CFIFOStream() {};
+
+public:
+  // Produce words for the FIFO, starting with word nFirst ...
+  virtual void Get (uint32_t nFirst, uint32_t clData, uint32_t alData[]) const = 0;
+  // Consume words from the FIFO, starting with word nFirst ...
+  virtual void Put (uint32_t nFirst, uint32_t clData, const uint32_t alData[]) = 0;
+};
+
+
+class CTransferEngine {
+  //++
+  // Abstract UPE data FIFO block transfer interface ...
+  //--
+
+public:
+  // Special return value for ReadFIFO() and WriteFIFO() ...
+  enum {FAILED = 0xFFFFFFFFUL};
+
+public:
+  CTransferEngine() {};
+  virtual ~CTransferEngine() {};
+
+public:
+  // Return the name of this engine (e.g. "DMA") for messages ...
+  virtual const char *GetTransferName() const = 0;
+  // Read valid words from the "to PC" FIFO ...
+  virtual uint32_t ReadFIFO (uint32_t alData[], uint32_t clData) = 0;
+  // Write words to the "from PC" FIFO ...
+  virtual uint32_t WriteFIFO (const uint32_t alData[], uint32_t clData) = 0;
+  // Write words from a stream to the "from PC" FIFO ...
+  virtual uint32_t WriteStream (const CFIFOStream &src, uint32_t nFirst, uint32_t clData)
+  {
+    uint32_t alChunk[CFIFOStream::CHUNK], nDone = 0;
+    while (nDone < clData) {
+      uint32_t cl = ((clData-nDone) < CFIFOStream::CHUNK) ? (clData-nDone) : CFIFOStream::CHUNK;
+      src.Get(nFirst+nDone, cl, alChunk);
+      //   If the engine fails after some words have already gone out, then
+      // report what was written so the caller doesn't send them again ...
+      uint32_t n = WriteFIFO(alChunk, cl);
+      if (n == FAILED) return (nDone > 0) ? nDone : (uint32_t) FAILED;
+      nDone += n;
+      if (n < cl) break;
+    }
+    return nDone;
+  }
+};
@@ -25,8 +25,11 @@
 //   One warning - remember that the UI runs in a different thread from the
 // routines that execute the MASSBUS commands.  This means that any UI command
 // that messes with a MASSBUS or CBaseDrive object must first acquire exclusive
-// access to that MBA using the LockUI() method.  Once we're done fiddling with
-// the server data, access is released with the UnlockUI() method.
+// access to that unit using the LockUnit() method.  Once we're done fiddling
+// with the server data, access is released with the UnlockUnit() method.  Only
+// the other commands for that one unit wait meanwhile, so even a slow ATTACH
+// never holds up I/O on the rest of the bus.  Things that affect the whole
+// bus (e.g. SET UPE/DMA) use LockUI() and UnlockUI() instead.
 //
 // CHANGES FROM THE SPECIFICATION -
 //   * The verb "QUIT" is a synonym for "EXIT"
@@ -71,6 +74,8 @@
 #include <stdint.h>	        // uint8_t, uint32_t, etc ...
 #include <assert.h>             // assert() (what else??)
 #include <string.h>             // memset(), strlen(), etc ...
+#include <chrono>               // C++ std::chrono::steady_clock, et al ...
+#include <vector>               // C++ std::vector template
 #include "UPELIB.hpp"           // UPE library definitions
 #include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
 #include "UPE.hpp"              // UPE library FPGA interface methods
@@ -81,13 +86,27 @@
 #include "CommandLine.hpp"      // UPE library shell (argc/argv) parser methods
 #include "MBS.hpp"              // global declarations for this project
 #include "DECUPE.hpp"           // DEC specific UPE/FPGA interface methods
+#include "SimUPE.hpp"           // software UPE simulation
 #include "MASSBUS.h"            // MASSBUS commands and registers
 #include "DriveType.hpp"        // static drive type data
 #include "LogFile.hpp"          // message logging facility
 #include "BaseDrive.hpp"        // single MASSBUS drive emulation
 #include "DiskDrive.hpp"        // disk specific methods
 #include "TapeDrive.hpp"        // tape specific methods
+#include "SectorCache.hpp"      // SLRU cache of unpacked sectors
+#include "ReadAhead.hpp"        // sequential read ahead
+#include "WriteBehind.hpp"      // asynchronous write queue
+#include "Overlay.hpp"          // copy on write overlays
+#include "SparseImage.hpp"      // sparse image file I/O
+#include "ChunkedImage.hpp"     // compressed image container
+#include "RamImage.hpp"         // RAM resident images
+#include "ImageSync.hpp"        // image durability and group commit
+#include "SectorKernels.hpp"    // SIMD sector pack/unpack kernels
 #include "MBA.hpp"              // MASSBUS drive collection class
+#include "DriveWorker.hpp"      // per unit command worker threads
+#include "RealTime.hpp"         // real time scheduling and jitter probe
+#include "TraceLog.hpp"         // deferred TRACE message logging
+#include "FlightRecorder.hpp"   // MASSBUS command history
 #include "StandardUI.hpp"       // UPE library standard UI commands
 #include "UserInterface.hpp"    // declarations for this module
 
@@ -119,9 +138,11 @@ const CCmdArgKeyword::keyword_t CUI::m_keysControllerType[] = {
 };
 
 // Image file format keywords ...
-//   This doesn't really do anything now, so the value is moot...
+//   These matter only for 18 bit disk packs - 16 bit packs and tapes have
+// only one format ...
 const CCmdArgKeyword::keyword_t CUI::m_keysImageFormat[] = {
-  {"SIMH", 0},  {NULL, 0}
+  {"SIMH", CDiskDrive::FORMAT_SIMH},  {"PACKED", CDiskDrive::FORMAT_PACKED},
+  {"CHUNKED", CDiskDrive::FORMAT_CHUNKED},  {NULL, 0}
 };
 
 // Port type keywords ...
@@ -130,6 +151,13 @@ const CCmdArgKeyword::keyword_t CUI::m_keysPortType[] = {
   {"A", 0},  {"B", 0},  {"BOTH", 0},  {NULL, 0}
 };
 
+// Real time priority keywords ...
+const CCmdArgKeyword::keyword_t CUI::m_keysPriority[] = {
+  {"NORM*AL",    CRealTime::PRIORITY_NORMAL},
+  {"REAL*TIME",  CRealTime::PRIORITY_REALTIME},
+  {NULL, 0}
+};
+
 // File sharing keywords ...
 const CCmdArgKeyword::keyword_t CUI::m_keysShareMode[] = {
   {"NO*NE",  CImageFile::SHARE_NONE},
@@ -161,6 +189,7 @@ CCmdArgKeyword     CUI::m_argControllerType("type", m_keysControllerType);
 CCmdArgNumber      CUI::m_argSerial("serial number", 10, 1, 65535);
 CCmdArgFileName    CUI::m_argFileName("file name");
 CCmdArgFileName    CUI::m_argOptFileName("file name", true);
+CCmdArgFileName    CUI::m_argOutputFile("output file name");
 CCmdArgNumber      CUI::m_argBits("bits", 10, 16, 18);
 CCmdArgKeyword     CUI::m_argFormat("format", m_keysImageFormat);
 CCmdArgKeyword     CUI::m_argPort("port", m_keysPortType);
@@ -170,7 +199,15 @@ CCmdArgDiskAddress CUI::m_argBlockNumber("block number", false);
 CCmdArgNumber      CUI::m_argCount("sector count", 10, 1, 65535);
 CCmdArgNumber      CUI::m_argDataClock("data clock", 0, 0, 255);
 CCmdArgNumber      CUI::m_argTransferDelay("transfer delay", 0, 0, 255);
+CCmdArgNumber      CUI::m_argPollTime("poll time", 10, 0, CDECUPE::MAX_POLL);
+CCmdArgNumber      CUI::m_argFlushInterval("flush interval", 10, 0, 86400);
 CCmdArgKeyword     CUI::m_argShare("share mode", m_keysShareMode);
+CCmdArgName        CUI::m_argCacheSize("cache size");
+CCmdArgFileName    CUI::m_argOverlayFile("overlay file");
+CCmdArgName        CUI::m_argSync("sync policy");
+CCmdArgName        CUI::m_argOptBus("bus", true);
+CCmdArgName        CUI::m_argCPU("cpu");
+CCmdArgKeyword     CUI::m_argPriority("priority", m_keysPriority);
 
 // Modifier definitions ...
 //   Like the command arguments, modifier objects may be shared by several
@@ -186,13 +223,32 @@ CCmdModifier     CUI::m_modOctal("OCT*AL","HEX*ADECIMAL");
 CCmdModifier     CUI::m_modCount("CO*UNT", NULL, &m_argCount);
 CCmdModifier     CUI::m_modClock("CLO*CK", NULL, &m_argDataClock);
 CCmdModifier     CUI::m_modDelay("DEL*AY", NULL, &m_argTransferDelay);
+CCmdModifier     CUI::m_modPoll("POL*L", NULL, &m_argPollTime);
+CCmdModifier     CUI::m_modDMA("DMA", "NODMA");
+CCmdModifier     CUI::m_modWorkers("WORK*ERS", "NOWORK*ERS");
 CCmdModifier     CUI::m_modForce("FORCE", "NOFORCE");
 CCmdModifier     CUI::m_modShare("SHA*RE", NULL, &m_argShare);
 CCmdModifier     CUI::m_modConfiguration("CONF*IGURATION", NULL, &m_argFileName);
+CCmdModifier     CUI::m_modSimulate("SIM*ULATE", "NOSIM*ULATE");
+CCmdModifier     CUI::m_modReset("RES*ET", "NORES*ET");
+CCmdModifier     CUI::m_modCache("CA*CHE", NULL, &m_argCacheSize);
+CCmdModifier     CUI::m_modReadAhead("READ*AHEAD", "NOREAD*AHEAD");
+CCmdModifier     CUI::m_modMap("MAP", "NOMAP");
+CCmdModifier     CUI::m_modFlush("FLU*SH", NULL, &m_argFlushInterval);
+CCmdModifier     CUI::m_modWriteBehind("WRITEB*EHIND", "NOWRITEB*EHIND");
+CCmdModifier     CUI::m_modOverlay("OVER*LAY", NULL, &m_argOverlayFile);
+CCmdModifier     CUI::m_modSparse("SPA*RSE", "NOSPA*RSE");
+CCmdModifier     CUI::m_modRam("RAM", "NORAM");
+CCmdModifier     CUI::m_modHugePages("HUGE*PAGES", "NOHUGE*PAGES");
+CCmdModifier     CUI::m_modSync("SY*NC", NULL, &m_argSync);
+CCmdModifier     CUI::m_modCPU("CPU", NULL, &m_argCPU);
+CCmdModifier     CUI::m_modPriority("PRI*ORITY", NULL, &m_argPriority);
+CCmdModifier     CUI::m_modLock("LOCK", "NOLOCK");
+CCmdModifier     CUI::m_modTrace("ENA*BLE", "DISA*BLE");
 
 // CREATE verb definition ...
 CCmdArgument * const CUI::m_argsCreate[]     = {&m_argBus, &m_argControllerType, &m_argPCI, NULL};
-CCmdModifier * const CUI::m_modsCreate[]     = {&m_modForce, &m_modConfiguration, NULL};
+CCmdModifier * const CUI::m_modsCreate[]     = {&m_modForce, &m_modConfiguration, &m_modSimulate, &m_modCPU, &m_modPriority, &m_modLock, NULL};
 CCmdVerb CUI::m_cmdCreate("CRE*ATE", &DoCreate, m_argsCreate, m_modsCreate);
 
 // CONNECT and DISCONNECT verb definitions ...
@@ -204,7 +260,7 @@ CCmdVerb CUI::m_cmdDisconnect ("DISC*ONNECT", &DoDisconnect, m_argsDisconnect, N
 
 // ATTACH and DETACH verb definition ...
 CCmdArgument * const CUI::m_argsAttach[] = {&m_argUnit, &m_argFileName, NULL};
-CCmdModifier * const CUI::m_modsAttach[] = {&m_modWrite, &m_modOnline, &m_modBits, &m_modFormat, &m_modShare, NULL};
+CCmdModifier * const CUI::m_modsAttach[] = {&m_modWrite, &m_modOnline, &m_modBits, &m_modFormat, &m_modShare, &m_modCache, &m_modReadAhead, &m_modMap, &m_modFlush, &m_modWriteBehind, &m_modOverlay, &m_modSparse, &m_modRam, &m_modHugePages, &m_modSync, NULL};
 CCmdArgument * const CUI::m_argsDetach[] = {&m_argUnit, NULL};
 CCmdVerb CUI::m_cmdAttach("ATT*ACH", &DoAttach, m_argsAttach, m_modsAttach);
 CCmdVerb CUI::m_cmdDetach("DET*ACH", &DoDetach, m_argsDetach, NULL);
@@ -213,30 +269,56 @@ CCmdVerb CUI::m_cmdDetach("DET*ACH", &DoDetach, m_argsDetach, NULL);
 CCmdArgument * const CUI::m_argsRewind[] = {&m_argUnit, NULL};
 CCmdVerb CUI::m_cmdRewind("REW*IND", &DoRewind, m_argsRewind, NULL);
 
+// CONVERT verb definition ...
+CCmdArgument * const CUI::m_argsConvert[] = {&m_argFileName, &m_argOutputFile, NULL};
+CCmdModifier * const CUI::m_modsConvert[] = {&m_modFormat, &m_modBits, NULL};
+CCmdVerb CUI::m_cmdConvert("CONV*ERT", &DoConvert, m_argsConvert, m_modsConvert);
+
+// COMMIT verb definition ...
+CCmdArgument * const CUI::m_argsCommit[] = {&m_argUnit, NULL};
+CCmdVerb CUI::m_cmdCommit("COMM*IT", &DoCommit, m_argsCommit, NULL);
+
 // SET verb definition ...
 CCmdArgument * const CUI::m_argsSetUnit[] = {&m_argUnit, NULL};
 CCmdModifier * const CUI::m_modsSetUnit[] = {&m_modWrite, &m_modOnline, &m_modPort, &m_modAlias, NULL};
 CCmdArgument * const CUI::m_argsSetUPE[] = {&m_argPCI, NULL};
-CCmdModifier * const CUI::m_modsSetUPE[] = {&m_modDelay, &m_modClock, NULL};
+CCmdModifier * const CUI::m_modsSetUPE[] = {&m_modDelay, &m_modClock, &m_modPoll, &m_modDMA, &m_modWorkers, NULL};
 CCmdVerb CUI::m_cmdSetUnit("UN*IT", &DoSetUnit, m_argsSetUnit, m_modsSetUnit);
+CCmdArgument * const CUI::m_argsSetBus[] = {&m_argBus, NULL};
+CCmdModifier * const CUI::m_modsSetBus[] = {&m_modCPU, &m_modPriority, &m_modLock, NULL};
 CCmdVerb CUI::m_cmdSetUPE("UPE", &DoSetUPE, m_argsSetUPE, m_modsSetUPE);
+CCmdVerb CUI::m_cmdSetBus("BUS", &DoSetBus, m_argsSetBus, m_modsSetBus);
+CCmdModifier * const CUI::m_modsSetTrace[] = {&m_modTrace, NULL};
+CCmdVerb CUI::m_cmdSetTrace("TR*ACE", &DoSetTrace, NULL, m_modsSetTrace);
 CCmdVerb * const CUI::g_aSetVerbs[] = {
-  &m_cmdSetUnit, &CStandardUI::m_cmdSetLog,
-  &CStandardUI::m_cmdSetWindow, &m_cmdSetUPE, NULL
+  &m_cmdSetUnit, &CStandardUI::m_cmdSetLog, &CStandardUI::m_cmdSetWindow,
+  &m_cmdSetUPE, &m_cmdSetBus, &m_cmdSetTrace, NULL
 };
 CCmdVerb CUI::m_cmdSet("SE*T", NULL, NULL, NULL, g_aSetVerbs);
 
 // SHOW verb definition ...
 CCmdArgument * const CUI::m_argsShowUnit[] = {&m_argOptUnit, NULL};
 CCmdArgument * const CUI::m_argsShowUPE[] = {&m_argPCI, NULL};
+CCmdArgument * const CUI::m_argsShowLatency[] = {&m_argUnit, NULL};
+CCmdArgument * const CUI::m_argsShowBus[] = {&m_argOptBus, NULL};
+CCmdModifier * const CUI::m_modsShowLatency[] = {&m_modReset, NULL};
+CCmdArgument * const CUI::m_argsShowHistory[] = {&m_argBus, NULL};
+CCmdModifier * const CUI::m_modsShowHistory[] = {&m_modCount, NULL};
 CCmdVerb CUI::m_cmdShowUnit("UN*IT", &DoShowUnit, m_argsShowUnit);
 CCmdVerb CUI::m_cmdShowUPE("UPE", &DoShowUPE, m_argsShowUPE);
 CCmdVerb CUI::m_cmdShowVersion("VER*SION", &DoShowVersion);
 CCmdVerb CUI::m_cmdShowAll("ALL", &DoShowAll);
+CCmdVerb CUI::m_cmdShowStatistics("STAT*ISTICS", &DoShowStatistics);
+CCmdVerb CUI::m_cmdShowLatency("LAT*ENCY", &DoShowLatency, m_argsShowLatency, m_modsShowLatency);
+CCmdVerb CUI::m_cmdShowKernels("KERN*ELS", &DoShowKernels);
+CCmdVerb CUI::m_cmdShowBus("BUS", &DoShowBus, m_argsShowBus);
+CCmdVerb CUI::m_cmdShowTrace("TR*ACE", &DoShowTrace);
+CCmdVerb CUI::m_cmdShowHistory("HIST*ORY", &DoShowHistory, m_argsShowHistory, m_modsShowHistory);
 CCmdVerb * const CUI::g_aShowVerbs[] = {
-  &m_cmdShowUnit, &CStandardUI::m_cmdShowLog, &m_cmdShowUPE,
-  &CStandardUI::m_cmdShowAliases, &m_cmdShowVersion, &m_cmdShowAll,
-  NULL
+  &m_cmdShowUnit, &CStandardUI::m_cmdShowLog, &m_cmdShowUPE, &m_cmdShowBus,
+  &CStandardUI::m_cmdShowAliases, &m_cmdShowVersion, &m_cmdShowStatistics,
+  &m_cmdShowLatency, &m_cmdShowHistory, &m_cmdShowKernels, &m_cmdShowTrace,
+  &m_cmdShowAll, NULL
 };
 CCmdVerb CUI::m_cmdShow("SH*OW", NULL, NULL, NULL, g_aShowVerbs);
 
@@ -252,11 +334,22 @@ CCmdVerb * const CUI::g_aDumpVerbs[] = {
 };
 CCmdVerb CUI::m_cmdDump("DU*MP", NULL, NULL, NULL, g_aDumpVerbs);
 
+// EXERCISE verb definition ...
+CCmdArgument * const CUI::m_argsExercise[] = {&m_argUnit, NULL};
+CCmdModifier * const CUI::m_modsExercise[] = {&m_modCount, &m_modWrite, NULL};
+CCmdVerb CUI::m_cmdExercise("EXER*CISE", &DoExercise, m_argsExercise, m_modsExercise);
+
+// PROBE verb definition ...
+CCmdArgument * const CUI::m_argsProbe[] = {&m_argBus, NULL};
+CCmdModifier * const CUI::m_modsProbe[] = {&m_modCount, NULL};
+CCmdVerb CUI::m_cmdProbe("PRO*BE", &DoProbe, m_argsProbe, m_modsProbe);
+
 // Master list of all verbs ...
 CCmdVerb * const CUI::g_aVerbs[] = {
   &m_cmdCreate,
   &m_cmdConnect, &m_cmdDisconnect, &m_cmdAttach, &m_cmdDetach,
-  &m_cmdSet, &m_cmdShow, &m_cmdDump, &m_cmdRewind,
+  &m_cmdSet, &m_cmdShow, &m_cmdDump, &m_cmdRewind, &m_cmdExercise, &m_cmdProbe,
+  &m_cmdConvert, &m_cmdCommit,
   &CStandardUI::m_cmdDefine, &CStandardUI::m_cmdUndefine,
   &CStandardUI::m_cmdIndirect, &CStandardUI::m_cmdExit,
   &CStandardUI::m_cmdQuit, &CCmdParser::g_cmdHelp,
@@ -409,21 +502,32 @@ bool CUI::DoCreate (CCmdParser &cmd)
   // is omitted, an "offline" UPE is created and connected to the MASSBUS.
   // Offline UPEs are handy for debugging, but not much else.
   //
-  // Format:
-  //    CREATE <bus> <type> [<PCI address>]
+  //   The /SIMULATE modifier, which is only legal for offline UPEs, attaches a
+  // software simulation of the UPE FIFOs.  A simulated MASSBUS actually runs
+  // commands and transfers data, and the EXERCISE command can drive it.
   //
-  // This command has no qualifiers.
+  //   /CPU, /PRIORITY and /LOCK set the real time scheduling policy for the
+  // MASSBUS threads - see SET BUS for the details.
+  //
+  // Format:
+  //    CREATE <bus> <type> [<PCI address>] [/SIMULATE] [/CPU=n] [/PRIORITY=REALTIME] [/LOCK]
   //--
   char chBus;  CMBA *pBus;  CDECUPE *pUPE;  uint8_t nVHDLtype;  bool fForce;
+  bool fSimulate = m_modSimulate.IsPresent() && !m_modSimulate.IsNegated();
+  CRealTime policy;
 
   // First parse the MASSBUS name - that's easy ...
   if (!FindBus(m_argBus.GetValue(), chBus, pBus)) return false;
   if (pBus != NULL) {
     CMDERRS("MASSBUS " << chBus << " already exists");  return false;
   }
+  if (!ParseRealTime(policy)) return false;
 
   // Open the required UPE ...
   if (!g_pUPEs->Open(m_argPCI.GetBus(), m_argPCI.GetSlot(), (CUPE *&) pUPE)) return false;
+  if (fSimulate && !pUPE->IsOffline()) {
+    CMDERRS("/SIMULATE is allowed only for offline UPEs");  goto CloseUPE;
+  }
 
   //   If the user wants to load a configuration bitstream into the FPGA, then
   // now is the time to do it!  Note that the configuration file is just a
@@ -460,9 +564,10 @@ bool CUI::DoCreate (CCmdParser &cmd)
 
   // Initialize the FPGA control registers and capture interrupts ...
   if (!pUPE->Initialize()) goto CloseUPE;
+  if (fSimulate && !pUPE->Simulate()) goto CloseUPE;
 
   // And create the MASSBUS object for it ...
-  return g_pMBAs->Create(chBus, pUPE, pBus);
+  return g_pMBAs->Create(chBus, pUPE, policy, pBus);
 
   // Here if something fails after the UPE is opened - close it and return ...
 CloseUPE:
@@ -493,11 +598,11 @@ bool CUI::DoConnect (CCmdParser &cmd)
     CMDERRS("unit type not compatible with MASSBUS type");
     return false;
   }
-  pBus->LockUI();
+  pBus->LockUnit(nUnit);
   CBaseDrive &drive = pBus->AddUnit(nUnit, nIDT);
   if (m_argAlias.IsPresent()) drive.SetAlias(m_argAlias.GetValue());
   if (m_argSerial.IsPresent()) drive.SetSerialNumber(m_argSerial.GetNumber());
-  pBus->UnlockUI();
+  pBus->UnlockUnit(nUnit);
   return true;
 }
 
@@ -521,9 +626,10 @@ bool CUI::DoDisconnect (CCmdParser &cmd)
   if (pDrive->IsOnline()) {
     if (!cmd.AreYouSure("Unit " + pDrive->GetName() + " is online.")) return true;
   }
-  pBus->LockUI();
+  uint8_t nUnit = pDrive->GetUnit();
+  pBus->LockUnit(nUnit);
   pBus->RemoveUnit(pDrive);
-  pBus->UnlockUI();
+  pBus->UnlockUnit(nUnit);
   return true;
 }
 
@@ -536,7 +642,54 @@ bool CUI::DoAttach (CCmdParser &cmd)
   // file will be created.
   //
   // Format:
-  //    ATTACH <unit> <file-name> /BITS=nn /FORMAT=xyz /ONLINE /NOWRITE /SHARE=xxx
+  //    ATTACH <unit> <file-name> /BITS=nn /FORMAT=xyz /ONLINE /NOWRITE /SHARE=xxx /CACHE=size /READAHEAD /MAP /FLUSH=nn /WRITEBEHIND /OVERLAY=file /SPARSE /RAM /HUGEPAGES /SYNC=policy
+  //
+  //   /FORMAT=PACKED (18 bit disks only) uses the packed image format, with
+  // two 36 bit words in nine bytes, instead of the default simh format.
+  // /FORMAT=CHUNKED (disks only) stores the image in a compressed container,
+  // which is created if the file is empty.  It can't be used with /MAP,
+  // /SPARSE or /OVERLAY, and /FLUSH=nn sets how often the container's index
+  // is written.  The container is compacted when the drive is detached.
+  //
+  //   /CACHE (disks only) gives the drive a sector cache with the specified
+  // memory budget, e.g. /CACHE=64M.  K, M and G suffixes are allowed.
+  // /READAHEAD (also disks only) starts a thread that prefetches sectors
+  // when the host reads sequentially.  /MAP (disks only, again) maps the whole
+  // image file into memory and /FLUSH=nn sets how often, in seconds, the
+  // mapped image is written back to the disk (zero means only when the drive
+  // is spun down or detached).  If the image can't be mapped for some reason,
+  // the drive just uses normal file I/O.  /WRITEBEHIND (disks only) queues
+  // writes to the image file on a separate thread, so that a slow file system
+  // doesn't hold up the whole MASSBUS.
+  //
+  //   /OVERLAY=file (disks only) attaches the image read only, as a "base",
+  // and sends all writes to the overlay file instead.  The overlay is created
+  // if it doesn't exist.  Any number of units can use the same base, each with
+  // its own overlay, and with /OVERLAY the /CACHE size is for a cache of base
+  // sectors shared by all of them (the first unit to attach picks the size).
+  // /OVERLAY can't be used with /MAP.  See the COMMIT command, too.
+  //
+  //   /SPARSE (disks only) keeps track of the sectors that are all zeros, so
+  // that reading them never touches the file system, and writes zeros by
+  // punching holes in the image file.  It can't be used with /MAP either.
+  //
+  //   /RAM (disks only) loads the whole image into memory, so that the image
+  // file is never touched by a read or write at all.  Changed sectors are
+  // written back by a background checkpoint every /FLUSH=nn seconds, and when
+  // the drive is spun down or detached.  /HUGEPAGES puts the image in huge
+  // pages, if the OS has any to spare.  /RAM works with /OVERLAY, /SPARSE and
+  // /FORMAT=CHUNKED, but not with /MAP.
+  //
+  //   /SYNC=policy (disks only) sets how soon writes are forced out of the
+  // host's page cache to the disk.  NONE (the default) leaves it up to the OS,
+  // INTERVAL=ms syncs no more than ms milliseconds after a write (just ms by
+  // itself is the same thing), and WRITE doesn't finish a write until it's on
+  // the disk.  Writes from all the units on the same file system are synced
+  // together, so /SYNC=WRITE costs less the busier things are.  With an
+  // overlay it's the delta that gets synced, and with /RAM it's the checkpoint.
+  // /SYNC can't be used with /MAP or /FORMAT=CHUNKED, and /SYNC=WRITE can't
+  // be used with /WRITEBEHIND (the write would finish long before it's
+  // synced, and that's the whole point of /SYNC=WRITE).
   //--
   CMBA *pBus=NULL;  CBaseDrive *pDrive=NULL;
 
@@ -558,21 +711,129 @@ bool CUI::DoAttach (CCmdParser &cmd)
   // is optional.  For the moment it defaults to 18 bits...
   bool f18bits = true;
   if (m_argBits.IsPresent() && (m_argBits.GetNumber() == 16))  f18bits = false;
-  pBus->LockUI();
-  if (!pDrive->Attach(m_argFileName.GetFullPath(), !fWrite, nShareMode))
-    {pBus->UnlockUI();  return false;}
+  CDiskDrive::IMAGE_FORMAT nFormat = CDiskDrive::FORMAT_SIMH;
+  if (m_modFormat.IsPresent())
+    nFormat = (CDiskDrive::IMAGE_FORMAT) m_argFormat.GetKeyValue();
+  if ((nFormat == CDiskDrive::FORMAT_PACKED) && (!pDrive->IsDisk() || !f18bits)) {
+    CMDERRS("/FORMAT=PACKED is allowed only for 18 bit disks");  return false;
+  }
+  bool fChunked = (nFormat == CDiskDrive::FORMAT_CHUNKED);
+  if (fChunked && !pDrive->IsDisk()) {
+    CMDERRS("/FORMAT=CHUNKED is allowed only for disk drives");  return false;
+  }
+
+  // Parse the cache size, if any ...
+  uint64_t cbCache = 0;
+  if (m_modCache.IsPresent()) {
+    if (!pDrive->IsDisk()) {
+      CMDERRS("/CACHE is allowed only for disk drives");  return false;
+    }
+    if (!CSectorCache::ParseSize(m_argCacheSize.GetValue().c_str(), cbCache)) {
+      CMDERRS("invalid cache size - " << m_argCacheSize.GetValue());  return false;
+    }
+    if (cbCache > CSectorCache::MAX_BUDGET) {
+      CMDERRS("cache size too large - " << m_argCacheSize.GetValue());  return false;
+    }
+  }
+  bool fReadAhead = m_modReadAhead.IsPresent() && !m_modReadAhead.IsNegated();
+  if (fReadAhead && !pDrive->IsDisk()) {
+    CMDERRS("/READAHEAD is allowed only for disk drives");  return false;
+  }
+  bool fMap = m_modMap.IsPresent() && !m_modMap.IsNegated();
+  if (fMap && !pDrive->IsDisk()) {
+    CMDERRS("/MAP is allowed only for disk drives");  return false;
+  }
+  bool fRam = m_modRam.IsPresent() && !m_modRam.IsNegated();
+  if (fRam && !pDrive->IsDisk()) {
+    CMDERRS("/RAM is allowed only for disk drives");  return false;
+  }
+  if (fRam && fMap) {
+    CMDERRS("/RAM and /MAP can't be used together");  return false;
+  }
+  bool fHugePages = m_modHugePages.IsPresent() && !m_modHugePages.IsNegated();
+  if (fHugePages && !fRam) {
+    CMDERRS("/HUGEPAGES is allowed only with /RAM");  return false;
+  }
+  if (m_modFlush.IsPresent() && !fMap && !fChunked && !fRam) {
+    CMDERRS("/FLUSH is allowed only with /MAP, /RAM or /FORMAT=CHUNKED");  return false;
+  }
+  if (fChunked && fMap) {
+    CMDERRS("/FORMAT=CHUNKED and /MAP can't be used together");  return false;
+  }
+  bool fWriteBehind = m_modWriteBehind.IsPresent() && !m_modWriteBehind.IsNegated();
+  if (fWriteBehind && !pDrive->IsDisk()) {
+    CMDERRS("/WRITEBEHIND is allowed only for disk drives");  return false;
+  }
+  bool fOverlay = m_modOverlay.IsPresent();
+  if (fOverlay && !pDrive->IsDisk()) {
+    CMDERRS("/OVERLAY is allowed only for disk drives");  return false;
+  }
+  if (fOverlay && fMap) {
+    CMDERRS("/OVERLAY and /MAP can't be used together");  return false;
+  }
+  if (fOverlay && fChunked) {
+    CMDERRS("/OVERLAY and /FORMAT=CHUNKED can't be used together");  return false;
+  }
+  bool fSparse = m_modSparse.IsPresent() && !m_modSparse.IsNegated();
+  if (fSparse && !pDrive->IsDisk()) {
+    CMDERRS("/SPARSE is allowed only for disk drives");  return false;
+  }
+  if (fSparse && fMap) {
+    CMDERRS("/SPARSE and /MAP can't be used together");  return false;
+  }
+  if (fSparse && fChunked) {
+    CMDERRS("/SPARSE and /FORMAT=CHUNKED can't be used together");  return false;
+  }
+  CImageSync::SYNC_POLICY nSync = CImageSync::SYNC_NONE;  uint32_t lSyncInterval = 0;
+  if (m_modSync.IsPresent()) {
+    if (!pDrive->IsDisk()) {
+      CMDERRS("/SYNC is allowed only for disk drives");  return false;
+    }
+    if (!CImageSync::ParsePolicy(m_argSync.GetValue(), nSync, lSyncInterval)) {
+      CMDERRS("invalid sync policy - " << m_argSync.GetValue());  return false;
+    }
+    if ((nSync != CImageSync::SYNC_NONE) && (fMap || fChunked)) {
+      CMDERRS("/SYNC can't be used with /MAP or /FORMAT=CHUNKED");  return false;
+    }
+    if ((nSync == CImageSync::SYNC_WRITE) && fWriteBehind) {
+      CMDERRS("/SYNC=WRITE and /WRITEBEHIND can't be used together");  return false;
+    }
+  }
+  uint32_t nFlushInterval = m_modFlush.IsPresent() ? m_argFlushInterval.GetNumber() : CDiskDrive::DEFAULT_FLUSH;
+  pBus->LockUnit(pDrive->GetUnit());
+  if (!pDrive->Attach(m_argFileName.GetFullPath(), fOverlay || !fWrite, nShareMode))
+    {pBus->UnlockUnit(pDrive->GetUnit());  return false;}
 
   // And the rest is device (disk vs tape) dependent ...
   if (pDrive->IsDisk()) {
     CDiskDrive *pDisk = (CDiskDrive *) pDrive;
-    pDisk->Set18Bit(f18bits);
+    pDisk->SetFormat(f18bits, nFormat);
+    if (fChunked && (pDisk->GetChunked() == NULL)) {
+      CMDERRS("unable to open " << pDisk->GetFileName() << " as a chunked image");
+      pDisk->Detach();  pBus->UnlockUnit(pDrive->GetUnit());  return false;
+    }
+    pDisk->SetCache(fOverlay ? 0 : cbCache);
+    if (fOverlay && !pDisk->SetOverlay(m_argOverlayFile.GetFullPath(), !fWrite, cbCache)) {
+      CMDERRS("unable to open overlay " << m_argOverlayFile.GetFullPath());
+      pDisk->Detach();  pBus->UnlockUnit(pDrive->GetUnit());  return false;
+    }
+    if (fSparse && !pDisk->SetSparse(true))
+      CMDERRS("unable to open " << pDisk->GetFileName() << " as sparse - using file I/O");
+    pDisk->SetFlushInterval(nFlushInterval);
+    if (fMap && !pDisk->SetMap(true))
+      CMDERRS("unable to map " << pDisk->GetFileName() << " - using file I/O");
+    if ((nSync != CImageSync::SYNC_NONE) && !pDisk->SetSync(nSync, lSyncInterval))
+      CMDERRS("unable to sync " << pDisk->GetFileName() << " - writes won't be synced");
+    if (fRam && !pDisk->SetRam(true, fHugePages))
+      CMDERRS("unable to load " << pDisk->GetFileName() << " into RAM - using file I/O");
+    pDisk->SetReadAhead(fReadAhead);  pDisk->SetWriteBehind(fWriteBehind);
   } else {
     //CTapeDrive *pTape = (CTapeDrive *) pDrive;
   }
   if (fOnline) pDrive->GoOnline();
 
   // All done!
-  pBus->UnlockUI();
+  pBus->UnlockUnit(pDrive->GetUnit());
   return true;
 }
 
@@ -597,9 +858,100 @@ bool CUI::DoDetach (CCmdParser &cmd)
     CMDERRS("Unit " << *pDrive << " is not attached");
     return false;
   }
-  pBus->LockUI();
+  pBus->LockUnit(pDrive->GetUnit());
   pDrive->Detach();
-  pBus->UnlockUI();
+  pBus->UnlockUnit(pDrive->GetUnit());
+  return true;
+}
+
+
+bool CUI::DoConvert (CCmdParser &cmd)
+{
+  //++
+  //   The CONVERT command copies a disk image from one format to another.
+  // /FORMAT gives the format of the output file, and the input file is
+  // assumed to be in the other format.  A chunked input file is recognized
+  // automatically, and a chunked output file is always made from a simh input
+  // file.  /BITS=16 converts a 16 bit pack, which can only go into or out of
+  // a chunked container - there's no packed format for 16 bits.  The default
+  // is 18 bits.  The image must not be attached to any unit while it's being
+  // converted!
+  //
+  // Format:
+  //    CONVERT <input-file> <output-file> /FORMAT=PACKED|SIMH|CHUNKED /BITS=16|18
+  //--
+  if (!m_modFormat.IsPresent()) {
+    CMDERRS("specify the output /FORMAT");  return false;
+  }
+  string strInput = m_argFileName.GetFullPath();
+  string strOutput = m_argOutputFile.GetFullPath();
+  if (strInput == strOutput) {
+    CMDERRS("input and output files must be different");  return false;
+  }
+  CDiskDrive::IMAGE_FORMAT nOutput = (CDiskDrive::IMAGE_FORMAT) m_argFormat.GetKeyValue();
+  CDiskDrive::IMAGE_FORMAT nInput = (nOutput == CDiskDrive::FORMAT_SIMH)
+    ? CDiskDrive::FORMAT_PACKED : CDiskDrive::FORMAT_SIMH;
+  if (CChunkedImage::IsChunked(strInput)) {
+    if (nOutput == CDiskDrive::FORMAT_CHUNKED) {
+      CMDERRS(strInput << " is already a chunked image");  return false;
+    }
+    nInput = CDiskDrive::FORMAT_CHUNKED;
+  }
+  bool f18Bit = !(m_argBits.IsPresent() && (m_argBits.GetNumber() == 16));
+  if (!f18Bit && ((nInput == CDiskDrive::FORMAT_PACKED) || (nOutput == CDiskDrive::FORMAT_PACKED))) {
+    CMDERRS("16 bit images can only be converted to or from /FORMAT=CHUNKED");  return false;
+  }
+
+  // Do the work and time it ...
+  uint32_t nSectors;
+  std::chrono::steady_clock::time_point tmStart = std::chrono::steady_clock::now();
+  if (!CDiskDrive::ConvertImage(strInput, nInput, strOutput, nOutput, f18Bit, nSectors)) {
+    CMDERRS("conversion failed");  return false;
+  }
+  double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+  uint64_t cbInput = (uint64_t) nSectors * CDiskDrive::GetImageSectorSize(f18Bit, nInput);
+  CMDOUTF("%u sectors converted in %.1f seconds (%.1f MB/sec)", nSectors, dSeconds,
+    (dSeconds > 0) ? (cbInput / dSeconds / 1048576.0) : 0.0);
+  return true;
+}
+
+
+bool CUI::DoCommit (CCmdParser &cmd)
+{
+  //++
+  //   The COMMIT command copies everything in a unit's overlay back to its
+  // base image, and then empties the overlay.  Since every other unit using
+  // the same base would suddenly see the changes, COMMIT isn't allowed when
+  // any other unit is attached to the base.
+  //
+  // Format:
+  //    COMMIT <unit>
+  //
+  // This command has no qualifiers.
+  //--
+  CMBA *pBus;  CDiskDrive *pDisk;
+  if (!FindDisk(m_argUnit.GetValue(), pBus, pDisk)) return false;
+  if (pDisk->GetOverlay() == NULL) {
+    CMDERRS("unit " << *pDisk << " has no overlay");  return false;
+  }
+  for (CMBAs::const_iterator itBus = g_pMBAs->begin();  itBus != g_pMBAs->end();  ++itBus) {
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!(*itBus)->UnitExists(i)) continue;
+      const CBaseDrive *pUnit = (*itBus)->Unit(i);
+      if ((pUnit != pDisk) && pUnit->IsAttached() && (pUnit->GetFileName() == pDisk->GetFileName())) {
+        CMDERRS("unit " << *pUnit << " is also using " << pDisk->GetFileName());  return false;
+      }
+    }
+  }
+  if (!cmd.AreYouSure("This will permanently change " + pDisk->GetFileName() + ".")) return true;
+  uint32_t nSectors;
+  pBus->LockUnit(pDisk->GetUnit());
+  bool fOK = pDisk->CommitOverlay(nSectors);
+  pBus->UnlockUnit(pDisk->GetUnit());
+  if (!fOK) {
+    CMDERRS("commit failed");  return false;
+  }
+  CMDOUTF("%u sectors committed to %s", nSectors, pDisk->GetFileName().c_str());
   return true;
 }
 
@@ -627,9 +979,9 @@ bool CUI::DoRewind (CCmdParser &cmd)
   }
 
   // Rewind the tape drive and we're done ...
-  pBus->LockUI();
+  pBus->LockUnit(pDrive->GetUnit());
   ((CTapeDrive *) pDrive)->ManualRewind();
-  pBus->UnlockUI();
+  pBus->UnlockUnit(pDrive->GetUnit());
   return true;
 }
 
@@ -657,7 +1009,7 @@ bool CUI::DoSetUnit(CCmdParser &cmd)
   //--
   CMBA *pBus = NULL;  CBaseDrive *pDrive = NULL;
   if (!FindUnit(m_argUnit.GetValue(), pBus, pDrive)) return false;
-  pBus->LockUI();
+  pBus->LockUnit(pDrive->GetUnit());
 
   // "SET <unit> /NOWRITE" ...
   if (m_modWrite.IsPresent()) {
@@ -684,7 +1036,7 @@ bool CUI::DoSetUnit(CCmdParser &cmd)
   // "SET <unit> /ALIAS" ...
   if (m_modAlias.IsPresent()) pDrive->SetAlias(m_argAlias.GetValue());
 
-  pBus->UnlockUI();
+  pBus->UnlockUnit(pDrive->GetUnit());
   return true;
 }
 
@@ -696,11 +1048,23 @@ bool CUI::DoSetUPE(CCmdParser &cmd)
   // as the data clock speed and transfer delay.
   //
   // Format:
-  //    SET UPE <PCI address> [/CLOCK=nn] [/DELAY=nn]
+  //    SET UPE <PCI address> [/CLOCK=nn] [/DELAY=nn] [/POLL=nnnn] [/[NO]DMA] [/[NO]WORKERS]
   //
   // Note that the clock and delay values are limited to 8 bits and default to
   // the DECIMAL radix.  Hexadecimal numbers may be specified by prefixing them
   // with the usual "0x" sequence.
+  //
+  //   /POLL sets the time, in microseconds, that the MASSBUS thread will spin
+  // polling the command FIFO after each command before it falls back to
+  // waiting for an interrupt.  /POLL=0 disables polling altogether.
+  //
+  //   /DMA uses the PLX DMA engine (or, for a simulated UPE, the simulator's
+  // block transfers) to move data to and from the UPE FIFO.  If DMA can't be
+  // used, then PIO continues as before.  /NODMA goes back to PIO.
+  //
+  //   /NOWORKERS makes the MASSBUS thread execute every command itself, the
+  // way it used to, instead of handing them to the per unit worker threads.
+  // /WORKERS (the default) goes back to using the workers.
   //--
   CDECUPE *pUPE = (CDECUPE *) g_pUPEs->Find(m_argPCI.GetBus(), m_argPCI.GetSlot());
   if (pUPE == NULL) {
@@ -709,6 +1073,101 @@ bool CUI::DoSetUPE(CCmdParser &cmd)
   }
   if (m_modDelay.IsPresent()) pUPE->SetTransferDelay(m_argTransferDelay.GetNumber());
   if (m_modClock.IsPresent()) pUPE->SetDataClock(m_argDataClock.GetNumber());
+  if (m_modPoll.IsPresent()) pUPE->SetPollTime(m_argPollTime.GetNumber());
+  if (m_modDMA.IsPresent()) {
+    if (!pUPE->IsOpen()) {
+      CMDERRS("UPE " << *pUPE << " is not in use");  return false;
+    }
+    CMBA *pBus = g_pMBAs->FindUPE(pUPE);
+    if (pBus != NULL) pBus->LockUI();
+    bool fOK = pUPE->SetDMA(!m_modDMA.IsNegated());
+    if (pBus != NULL) pBus->UnlockUI();
+    if (!fOK) {
+      CMDERRS("DMA is not available on UPE " << *pUPE);  return false;
+    }
+  }
+  if (m_modWorkers.IsPresent()) {
+    CMBA *pBus = g_pMBAs->FindUPE(pUPE);
+    if (pBus == NULL) {
+      CMDERRS("UPE " << *pUPE << " is not in use");  return false;
+    }
+    pBus->LockUI();
+    pBus->SetWorkers(!m_modWorkers.IsNegated());
+    pBus->UnlockUI();
+  }
+  return true;
+}
+
+
+bool CUI::ParseRealTime (CRealTime &policy)
+{
+  //++
+  //   Update a real time policy from the /CPU, /PRIORITY and /[NO]LOCK
+  // modifiers.  Anything that's not specified is left alone, so SET BUS can
+  // change just one thing at a time ...
+  //--
+  if (m_modCPU.IsPresent()) {
+    int nCPU;
+    if (!CRealTime::ParseCPU(m_argCPU.GetValue(), nCPU)) {
+      CMDERRS("illegal CPU \"" << m_argCPU.GetValue() << "\"");  return false;
+    }
+    policy.SetCPU(nCPU);
+  }
+  if (m_modPriority.IsPresent())
+    policy.SetPriority((CRealTime::PRIORITY) m_argPriority.GetKeyValue());
+  if (m_modLock.IsPresent()) policy.SetLock(!m_modLock.IsNegated());
+  return true;
+}
+
+
+bool CUI::DoSetBus (CCmdParser &cmd)
+{
+  //++
+  //   The "SET BUS" command changes the real time scheduling policy for the
+  // threads of one MASSBUS - the channel thread and all the unit workers.
+  //
+  // Format:
+  //    SET BUS <bus> [/CPU=n|ANY] [/PRIORITY=REALTIME|NORMAL] [/[NO]LOCK]
+  //
+  //   /CPU pins the threads to one CPU, which ideally should be one that's
+  // been isolated from everything else (e.g. with isolcpus=).  /PRIORITY=
+  // REALTIME uses SCHED_FIFO, which needs root or CAP_SYS_NICE on Linux.
+  // /LOCK locks ALL of MBS in memory with mlockall() - including any /RAM
+  // disk images! - and prefaults the transfer buffers.  The threads pick up
+  // the new policy the next time around their loops, and SHOW BUS shows what
+  // they actually got.
+  //--
+  char chBus;  CMBA *pBus;
+  if (!FindBus(m_argBus.GetValue(), chBus, pBus)) return false;
+  if (pBus == NULL) {
+    CMDERRS("MASSBUS " << chBus << " does not exist");  return false;
+  }
+  CRealTime policy = pBus->GetRealTime();
+  if (!ParseRealTime(policy)) return false;
+  pBus->LockUI();
+  pBus->SetRealTime(policy);
+  pBus->UnlockUI();
+  return true;
+}
+
+
+bool CUI::DoSetTrace (CCmdParser &cmd)
+{
+  //++
+  //   The "SET TRACE" command turns TRACEF() messages on or off.
+  //
+  // Format:
+  //    SET TRACE /ENABLE|/DISABLE
+  //
+  //   Tracing is off by default, because even the deferred trace records
+  // cost something on the MASSBUS command path.  Note that the records are
+  // still logged with LOGS(TRACE, ...), so nothing actually shows up unless
+  // the SET LOG level includes TRACE messages too ...
+  //--
+  if (!m_modTrace.IsPresent()) {
+    CMDERRS("specify /ENABLE or /DISABLE");  return false;
+  }
+  CTraceLog::SetEnabled(!m_modTrace.IsNegated());
   return true;
 }
 
@@ -723,6 +1182,84 @@ bool CUI::DoShowVersion (CCmdParser &cmd)
 }
 
 
+bool CUI::DoShowHistory (CCmdParser &cmd)
+{
+  //++
+  //   Show the flight recorder for one MASSBUS - the last few commands that
+  // it executed, oldest first.  The age is how long ago the command arrived,
+  // in milliseconds, and the other times are microseconds spent in each
+  // phase of the command (see SHOW LATENCY).  A PENDING command hasn't
+  // finished yet, which is just what you want to know when the host hangs!
+  // This doesn't lock anything, so it's safe to use while the bus is busy.
+  //
+  // Format:
+  //    SHOW HISTORY <bus> [/COUNT=nnn]
+  //--
+  char chBus;  CMBA *pBus;  char szBuffer[CLog::MAXMSG];
+  if (!FindBus(m_argBus.GetValue(), chBus, pBus)) return false;
+  if (pBus == NULL) {
+    CMDERRS("MASSBUS " << chBus << " does not exist");  return false;
+  }
+  if (!m_argCount.IsPresent()) m_argCount.SetNumber(CFlightRecorder::HISTORY_SIZE);
+  std::vector<CFlightRecorder::ENTRY> vecEntries(CFlightRecorder::HISTORY_SIZE);
+  size_t nEntries = pBus->GetHistory().Snapshot(vecEntries.data(), m_argCount.GetNumber());
+  uint64_t llNow = CFlightRecorder::Now();
+  CMDOUTS("");
+  CMDOUTF("Command history for MASSBUS %c (%llu commands total)", pBus->GetName(),
+    (unsigned long long) pBus->GetHistory().GetCount());
+  CMDOUTS(CFlightRecorder::Heading());
+  for (size_t i = 0;  i < nEntries;  ++i) {
+    CFlightRecorder::Format(vecEntries[i], pBus->IsTape(), llNow, szBuffer, sizeof(szBuffer));
+    CMDOUTS(szBuffer);
+  }
+  CMDOUTS("");
+  return true;
+}
+
+
+bool CUI::DoShowTrace (CCmdParser &cmd)
+{
+  //++
+  //   Show whether tracing is enabled and how many trace records have been
+  // logged so far.  "Dropped" records are ones that were thrown away because
+  // the logger thread couldn't keep up with some thread ...
+  //--
+  CMDOUTS("");
+  CMDOUTF("Tracing %s, %llu records logged, %llu dropped, %u threads",
+    CTraceLog::IsEnabled() ? "enabled" : "disabled",
+    (unsigned long long) CTraceLog::GetLogged(),
+    (unsigned long long) CTraceLog::GetDropped(), CTraceLog::GetThreads());
+  return true;
+}
+
+
+bool CUI::DoShowKernels (CCmdParser &cmd)
+{
+  //++
+  //   Show all the sector pack/unpack kernel sets, which one is in use, and
+  // how fast each one runs on this CPU.  Note that this runs a benchmark of
+  // every kernel right now, so it takes a second or two ...
+  //--
+  const CSectorKernels::KERNELS &kSelected = CSectorKernels::GetSelected();
+  CMDOUTS("");
+  CMDOUTF("Kernels    Unpack18    Pack18  Unpack16    Pack16    IsZero  (M sectors/sec)");
+  CMDOUTF("--------  --------  --------  --------  --------  --------");
+  for (uint32_t i = 0;  i < CSectorKernels::GetCount();  ++i) {
+    const CSectorKernels::KERNELS &k = CSectorKernels::GetKernels(i);
+    if (!(*k.pfnSupported)()) {
+      CMDOUTF("%-8s  not supported by this CPU", k.pszName);  continue;
+    }
+    double adRate[CSectorKernels::KERNEL_COUNT];
+    for (uint32_t j = 0;  j < CSectorKernels::KERNEL_COUNT;  ++j)
+      adRate[j] = CSectorKernels::Benchmark(k, (CSectorKernels::KERNEL) j, 1000000UL) / 1000000.0;
+    CMDOUTF("%-8s  %8.2f  %8.2f  %8.2f  %8.2f  %8.2f%s", k.pszName, adRate[0], adRate[1],
+      adRate[2], adRate[3], adRate[4], (&k == &kSelected) ? "  (selected)" : "");
+  }
+  CMDOUTS("");
+  return true;
+}
+
+
 void CUI::ShowOneUnit (const CBaseDrive *pUnit, bool fHeading)
 {
   //++
@@ -772,14 +1309,39 @@ bool CUI::DoShowUnit (CCmdParser &cmd)
 {
   //++
   //   Show the current status of the specified unit.  If no unit name is
-  // specified, then show the status of all drives ...
+  // specified, then show the status of all drives.  For a single disk, show
+  // the image file size and the space actually allocated to it, which is
+  // less for a sparse file, and the compression for a chunked image.  If
+  // there's a sync policy, show the writes that haven't been synced yet ...
   //--
   if (!m_argOptUnit.IsPresent()) {
     ShowAllUnits();
   } else {
-    CMBA *pBus;  CBaseDrive *pDrive;
+    CMBA *pBus;  CBaseDrive *pDrive;  uint64_t cbLogical, cbAllocated;
     if (!FindUnit(m_argOptUnit.GetValue(), pBus, pDrive)) return false;
     ShowOneUnit(pDrive, true);  CMDOUTS("");
+    if (pDrive->IsDisk() && pDrive->IsAttached()
+     && CSparseImage::GetFileSizes(pDrive->GetFileName(), cbLogical, cbAllocated)) {
+      CMDOUTF("Image size %llu bytes, %llu allocated (%.1f%%)",
+        (unsigned long long) cbLogical, (unsigned long long) cbAllocated,
+        (cbLogical > 0) ? (100.0 * cbAllocated / cbLogical) : 0.0);
+      const CSparseImage *pSparse = ((const CDiskDrive *) pDrive)->GetSparse();
+      const CChunkedImage *pChunked = ((const CDiskDrive *) pDrive)->GetChunked();
+      if (pSparse != NULL)
+        CMDOUTF("Sparse image, %u sectors zero, hole punching %s",
+          pSparse->GetZeroSectors(), pSparse->CanPunch() ? "enabled" : "not supported");
+      else if (pChunked != NULL)
+        CMDOUTF("Chunked image, %u of %u chunks stored, %llu bytes of chunk data%s",
+          pChunked->GetStoredChunks(), pChunked->GetChunks(),
+          (unsigned long long) pChunked->GetLiveBytes(),
+          pChunked->NeedsCompaction() ? ", will compact at detach" : "");
+      else
+        CMDOUTS("");
+    }
+    const CImageSync *pSync = pDrive->IsDisk() ? ((const CDiskDrive *) pDrive)->GetSync() : NULL;
+    if (pSync != NULL)
+      CMDOUTF("Sync %s, %u sectors not synced yet",
+        pSync->GetPolicyName().c_str(), pSync->GetUnsynced());
   }
   return true;
 }
@@ -822,7 +1384,7 @@ void CUI::ShowOneUPE (const CDECUPE *pUPE, bool fHeading)
     sprintf_s(sz, sizeof(sz), "  %4d 0x%02X 0x%02X %s  %s   %c    %d/%d",
       pUPE->GetRevision(), pUPE->GetTransferDelay(), pUPE->GetDataClock(),
       (pUPE->IsDisk() ? "DISK" : pUPE->IsTape() ? "TAPE" : pUPE->IsNI() ? "MEIS" : "????"),
-      (pUPE->IsOffline() ? "OFFLINE " : pUPE->IsCableConnected() ? "ONLINE  " : "NO CABLE"),
+      (pUPE->IsSimulated() ? "SIMULATE" : pUPE->IsOffline() ? "OFFLINE " : pUPE->IsCableConnected() ? "ONLINE  " : "NO CABLE"),
       pMBA->GetName(), pMBA->UnitsOnline(), pMBA->UnitsConnected());
     strcat_s(szBuffer, sizeof(szBuffer), sz);
   }
@@ -832,13 +1394,16 @@ void CUI::ShowOneUPE (const CDECUPE *pUPE, bool fHeading)
 //------- --- ---- --------  ---- ---- ---- ----  --------  ---  -----
 //00:00.0   0   0  0000 00      0 0x00 0x00 DISK  NO CABLE   A    0/0
 //                                                OFFLINE
+//                                                SIMULATE
 //                                                ONLINE
 
 bool CUI::DoShowUPE (CCmdParser &cmd)
 {
   //++
   //   Show the current status of the specified UPE.  If no UPE is specified,
-  // then show the status of all known UPEs ...
+  // then show the status of all known UPEs.  For a single UPE that's in use,
+  // this includes how long transfers have had to wait for the data FIFO and
+  // how close any of them came to timing out ...
   //--
   if (!m_argPCI.IsPresent()) {
     ShowAllUPEs();
@@ -849,12 +1414,288 @@ bool CUI::DoShowUPE (CCmdParser &cmd)
       return false;
     } else {
       ShowOneUPE(pUPE, true);  CMDOUTS("");
+      if (pUPE->IsOpen()) {
+        CMDOUTF("Data transfers: %s", pUPE->GetTransferName());
+        CMDOUTF("Commands: %llu ready, %llu polled, %llu interrupt (poll window %d us)",
+          (unsigned long long) pUPE->GetCommandsReady(),
+          (unsigned long long) pUPE->GetCommandsPolled(),
+          (unsigned long long) pUPE->GetCommandsInterrupt(), pUPE->GetPollTime());
+        uint64_t cCommands = pUPE->GetCommandCount();
+        CMDOUTF("Registers: %llu reads, %llu writes (%.1f reads/command)",
+          (unsigned long long) pUPE->GetRegisterReads(),
+          (unsigned long long) pUPE->GetRegisterWrites(),
+          (cCommands > 0) ? ((double) pUPE->GetRegisterReads() / cCommands) : 0.0);
+        CMBA *pMBA = g_pMBAs->FindUPE(pUPE);
+        if ((pMBA != NULL) && (pMBA->GetBatchCount() > 0))
+          CMDOUTF("Batches: %llu, %.2f commands/batch, largest %d",
+            (unsigned long long) pMBA->GetBatchCount(),
+            (double) cCommands / pMBA->GetBatchCount(), pMBA->GetLargestBatch());
+        if (pMBA != NULL)
+          CMDOUTF("Unit workers: %s", pMBA->IsWorkers() ? "enabled" : "disabled");
+        CHistogram hist;  pUPE->GetStallHistogram(hist);
+        CMDOUTF("Data FIFO stalls: %llu, mean %.1f us, p99 %.1f us, max %.1f us (deadline %d us)",
+          (unsigned long long) hist.GetCount(), hist.GetMean()/1000.0,
+          hist.GetPercentile(99.0)/1000.0, hist.GetMax()/1000.0, CDECUPE::DATA_TIMEOUT);
+        CMDOUTF("  %llu near misses (over %d%% of the deadline), %llu timeouts",
+          (unsigned long long) pUPE->GetNearMisses(), CDECUPE::NEAR_MISS,
+          (unsigned long long) pUPE->GetDataTimeouts());
+      }
     }
   }
   return true;
 }
 
 
+bool CUI::DoShowStatistics (CCmdParser &cmd)
+{
+  //++
+  //   Show the FPGA parity error counts and, for every unit, the sectors read
+  // and written as counted by the FPGA alongside the reads and writes (disk
+  // sectors or tape records) actually done by MBS.  The rates are per second
+  // over the last sample interval - the counters are sampled about once a
+  // second by the MASSBUS thread, so everything here is up to a second old.
+  // Units with a sector cache get an extra line with the cache hit rate, and
+  // units with read ahead get one with the prefetch hit rate and window.
+  // Likewise for units with write behind and their queue depths, and for
+  // units with an overlay or a sparse image.  Every unit with a worker thread
+  // gets a line with its command queue depth and queue wait times.
+  //--
+  char szBuffer[CLog::MAXMSG];  uint8_t nBuses = 0;
+  for (CMBAs::const_iterator itBus = g_pMBAs->begin();  itBus != g_pMBAs->end();  ++itBus) {
+    const CMBA *pBus = *itBus;  const CDECUPE &upe = pBus->GetUPE();
+    CMDOUTS("");
+    CMDOUTF("MASSBUS %c, UPE %s, parity errors %llu control (%.0f/sec), %llu data (%.0f/sec)",
+      pBus->GetName(), upe.GetBDF().c_str(),
+      (unsigned long long) upe.GetControlErrors().GetTotal(), upe.GetControlErrors().GetRate(),
+      (unsigned long long) upe.GetDataErrors().GetTotal(), upe.GetDataErrors().GetRate());
+    CMDOUTF("Unit  FPGA Read   /sec FPGA Write   /sec   MBS Read   /sec  MBS Write   /sec");
+    CMDOUTF("---- ---------- ------ ---------- ------ ---------- ------ ---------- ------");
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!pBus->UnitExists(i)) continue;
+      const CBaseDrive *pUnit = pBus->Unit(i);
+      sprintf_s(szBuffer, sizeof(szBuffer),
+        " %2.2s  %10llu %6.0f %10llu %6.0f %10llu %6.0f %10llu %6.0f",
+        pUnit->GetCU().c_str(),
+        (unsigned long long) upe.GetSectorsRead(i).GetTotal(), upe.GetSectorsRead(i).GetRate(),
+        (unsigned long long) upe.GetSectorsWritten(i).GetTotal(), upe.GetSectorsWritten(i).GetRate(),
+        (unsigned long long) pUnit->GetReadCounter().GetTotal(), pUnit->GetReadCounter().GetRate(),
+        (unsigned long long) pUnit->GetWriteCounter().GetTotal(), pUnit->GetWriteCounter().GetRate());
+      CMDOUTS(szBuffer);
+    }
+    // Show the sector cache statistics for any unit that has a cache ...
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!pBus->UnitExists(i) || !pBus->Unit(i)->IsDisk()) continue;
+      const CSectorCache *pCache = ((const CDiskDrive *) pBus->Unit(i))->GetCache();
+      if (pCache == NULL) continue;
+      uint64_t cLookups = pCache->GetHits() + pCache->GetMisses();
+      CMDOUTF("Unit %s cache: %u/%u sectors, %llu hits, %llu misses (%.1f%%), %llu evictions",
+        pBus->Unit(i)->GetCU().c_str(), pCache->GetCount(), pCache->GetCapacity(),
+        (unsigned long long) pCache->GetHits(), (unsigned long long) pCache->GetMisses(),
+        (cLookups > 0) ? (100.0 * pCache->GetHits() / cLookups) : 0.0,
+        (unsigned long long) pCache->GetEvictions());
+    }
+    // And the read ahead statistics ...
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!pBus->UnitExists(i) || !pBus->Unit(i)->IsDisk()) continue;
+      const CReadAhead *pReadAhead = ((const CDiskDrive *) pBus->Unit(i))->GetReadAhead();
+      if (pReadAhead == NULL) continue;
+      uint64_t cReads = pReadAhead->GetReads();
+      CMDOUTF("Unit %s read ahead: window %u, %llu/%llu hits (%.1f%%), %llu late, %llu prefetched, %llu wasted",
+        pBus->Unit(i)->GetCU().c_str(), pReadAhead->GetWindow(),
+        (unsigned long long) pReadAhead->GetHits(), (unsigned long long) cReads,
+        (cReads > 0) ? (100.0 * pReadAhead->GetHits() / cReads) : 0.0,
+        (unsigned long long) pReadAhead->GetLate(),
+        (unsigned long long) pReadAhead->GetPrefetched(),
+        (unsigned long long) pReadAhead->GetWasted());
+    }
+    // And the write behind statistics ...
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!pBus->UnitExists(i) || !pBus->Unit(i)->IsDisk()) continue;
+      const CWriteBehind *pWriteBehind = ((const CDiskDrive *) pBus->Unit(i))->GetWriteBehind();
+      if (pWriteBehind == NULL) continue;
+      CMDOUTF("Unit %s write behind: depth %u (avg %.1f, max %u of %u), %llu queued, %llu coalesced, %llu stalls, %llu errors",
+        pBus->Unit(i)->GetCU().c_str(), pWriteBehind->GetDepth(),
+        pWriteBehind->GetAverageDepth(), pWriteBehind->GetMaxDepth(), CWriteBehind::HIGH_WATER,
+        (unsigned long long) pWriteBehind->GetQueued(),
+        (unsigned long long) pWriteBehind->GetCoalesced(),
+        (unsigned long long) pWriteBehind->GetStalls(),
+        (unsigned long long) pWriteBehind->GetErrors());
+    }
+    // And the unit worker statistics ...
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!pBus->UnitExists(i)) continue;
+      const CDriveWorker *pWorker = pBus->GetWorker(i);
+      if (pWorker == NULL) continue;
+      CMDOUTF("Unit %s worker: depth %u (avg %.1f, max %u of %u), %llu executed, wait avg %.1f us (max %.1f us), %llu stalls",
+        pBus->Unit(i)->GetCU().c_str(), pWorker->GetDepth(),
+        pWorker->GetAverageDepth(), pWorker->GetMaxDepth(), CDriveWorker::QUEUE_SIZE,
+        (unsigned long long) pWorker->GetExecuted(),
+        pWorker->GetAverageWait(), pWorker->GetMaxWait(),
+        (unsigned long long) pWorker->GetStalls());
+    }
+    // And the sparse image statistics ...
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!pBus->UnitExists(i) || !pBus->Unit(i)->IsDisk()) continue;
+      const CSparseImage *pSparse = ((const CDiskDrive *) pBus->Unit(i))->GetSparse();
+      if (pSparse == NULL) continue;
+      CMDOUTF("Unit %s sparse: %u zero sectors, %llu reads and %llu writes skipped, %llu holes punched",
+        pBus->Unit(i)->GetCU().c_str(), pSparse->GetZeroSectors(),
+        (unsigned long long) pSparse->GetElidedReads(),
+        (unsigned long long) pSparse->GetElidedWrites(),
+        (unsigned long long) pSparse->GetPunched());
+    }
+    // And the RAM image statistics ...
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!pBus->UnitExists(i) || !pBus->Unit(i)->IsDisk()) continue;
+      const CRamImage *pRam = ((const CDiskDrive *) pBus->Unit(i))->GetRam();
+      if (pRam == NULL) continue;
+      CMDOUTF("Unit %s RAM: %llu bytes%s, %u dirty, %llu checkpoints, %llu sectors written, %llu errors, last %.3f seconds",
+        pBus->Unit(i)->GetCU().c_str(), (unsigned long long) pRam->GetBytes(),
+        pRam->IsHuge() ? " in huge pages" : "", pRam->GetDirty(),
+        (unsigned long long) pRam->GetCheckpoints(),
+        (unsigned long long) pRam->GetWritten(),
+        (unsigned long long) pRam->GetErrors(), pRam->GetLastSeconds());
+    }
+    // And the sync statistics ...
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!pBus->UnitExists(i) || !pBus->Unit(i)->IsDisk()) continue;
+      const CImageSync *pSync = ((const CDiskDrive *) pBus->Unit(i))->GetSync();
+      if (pSync == NULL) continue;
+      CMDOUTF("Unit %s sync %s: %u unsynced, %llu syncs (avg %.2f ms), %llu sectors synced, %llu writes waited, %llu errors",
+        pBus->Unit(i)->GetCU().c_str(), pSync->GetPolicyName().c_str(), pSync->GetUnsynced(),
+        (unsigned long long) pSync->GetSyncs(), pSync->GetAverageMilliseconds(),
+        (unsigned long long) pSync->GetSynced(), (unsigned long long) pSync->GetWaits(),
+        (unsigned long long) pSync->GetErrors());
+    }
+    // And the chunked image statistics ...
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!pBus->UnitExists(i) || !pBus->Unit(i)->IsDisk()) continue;
+      const CChunkedImage *pChunked = ((const CDiskDrive *) pBus->Unit(i))->GetChunked();
+      if (pChunked == NULL) continue;
+      uint64_t cbPack = (uint64_t) pChunked->GetSectors() * pChunked->GetSectorSize();
+      uint64_t cLookups = pChunked->GetHits() + pChunked->GetMisses();
+      CMDOUTF("Unit %s chunked: %u/%u chunks stored, %llu bytes (%.1f%% of %llu), file %llu bytes, %llu/%llu chunk hits (%.1f%%)",
+        pBus->Unit(i)->GetCU().c_str(), pChunked->GetStoredChunks(), pChunked->GetChunks(),
+        (unsigned long long) pChunked->GetLiveBytes(),
+        (cbPack > 0) ? (100.0 * pChunked->GetLiveBytes() / cbPack) : 0.0,
+        (unsigned long long) cbPack, (unsigned long long) pChunked->GetFileBytes(),
+        (unsigned long long) pChunked->GetHits(), (unsigned long long) cLookups,
+        (cLookups > 0) ? (100.0 * pChunked->GetHits() / cLookups) : 0.0);
+    }
+    // And the overlay statistics ...
+    for (uint8_t i = 0;  i < CMBA::MAXUNIT;  ++i) {
+      if (!pBus->UnitExists(i) || !pBus->Unit(i)->IsDisk()) continue;
+      const CDiskDrive *pDisk = (const CDiskDrive *) pBus->Unit(i);
+      const COverlayImage *pOverlay = pDisk->GetOverlay();
+      if (pOverlay == NULL) continue;
+      const CBaseCache *pBase = pDisk->GetBaseCache();
+      if (pBase == NULL) {
+        CMDOUTF("Unit %s overlay: %u/%u sectors, no base cache",
+          pDisk->GetCU().c_str(), pOverlay->GetAllocated(), pOverlay->GetSectors());
+      } else {
+        const CSectorCache *pCache = pBase->GetCache();
+        CMDOUTF("Unit %s overlay: %u/%u sectors, base cache %u users, %llu hits, %llu misses",
+          pDisk->GetCU().c_str(), pOverlay->GetAllocated(), pOverlay->GetSectors(), pBase->GetUsers(),
+          (unsigned long long) pCache->GetHits(), (unsigned long long) pCache->GetMisses());
+      }
+    }
+    ++nBuses;
+  }
+  if (nBuses == 0)
+    CMDOUTF("No MASSBUS adapters connected");
+  else
+    CMDOUTS("");
+  return true;
+}
+
+
+bool CUI::DoShowLatency (CCmdParser &cmd)
+{
+  //++
+  //   Show the command latency histograms for one unit - the count, mean,
+  // median, p99, p99.9 and maximum for every phase of every class of command
+  // that the unit has seen.  All times are in microseconds.  The histograms
+  // belong to the unit's worker, so we lock the unit just long enough to
+  // make a copy (and to reset them, if /RESET was specified) ...
+  //--
+  CMBA *pBus;  CBaseDrive *pDrive;  char szBuffer[CLog::MAXMSG];
+  if (!FindUnit(m_argUnit.GetValue(), pBus, pDrive)) return false;
+  bool fReset = m_modReset.IsPresent() && !m_modReset.IsNegated();
+  CLatency *pLatency;
+  pBus->LockUnit(pDrive->GetUnit());
+  pLatency = new CLatency(pDrive->GetLatency());
+  if (fReset) pDrive->GetLatency().Reset();
+  pBus->UnlockUnit(pDrive->GetUnit());
+
+  uint32_t nRows = 0;
+  for (uint32_t i = 0;  i < CLatency::MAXCLASS;  ++i) {
+    for (uint32_t j = 0;  j < CLatency::MAXPHASE;  ++j) {
+      const CHistogram &h = pLatency->GetHistogram((CLatency::CLASS) i, (CLatency::PHASE) j);
+      if (h.GetCount() == 0) continue;
+      if (nRows++ == 0) {
+        CMDOUTS("");
+        CMDOUTS("Latency for unit " << *pDrive << " (microseconds)");
+        CMDOUTF("Class  Phase        Count     Mean      p50      p99    p99.9      Max");
+        CMDOUTF("------ -------- --------- -------- -------- -------- -------- --------");
+      }
+      sprintf_s(szBuffer, sizeof(szBuffer), "%-6s %-8s %9llu %8.1f %8.1f %8.1f %8.1f %8.1f",
+        CLatency::ClassName((CLatency::CLASS) i), CLatency::PhaseName((CLatency::PHASE) j),
+        (unsigned long long) h.GetCount(), h.GetMean()/1000.0,
+        h.GetPercentile(50.0)/1000.0, h.GetPercentile(99.0)/1000.0,
+        h.GetPercentile(99.9)/1000.0, h.GetMax()/1000.0);
+      CMDOUTS(szBuffer);
+    }
+  }
+  if (nRows == 0)
+    CMDOUTS("No commands timed for unit " << *pDrive);
+  CMDOUTS("");
+  delete pLatency;
+  return true;
+}
+
+
+void CUI::ShowOneBus (const CMBA *pBus)
+{
+  //++
+  //   Show the real time policy for one MASSBUS, and what the channel thread
+  // and the unit workers actually got.  A thread that hasn't applied any
+  // policy yet is just running with whatever it inherited ...
+  //--
+  CRealTime policy = pBus->GetRealTime();
+  string strChannel = pBus->GetChannelPolicy();
+  string strWorker = pBus->GetWorkerPolicy();
+  CMDOUTS("MASSBUS " << pBus->GetName() << ": " << policy.GetName());
+  CMDOUTS("  Channel thread: " << (strChannel.empty() ? "default" : strChannel));
+  CMDOUTS("  Unit workers:   " << (strWorker.empty() ? "default" : strWorker));
+}
+
+
+bool CUI::DoShowBus (CCmdParser &cmd)
+{
+  //++
+  //   Show the real time scheduling policy for one MASSBUS or, if no bus is
+  // specified, for all of them ...
+  //--
+  if (m_argOptBus.IsPresent()) {
+    char chBus;  CMBA *pBus;
+    if (!FindBus(m_argOptBus.GetValue(), chBus, pBus)) return false;
+    if (pBus == NULL) {
+      CMDERRS("MASSBUS " << chBus << " does not exist");  return false;
+    }
+    CMDOUTS("");  ShowOneBus(pBus);
+  } else {
+    if (g_pMBAs->Count() == 0) {
+      CMDOUTS("No MASSBUS adapters connected");  return true;
+    }
+    CMDOUTS("");
+    for (CMBAs::const_iterator it = g_pMBAs->begin();  it != g_pMBAs->end();  ++it)
+      ShowOneBus(*it);
+  }
+  CMDOUTS("Memory " << (CRealTime::IsMemoryLocked() ? "locked" : "not locked"));
+  return true;
+}
+
+
 bool CUI::DoShowAll (CCmdParser &cmd)
 {
   //++
@@ -1032,3 +1873,92 @@ bool CUI::DoTapeDump (CCmdParser &cmd)
   tape.Close();
   return true;
 }
+
+
+bool CUI::DoExercise (CCmdParser &cmd)
+{
+  //++
+  //   The EXERCISE command uses the simulated host on a simulated MASSBUS to
+  // read or write a series of consecutive sectors on a disk unit, starting at
+  // block zero.  Every transfer goes through the same code path that a real
+  // RH20 would use - the command FIFO, CMBA::CommandLoop, the unit's worker,
+  // CDiskDrive and the data FIFO - and so the result is a measure of the
+  // server's throughput.
+  // The unit must be attached and online, and /WRITE (which overwrites the
+  // image file!) also requires that the unit be write enabled.
+  //
+  // Format:
+  //    EXERCISE <unit> [/COUNT=nnnn] [/WRITE]
+  //--
+  CMBA *pBus;  CDiskDrive *pDisk;
+  if (!FindDisk(m_argUnit.GetValue(), pBus, pDisk)) return false;
+  CUPESimulator *pSimulator = pBus->GetUPE().GetSimulator();
+  if (pSimulator == NULL) {
+    CMDERRS("MASSBUS " << pBus->GetName() << " is not simulated");  return false;
+  }
+  if (!pDisk->IsOnline()) {
+    CMDERRS("Unit " << *pDisk << " is not online");  return false;
+  }
+  bool fWrite = m_modWrite.IsPresent() && !m_modWrite.IsNegated();
+  if (fWrite) {
+    if (pDisk->IsReadOnly()) {
+      CMDERRS("Unit " << *pDisk << " is read only");  return false;
+    }
+    if (!cmd.AreYouSure("This will overwrite " + pDisk->GetFileName() + ".")) return true;
+  }
+  if (!m_argCount.IsPresent()) m_argCount.SetNumber(1000);
+
+  //   Note that we do NOT lock the unit here - LockUnit() would pause the
+  // worker that has to execute the commands we're about to send it!
+  CUPESimulator::EXERCISE_RESULT result;
+  bool fOK = pSimulator->ExerciseDisk(pDisk->GetUnit(), pDisk->GetType(),
+    pDisk->Is18Bit(), fWrite, m_argCount.GetNumber(), result);
+  if (!fOK) {
+    CMDERRS("exercise aborted after " << result.cCompleted << " sectors");  return false;
+  }
+  double dSeconds = result.llElapsed / 1000000.0;
+  CMDOUTF("%d sectors %s in %.3f seconds, %d errors", result.cCompleted,
+    (fWrite ? "written" : "read"), dSeconds, result.cErrors);
+  if ((dSeconds > 0.0) && (result.cCompleted > 0))
+    CMDOUTF("%.0f sectors/second, %.1f microseconds/sector",
+      result.cCompleted/dSeconds, (double) result.llElapsed/result.cCompleted);
+  return true;
+}
+
+
+bool CUI::DoProbe (CCmdParser &cmd)
+{
+  //++
+  //   The PROBE command measures the scheduling jitter that the threads of a
+  // MASSBUS would see with its current real time policy.  It starts a thread
+  // with the same policy, which wakes up every millisecond and records how
+  // late it was, and then prints the same statistics as SHOW LATENCY.  The
+  // MASSBUS itself isn't affected, so this is safe to do while it's busy, but
+  // notice that the probe thread competes with the MASSBUS threads for the
+  // same CPU!  All times are in microseconds.
+  //
+  // Format:
+  //    PROBE <bus> [/COUNT=nnnn]
+  //--
+  char chBus;  CMBA *pBus;  char szBuffer[CLog::MAXMSG];
+  if (!FindBus(m_argBus.GetValue(), chBus, pBus)) return false;
+  if (pBus == NULL) {
+    CMDERRS("MASSBUS " << chBus << " does not exist");  return false;
+  }
+  if (!m_argCount.IsPresent()) m_argCount.SetNumber(1000);
+  CRealTime policy = pBus->GetRealTime();
+  CHistogram hist;  string strEffective;
+  if (!policy.Probe(m_argCount.GetNumber(), CRealTime::PROBE_PERIOD, hist, strEffective)) {
+    CMDERRS("unable to start the probe thread");  return false;
+  }
+  CMDOUTS("");
+  CMDOUTS("Jitter for MASSBUS " << pBus->GetName() << " (" << strEffective << ", microseconds)");
+  CMDOUTF("    Count     Mean      p50      p99    p99.9      Max");
+  CMDOUTF("--------- -------- -------- -------- -------- --------");
+  sprintf_s(szBuffer, sizeof(szBuffer), "%9llu %8.1f %8.1f %8.1f %8.1f %8.1f",
+    (unsigned long long) hist.GetCount(), hist.GetMean()/1000.0,
+    hist.GetPercentile(50.0)/1000.0, hist.GetPercentile(99.0)/1000.0,
+    hist.GetPercentile(99.9)/1000.0, hist.GetMax()/1000.0);
+  CMDOUTS(szBuffer);  CMDOUTS("");
+  return true;
+}
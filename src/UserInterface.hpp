@@ -58,15 +58,19 @@ private:
   static const CCmdArgKeyword::keyword_t m_keysImageFormat[];
   static const CCmdArgKeyword::keyword_t m_keysPortType[];
   static const CCmdArgKeyword::keyword_t m_keysShareMode[];
+  static const CCmdArgKeyword::keyword_t m_keysPriority[];
 
   // Argument tables ...
 private:
   static CCmdArgName     m_argUnit, m_argOptUnit, m_argAlias, m_argBus;
+  static CCmdArgName     m_argCacheSize, m_argSync, m_argOptBus, m_argCPU;
+  static CCmdArgFileName m_argOverlayFile;
   static CCmdArgKeyword  m_argDriveType, m_argControllerType;
-  static CCmdArgKeyword  m_argFormat, m_argPort, m_argShare;
+  static CCmdArgKeyword  m_argFormat, m_argPort, m_argShare, m_argPriority;
   static CCmdArgNumber   m_argSerial, m_argBits, m_argCount;
-  static CCmdArgNumber   m_argTransferDelay, m_argDataClock;
-  static CCmdArgFileName m_argFileName, m_argOptFileName;
+  static CCmdArgNumber   m_argTransferDelay, m_argDataClock, m_argPollTime;
+  static CCmdArgNumber   m_argFlushInterval;
+  static CCmdArgFileName m_argFileName, m_argOptFileName, m_argOutputFile;
   static CCmdArgPCIAddress  m_argPCI;
   static CCmdArgDiskAddress m_argBlockNumber;
 
@@ -74,8 +78,11 @@ private:
 private:
   static CCmdModifier m_modSerial, m_modAlias, m_modOnline, m_modWrite;
   static CCmdModifier m_modBits, m_modFormat, m_modPort, m_modConfiguration;
-  static CCmdModifier m_modOctal, m_modCount, m_modClock, m_modDelay;
-  static CCmdModifier m_modForce, m_modShare;
+  static CCmdModifier m_modOctal, m_modCount, m_modClock, m_modDelay, m_modPoll;
+  static CCmdModifier m_modForce, m_modShare, m_modSimulate, m_modDMA, m_modWorkers;
+  static CCmdModifier m_modReset, m_modCache, m_modReadAhead, m_modMap, m_modFlush;
+  static CCmdModifier m_modWriteBehind, m_modOverlay, m_modSparse, m_modRam, m_modHugePages;
+  static CCmdModifier m_modSync, m_modCPU, m_modPriority, m_modLock, m_modTrace;
 
   // Verb definitions ...
 private:
@@ -100,18 +107,37 @@ private:
   static CCmdArgument * const m_argsRewind[];
   static CCmdVerb m_cmdRewind;
 
+  // CONVERT verb definition ...
+  static CCmdArgument * const m_argsConvert[];
+  static CCmdModifier * const m_modsConvert[];
+  static CCmdVerb m_cmdConvert;
+
+  // COMMIT verb definition ...
+  static CCmdArgument * const m_argsCommit[];
+  static CCmdVerb m_cmdCommit;
+
   // SET and SHOW verb definitions ...
   static CCmdArgument * const m_argsSetUnit[];
   static CCmdArgument * const m_argsShowUnit[];
   static CCmdArgument * const m_argsSetUPE[];
   static CCmdArgument * const m_argsShowUPE[];
+  static CCmdArgument * const m_argsShowLatency[];
+  static CCmdModifier * const m_modsShowLatency[];
   static CCmdModifier * const m_modsSetUnit[];
   static CCmdModifier * const m_modsSetUPE[];
+  static CCmdArgument * const m_argsSetBus[];
+  static CCmdModifier * const m_modsSetBus[];
+  static CCmdArgument * const m_argsShowBus[];
   static CCmdVerb * const g_aSetVerbs[];
   static CCmdVerb * const g_aShowVerbs[];
-  static CCmdVerb m_cmdSet, m_cmdSetUnit, m_cmdSetUPE;
-  static CCmdVerb m_cmdShowUnit, m_cmdShowUPE;
+  static CCmdModifier * const m_modsSetTrace[];
+  static CCmdVerb m_cmdSet, m_cmdSetUnit, m_cmdSetUPE, m_cmdSetBus, m_cmdSetTrace;
+  static CCmdVerb m_cmdShowUnit, m_cmdShowUPE, m_cmdShowBus;
   static CCmdVerb m_cmdShow, m_cmdShowAll, m_cmdShowVersion;
+  static CCmdArgument * const m_argsShowHistory[];
+  static CCmdModifier * const m_modsShowHistory[];
+  static CCmdVerb m_cmdShowStatistics, m_cmdShowLatency, m_cmdShowKernels, m_cmdShowTrace;
+  static CCmdVerb m_cmdShowHistory;
 
   // DUMP DISK and DUMP TAPE verb definition ...
   static CCmdArgument * const m_argsTapeDump[];
@@ -121,6 +147,16 @@ private:
   static CCmdVerb m_cmdDump, m_cmdTapeDump, m_cmdDiskDump;
   static CCmdVerb * const g_aDumpVerbs[];
 
+  // EXERCISE verb definition ...
+  static CCmdArgument * const m_argsExercise[];
+  static CCmdModifier * const m_modsExercise[];
+  static CCmdVerb m_cmdExercise;
+
+  // PROBE verb definition ...
+  static CCmdArgument * const m_argsProbe[];
+  static CCmdModifier * const m_modsProbe[];
+  static CCmdVerb m_cmdProbe;
+
   // Verb action routines ....
 private:
   static bool DoCreate(CCmdParser &cmd);
@@ -129,8 +165,15 @@ private:
   static bool DoSetUnit(CCmdParser &cmd), DoShowUnit(CCmdParser &cmd);
   static bool DoSetUPE(CCmdParser &cmd), DoShowUPE(CCmdParser &cmd);
   static bool DoShowVersion(CCmdParser &cmd), DoShowAll(CCmdParser &cmd);
+  static bool DoShowStatistics(CCmdParser &cmd), DoShowLatency(CCmdParser &cmd);
+  static bool DoShowKernels(CCmdParser &cmd);
+  static bool DoSetBus(CCmdParser &cmd), DoShowBus(CCmdParser &cmd);
+  static bool DoSetTrace(CCmdParser &cmd), DoShowTrace(CCmdParser &cmd);
+  static bool DoShowHistory(CCmdParser &cmd);
+  static bool DoProbe(CCmdParser &cmd);
   static bool DoTapeDump(CCmdParser &cmd), DoDiskDump(CCmdParser &cmd);
-  static bool DoRewind(CCmdParser &cmd);
+  static bool DoRewind(CCmdParser &cmd), DoExercise(CCmdParser &cmd);
+  static bool DoConvert(CCmdParser &cmd), DoCommit(CCmdParser &cmd);
 
   // Other "helper" routines ...
 private:
@@ -144,6 +187,8 @@ private:
   static void ShowOneUnit (const CBaseDrive *pUnit, bool fHeading);
   static void ShowAllUPEs();
   static void ShowOneUPE (const CDECUPE *pUPE, bool fHeading);
+  static void ShowOneBus (const CMBA *pBus);
+  static bool ParseRealTime (CRealTime &policy);
   static bool SetUnit (CMBA *pMBA, CBaseDrive *pDrive);
   static void DumpDisk18 (CMBA *pBus, CDiskDrive *pDrive, uint32_t lLBN);
   static void DumpDisk16 (CMBA *pBus, CDiskDrive *pDrive, uint32_t lLBN, bool fHex);
@@ -0,0 +1,185 @@
+//++
+// WriteBehind.cpp -> CWriteBehind (asynchronous disk write queue) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This module implements the CWriteBehind class.  See WriteBehind.hpp for
+// all the details.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memcpy(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <iostream>             // C++ style output for LOGS() ...
+#include <sstream>              // ostringstream, et al, for LOGS() ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "UPE.hpp"              // UPE library FPGA interface methods
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // UPE library image file methods
+#include "MBS.hpp"              // global declarations for this project
+#include "MASSBUS.h"            // MASSBUS commands and registers
+#include "DriveType.hpp"        // internal drive type class
+#include "DECUPE.hpp"           // DEC specific UPE/FPGA class definitions
+#include "BaseDrive.hpp"        // common methods for all MASSBUS drives
+#include "DiskDrive.hpp"        // disk specific emulation
+#include "WriteBehind.hpp"      // declarations for this module
+using std::unique_lock;         // ...
+using std::mutex;               // ...
+
+
+CWriteBehind::CWriteBehind (CDiskDrive &disk)
+  : m_Disk(disk), m_Thread(&CWriteBehind::WriteLoop), m_fExit(false),
+    m_fBusy(false), m_fError(false), m_nHead(0), m_nCount(0), m_nMaxDepth(0),
+    m_llDepthSum(0), m_cQueued(0), m_cCoalesced(0), m_cStalls(0), m_cErrors(0)
+{
+  //++
+  // The thread isn't started until Begin() is called ...
+  //--
+  string sName = m_Disk.GetName() + " write behind";
+  m_Thread.SetName(sName.c_str());
+  m_Thread.SetParameter(this);
+}
+
+
+CWriteBehind::~CWriteBehind()
+{
+  //++
+  //   Write everything that's still queued, then tell the background thread
+  // to stop and wait for it to exit ...
+  //--
+  Drain();
+  {
+    unique_lock<mutex> lock(m_mtxQueue);
+    m_fExit = true;
+  }
+  m_cvWork.notify_all();
+  m_Thread.WaitExit();
+}
+
+
+bool CWriteBehind::Begin()
+{
+  //++
+  // Start the write behind thread ...
+  //--
+  return m_Thread.Begin();
+}
+
+
+bool CWriteBehind::Put (uint32_t lLBA, const uint32_t alData[])
+{
+  //++
+  //   Queue one sector to be written.  If the same sector is already queued
+  // and isn't being written right now, then the new data just replaces the
+  // old.  Otherwise it goes on the end of the queue, after waiting for room
+  // if the queue is full.  Returns false if an earlier write has failed.
+  //--
+  unique_lock<mutex> lock(m_mtxQueue);
+  if (m_fError) return false;
+  ++m_cQueued;  m_llDepthSum += m_nCount;
+  for (uint32_t i = (m_fBusy ? 1 : 0);  i < m_nCount;  ++i) {
+    ENTRY &e = m_aQueue[Index(i)];
+    if (e.lLBA != lLBA) continue;
+    memcpy(e.alData, alData, sizeof(e.alData));
+    ++m_cCoalesced;  return true;
+  }
+  if (m_nCount >= HIGH_WATER) {
+    ++m_cStalls;
+    while ((m_nCount >= HIGH_WATER) && !m_fError)  m_cvSpace.wait(lock);
+    if (m_fError) return false;
+  }
+  ENTRY &e = m_aQueue[Index(m_nCount)];
+  e.lLBA = lLBA;  memcpy(e.alData, alData, sizeof(e.alData));
+  if (++m_nCount > m_nMaxDepth) m_nMaxDepth = m_nCount;
+  m_cvWork.notify_one();
+  return true;
+}
+
+
+bool CWriteBehind::Find (uint32_t lLBA, uint32_t alData[])
+{
+  //++
+  //   If sector lLBA is queued, copy the queued data to alData[] and return
+  // true.  Search from the newest entry back, since the sector could be there
+  // twice - once being written and once more waiting behind it ...
+  //--
+  unique_lock<mutex> lock(m_mtxQueue);
+  for (uint32_t i = m_nCount;  i > 0;  --i) {
+    const ENTRY &e = m_aQueue[Index(i-1)];
+    if (e.lLBA != lLBA) continue;
+    memcpy(alData, e.alData, sizeof(e.alData));
+    return true;
+  }
+  return false;
+}
+
+
+bool CWriteBehind::Drain()
+{
+  //++
+  //   Wait for the queue to empty.  Returns false (and clears the error) if
+  // any write failed since the last time ...
+  //--
+  unique_lock<mutex> lock(m_mtxQueue);
+  while (m_nCount > 0)  m_cvSpace.wait(lock);
+  bool fOK = !m_fError;  m_fError = false;
+  return fOK;
+}
+
+
+void CWriteBehind::DoWrites()
+{
+  //++
+  //   This is the body of the write behind thread.  It writes the oldest
+  // entry in the queue to the image file and then removes it.  The entry stays
+  // in the queue (so Find() can see it) while it's being written, and the
+  // m_fBusy flag keeps Put() from changing it.  If a write fails, the rest of
+  // the queue is thrown away - the drive is going offline anyway.
+  //--
+  unique_lock<mutex> lock(m_mtxQueue);
+  while (!m_fExit) {
+    if (m_nCount == 0) {m_cvWork.wait(lock);  continue;}
+    const ENTRY &e = m_aQueue[m_nHead];  m_fBusy = true;
+    lock.unlock();
+    bool fOK = m_Disk.WriteSector(e.lLBA, e.alData);
+    lock.lock();
+    m_fBusy = false;
+    if (fOK) {
+      m_nHead = Index(1);  --m_nCount;
+    } else {
+      LOGS(ERROR, "unit " << m_Disk << " write behind failed for LBA " << e.lLBA);
+      ++m_cErrors;  m_fError = true;  m_nCount = 0;
+    }
+    m_cvSpace.notify_all();
+  }
+}
+
+
+/* static */ void* THREAD_ATTRIBUTES CWriteBehind::WriteLoop (void *pParam)
+{
+  //++
+  // Thread entry point - just call DoWrites() for the right object ...
+  //--
+  CThread *pThread = (CThread *) pParam;
+  CWriteBehind *pWriteBehind = (CWriteBehind *) pThread->GetParameter();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " is running");
+  pWriteBehind->DoWrites();
+  LOGS(DEBUG, "thread for " << pThread->GetName() << " terminated");
+  return pThread->End();
+}
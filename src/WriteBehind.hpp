@@ -0,0 +1,124 @@
+//++
+// WriteBehind.hpp -> CWriteBehind (asynchronous disk write queue) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the MASSBUS SERVER project.  MBS is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    MBS is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Normally CDiskDrive::DoWrite() writes each sector to the image file right
+// there on the MASSBUS channel thread, and if the file system is slow then
+// every other drive on the same bus waits too.  With write behind, DoWrite()
+// just drops the sector into this queue and a worker thread writes it to the
+// image later.
+//
+//   The queue holds at most HIGH_WATER sectors.  If it fills up then Put()
+// waits for the worker to make room, which slows the host down to whatever
+// speed the image file can actually handle.  Writing a sector that's already
+// queued (and not being written yet) just replaces the queued data, so there
+// is never more than one pending copy of any sector and the order of writes
+// to the same LBA is always preserved.  Reads have to check the queue first
+// with Find() - otherwise they could read stale data from the image.
+//
+//   Since the actual write happens later, an image write error can't be
+// reported to the command that caused it.  Instead the error is remembered
+// and the next Put() or Drain() fails, which takes the drive offline.
+// CDiskDrive calls Drain() before spinning down, detaching, changing the
+// write lock or changing the pack format.
+//--
+#pragma once
+#include <stdint.h>             // uint32_t, uint64_t, etc ...
+#include <mutex>                // C++ std::mutex
+#include <condition_variable>   // C++ std::condition_variable
+#include "Thread.hpp"           // UPELIB CThread portable thread library
+class CDiskDrive;               // we need a forward pointer for this class
+
+
+class CWriteBehind {
+  //++
+  // Write behind queue for one disk drive ...
+  //--
+
+  // Constants and parameters ...
+public:
+  enum {
+    HIGH_WATER = 64,            // maximum number of queued sectors
+  };
+
+  // Constructor and destructor ...
+public:
+  CWriteBehind (CDiskDrive &disk);
+  virtual ~CWriteBehind();
+private:
+  // Disallow copy and assignment operations with CWriteBehind objects...
+  CWriteBehind(const CWriteBehind &) = delete;
+  CWriteBehind& operator= (const CWriteBehind &) = delete;
+
+  // Public properties ...
+public:
+  // Return the current and maximum queue depth ...
+  uint32_t GetDepth() const {return m_nCount;}
+  uint32_t GetMaxDepth() const {return m_nMaxDepth;}
+  // Return the average queue depth seen by Put() ...
+  double GetAverageDepth() const
+    {return (m_cQueued > 0) ? ((double) m_llDepthSum / m_cQueued) : 0.0;}
+  // Return the write behind statistics ...
+  uint64_t GetQueued() const {return m_cQueued;}
+  uint64_t GetCoalesced() const {return m_cCoalesced;}
+  uint64_t GetStalls() const {return m_cStalls;}
+  uint64_t GetErrors() const {return m_cErrors;}
+
+  // Public methods ...
+public:
+  // Start the background thread ...
+  bool Begin();
+  // Queue a sector to be written (waits if the queue is full) ...
+  bool Put (uint32_t lLBA, const uint32_t alData[]);
+  // Return the queued data for a sector, if there is any ...
+  bool Find (uint32_t lLBA, uint32_t alData[]);
+  // Wait for everything in the queue to be written ...
+  bool Drain();
+
+  // Private methods ...
+private:
+  // The background thread that writes the queue ...
+  static void* THREAD_ATTRIBUTES WriteLoop (void *pParam);
+  void DoWrites();
+  // Return the index of the n-th oldest queue entry ...
+  uint32_t Index (uint32_t n) const {return (m_nHead+n) % HIGH_WATER;}
+
+  // Private member data ...
+private:
+  struct ENTRY {
+    uint32_t lLBA;                      // sector to be written
+    uint32_t alData[SECTOR_SIZE];       // sector data, unpacked
+  };
+  CDiskDrive             &m_Disk;       // the drive we're writing for
+  CThread                 m_Thread;     // background write thread
+  std::mutex              m_mtxQueue;   // protects everything below
+  std::condition_variable m_cvWork;     // signalled when a sector is queued
+  std::condition_variable m_cvSpace;    // signalled when a sector is written
+  bool                    m_fExit;      // true to stop the thread
+  bool                    m_fBusy;      // the oldest entry is being written
+  bool                    m_fError;     // an image write has failed
+  ENTRY                   m_aQueue[HIGH_WATER]; // the queue itself
+  uint32_t                m_nHead;      // index of the oldest entry
+  uint32_t                m_nCount;     // number of entries queued
+  uint32_t                m_nMaxDepth;  // largest m_nCount ever seen
+  uint64_t                m_llDepthSum; // sum of the depths seen by Put()
+  uint64_t                m_cQueued;    // total sectors queued
+  uint64_t                m_cCoalesced; // ... that replaced a queued sector
+  uint64_t                m_cStalls;    // times Put() waited for room
+  uint64_t                m_cErrors;    // image write errors
+};